@@ -41,6 +41,8 @@ struct EmulatedSystem {
    bool emuHasDebugger;
    // clock ticks to emulate
    int emuCount;
+   // hash of the emulated state, see common/StateHash.h
+   u64 (*emuStateHash)();
 };
 
 extern void log(const char *,...);
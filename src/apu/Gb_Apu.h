@@ -85,6 +85,11 @@ public:
 	// to be stored in the future.
 	void save_state( gb_apu_state_t* state_out );
 
+	// Saves the state as save_state() would after end_frame( time ), but leaves
+	// this APU alone and generates no sound. The emulation up to time is done
+	// in scratch, whose state is overwritten.
+	void save_state( blip_time_t time, gb_apu_state_t* state_out, Gb_Apu* scratch );
+
 	// Loads state. You should call reset() BEFORE this.
 	blargg_err_t load_state( gb_apu_state_t const& in );
 
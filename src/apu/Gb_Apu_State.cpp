@@ -104,6 +104,22 @@ void Gb_Apu::save_state( gb_apu_state_t* out )
 	#endif
 }
 
+void Gb_Apu::save_state( blip_time_t time, gb_apu_state_t* out, Gb_Apu* scratch )
+{
+	save_state( out );
+
+	// scratch has no outputs, so running it only updates its state
+	scratch->reset( (mode_t) wave.mode, wave.agb_mask != 0 );
+	scratch->frame_period = frame_period;
+	scratch->load_state( *out );
+
+	// Oscillator delays are saved relative to last_time, the frame sequencer
+	// time isn't
+	scratch->frame_time -= last_time;
+	scratch->end_frame( time - last_time );
+	scratch->save_state( out );
+}
+
 blargg_err_t Gb_Apu::load_state( gb_apu_state_t const& in )
 {
 	RETURN_ERR( save_load( CONST_CAST(gb_apu_state_t*,&in), false ) );
@@ -380,19 +380,31 @@ void Gb_Square::run( blip_time_t time, blip_time_t end_time )
 		}
 		else
 		{
-			// Output amplitude transitions
+			// Output amplitude transitions, stepping straight from one edge
+			// of the duty cycle to the next
 			int delta = vol;
-			do
+			blip_resampled_time_t rtime = out->resampled_time( time );
+			blip_resampled_time_t const rper = out->resampled_duration( per );
+			while ( true )
 			{
-				ph = (ph + 1) & 7;
-				if ( ph == 0 || ph == duty )
+				int steps = (ph < duty ? duty : 8) - ph;
+				blip_time_t edge = time + (steps - 1) * per;
+				if ( edge >= end_time )
 				{
-					good_synth->offset_inline( time, delta, out );
-					delta = -delta;
+					int count = (end_time - time + per - 1) / per;
+					ph += count; // will be masked below
+					time += (blip_time_t) count * per;
+					break;
 				}
-				time += per;
+				ph = (ph + steps) & 7;
+				rtime += (steps - 1) * rper;
+				good_synth->offset_resampled( rtime, delta, out );
+				delta = -delta;
+				rtime += rper;
+				time = edge + per;
+				if ( time >= end_time )
+					break;
 			}
-			while ( time < end_time );
 
 			if ( delta != vol )
 				last_amp -= delta;
@@ -478,6 +490,26 @@ static unsigned run_lfsr( unsigned s, unsigned mask, int count )
 	return s;
 }
 
+// Index of the lowest set bit of each byte
+static byte const lowest_bit [256] = {
+	0,0,1,0,2,0,1,0,3,0,1,0,2,0,1,0,
+	4,0,1,0,2,0,1,0,3,0,1,0,2,0,1,0,
+	5,0,1,0,2,0,1,0,3,0,1,0,2,0,1,0,
+	4,0,1,0,2,0,1,0,3,0,1,0,2,0,1,0,
+	6,0,1,0,2,0,1,0,3,0,1,0,2,0,1,0,
+	4,0,1,0,2,0,1,0,3,0,1,0,2,0,1,0,
+	5,0,1,0,2,0,1,0,3,0,1,0,2,0,1,0,
+	4,0,1,0,2,0,1,0,3,0,1,0,2,0,1,0,
+	7,0,1,0,2,0,1,0,3,0,1,0,2,0,1,0,
+	4,0,1,0,2,0,1,0,3,0,1,0,2,0,1,0,
+	5,0,1,0,2,0,1,0,3,0,1,0,2,0,1,0,
+	4,0,1,0,2,0,1,0,3,0,1,0,2,0,1,0,
+	6,0,1,0,2,0,1,0,3,0,1,0,2,0,1,0,
+	4,0,1,0,2,0,1,0,3,0,1,0,2,0,1,0,
+	5,0,1,0,2,0,1,0,3,0,1,0,2,0,1,0,
+	4,0,1,0,2,0,1,0,3,0,1,0,2,0,1,0,
+};
+
 void Gb_Noise::run( blip_time_t time, blip_time_t end_time )
 {
 	// Determine what will be generated
@@ -547,7 +579,30 @@ void Gb_Noise::run( blip_time_t time, blip_time_t end_time )
 		{
 			// Output amplitude transitions
 			int delta = -vol;
-			do
+			blip_resampled_time_t rtime = out->resampled_time( time );
+			blip_resampled_time_t const rper = out->resampled_duration( per );
+
+			// With the 15-bit LFSR the next 8 outputs are already in its low
+			// bits, and the output changes wherever two neighbours differ. The
+			// same differences are the bits shifted in at the top.
+			if ( ~mask == 0x4000 )
+			{
+				while ( end_time - time > 7 * per )
+				{
+					unsigned edges = (bits ^ bits >> 1) & 0xFF;
+					bits = bits >> 8 | edges << 7;
+					for ( ; edges; edges &= edges - 1 )
+					{
+						delta = -delta;
+						med_synth->offset_resampled( rtime + lowest_bit [edges] * rper,
+								delta, out );
+					}
+					time += 8 * per;
+					rtime += 8 * rper;
+				}
+			}
+
+			while ( time < end_time )
 			{
 				unsigned changed = bits + 1;
 				bits = bits >> 1 & mask;
@@ -555,11 +610,11 @@ void Gb_Noise::run( blip_time_t time, blip_time_t end_time )
 				{
 					bits |= ~mask;
 					delta = -delta;
-					med_synth->offset_inline( time, delta, out );
+					med_synth->offset_resampled( rtime, delta, out );
 				}
 				time += per;
+				rtime += rper;
 			}
-			while ( time < end_time );
 
 			if ( delta == vol )
 				last_amp += delta;
@@ -631,8 +686,11 @@ void Gb_Wave::run( blip_time_t time, blip_time_t end_time )
 		}
 		else
 		{
-			// Output amplitude transitions
+			// Output amplitude transitions, advancing the resampled time
+			// instead of converting it for every delta
 			int lamp = this->last_amp + dac_bias;
+			blip_resampled_time_t rtime = out->resampled_time( time );
+			blip_resampled_time_t const rper = out->resampled_duration( per );
 			do
 			{
 				// Extract nybble
@@ -646,9 +704,10 @@ void Gb_Wave::run( blip_time_t time, blip_time_t end_time )
 				if ( delta )
 				{
 					lamp = amp;
-					med_synth->offset_inline( time, delta, out );
+					med_synth->offset_resampled( rtime, delta, out );
 				}
 				time += per;
+				rtime += rper;
 			}
 			while ( time < end_time );
 			this->last_amp = lamp - dac_bias;
@@ -0,0 +1,552 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "Movie.h"
+#include "../System.h"
+#include "../NLS.h"
+#include "../gba/Sound.h"
+
+//  Movie files; all values little-endian:
+//     <version>.32 = 2
+//     <frames>.32
+//     <keyframe interval>.32
+//     <keyframes>.32
+//     <rtc start>.64 = seconds since the epoch
+//     for every frame {
+//        <joypad>.32 x 4
+//        <sensor x>.32
+//        <sensor y>.32
+//        <flags>.32
+//     }
+//     for every keyframe {
+//        <frame>.32
+//        <offset>.32 = from the start of the file
+//        <size>.32
+//     }
+//     the keyframes, as written by emuWriteMemState
+//
+//  Version 1 movies are a keystroke log of the default joypad in name.vmv
+//  and a savestate in name.vm0.
+
+int movieKeyframeInterval = 600;
+
+#define MOVIE_VERSION 2
+#define MOVIE_HEADER_SIZE 24
+#define MOVIE_INPUT_SIZE 28
+#define MOVIE_INDEX_SIZE 12
+// buffer for one memory savestate
+#define MOVIE_STATE_SIZE 0x100000
+// the joypad bits that are recorded; speed and capture stay live
+#define MOVIE_JOYPAD_MASK 0x3ff
+
+// frame flags
+#define MOVIE_RESET 1
+
+// what was read of the current frame
+#define MOVIE_READ_SENSOR_X 0x10
+#define MOVIE_READ_SENSOR_Y 0x20
+
+struct MovieInput {
+  u32 joypad[4];
+  s32 sensorX;
+  s32 sensorY;
+  u32 flags;
+};
+
+struct MovieKeyframe {
+  u32 frame;
+  u32 offset;
+  u32 size;
+  // kept in memory while recording, otherwise read from the file
+  std::vector<char> state;
+};
+
+static EmulatedSystem *movieSystem = NULL;
+static MovieMode movieMode = MOVIE_NONE;
+static std::string movieFileName;
+static FILE *movieFile = NULL;
+static std::vector<MovieInput> movieInputs;
+static std::vector<MovieKeyframe> movieKeyframes;
+static std::vector<char> movieState;
+static u32 movieInterval;
+static u32 movieFrameNumber;
+static time_t movieStartTime;
+// inputs the core has seen this frame
+static MovieInput movieCurrent;
+static u32 movieRead;
+// the next movieUpdate() starts movieFrameNumber
+static bool movieFrameStart;
+static bool movieResetPending;
+// version 1 movies don't have the sensor
+static bool movieLiveSensor;
+
+static void moviePut32(std::vector<u8> &out, u32 value)
+{
+  out.push_back(value);
+  out.push_back(value >> 8);
+  out.push_back(value >> 16);
+  out.push_back(value >> 24);
+}
+
+static u32 movieGet32(const u8 *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((u32)p[3] << 24);
+}
+
+static void movieStartFrame(u32 frame)
+{
+  movieFrameNumber = frame;
+  memset(&movieCurrent, 0, sizeof(movieCurrent));
+  movieRead = 0;
+  movieFrameStart = false;
+}
+
+static bool movieAddKeyframe()
+{
+  movieState.resize(MOVIE_STATE_SIZE);
+  if(!movieSystem->emuWriteMemState(&movieState[0], MOVIE_STATE_SIZE))
+    return false;
+
+  // memory states are "VBA ", the size of the rest and the rest
+  int size;
+  memcpy(&size, &movieState[4], sizeof(size));
+  if(size < 0 || size > MOVIE_STATE_SIZE - 8)
+    return false;
+
+  movieKeyframes.push_back(MovieKeyframe());
+  MovieKeyframe &k = movieKeyframes.back();
+  k.frame = movieFrameNumber;
+  k.offset = 0;
+  k.size = size + 8;
+  k.state.assign(movieState.begin(), movieState.begin() + k.size);
+  return true;
+}
+
+// returns NULL if the keyframe couldn't be read
+static const char *movieGetKeyframe(size_t index)
+{
+  MovieKeyframe &k = movieKeyframes[index];
+  if(!k.state.empty())
+    return &k.state[0];
+
+  movieState.resize(k.size);
+  if(fseek(movieFile, k.offset, SEEK_SET) != 0 ||
+     fread(&movieState[0], 1, k.size, movieFile) != k.size)
+    return NULL;
+  return &movieState[0];
+}
+
+static bool movieLoadKeyframe(size_t index)
+{
+  MovieKeyframe &k = movieKeyframes[index];
+  const char *state = movieGetKeyframe(index);
+  if(state == NULL || !movieSystem->emuReadMemState((char *)state, k.size))
+    return false;
+  movieStartFrame(k.frame);
+  return true;
+}
+
+static bool movieWrite()
+{
+  std::vector<u8> out;
+  moviePut32(out, MOVIE_VERSION);
+  moviePut32(out, movieInputs.size());
+  moviePut32(out, movieInterval);
+  moviePut32(out, movieKeyframes.size());
+  moviePut32(out, (u32)((u64)movieStartTime));
+  moviePut32(out, (u32)((u64)movieStartTime >> 32));
+
+  for(size_t i = 0; i < movieInputs.size(); i++) {
+    const MovieInput &input = movieInputs[i];
+    for(int j = 0; j < 4; j++)
+      moviePut32(out, input.joypad[j] & MOVIE_JOYPAD_MASK);
+    moviePut32(out, input.sensorX);
+    moviePut32(out, input.sensorY);
+    moviePut32(out, input.flags);
+  }
+
+  u32 offset = out.size() + movieKeyframes.size() * MOVIE_INDEX_SIZE;
+  for(size_t i = 0; i < movieKeyframes.size(); i++) {
+    moviePut32(out, movieKeyframes[i].frame);
+    moviePut32(out, offset);
+    moviePut32(out, movieKeyframes[i].size);
+    offset += movieKeyframes[i].size;
+  }
+
+  FILE *f = fopen(movieFileName.c_str(), "wb");
+  if(f == NULL)
+    return false;
+  bool ok = fwrite(&out[0], 1, out.size(), f) == out.size();
+  for(size_t i = 0; ok && i < movieKeyframes.size(); i++) {
+    const MovieKeyframe &k = movieKeyframes[i];
+    ok = fwrite(&k.state[0], 1, k.size, f) == k.size;
+  }
+  if(fclose(f) != 0)
+    ok = false;
+  return ok;
+}
+
+bool movieStartRecording(EmulatedSystem *system, const char *fileName)
+{
+  movieStop();
+  if(!system->emuWriteMemState)
+    return false;
+
+  movieSystem = system;
+  movieFileName = fileName;
+  movieInterval = movieKeyframeInterval > 0 ? movieKeyframeInterval : 1;
+  movieStartTime = time(NULL);
+  movieResetPending = false;
+  movieLiveSensor = false;
+  movieStartFrame(0);
+  if(!movieAddKeyframe()) {
+    movieStop();
+    return false;
+  }
+  movieMode = MOVIE_RECORDING;
+  return true;
+}
+
+#ifndef __LIBRETRO__
+static bool movieStartVersion1(EmulatedSystem *system, const char *fileName,
+                               FILE *f)
+{
+  // the joypad changes at every <frame>.32 <joypad>.32 pair; the last pair
+  // is where the movie ends
+  MovieInput input;
+  memset(&input, 0, sizeof(input));
+  u8 change[8];
+  while(fread(change, 1, sizeof(change), f) == sizeof(change)) {
+    u32 frame = movieGet32(change);
+    if(frame < movieInputs.size()) {
+      fclose(f);
+      return false;
+    }
+    movieInputs.resize(frame, input);
+    input.joypad[0] = movieGet32(change + 4);
+  }
+  fclose(f);
+
+  std::string state = fileName;
+  state[state.size() - 1] = '0';
+  if(movieInputs.empty() || !system->emuReadState(state.c_str()))
+    return false;
+
+  movieSystem = system;
+  movieInterval = movieKeyframeInterval > 0 ? movieKeyframeInterval : 1;
+  movieStartTime = time(NULL);
+  movieLiveSensor = true;
+  movieStartFrame(0);
+  if(!movieAddKeyframe())
+    return false;
+  movieMode = MOVIE_PLAYING;
+  return true;
+}
+#endif
+
+bool movieStartPlayback(EmulatedSystem *system, const char *fileName)
+{
+  movieStop();
+  if(!system->emuReadMemState || !system->emuWriteMemState)
+    return false;
+
+  FILE *f = fopen(fileName, "rb");
+  if(f == NULL)
+    return false;
+  fseek(f, 0, SEEK_END);
+  long fileSize = ftell(f);
+  fseek(f, 0, SEEK_SET);
+
+  u8 header[MOVIE_HEADER_SIZE];
+  if(fread(header, 1, 4, f) != 4) {
+    fclose(f);
+    return false;
+  }
+  u32 version = movieGet32(header);
+#ifndef __LIBRETRO__
+  if(version == 1) {
+    if(movieStartVersion1(system, fileName, f))
+      return true;
+    movieStop();
+    return false;
+  }
+#endif
+  if(version != MOVIE_VERSION ||
+     fread(header + 4, 1, MOVIE_HEADER_SIZE - 4, f) != MOVIE_HEADER_SIZE - 4) {
+    fclose(f);
+    return false;
+  }
+
+  u32 frames = movieGet32(header + 4);
+  u32 interval = movieGet32(header + 8);
+  u32 keyframes = movieGet32(header + 12);
+  u64 tableSize = (u64)frames * MOVIE_INPUT_SIZE +
+    (u64)keyframes * MOVIE_INDEX_SIZE;
+  if(frames == 0 || keyframes == 0 || fileSize < 0 ||
+     MOVIE_HEADER_SIZE + tableSize > (u64)fileSize) {
+    fclose(f);
+    return false;
+  }
+
+  std::vector<u8> table(tableSize);
+  if(fread(&table[0], 1, table.size(), f) != table.size()) {
+    fclose(f);
+    return false;
+  }
+
+  movieInputs.resize(frames);
+  const u8 *p = &table[0];
+  for(u32 i = 0; i < frames; i++, p += MOVIE_INPUT_SIZE) {
+    MovieInput &input = movieInputs[i];
+    for(int j = 0; j < 4; j++)
+      input.joypad[j] = movieGet32(p + j * 4);
+    input.sensorX = movieGet32(p + 16);
+    input.sensorY = movieGet32(p + 20);
+    input.flags = movieGet32(p + 24);
+  }
+
+  movieKeyframes.resize(keyframes);
+  for(u32 i = 0; i < keyframes; i++, p += MOVIE_INDEX_SIZE) {
+    MovieKeyframe &k = movieKeyframes[i];
+    k.frame = movieGet32(p);
+    k.offset = movieGet32(p + 4);
+    k.size = movieGet32(p + 8);
+    bool ordered = i == 0 ? k.frame == 0 : k.frame > movieKeyframes[i - 1].frame;
+    if(!ordered || k.frame >= frames || k.size < 8 ||
+       (u64)k.offset + k.size > (u64)fileSize) {
+      fclose(f);
+      movieStop();
+      return false;
+    }
+  }
+
+  movieSystem = system;
+  movieFile = f;
+  movieFileName = fileName;
+  movieInterval = interval > 0 ? interval : 1;
+  movieStartTime = (time_t)(movieGet32(header + 16) |
+                            ((u64)movieGet32(header + 20) << 32));
+  movieLiveSensor = false;
+  if(!movieLoadKeyframe(0)) {
+    movieStop();
+    return false;
+  }
+  movieMode = MOVIE_PLAYING;
+  return true;
+}
+
+bool movieStop()
+{
+  bool ok = true;
+  if(movieMode == MOVIE_RECORDING)
+    ok = movieWrite();
+  if(movieFile != NULL) {
+    fclose(movieFile);
+    movieFile = NULL;
+  }
+  movieMode = MOVIE_NONE;
+  movieSystem = NULL;
+  movieInputs.clear();
+  movieKeyframes.clear();
+  std::vector<char>().swap(movieState);
+  movieStartFrame(0);
+  return ok;
+}
+
+MovieMode movieGetMode()
+{
+  return movieMode;
+}
+
+u32 movieGetFrame()
+{
+  return movieFrameNumber;
+}
+
+u32 movieGetLength()
+{
+  return movieInputs.size();
+}
+
+static bool movieKeyframeAfter(u32 frame, const MovieKeyframe &k)
+{
+  return frame < k.frame;
+}
+
+bool movieSeek(u32 frame)
+{
+  if(movieMode != MOVIE_PLAYING || frame >= movieInputs.size())
+    return false;
+
+  size_t index = std::upper_bound(movieKeyframes.begin(), movieKeyframes.end(),
+                                  frame, movieKeyframeAfter) -
+    movieKeyframes.begin() - 1;
+  // keeps going from where it is when that is closer than the keyframe
+  if(movieFrameNumber < movieKeyframes[index].frame ||
+     movieFrameNumber > frame ||
+     (movieFrameNumber == frame && !movieFrameStart)) {
+    if(!movieLoadKeyframe(index)) {
+      movieStop();
+      return false;
+    }
+  }
+
+  // the emulated state doesn't depend on the sound output
+  bool synthesis = soundGetSynthesis();
+  soundSetSynthesis(false);
+  while(movieMode == MOVIE_PLAYING && movieFrameNumber < frame)
+    movieSystem->emuMain(movieSystem->emuCount);
+  soundSetSynthesis(synthesis);
+  return movieMode == MOVIE_PLAYING;
+}
+
+int movieGetSegments()
+{
+  if(movieMode != MOVIE_PLAYING)
+    return 0;
+  // keyframes added while playing end where the replay did
+  int segments = 0;
+  while(segments + 1 < (int)movieKeyframes.size() &&
+        movieKeyframes[segments + 1].state.empty())
+    segments++;
+  return segments;
+}
+
+u32 movieGetSegmentStart(int segment)
+{
+  return movieKeyframes[segment].frame;
+}
+
+bool movieVerifySegment(int segment)
+{
+  if(segment < 0 || segment >= movieGetSegments())
+    return false;
+  if(!movieLoadKeyframe(segment)) {
+    movieStop();
+    return false;
+  }
+
+  u32 end = movieKeyframes[segment + 1].frame;
+  bool synthesis = soundGetSynthesis();
+  soundSetSynthesis(false);
+  while(movieMode == MOVIE_PLAYING && movieFrameNumber < end)
+    movieSystem->emuMain(movieSystem->emuCount);
+  soundSetSynthesis(synthesis);
+  if(movieMode != MOVIE_PLAYING)
+    return false;
+
+  // the keyframe was taken after the reset of its frame
+  movieUpdate();
+  std::vector<char> state(MOVIE_STATE_SIZE);
+  if(!movieSystem->emuWriteMemState(&state[0], MOVIE_STATE_SIZE))
+    return false;
+  const MovieKeyframe &k = movieKeyframes[segment + 1];
+  const char *expected = movieGetKeyframe(segment + 1);
+  return expected != NULL && memcmp(&state[0], expected, k.size) == 0;
+}
+
+void movieReset()
+{
+  if(movieMode == MOVIE_RECORDING)
+    movieResetPending = true;
+}
+
+void movieUpdate()
+{
+  if(!movieFrameStart)
+    return;
+  movieFrameStart = false;
+
+  if(movieMode == MOVIE_RECORDING) {
+    if(movieResetPending) {
+      movieResetPending = false;
+      movieCurrent.flags |= MOVIE_RESET;
+      movieSystem->emuReset();
+    }
+    // without it seeks go back to the previous keyframe
+    if(movieFrameNumber % movieInterval == 0)
+      movieAddKeyframe();
+  } else {
+    if(movieInputs[movieFrameNumber].flags & MOVIE_RESET)
+      movieSystem->emuReset();
+    // playback past the last keyframe, for the version 1 movies
+    if(movieFrameNumber >= movieKeyframes.back().frame + movieInterval)
+      movieAddKeyframe();
+  }
+}
+
+bool movieFrame()
+{
+  if(movieMode == MOVIE_NONE)
+    return false;
+
+  if(movieMode == MOVIE_RECORDING)
+    movieInputs.push_back(movieCurrent);
+  movieStartFrame(movieFrameNumber + 1);
+  if(movieMode == MOVIE_PLAYING && movieFrameNumber >= movieInputs.size()) {
+    movieStop();
+    systemScreenMessage(N_("Playback ended"));
+    return false;
+  }
+  movieFrameStart = true;
+  return true;
+}
+
+u32 movieReadJoypad(int which)
+{
+  if(movieMode == MOVIE_NONE)
+    return systemReadJoypad(which);
+
+  int joy = which < 0 ? 0 : which & 3;
+  if(!(movieRead & (1 << joy))) {
+    u32 value = systemReadJoypad(which);
+    if(movieMode == MOVIE_PLAYING)
+      value = (value & ~MOVIE_JOYPAD_MASK) |
+        (movieInputs[movieFrameNumber].joypad[joy] & MOVIE_JOYPAD_MASK);
+    movieCurrent.joypad[joy] = value;
+    movieRead |= 1 << joy;
+  }
+  return movieCurrent.joypad[joy];
+}
+
+int movieGetSensorX()
+{
+  if(movieMode == MOVIE_NONE || movieLiveSensor)
+    return systemGetSensorX();
+
+  if(!(movieRead & MOVIE_READ_SENSOR_X)) {
+    movieCurrent.sensorX = movieMode == MOVIE_PLAYING ?
+      movieInputs[movieFrameNumber].sensorX : systemGetSensorX();
+    movieRead |= MOVIE_READ_SENSOR_X;
+  }
+  return movieCurrent.sensorX;
+}
+
+int movieGetSensorY()
+{
+  if(movieMode == MOVIE_NONE || movieLiveSensor)
+    return systemGetSensorY();
+
+  if(!(movieRead & MOVIE_READ_SENSOR_Y)) {
+    movieCurrent.sensorY = movieMode == MOVIE_PLAYING ?
+      movieInputs[movieFrameNumber].sensorY : systemGetSensorY();
+    movieRead |= MOVIE_READ_SENSOR_Y;
+  }
+  return movieCurrent.sensorY;
+}
+
+time_t movieTime(time_t *t)
+{
+  time_t now;
+  if(movieMode == MOVIE_NONE)
+    now = time(NULL);
+  else
+    now = movieStartTime + movieFrameNumber / 60;
+  if(t != NULL)
+    *t = now;
+  return now;
+}
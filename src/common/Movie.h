@@ -0,0 +1,58 @@
+#ifndef MOVIE_H
+#define MOVIE_H
+
+#include <time.h>
+
+#include "Types.h"
+
+struct EmulatedSystem;
+
+// Input movies hold everything the core reads from the frontend, frame by
+// frame: all four joypads, the motion sensor, resets and the RTC clock,
+// which runs from the time the recording started. The movie begins with a
+// memory savestate and adds one every movieKeyframeInterval frames, so a
+// seek loads the keyframe at or before the frame and replays the rest.
+//
+// While a movie is active the cores return from emuMain at every frame
+// end; keyframes and resets are taken when they are entered again.
+
+// frames between keyframes when recording
+extern int movieKeyframeInterval;
+
+enum MovieMode {
+  MOVIE_NONE,
+  MOVIE_RECORDING,
+  MOVIE_PLAYING
+};
+
+// Records from the current state; the file is written by movieStop().
+bool movieStartRecording(EmulatedSystem *system, const char *fileName);
+// Also plays the old version 1 keystroke logs (name.vmv with name.vm0).
+bool movieStartPlayback(EmulatedSystem *system, const char *fileName);
+// Returns false if the recording couldn't be written.
+bool movieStop();
+MovieMode movieGetMode();
+u32 movieGetFrame();
+u32 movieGetLength();
+// Playback only: loads the keyframe at or before frame and runs up to it.
+bool movieSeek(u32 frame);
+// Playback only: the keyframes of the file split the movie into segments
+// that can be replayed on their own, segment n running from keyframe n to
+// keyframe n + 1.
+int movieGetSegments();
+u32 movieGetSegmentStart(int segment);
+// Replays the segment and checks that it ends in the state of the next
+// keyframe. Leaves the system at the end of the segment.
+bool movieVerifySegment(int segment);
+// Resets the emulated system at the start of the next frame and records it.
+void movieReset();
+
+// Called by the cores instead of the system functions
+void movieUpdate();
+bool movieFrame();
+u32 movieReadJoypad(int which);
+int movieGetSensorX();
+int movieGetSensorY();
+time_t movieTime(time_t *t);
+
+#endif // MOVIE_H
@@ -26,74 +26,121 @@ typedef off64_t __off64_t;
 typedef	__int64 __off64_t;
 #endif
 
-static int readInt2(FILE *f)
+// The whole patch is read into memory with a single fread and every
+// record is decoded from this cursor, so there is no per-byte stdio
+// call and the patch CRC can be computed without reading the file twice.
+struct PatchData {
+  u8 *data;
+  size_t size;
+  size_t pos;
+};
+
+static bool patchLoad(const char *patchname, PatchData *p)
 {
-  int res = 0;
-  int c = fgetc(f);
-  if(c == EOF)
-    return -1;
-  res = c;
-  c = fgetc(f);
-  if(c == EOF)
-    return -1;
-  return c + (res<<8);
+  p->data = NULL;
+  p->size = 0;
+  p->pos = 0;
+
+  FILE *f = fopen(patchname, "rb");
+  if (!f)
+    return false;
+
+  fseeko64(f, 0, SEEK_END);
+  __off64_t size = ftello64(f);
+  fseeko64(f, 0, SEEK_SET);
+
+  if (size <= 0) {
+    fclose(f);
+    return false;
+  }
+
+  p->data = (u8 *)malloc((size_t)size);
+  if (p->data == NULL) {
+    fclose(f);
+    return false;
+  }
+
+  if (fread(p->data, 1, (size_t)size, f) != (size_t)size) {
+    free(p->data);
+    p->data = NULL;
+    fclose(f);
+    return false;
+  }
+
+  p->size = (size_t)size;
+  fclose(f);
+  return true;
 }
 
-static int readInt3(FILE *f)
+static void patchFree(PatchData *p)
 {
-  int res = 0;
-  int c = fgetc(f);
-  if(c == EOF)
-    return -1;
-  res = c;
-  c = fgetc(f);
-  if(c == EOF)
-    return -1;
-  res = c + (res<<8);
-  c = fgetc(f);
-  if(c == EOF)
+  free(p->data);
+  p->data = NULL;
+  p->size = 0;
+  p->pos = 0;
+}
+
+static int readByte(PatchData *p)
+{
+  if (p->pos >= p->size)
     return -1;
-  return c + (res<<8);
+  return p->data[p->pos++];
 }
 
-static s64 readInt4(FILE *f)
+static bool readBlock(PatchData *p, u8 *dest, size_t len)
 {
-  s64 tmp, res = 0;
-  int c;
-
-  for (int i = 0; i < 4; i++) {
-    c = fgetc(f);
-    if (c == EOF)
-      return -1;
-    tmp = c;
-    res = res + (tmp << (i*8));
-  }
+  if (len > p->size - p->pos)
+    return false;
+  memcpy(dest, p->data + p->pos, len);
+  p->pos += len;
+  return true;
+}
 
-  return res;
+static int readInt2(PatchData *p)
+{
+  if (p->size - p->pos < 2)
+    return -1;
+  const u8 *d = p->data + p->pos;
+  p->pos += 2;
+  return (d[0] << 8) | d[1];
 }
 
-static s64 readInt8(FILE *f)
+static int readInt3(PatchData *p)
 {
-  s64 tmp, res = 0;
-  int c;
-
-  for (int i = 0; i < 8; i++) {
-    c = fgetc(f);
-    if (c == EOF)
-      return -1;
-    tmp = c;
-    res = res + (tmp << (i*8));
-  }
+  if (p->size - p->pos < 3)
+    return -1;
+  const u8 *d = p->data + p->pos;
+  p->pos += 3;
+  return (d[0] << 16) | (d[1] << 8) | d[2];
+}
 
+static s64 readInt4(PatchData *p)
+{
+  if (p->size - p->pos < 4)
+    return -1;
+  const u8 *d = p->data + p->pos;
+  p->pos += 4;
+  return (s64)d[0] | ((s64)d[1] << 8) | ((s64)d[2] << 16) | ((s64)d[3] << 24);
+}
+
+static s64 readInt8(PatchData *p)
+{
+  if (p->size - p->pos < 8)
+    return -1;
+  s64 res = 0;
+  for (int i = 0; i < 8; i++)
+    res |= (s64)p->data[p->pos + i] << (i*8);
+  p->pos += 8;
   return res;
 }
 
-static s64 readVarPtr(FILE *f)
+// variable length integer shared by UPS and BPS
+static s64 readVarPtr(PatchData *p)
 {
   s64 offset = 0, shift = 1;
   for (;;) {
-    int c = fgetc(f);
-    if (c == EOF) return 0;
+    int c = readByte(p);
+    if (c == -1) return 0;
     offset += (c & 0x7F) * shift;
     if (c & 0x80) break;
     shift <<= 7;
@@ -102,183 +149,302 @@ static s64 readVarPtr(FILE *f)
   return offset;
 }
 
-#ifndef MIN
-#define MIN(a,b) (((a)<(b))?(a):(b))
-#endif
-
-static uLong computePatchCRC(FILE *f, unsigned int size)
+// UPS and BPS end with source, target and patch CRC32s; the patch CRC
+// covers everything but its own four bytes.
+static bool patchCheckFooter(PatchData *p, s64 *srcCRC, s64 *dstCRC)
 {
-  Bytef buf[4096];
-  long readed;
+  size_t save = p->pos;
+  p->pos = p->size - 12;
+  *srcCRC = readInt4(p);
+  *dstCRC = readInt4(p);
+  s64 patchCRC = readInt4(p);
+  p->pos = save;
+
+  if (*srcCRC == -1 || *dstCRC == -1 || patchCRC == -1)
+    return false;
 
   uLong crc = crc32(0L, Z_NULL, 0);
-  do {
-    readed = fread(buf, 1, MIN(size, sizeof(buf)), f);
-    crc = crc32(crc, buf, readed);
-    size -= readed;
-  } while (readed > 0);
-  return crc;
+  crc = crc32(crc, p->data, p->size - 4);
+  return crc == (uLong)patchCRC;
 }
 
 static bool patchApplyIPS(const char *patchname, u8 **r, unsigned int *s)
 {
   // from the IPS spec at http://zerosoft.zophar.net/ips.htm
-  FILE *f = fopen(patchname, "rb");
-  if(!f)
+  PatchData p;
+  if (!patchLoad(patchname, &p))
     return false;
 
   bool result = false;
 
   u8 *rom = *r;
   unsigned int size = *s;
-  if(fgetc(f) == 'P' &&
-     fgetc(f) == 'A' &&
-     fgetc(f) == 'T' &&
-     fgetc(f) == 'C' &&
-     fgetc(f) == 'H') {
+  if (p.size >= 5 && memcmp(p.data, "PATCH", 5) == 0) {
     int b;
     int offset;
     int len;
 
     result = true;
+    p.pos = 5;
 
     for(;;) {
       // read offset
-      offset = readInt3(f);
+      offset = readInt3(&p);
       // if offset == EOF, end of patch
       if(offset == 0x454f46 || offset == -1)
         break;
       // read length
-      len = readInt2(f);
+      len = readInt2(&p);
       if(!len) {
         // len == 0, RLE block
-        len = readInt2(f);
+        len = readInt2(&p);
         // byte to fill
-        int c = fgetc(f);
+        int c = readByte(&p);
         if(c == -1)
           break;
         b = (u8)c;
       } else
         b= -1;
+      if(len == -1)
+        break;
       // check if we need to reallocate our ROM
-      if((offset + len) >= size) {
-        size *= 2;
+      if((unsigned int)(offset + len) >= size) {
+        while((unsigned int)(offset + len) >= size)
+          size *= 2;
         rom = (u8 *)realloc(rom, size);
         *r = rom;
         *s = size;
       }
       if(b == -1) {
-        // normal block, just read the data
-        if(fread(&rom[offset], 1, len, f) != (size_t)len)
+        // normal block, just copy the data
+        if(!readBlock(&p, &rom[offset], len))
           break;
       } else {
         // fill the region with the given byte
-        while(len--) {
-          rom[offset++] = b;
-        }
+        memset(&rom[offset], b, len);
       }
     }
   }
-  // close the file
-  fclose(f);
+
+  patchFree(&p);
 
   return result;
 }
 
 static bool patchApplyUPS(const char *patchname, u8 **rom, unsigned int *size)
 {
-  s64 srcCRC, dstCRC, patchCRC;
+  s64 srcCRC, dstCRC;
 
-  FILE *f = fopen(patchname, "rb");
-  if (!f)
+  PatchData p;
+  if (!patchLoad(patchname, &p))
     return false;
 
-  fseeko64(f, 0, SEEK_END);
-  __off64_t patchSize = ftello64(f);
-  if (patchSize < 20) {
-    fclose(f);
+  if (p.size < 20 || memcmp(p.data, "UPS1", 4) != 0 ||
+      !patchCheckFooter(&p, &srcCRC, &dstCRC)) {
+    patchFree(&p);
     return false;
   }
 
-  fseeko64(f, 0, SEEK_SET);
-  if(fgetc(f) != 'U' || fgetc(f) != 'P' || fgetc(f) != 'S' || fgetc(f) != '1') {
-    fclose(f);
+  u32 crc = crc32(0L, Z_NULL, 0);
+  crc = crc32(crc, *rom, *size);
+
+  p.pos = 4;
+  s64 dataSize, resultCRC;
+  s64 srcSize = readVarPtr(&p);
+  s64 dstSize = readVarPtr(&p);
+
+  if (crc == srcCRC && srcSize == *size) {
+    dataSize = dstSize;
+    resultCRC = dstCRC;
+  } else if (crc == dstCRC && dstSize == *size) {
+    dataSize = srcSize;
+    resultCRC = srcCRC;
+  } else {
+    patchFree(&p);
     return false;
   }
+  if (dataSize > *size) {
+    u8 *grown = (u8 *)realloc(*rom, dataSize);
+    if (grown == NULL) {
+      patchFree(&p);
+      return false;
+    }
+    *rom = grown;
+    memset(*rom + *size, 0, dataSize - *size);
+  }
 
-  fseeko64(f, -12, SEEK_END);
-  srcCRC = readInt4(f);
-  dstCRC = readInt4(f);
-  patchCRC = readInt4(f);
-  if (srcCRC == -1 || dstCRC == -1 || patchCRC == -1) {
-    fclose(f);
-    return false;
+  // The records are XOR deltas at increasing offsets, so the CRC of the
+  // result is accumulated behind the write cursor and a mismatch can be
+  // undone by applying the same deltas a second time.
+  size_t hunks = p.pos;
+  for (int pass = 0; pass < 2; pass++) {
+    s64 relative = 0;
+    s64 checked = 0;
+    u8 *mem = *rom;
+    crc = crc32(0L, Z_NULL, 0);
+    p.pos = hunks;
+
+    while (p.pos < p.size - 12) {
+      relative += readVarPtr(&p);
+      // consume the whole record even if it lies past the output size
+      for (;;) {
+        int x = readByte(&p);
+        if (x <= 0) {
+          relative++;
+          break;
+        }
+        if (relative < dataSize)
+          mem[relative] ^= x;
+        relative++;
+      }
+      if (pass == 0) {
+        s64 end = relative < dataSize ? relative : dataSize;
+        if (end > checked) {
+          crc = crc32(crc, mem + checked, end - checked);
+          checked = end;
+        }
+      }
+    }
+
+    if (pass == 0) {
+      if (checked < dataSize)
+        crc = crc32(crc, mem + checked, dataSize - checked);
+      if (crc == resultCRC) {
+        *size = dataSize;
+        patchFree(&p);
+        return true;
+      }
+    }
   }
 
-  fseeko64(f, 0, SEEK_SET);
-  u32 crc = computePatchCRC(f, patchSize-4);
+  patchFree(&p);
+  return false;
+}
 
-  if (crc != patchCRC) {
-    fclose(f);
+static bool patchApplyBPS(const char *patchname, u8 **rom, unsigned int *size)
+{
+  s64 srcCRC, dstCRC;
+
+  PatchData p;
+  if (!patchLoad(patchname, &p))
+    return false;
+
+  if (p.size < 19 || memcmp(p.data, "BPS1", 4) != 0 ||
+      !patchCheckFooter(&p, &srcCRC, &dstCRC)) {
+    patchFree(&p);
     return false;
   }
 
-  crc = crc32(0L, Z_NULL, 0);
+  p.pos = 4;
+  s64 srcSize = readVarPtr(&p);
+  s64 dstSize = readVarPtr(&p);
+  s64 metaSize = readVarPtr(&p);
+
+  u32 crc = crc32(0L, Z_NULL, 0);
   crc = crc32(crc, *rom, *size);
 
-  fseeko64(f, 4, SEEK_SET);
-  s64 dataSize;
-  s64 srcSize = readVarPtr(f);
-  s64 dstSize = readVarPtr(f);
+  if (srcSize != *size || crc != srcCRC || p.pos > p.size - 12 ||
+      metaSize > (s64)(p.size - 12 - p.pos)) {
+    patchFree(&p);
+    return false;
+  }
+  p.pos += metaSize;
 
-  if (crc == srcCRC) {
-    if (srcSize != *size) {
-      fclose(f);
-      return false;
-    }
-    dataSize = dstSize;
-  } else if (crc == dstCRC) {
-    if (dstSize != *size) {
-      fclose(f);
-      return false;
-    }
-    dataSize = srcSize;
-  } else {
-    fclose(f);
+  // SourceCopy reads arbitrary source offsets while the target is being
+  // written in place, so keep the original image aside.
+  u8 *source = (u8 *)malloc(srcSize ? srcSize : 1);
+  if (source == NULL) {
+    patchFree(&p);
     return false;
   }
-  if (dataSize > *size) {
-    *rom = (u8*)realloc(*rom, dataSize);
-    memset(*rom + *size, 0, dataSize - *size);
-    *size = dataSize;
+  memcpy(source, *rom, srcSize);
+
+  if (dstSize > *size) {
+    u8 *grown = (u8 *)realloc(*rom, dstSize);
+    if (grown == NULL) {
+      free(source);
+      patchFree(&p);
+      return false;
+    }
+    *rom = grown;
+    memset(*rom + *size, 0, dstSize - *size);
   }
 
-  s64 relative = 0;
-  u8 *mem;
-  while(ftello64(f) < patchSize - 12) {
-    relative += readVarPtr(f);
-    if (relative > dataSize) continue;
-    mem = *rom + relative;
-    for(s64 i = relative; i < dataSize; i++) {
-      int x = fgetc(f);
-      relative++;
-      if (!x) break;
-      if (i < dataSize) {
-        *mem++ ^= x;
+  u8 *target = *rom;
+  s64 out = 0;
+  s64 sourceRelative = 0;
+  s64 targetRelative = 0;
+  bool ok = true;
+
+  while (ok && p.pos < p.size - 12) {
+    s64 data = readVarPtr(&p);
+    s64 len = (data >> 2) + 1;
+    if (out + len > dstSize) {
+      ok = false;
+      break;
+    }
+
+    switch (data & 3) {
+    case 0: // SourceRead
+      if (out + len > srcSize) {
+        ok = false;
+        break;
+      }
+      memcpy(target + out, source + out, len);
+      break;
+    case 1: // TargetRead
+      ok = readBlock(&p, target + out, len);
+      break;
+    case 2: { // SourceCopy
+      s64 offset = readVarPtr(&p);
+      sourceRelative += (offset & 1) ? -(offset >> 1) : (offset >> 1);
+      if (sourceRelative < 0 || sourceRelative + len > srcSize) {
+        ok = false;
+        break;
+      }
+      memcpy(target + out, source + sourceRelative, len);
+      sourceRelative += len;
+      break;
+    }
+    case 3: { // TargetCopy
+      s64 offset = readVarPtr(&p);
+      targetRelative += (offset & 1) ? -(offset >> 1) : (offset >> 1);
+      if (targetRelative < 0 || targetRelative >= out) {
+        ok = false;
+        break;
       }
+      // may overlap the bytes being written, copy forwards one at a time
+      for (s64 i = 0; i < len; i++)
+        target[out + i] = target[targetRelative++];
+      break;
+    }
     }
+    if (ok)
+      out += len;
   }
 
-  fclose(f);
-  return true;
+  if (ok) {
+    crc = crc32(0L, Z_NULL, 0);
+    crc = crc32(crc, target, dstSize);
+    ok = (out == dstSize && crc == dstCRC);
+  }
+
+  if (ok) {
+    *size = dstSize;
+  } else {
+    memcpy(*rom, source, srcSize);
+  }
+
+  free(source);
+  patchFree(&p);
+  return ok;
 }
 
-static int ppfVersion(FILE *f)
+static int ppfVersion(PatchData *p)
 {
-  fseeko64(f, 0, SEEK_SET);
-  if (fgetc(f) != 'P' || fgetc(f) != 'P' || fgetc(f) != 'F') //-V501
+  if (p->size < 4 || memcmp(p->data, "PPF", 3) != 0)
     return 0;
-  switch(fgetc(f)){
+  switch(p->data[3]){
     case '1': return 1;
     case '2': return 2;
     case '3': return 3;
@@ -286,42 +452,46 @@ static int ppfVersion(FILE *f)
   }
 }
 
-static int ppfFileIdLen(FILE *f, int version)
+static int ppfFileIdLen(PatchData *p, int version)
 {
-  if (version == 2) {
-    fseeko64(f, -8, SEEK_END);
-  } else {
-    fseeko64(f, -6, SEEK_END);
-  }
-
-  if (fgetc(f) != '.' || fgetc(f) != 'D' || fgetc(f) != 'I' || fgetc(f) != 'Z')
+  size_t tail = (version == 2) ? 8 : 6;
+  if (p->size < tail)
     return 0;
 
-  return (version == 2) ? readInt4(f) : readInt2(f);
+  size_t save = p->pos;
+  p->pos = p->size - tail;
+
+  int len = 0;
+  if (memcmp(p->data + p->pos, ".DIZ", 4) == 0) {
+    p->pos += 4;
+    len = (version == 2) ? (int)readInt4(p) : readInt2(p);
+  }
+
+  p->pos = save;
+  return len;
 }
 
-static bool patchApplyPPF1(FILE *f, u8 **rom, unsigned int *size)
+static bool patchApplyPPF1(PatchData *p, u8 **rom, unsigned int *size)
 {
-  fseek(f, 0, SEEK_END);
-  int count = ftell(f);
+  int count = (int)p->size;
   if (count < 56)
     return false;
   count -= 56;
 
-  fseek(f, 56, SEEK_SET);
+  p->pos = 56;
 
   u8 *mem = *rom;
 
   while (count > 0) {
-    int offset = readInt4(f);
+    int offset = (int)readInt4(p);
     if (offset == -1)
       break;
-    int len = fgetc(f);
-    if (len == EOF)
+    int len = readByte(p);
+    if (len == -1)
       break;
-    if (offset+len > *size)
+    if ((unsigned int)(offset+len) > *size)
       break;
-    if (fread(&mem[offset], 1, len, f) != (size_t)len)
+    if (!readBlock(p, &mem[offset], len))
       break;
     count -= 4 + 1 + len;
   }
@@ -329,43 +499,39 @@ static bool patchApplyPPF1(FILE *f, u8 **rom, unsigned int *size)
   return (count == 0);
 }
 
-static bool patchApplyPPF2(FILE *f, u8 **rom, unsigned int *size)
+static bool patchApplyPPF2(PatchData *p, u8 **rom, unsigned int *size)
 {
-  fseek(f, 0, SEEK_END);
-  int count = ftell(f);
+  int count = (int)p->size;
   if (count < 56+4+1024)
     return false;
   count -= 56+4+1024;
 
-  fseek(f, 56, SEEK_SET);
+  p->pos = 56;
 
-  int datalen = readInt4(f);
-  if (datalen != *size)
+  int datalen = (int)readInt4(p);
+  if ((unsigned int)datalen != *size)
     return false;
 
   u8 *mem = *rom;
 
-  u8 block[1024];
-  fread(&block, 1, 1024, f);
-  if (memcmp(&mem[0x9320], &block, 1024) != 0)
+  if (memcmp(&mem[0x9320], p->data + p->pos, 1024) != 0)
     return false;
+  p->pos += 1024;
 
-  int idlen = ppfFileIdLen(f, 2);
+  int idlen = ppfFileIdLen(p, 2);
   if (idlen > 0)
     count -= 16 + 16 + idlen;
 
-  fseek(f, 56+4+1024, SEEK_SET);
-
   while (count > 0) {
-    int offset = readInt4(f);
+    int offset = (int)readInt4(p);
     if (offset == -1)
       break;
-    int len = fgetc(f);
-    if (len == EOF)
+    int len = readByte(p);
+    if (len == -1)
       break;
-    if (offset+len > *size)
+    if ((unsigned int)(offset+len) > *size)
       break;
-    if (fread(&mem[offset], 1, len, f) != (size_t)len)
+    if (!readBlock(p, &mem[offset], len))
       break;
     count -= 4 + 1 + len;
   }
@@ -373,49 +539,45 @@ static bool patchApplyPPF2(FILE *f, u8 **rom, unsigned int *size)
   return (count == 0);
 }
 
-static bool patchApplyPPF3(FILE *f, u8 **rom, unsigned int *size)
+static bool patchApplyPPF3(PatchData *p, u8 **rom, unsigned int *size)
 {
-  fseek(f, 0, SEEK_END);
-  int count = ftell(f);
+  int count = (int)p->size;
   if (count < 56+4+1024)
     return false;
   count -= 56+4;
 
-  fseek(f, 56, SEEK_SET);
+  p->pos = 56;
 
-  int imagetype = fgetc(f);
-  int blockcheck = fgetc(f);
-  int undo = fgetc(f);
-  fgetc(f);
+  int imagetype = readByte(p);
+  int blockcheck = readByte(p);
+  int undo = readByte(p);
+  readByte(p);
 
   u8 *mem = *rom;
 
   if (blockcheck) {
-    u8 block[1024];
-    fread(&block, 1, 1024, f);
-    if (memcmp(&mem[(imagetype == 0) ? 0x9320 : 0x80A0], &block, 1024) != 0)
+    if (memcmp(&mem[(imagetype == 0) ? 0x9320 : 0x80A0], p->data + p->pos, 1024) != 0)
       return false;
+    p->pos += 1024;
     count -= 1024;
   }
 
-  int idlen = ppfFileIdLen(f, 2);
+  int idlen = ppfFileIdLen(p, 2);
   if (idlen > 0)
     count -= 16 + 16 + idlen;
 
-  fseek(f, 56+4+(blockcheck ? 1024 : 0), SEEK_SET);
-
   while (count > 0) {
-    __off64_t offset = readInt8(f);
+    s64 offset = readInt8(p);
     if (offset == -1)
       break;
-    int len = fgetc(f);
-    if (len == EOF)
+    int len = readByte(p);
+    if (len == -1)
       break;
     if (offset+len > *size)
       break;
-    if (fread(&mem[offset], 1, len, f) != (size_t)len)
+    if (!readBlock(p, &mem[offset], len))
       break;
-    if (undo) fseeko64(f, len, SEEK_CUR);
+    if (undo) p->pos += len;
     count -= 8 + 1 + len;
     if (undo) count -= len;
   }
@@ -425,20 +587,20 @@ static bool patchApplyPPF3(FILE *f, u8 **rom, unsigned int *size)
 
 static bool patchApplyPPF(const char *patchname, u8 **rom, unsigned int *size)
 {
-  FILE *f = fopen(patchname, "rb");
-  if (!f)
+  PatchData p;
+  if (!patchLoad(patchname, &p))
     return false;
 
   bool res = false;
 
-  int version = ppfVersion(f);
+  int version = ppfVersion(&p);
   switch (version) {
-    case 1: res = patchApplyPPF1(f, rom, size); break;
-    case 2: res = patchApplyPPF2(f, rom, size); break;
-    case 3: res = patchApplyPPF3(f, rom, size); break;
+    case 1: res = patchApplyPPF1(&p, rom, size); break;
+    case 2: res = patchApplyPPF2(&p, rom, size); break;
+    case 3: res = patchApplyPPF3(&p, rom, size); break;
   }
 
-  fclose(f);
+  patchFree(&p);
   return res;
 }
 
@@ -453,6 +615,8 @@ bool applyPatch(const char *patchname, u8 **rom,unsigned int *size)
     return patchApplyIPS(patchname, rom, size);
   if (_stricmp(p, ".ups") == 0)
     return patchApplyUPS(patchname, rom, size);
+  if (_stricmp(p, ".bps") == 0)
+    return patchApplyBPS(patchname, rom, size);
   if (_stricmp(p, ".ppf") == 0)
     return patchApplyPPF(patchname, rom, size);
   return false;
@@ -0,0 +1,332 @@
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef ASYNC_SAVES
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#endif
+
+#include "SaveWriter.h"
+
+bool saveJournal = false;
+
+// "VBAJ", followed by the size of the save the journal applies to
+#define SAVE_JOURNAL_MAGIC 0x4A414256
+// changed bytes closer together than this go into one journal record
+#define SAVE_JOURNAL_GAP 32
+
+struct SaveJob {
+  std::string name;
+  std::vector<u8> data;
+};
+
+// What the writer last put on disk for a file, to find the changed ranges
+struct SaveFile {
+  SaveFile() : known(false), journalSize(0) {}
+  bool known;
+  std::vector<u8> image;
+  size_t journalSize;
+};
+
+static std::map<std::string, SaveFile> saveFiles;
+
+static bool saveSync(FILE *f)
+{
+#ifdef _WIN32
+  return _commit(_fileno(f)) == 0;
+#else
+  return fsync(fileno(f)) == 0;
+#endif
+}
+
+static bool saveWriteFile(const std::string &name, const std::vector<u8> &data)
+{
+  std::string tmp = name + ".tmp";
+  FILE *f = fopen(tmp.c_str(), "wb");
+  if(f == NULL)
+    return false;
+
+  bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+  ok = ok && fflush(f) == 0 && saveSync(f);
+  if(fclose(f) != 0)
+    ok = false;
+
+#ifdef _WIN32
+  ok = ok && MoveFileExA(tmp.c_str(), name.c_str(),
+                         MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+#else
+  ok = ok && rename(tmp.c_str(), name.c_str()) == 0;
+  if(ok) {
+    // make the rename itself stick
+    size_t slash = name.rfind('/');
+    std::string dir = slash == std::string::npos ? "." :
+      name.substr(0, slash + 1);
+    int fd = open(dir.c_str(), O_RDONLY);
+    if(fd >= 0) {
+      fsync(fd);
+      close(fd);
+    }
+  }
+#endif
+
+  if(!ok)
+    remove(tmp.c_str());
+  return ok;
+}
+
+static void savePut32(u8 *p, u32 value)
+{
+  p[0] = value;
+  p[1] = value >> 8;
+  p[2] = value >> 16;
+  p[3] = value >> 24;
+}
+
+static u32 saveGet32(const u8 *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((u32)p[3] << 24);
+}
+
+// Journal records are offset, size, the bytes and a crc32 of all of it
+static bool saveAppendJournal(const std::string &name, SaveFile &file,
+                              const std::vector<u8> &data)
+{
+  std::vector<u8> out;
+  if(file.journalSize == 0) {
+    out.resize(8);
+    savePut32(&out[0], SAVE_JOURNAL_MAGIC);
+    savePut32(&out[4], data.size());
+  }
+
+  size_t size = data.size();
+  size_t i = 0;
+  while(i < size) {
+    if(data[i] == file.image[i]) {
+      i++;
+      continue;
+    }
+    size_t start = i;
+    size_t end = i + 1;
+    for(i++; i < size && i - end < SAVE_JOURNAL_GAP; i++)
+      if(data[i] != file.image[i])
+        end = i + 1;
+    i = end;
+
+    size_t at = out.size();
+    out.resize(at + 8 + (end - start) + 4);
+    savePut32(&out[at], start);
+    savePut32(&out[at + 4], end - start);
+    memcpy(&out[at + 8], &data[start], end - start);
+    u32 crc = crc32(0, &out[at], 8 + (end - start));
+    savePut32(&out[at + 8 + (end - start)], crc);
+  }
+
+  std::string journal = name + ".jnl";
+  FILE *f = fopen(journal.c_str(), file.journalSize ? "ab" : "wb");
+  if(f == NULL)
+    return false;
+  bool ok = fwrite(&out[0], 1, out.size(), f) == out.size();
+  ok = ok && fflush(f) == 0 && saveSync(f);
+  if(fclose(f) != 0)
+    ok = false;
+  if(ok)
+    file.journalSize += out.size();
+  return ok;
+}
+
+static bool saveCommit(const std::string &name, std::vector<u8> &data)
+{
+  SaveFile &file = saveFiles[name];
+  if(file.known && file.image == data)
+    return true;
+
+  if(saveJournal && file.known && file.image.size() == data.size() &&
+     file.journalSize < data.size()) {
+    if(saveAppendJournal(name, file, data)) {
+      file.image.swap(data);
+      return true;
+    }
+    // the journal may end in a partial record now, start over
+    file.known = false;
+  }
+
+  if(!saveWriteFile(name, data))
+    return false;
+  if(file.journalSize != 0 || saveJournal)
+    remove((name + ".jnl").c_str());
+  file.known = true;
+  file.journalSize = 0;
+  file.image.swap(data);
+  return true;
+}
+
+#ifdef ASYNC_SAVES
+static std::mutex saveMutex;
+static std::condition_variable saveWake;
+static std::condition_variable saveIdle;
+static std::vector<SaveJob> saveQueue;
+static std::set<std::string> saveFailed;
+static bool saveBusy = false;
+static bool saveStop = false;
+static std::thread saveThread;
+
+static void saveWorker()
+{
+  std::unique_lock<std::mutex> lock(saveMutex);
+  for(;;) {
+    while(saveQueue.empty() && !saveStop)
+      saveWake.wait(lock);
+    if(saveQueue.empty())
+      break;
+
+    SaveJob job;
+    job.name.swap(saveQueue.front().name);
+    job.data.swap(saveQueue.front().data);
+    saveQueue.erase(saveQueue.begin());
+    saveBusy = true;
+
+    lock.unlock();
+    bool ok = saveCommit(job.name, job.data);
+    lock.lock();
+
+    if(!ok)
+      saveFailed.insert(job.name);
+    saveBusy = false;
+    if(saveQueue.empty())
+      saveIdle.notify_all();
+  }
+}
+
+// writes out whatever is still queued when the program exits
+static struct SaveWriterExit {
+  ~SaveWriterExit()
+  {
+    {
+      std::lock_guard<std::mutex> lock(saveMutex);
+      saveStop = true;
+    }
+    saveWake.notify_one();
+    if(saveThread.joinable())
+      saveThread.join();
+  }
+} saveWriterExit;
+#endif
+
+bool saveWriterWrite(const char *fileName, const SaveBlock *blocks, int count)
+{
+  SaveJob job;
+  job.name = fileName;
+  size_t size = 0;
+  for(int i = 0; i < count; i++)
+    size += blocks[i].size;
+  job.data.reserve(size);
+  for(int i = 0; i < count; i++) {
+    const u8 *data = (const u8 *)blocks[i].data;
+    job.data.insert(job.data.end(), data, data + blocks[i].size);
+  }
+
+#ifdef ASYNC_SAVES
+  std::lock_guard<std::mutex> lock(saveMutex);
+  bool ok = saveFailed.erase(job.name) == 0;
+  if(!saveThread.joinable())
+    saveThread = std::thread(saveWorker);
+
+  // a newer copy replaces one that hasn't been written yet
+  for(size_t i = 0; i < saveQueue.size(); i++) {
+    if(saveQueue[i].name == job.name) {
+      saveQueue[i].data.swap(job.data);
+      return ok;
+    }
+  }
+  saveQueue.push_back(SaveJob());
+  saveQueue.back().name.swap(job.name);
+  saveQueue.back().data.swap(job.data);
+  saveWake.notify_one();
+  return ok;
+#else
+  return saveCommit(job.name, job.data);
+#endif
+}
+
+bool saveWriterWrite(const char *fileName, const void *data, size_t size)
+{
+  SaveBlock block = { data, size };
+  return saveWriterWrite(fileName, &block, 1);
+}
+
+void saveWriterFlush()
+{
+#ifdef ASYNC_SAVES
+  std::unique_lock<std::mutex> lock(saveMutex);
+  while(!saveQueue.empty() || saveBusy)
+    saveIdle.wait(lock);
+#endif
+}
+
+static bool saveReadFile(const std::string &name, std::vector<u8> &data)
+{
+  FILE *f = fopen(name.c_str(), "rb");
+  if(f == NULL)
+    return false;
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  data.resize(size > 0 ? size : 0);
+  bool ok = size >= 0 && fread(data.data(), 1, data.size(), f) == data.size();
+  fclose(f);
+  return ok;
+}
+
+void saveWriterRecover(const char *fileName)
+{
+  saveWriterFlush();
+
+  std::string name = fileName;
+  std::string journal = name + ".jnl";
+  std::vector<u8> records;
+  if(!saveReadFile(journal, records))
+    return;
+
+  // the writer's copy is out of date once the file is rewritten here
+  saveFiles.erase(name);
+
+  std::vector<u8> image;
+  if(saveReadFile(name, image) && records.size() >= 8 &&
+     saveGet32(&records[0]) == SAVE_JOURNAL_MAGIC &&
+     saveGet32(&records[4]) == image.size()) {
+    size_t at = 8;
+    bool changed = false;
+    // stops at a record cut short by a crash
+    while(at + 12 <= records.size()) {
+      u32 offset = saveGet32(&records[at]);
+      u32 size = saveGet32(&records[at + 4]);
+      if(size > records.size() - at - 12 || offset > image.size() ||
+         size > image.size() - offset)
+        break;
+      u32 crc = crc32(0, &records[at], 8 + size);
+      if(crc != saveGet32(&records[at + 8 + size]))
+        break;
+      memcpy(&image[offset], &records[at + 8], size);
+      changed = true;
+      at += 12 + size;
+    }
+    if(changed && !saveWriteFile(name, image))
+      return;
+  }
+  remove(journal.c_str());
+}
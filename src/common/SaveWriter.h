@@ -0,0 +1,32 @@
+#ifndef SAVEWRITER_H
+#define SAVEWRITER_H
+
+#include <stddef.h>
+
+#include "Types.h"
+
+// Battery saves are written crash safe: the file is built as name.tmp,
+// synced and renamed over name, so a crash leaves the previous save in
+// place. With ASYNC_SAVES this is done on a background thread; the data is
+// copied when it is queued, so the caller may keep changing it.
+
+// Only appends the ranges that changed since the last write to name.jnl,
+// rewriting the whole file once the journal gets bigger than the save.
+extern bool saveJournal;
+
+struct SaveBlock {
+  const void *data;
+  size_t size;
+};
+
+// Writes the blocks one after the other to fileName. Returns false if the
+// write failed; with ASYNC_SAVES, if the previous write of fileName did.
+bool saveWriterWrite(const char *fileName, const SaveBlock *blocks, int count);
+bool saveWriterWrite(const char *fileName, const void *data, size_t size);
+// Waits until everything queued is on disk.
+void saveWriterFlush();
+// Flushes and folds a journal left next to fileName into it. Call before
+// reading a save.
+void saveWriterRecover(const char *fileName);
+
+#endif // SAVEWRITER_H
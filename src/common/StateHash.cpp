@@ -0,0 +1,186 @@
+#include <string.h>
+
+#include "StateHash.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define STATE_HASH_SSE2
+#include <emmintrin.h>
+#endif
+
+// The data goes through eight 64 bit lanes, 64 byte stripes at a time:
+// each lane adds the product of the two halves of its keyed input word and
+// the input word of its neighbour. That is one _mm_mul_epu32 per two lanes
+// with SSE2, and the C loop gives the same result. The lanes are scrambled
+// after every 1K block and folded together at the end.
+#define STATE_HASH_STRIPE 64
+#define STATE_HASH_BLOCK  1024
+
+static const u64 stateHashKey[8] = {
+  0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL,
+  0xdb979083e96dd4deULL, 0x1f67b3b7a4a44072ULL,
+  0x78e5c0cc4ee679cbULL, 0x2172ffcc7dd05a82ULL,
+  0x8e2443f7744608b8ULL, 0x4c263a81e69035e0ULL
+};
+
+#define STATE_HASH_PRIME32   0x9E3779B1ULL
+#define STATE_HASH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define STATE_HASH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define STATE_HASH_PRIME64_3 0x165667B19E3779F9ULL
+#define STATE_HASH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+
+#ifdef STATE_HASH_SSE2
+static void stateHashAccumulate(u64 *acc, const u8 *p, size_t stripes)
+{
+  __m128i a[4], k[4];
+  for(int j = 0; j < 4; j++) {
+    a[j] = _mm_loadu_si128((const __m128i *)acc + j);
+    k[j] = _mm_loadu_si128((const __m128i *)stateHashKey + j);
+  }
+
+  for(; stripes != 0; stripes--, p += STATE_HASH_STRIPE) {
+    for(int j = 0; j < 4; j++) {
+      __m128i d = _mm_loadu_si128((const __m128i *)p + j);
+      __m128i dk = _mm_xor_si128(d, k[j]);
+      __m128i product = _mm_mul_epu32(dk, _mm_shuffle_epi32(dk, _MM_SHUFFLE(3, 3, 1, 1)));
+      __m128i swapped = _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+      a[j] = _mm_add_epi64(a[j], _mm_add_epi64(product, swapped));
+    }
+  }
+
+  for(int j = 0; j < 4; j++)
+    _mm_storeu_si128((__m128i *)acc + j, a[j]);
+}
+#else
+static void stateHashAccumulate(u64 *acc, const u8 *p, size_t stripes)
+{
+  for(; stripes != 0; stripes--, p += STATE_HASH_STRIPE) {
+    for(int i = 0; i < 8; i++) {
+      u64 d;
+      memcpy(&d, p + i * 8, 8);
+      u64 dk = d ^ stateHashKey[i];
+      acc[i ^ 1] += d;
+      acc[i] += (dk & 0xffffffff) * (dk >> 32);
+    }
+  }
+}
+#endif
+
+static void stateHashScramble(u64 *acc)
+{
+  for(int i = 0; i < 8; i++)
+    acc[i] = (acc[i] ^ (acc[i] >> 47) ^ stateHashKey[i]) * STATE_HASH_PRIME32;
+}
+
+static u64 stateHashAvalanche(u64 h)
+{
+  h ^= h >> 33;
+  h *= STATE_HASH_PRIME64_2;
+  h ^= h >> 29;
+  h *= STATE_HASH_PRIME64_3;
+  h ^= h >> 32;
+  return h;
+}
+
+u64 stateHashData(const void *data, size_t size, u64 seed)
+{
+  u64 acc[8] = {
+    STATE_HASH_PRIME32, STATE_HASH_PRIME64_1,
+    STATE_HASH_PRIME64_2, STATE_HASH_PRIME64_3,
+    STATE_HASH_PRIME64_4, 0x85EBCA77ULL,
+    0x27D4EB2F165667C5ULL, 0xC2B2AE3DULL
+  };
+  const u8 *p = (const u8 *)data;
+  size_t left = size;
+
+  for(; left >= STATE_HASH_BLOCK; left -= STATE_HASH_BLOCK) {
+    stateHashAccumulate(acc, p, STATE_HASH_BLOCK / STATE_HASH_STRIPE);
+    stateHashScramble(acc);
+    p += STATE_HASH_BLOCK;
+  }
+  if(left >= STATE_HASH_STRIPE) {
+    stateHashAccumulate(acc, p, left / STATE_HASH_STRIPE);
+    p += left & ~(STATE_HASH_STRIPE - 1);
+    left &= STATE_HASH_STRIPE - 1;
+  }
+  if(left != 0) {
+    u8 last[STATE_HASH_STRIPE];
+    memset(last, 0, sizeof(last));
+    memcpy(last, p, left);
+    stateHashAccumulate(acc, last, 1);
+  }
+
+  u64 h = seed ^ ((u64)size * STATE_HASH_PRIME64_1);
+  for(int i = 0; i < 8; i++) {
+    h ^= stateHashAvalanche(acc[i] + stateHashKey[i]);
+    h = ((h << 27) | (h >> 37)) * STATE_HASH_PRIME64_1 + STATE_HASH_PRIME64_4;
+  }
+  return stateHashAvalanche(h);
+}
+
+u64 stateHashVariables(const variable_desc *variables, u64 seed)
+{
+  // most of the lists are only a few hundred bytes of small variables
+  u8 buffer[STATE_HASH_BLOCK];
+  size_t used = 0;
+  u64 h = seed;
+
+  for(; variables->address; variables++) {
+    const u8 *p = (const u8 *)variables->address;
+    size_t left = variables->size;
+    while(left != 0) {
+      size_t n = sizeof(buffer) - used;
+      if(n > left)
+        n = left;
+      memcpy(buffer + used, p, n);
+      used += n;
+      p += n;
+      left -= n;
+      if(used == sizeof(buffer)) {
+        h = stateHashData(buffer, used, h);
+        used = 0;
+      }
+    }
+  }
+  return stateHashData(buffer, used, h);
+}
+
+void stateHashInvalidate(StateHashRegion &region)
+{
+  memset(region.dirty, 0xff, sizeof(region.dirty));
+}
+
+u64 stateHashRegion(StateHashRegion &region, const void *data, u32 size,
+                    u64 seed)
+{
+  const u8 *p = (const u8 *)data;
+  if(region.data != p || region.size != size) {
+    region.data = p;
+    region.size = size;
+    stateHashInvalidate(region);
+  }
+
+  u32 pages = (size + (1 << STATE_HASH_PAGE_SHIFT) - 1) >> STATE_HASH_PAGE_SHIFT;
+  if(pages > STATE_HASH_MAX_PAGES)
+    pages = STATE_HASH_MAX_PAGES;
+
+  for(u32 page = 0; page < pages; page += 32) {
+    u32 dirty = region.dirty[page >> 5];
+    region.dirty[page >> 5] = 0;
+    for(u32 i = page; dirty != 0 && i < pages; i++, dirty >>= 1) {
+      if(!(dirty & 1))
+        continue;
+      u32 offset = i << STATE_HASH_PAGE_SHIFT;
+      u32 length = size - offset;
+      if(length > (1 << STATE_HASH_PAGE_SHIFT))
+        length = 1 << STATE_HASH_PAGE_SHIFT;
+      region.pages[i] = stateHashData(p + offset, length, i);
+    }
+  }
+
+  u64 h = stateHashData(region.pages, pages * sizeof(u64), seed);
+  // anything past the last page is hashed every time
+  u32 covered = pages << STATE_HASH_PAGE_SHIFT;
+  if(size > covered)
+    h = stateHashData(p + covered, size - covered, h);
+  return h;
+}
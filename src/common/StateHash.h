@@ -0,0 +1,53 @@
+#ifndef STATEHASH_H
+#define STATEHASH_H
+
+#include <stddef.h>
+
+#include "../Util.h"
+#include "Types.h"
+
+// Fast non-cryptographic hashes of the emulated state, to compare two runs
+// frame by frame (netplay desyncs, nondeterminism). They only have to
+// match between builds of the same version on hosts of the same
+// endianness.
+
+// Memory is hashed in pages; the writes mark the pages they touch, and only
+// those are hashed again. Memory changed behind the back of the marking
+// has to be passed to stateHashInvalidate().
+#define STATE_HASH_PAGE_SHIFT 10
+#define STATE_HASH_MAX_PAGES  256
+
+struct StateHashRegion {
+  // what the page hashes are of
+  const u8 *data;
+  u32 size;
+  u32 dirty[STATE_HASH_MAX_PAGES / 32];
+  u64 pages[STATE_HASH_MAX_PAGES];
+};
+
+static inline void stateHashWritten(StateHashRegion &region, u32 offset)
+{
+  region.dirty[(offset >> (STATE_HASH_PAGE_SHIFT + 5)) &
+               (STATE_HASH_MAX_PAGES / 32 - 1)] |=
+    1u << ((offset >> STATE_HASH_PAGE_SHIFT) & 31);
+}
+
+// For writes through a pointer that may or may not be in the region
+static inline void stateHashWrittenAt(StateHashRegion &region, const void *p)
+{
+  uintptr_t offset = (uintptr_t)p - (uintptr_t)region.data;
+  if(offset < region.size)
+    stateHashWritten(region, (u32)offset);
+}
+
+void stateHashInvalidate(StateHashRegion &region);
+
+u64 stateHashData(const void *data, size_t size, u64 seed);
+// Hashes the variables of a savestate list
+u64 stateHashVariables(const variable_desc *variables, u64 seed);
+// Hashes size bytes at data; starts over when they aren't what the region
+// hashed last time.
+u64 stateHashRegion(StateHashRegion &region, const void *data, u32 size,
+                    u64 seed);
+
+#endif // STATEHASH_H
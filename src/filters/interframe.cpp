@@ -4,6 +4,22 @@
 
 #include "interframe.hpp"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define IFB_SSE2
+#include <emmintrin.h>
+#endif
+
+#if (defined(__x86_64__) && defined(__GNUC__)) || defined(_M_X64)
+#define IFB_AVX2
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define IFB_TARGET_AVX2
+#else
+#define IFB_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
 #ifdef MMX
 extern "C" bool cpu_mmx;
 static void SmartIB_MMX(u8 *srcPtr, u32 srcPitch, int width, int starty, int height);
@@ -213,6 +229,173 @@ void SmartIB(u8 *srcPtr, u32 srcPitch, int width, int height)
   SmartIB(srcPtr, srcPitch, width, 0, height);
 }
 
+#ifdef IFB_AVX2
+static bool ifbDetectAVX2()
+{
+#ifdef _MSC_VER
+  int info[4];
+  __cpuid(info, 0);
+  if(info[0] < 7)
+    return false;
+  __cpuid(info, 1);
+  // the OS has to save the ymm registers too
+  if(!(info[2] & (1 << 27)) || (_xgetbv(0) & 6) != 6)
+    return false;
+  __cpuidex(info, 7, 0);
+  return (info[1] & (1 << 5)) != 0;
+#else
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+
+static const bool ifbAVX2 = ifbDetectAVX2();
+#endif
+
+static void SmartIB32Line_C(u32 *dst, u32 *src, u32 *src1, u32 *src2, u32 *src3, int count)
+{
+  u32 colorMask = 0xfefefe;
+
+  for (int i = 0; i < count; i++) {
+    u32 color = src[i];
+    dst[i] =
+      (src1[i] != src2[i]) &&
+      (src3[i] != color) &&
+      ((color == src2[i]) || (src1[i] == src3[i]))
+      ? (((color & colorMask) >> 1) + ((src1[i] & colorMask) >> 1)) :
+      color;
+    src3[i] = color; /* oldest buffer now holds newest frame */
+  }
+}
+
+static void MotionBlurIB32Line_C(u32 *dst, u32 *src, u32 *src1, int count)
+{
+  u32 colorMask = 0xfefefe;
+
+  for (int i = 0; i < count; i++) {
+    u32 color = src[i];
+    dst[i] = (((color & colorMask) >> 1) +
+              ((src1[i] & colorMask) >> 1));
+    src1[i] = color;
+  }
+}
+
+#ifdef IFB_SSE2
+static void SmartIB32Line_SSE2(u32 *dst, u32 *src, u32 *src1, u32 *src2, u32 *src3, int count)
+{
+  const __m128i colorMask = _mm_set1_epi32(0xfefefe);
+
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i c0 = _mm_loadu_si128((__m128i *)(src + i));
+    __m128i c1 = _mm_loadu_si128((__m128i *)(src1 + i));
+    __m128i c2 = _mm_loadu_si128((__m128i *)(src2 + i));
+    __m128i c3 = _mm_loadu_si128((__m128i *)(src3 + i));
+    _mm_storeu_si128((__m128i *)(src3 + i), c0);
+    // (!(src1 == src2 | src3 == src0)) & (src0 == src2 | src1 == src3)
+    __m128i res = _mm_andnot_si128(
+      _mm_or_si128(_mm_cmpeq_epi32(c1, c2), _mm_cmpeq_epi32(c3, c0)),
+      _mm_or_si128(_mm_cmpeq_epi32(c0, c2), _mm_cmpeq_epi32(c1, c3)));
+    __m128i blend = _mm_add_epi32(
+      _mm_srli_epi32(_mm_and_si128(c0, colorMask), 1),
+      _mm_srli_epi32(_mm_and_si128(c1, colorMask), 1));
+    _mm_storeu_si128((__m128i *)(dst + i),
+                     _mm_or_si128(_mm_and_si128(res, blend),
+                                  _mm_andnot_si128(res, c0)));
+  }
+  SmartIB32Line_C(dst + i, src + i, src1 + i, src2 + i, src3 + i, count - i);
+}
+
+static void MotionBlurIB32Line_SSE2(u32 *dst, u32 *src, u32 *src1, int count)
+{
+  const __m128i colorMask = _mm_set1_epi32(0xfefefe);
+
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i c0 = _mm_loadu_si128((__m128i *)(src + i));
+    __m128i c1 = _mm_loadu_si128((__m128i *)(src1 + i));
+    _mm_storeu_si128((__m128i *)(src1 + i), c0);
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_add_epi32(
+      _mm_srli_epi32(_mm_and_si128(c0, colorMask), 1),
+      _mm_srli_epi32(_mm_and_si128(c1, colorMask), 1)));
+  }
+  MotionBlurIB32Line_C(dst + i, src + i, src1 + i, count - i);
+}
+#endif
+
+#ifdef IFB_AVX2
+IFB_TARGET_AVX2
+static void SmartIB32Line_AVX2(u32 *dst, u32 *src, u32 *src1, u32 *src2, u32 *src3, int count)
+{
+  const __m256i colorMask = _mm256_set1_epi32(0xfefefe);
+
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i c0 = _mm256_loadu_si256((__m256i *)(src + i));
+    __m256i c1 = _mm256_loadu_si256((__m256i *)(src1 + i));
+    __m256i c2 = _mm256_loadu_si256((__m256i *)(src2 + i));
+    __m256i c3 = _mm256_loadu_si256((__m256i *)(src3 + i));
+    _mm256_storeu_si256((__m256i *)(src3 + i), c0);
+    __m256i res = _mm256_andnot_si256(
+      _mm256_or_si256(_mm256_cmpeq_epi32(c1, c2), _mm256_cmpeq_epi32(c3, c0)),
+      _mm256_or_si256(_mm256_cmpeq_epi32(c0, c2), _mm256_cmpeq_epi32(c1, c3)));
+    __m256i blend = _mm256_add_epi32(
+      _mm256_srli_epi32(_mm256_and_si256(c0, colorMask), 1),
+      _mm256_srli_epi32(_mm256_and_si256(c1, colorMask), 1));
+    _mm256_storeu_si256((__m256i *)(dst + i),
+                        _mm256_blendv_epi8(c0, blend, res));
+  }
+  SmartIB32Line_C(dst + i, src + i, src1 + i, src2 + i, src3 + i, count - i);
+}
+
+IFB_TARGET_AVX2
+static void MotionBlurIB32Line_AVX2(u32 *dst, u32 *src, u32 *src1, int count)
+{
+  const __m256i colorMask = _mm256_set1_epi32(0xfefefe);
+
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i c0 = _mm256_loadu_si256((__m256i *)(src + i));
+    __m256i c1 = _mm256_loadu_si256((__m256i *)(src1 + i));
+    _mm256_storeu_si256((__m256i *)(src1 + i), c0);
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_add_epi32(
+      _mm256_srli_epi32(_mm256_and_si256(c0, colorMask), 1),
+      _mm256_srli_epi32(_mm256_and_si256(c1, colorMask), 1)));
+  }
+  MotionBlurIB32Line_C(dst + i, src + i, src1 + i, count - i);
+}
+#endif
+
+void SmartIB32Line(u32 *dst, u32 *src, u32 *frm1, u32 *frm2, u32 *frm3, int count)
+{
+#ifdef IFB_AVX2
+  if(ifbAVX2) {
+    SmartIB32Line_AVX2(dst, src, frm1, frm2, frm3, count);
+    return;
+  }
+#endif
+#ifdef IFB_SSE2
+  SmartIB32Line_SSE2(dst, src, frm1, frm2, frm3, count);
+#else
+  SmartIB32Line_C(dst, src, frm1, frm2, frm3, count);
+#endif
+}
+
+void MotionBlurIB32Line(u32 *dst, u32 *src, u32 *frm1, int count)
+{
+#ifdef IFB_AVX2
+  if(ifbAVX2) {
+    MotionBlurIB32Line_AVX2(dst, src, frm1, count);
+    return;
+  }
+#endif
+#ifdef IFB_SSE2
+  MotionBlurIB32Line_SSE2(dst, src, frm1, count);
+#else
+  MotionBlurIB32Line_C(dst, src, frm1, count);
+#endif
+}
+
 #ifdef MMX
 static void SmartIB32_MMX(u8 *srcPtr, u32 srcPitch, int width, int starty, int height)
 {
@@ -349,23 +532,7 @@ void SmartIB32(u8 *srcPtr, u32 srcPitch, int width, int starty, int height)
   u32 *src2 = (u32 *)frm2 + starty * srcPitch / 4;
   u32 *src3 = (u32 *)frm3 + starty * srcPitch / 4;
 
-  u32 colorMask = 0xfefefe;
-
-  int sPitch = srcPitch >> 2;
-  int pos = 0;
-
-  for (int j = 0; j < height;  j++)
-    for (int i = 0; i < sPitch; i++) {
-      u32 color = src0[pos];
-      src0[pos] =
-        (src1[pos] != src2[pos]) &&
-        (src3[pos] != color) &&
-        ((color == src2[pos]) || (src1[pos] == src3[pos]))
-        ? (((color & colorMask) >> 1) + ((src1[pos] & colorMask) >> 1)) :
-        color;
-      src3[pos] = color; /* oldest buffer now holds newest frame */
-      pos++;
-    }
+  SmartIB32Line(src0, src0, src1, src2, src3, (srcPitch >> 2) * height);
 
   /* Swap buffers around */
   u8 *temp = frm1;
@@ -569,19 +736,7 @@ void MotionBlurIB32(u8 *srcPtr, u32 srcPitch, int width, int starty, int height)
   u32 *src0 = (u32 *)srcPtr + starty * srcPitch / 4;
   u32 *src1 = (u32 *)frm1 + starty * srcPitch / 4;
 
-  u32 colorMask = 0xfefefe;
-
-  int sPitch = srcPitch >> 2;
-  int pos = 0;
-
-  for (int j = 0; j < height;  j++)
-    for (int i = 0; i < sPitch; i++) {
-      u32 color = src0[pos];
-      src0[pos] = (((color & colorMask) >> 1) +
-                   ((src1[pos] & colorMask) >> 1));
-      src1[pos] = color;
-      pos++;
-    }
+  MotionBlurIB32Line(src0, src0, src1, (srcPitch >> 2) * height);
 }
 
 void MotionBlurIB32(u8 *srcPtr, u32 srcPitch, int width, int height)
@@ -17,6 +17,11 @@ void MotionBlurIB(u8 *srcPtr, u32 srcPitch, int width, int starty, int height);
 void MotionBlurIB32(u8 *srcPtr, u32 srcPitch, int width, int starty, int height);
 
 
+// Blend count 32 bit pixels of src into dst (which may be src) and move
+// the history buffers along. Use SSE2/AVX2 where the CPU has them.
+void SmartIB32Line(u32 *dst, u32 *src, u32 *frm1, u32 *frm2, u32 *frm3, int count);
+void MotionBlurIB32Line(u32 *dst, u32 *src, u32 *frm1, int count);
+
 //Options for if starty is 0
 void SmartIB(u8 *srcPtr, u32 srcPitch, int width, int height);
 void SmartIB32(u8 *srcPtr, u32 srcPitch, int width, int height);
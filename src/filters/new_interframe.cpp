@@ -8,6 +8,7 @@
 #include <stdexcept>
 
 #include "new_interframe.hpp"
+#include "interframe.hpp"
 
 SmartIB::SmartIB(unsigned int _width,unsigned int _height): filter_base(_width,_height)
 {
@@ -34,23 +35,7 @@ SmartIB::~SmartIB()
 
 void SmartIB::run(u32 *srcPtr,u32 *dstPtr)
 {
-    u32 *src1 = frm1;
-    u32 *src2 = frm2;
-    u32 *src3 = frm3;
-
-    u32 colorMask = 0xfefefe;
-
-    for (unsigned int i = 0; i < getWidth()*getHeight();  i++)
-    {
-        u32 color = srcPtr[i];
-        dstPtr[i] =
-            (src1[i] != src2[i]) &&
-            (src3[i] != color) &&
-            ((color == src2[i]) || (src1[i] == src3[i]))
-                ? (((color & colorMask) >> 1) + ((src1[i] & colorMask) >> 1)) :
-                color;
-        src3[i] = color; /* oldest buffer now holds newest frame */
-    }
+    SmartIB32Line(dstPtr, srcPtr, frm1, frm2, frm3, getWidth()*getHeight());
 
     /* Swap buffers around */
     u32 *temp = frm1;
@@ -75,15 +60,5 @@ MotionBlurIB::~MotionBlurIB()
 
 void MotionBlurIB::run(u32 *srcPtr,u32 *dstPtr)
 {
-    u32 *src1 = frm1;
-
-    u32 colorMask = 0xfefefe;
-
-    for (unsigned int i = 0; i < getWidth()*getHeight();  i++)
-    {
-        u32 color = srcPtr[i];
-        dstPtr[i] = (((color & colorMask) >> 1) +
-                  ((src1[i] & colorMask) >> 1));
-        src1[i] = color;
-    }
+    MotionBlurIB32Line(dstPtr, srcPtr, frm1, getWidth()*getHeight());
 }
@@ -14,6 +14,8 @@
 #include "gbSGB.h"
 #include "gbSound.h"
 #include "../Util.h"
+#include "../common/Movie.h"
+#include "../common/SaveWriter.h"
 
 #ifdef __GNUC__
 #define _stricmp strcasecmp
@@ -139,6 +141,14 @@ const u8 gbTimerMask [4] = {0xff, 0x3, 0xf, 0x3f};
 const u8 gbTimerBug [8] = {0x80, 0x80, 0x02, 0x02, 0x0, 0xff, 0x0, 0xff};
 bool gbTimerModeChange = false;
 bool gbTimerOnChange = false;
+// Ticks left before one of the DIV/LCD/serial/sound/timer counters runs
+// out. Until then gbEmulate only adds the elapsed ticks to gbEventPending,
+// which gbSyncEventTicks takes off the counters before anything else looks
+// at them. gbEventTicks is set to 0 whenever they are changed from outside
+// the event code.
+static int gbEventTicks = 0;
+static int gbEventPending = 0;
+static void gbSyncEventTicks();
 // lcd
 bool gbScreenOn = true;
 int gbLcdMode = 2;
@@ -577,7 +587,8 @@ u8 ZeroTable[256] = {
 #define GBSAVE_GAME_VERSION_10 10
 #define GBSAVE_GAME_VERSION_11 11
 #define GBSAVE_GAME_VERSION_12 12
-#define GBSAVE_GAME_VERSION GBSAVE_GAME_VERSION_12
+#define GBSAVE_GAME_VERSION_13 13
+#define GBSAVE_GAME_VERSION GBSAVE_GAME_VERSION_13
 
 int inline gbGetValue(int min,int max,int v)
 {
@@ -630,6 +641,7 @@ bool gbIsGameboyRom(char * file)
 void gbCopyMemory(u16 d, u16 s, int count)
 {
   while(count) {
+    gbStateHashWritten(&gbMemoryMap[d>>12][d & 0x0fff]);
     gbMemoryMap[d>>12][d & 0x0fff] = gbMemoryMap[s>>12][s & 0x0fff];
     s++;
     d++;
@@ -724,13 +736,16 @@ void  gbWriteMemory(register u16 address, register u8 value)
   if(address < 0xa000) {
     // No access to Vram during mode 3
     // (used to emulate the gfx differences between GB & GBC-GBA/SP in Stunt Racer)
+    gbSyncEventTicks();
     if ((gbLcdModeDelayed !=3) ||
     // This part is used to emulate a small difference between hardwares
     // (check 8-in-1's arrow on GBA/GBC to verify it)
        ((register_LY == 0) && ((gbHardware & 0xa) && (gbScreenOn==false) &&
        (register_LCDC & 0x80)) &&
-       (gbLcdLYIncrementTicksDelayed ==(GBLY_INCREMENT_CLOCK_TICKS-GBLCD_MODE_2_CLOCK_TICKS))))
+       (gbLcdLYIncrementTicksDelayed ==(GBLY_INCREMENT_CLOCK_TICKS-GBLCD_MODE_2_CLOCK_TICKS)))) {
+      gbStateHashWritten(&gbMemoryMap[address>>12][address&0x0fff]);
       gbMemoryMap[address>>12][address&0x0fff] = value;
+    }
     return;
   }
 
@@ -749,17 +764,24 @@ void  gbWriteMemory(register u16 address, register u8 value)
 #endif
 
     // Is that a correct fix ??? (it used to be 'if (mapper)')...
-    if(mapperRAM)
+    if(mapperRAM) {
+        // TAMA5 keeps its registers at the start of the bank
+        gbStateHashWritten(&gbMemoryMap[address>>12][address&0x0fff]);
+        gbStateHashWritten(gbMemoryMap[0x0a]);
         (*mapperRAM)(address, value);
+    }
     return;
   }
 
 
   if(address < 0xfe00) {
+    gbStateHashWritten(&gbMemoryMap[address>>12][address & 0x0fff]);
     gbMemoryMap[address>>12][address & 0x0fff] = value;
     return;
   }
 
+  gbSyncEventTicks();
+
   // OAM not accessible during mode 2 & 3.
   if(address < 0xfea0)
   {
@@ -782,6 +804,10 @@ void  gbWriteMemory(register u16 address, register u8 value)
     return;
   }
 
+  // IO writes can restart any of the counters
+  if(address < 0xff80)
+    gbEventTicks = 0;
+
   switch(address & 0x00ff) {
 
     case 0x00: {
@@ -1566,8 +1592,10 @@ void  gbWriteMemory(register u16 address, register u8 value)
   gbMemory[address] = value;
 }
 
-u8 gbReadOpcode(register u16 address)
+static u8 gbReadOpcodeSlow(register u16 address)
 {
+  gbSyncEventTicks();
+
   if(gbCheatMap[address])
     return gbCheatRead(address);
 
@@ -1731,8 +1759,31 @@ u8 gbReadOpcode(register u16 address)
   return gbMemoryMap[address>>12][address & 0x0fff];
 }
 
-u8 gbReadMemory(register u16 address)
+// 4KB pages that read straight from gbMemoryMap: ROM and WRAM, plus VRAM
+// while neither LCD mode is 3, minus the pages holding a cheat. Everything
+// else takes the slow path with the full accessibility checks.
+#define GB_READ_DIRECT_PAGES 0x30ff
+#define GB_READ_VRAM_PAGES 0x0300
+
+static inline u16 gbReadDirectPages(u16 pages)
+{
+  if(gbLcdMode != 3 && gbLcdModeDelayed != 3)
+    pages |= GB_READ_VRAM_PAGES;
+  return pages & ~gbCheatPages;
+}
+
+static inline u8 gbReadOpcode(u16 address)
 {
+  // unlike data reads, opcode fetches don't go through mapperReadRAM
+  if((gbReadDirectPages(GB_READ_DIRECT_PAGES | 0x0c00) >> (address >> 12)) & 1)
+    return gbMemoryMap[address >> 12][address & 0x0fff];
+  return gbReadOpcodeSlow(address);
+}
+
+static u8 gbReadMemorySlow(register u16 address)
+{
+  gbSyncEventTicks();
+
   if(gbCheatMap[address])
     return gbCheatRead(address);
 
@@ -2009,6 +2060,13 @@ u8 gbReadMemory(register u16 address)
   return gbMemoryMap[address>>12][address & 0x0fff];
 }
 
+static inline u8 gbReadMemory(u16 address)
+{
+  if((gbReadDirectPages(GB_READ_DIRECT_PAGES) >> (address >> 12)) & 1)
+    return gbMemoryMap[address >> 12][address & 0x0fff];
+  return gbReadMemorySlow(address);
+}
+
 void gbVblank_interrupt()
 {
   gbCheatWrite(false); // Emulates GS codes.
@@ -2053,6 +2111,8 @@ void gbJoypad_interrupt()
 
 void gbSpeedSwitch()
 {
+  gbSyncEventTicks();
+  gbEventTicks = 0;
   gbBlackScreen = true;
   if(gbSpeed == 0) {
     gbSpeed = 1;
@@ -2267,6 +2327,8 @@ void gbReset()
       memcpy ((u16 *)(gbWram+i*0x1000), (u16 *)(gbMemory+0xC000), 0x1000);
   }
 
+  gbStateHashInvalidate();
+
   memset(gbSCYLine,0,sizeof(gbSCYLine));
   memset(gbSCXLine,0,sizeof(gbSCXLine));
   memset(gbBgpLine,0xfc,sizeof(gbBgpLine));
@@ -2721,23 +2783,20 @@ void gbReset()
 
 }
 
+static void gbWriteSave(const char *name, const SaveBlock *blocks, int count)
+{
+  if(!saveWriterWrite(name, blocks, count))
+    systemMessage(MSG_ERROR_CREATING_FILE, N_("Error creating file %s"), name);
+}
+
 void gbWriteSaveMBC1(const char * name)
 {
   if (gbRam)
   {
-    FILE *gzFile = fopen(name,"wb");
-
-    if(gzFile == NULL) {
-      systemMessage(MSG_ERROR_CREATING_FILE, N_("Error creating file %s"), name);
-      return;
-    }
-
-    fwrite(gbRam,
-           1,
-           (gbRamSizeMask+1),
-           gzFile);
-
-    fclose(gzFile);
+    SaveBlock blocks[] = {
+      { gbRam, (size_t)(gbRamSizeMask+1) }
+    };
+    gbWriteSave(name, blocks, 1);
   }
 }
 
@@ -2745,19 +2804,10 @@ void gbWriteSaveMBC2(const char * name)
 {
   if (gbRam)
   {
-    FILE *file = fopen(name, "wb");
-
-    if(file == NULL) {
-      systemMessage(MSG_ERROR_CREATING_FILE, N_("Error creating file %s"), name);
-      return;
-    }
-
-    fwrite(gbMemoryMap[0x0a],
-           1,
-           512,
-           file);
-
-    fclose(file);
+    SaveBlock blocks[] = {
+      { gbMemoryMap[0x0a], 512 }
+    };
+    gbWriteSave(name, blocks, 1);
   }
 }
 
@@ -2765,28 +2815,19 @@ void gbWriteSaveMBC3(const char * name, bool extendedSave)
 {
   if (gbRam || extendedSave)
   {
-    FILE *gzFile = fopen(name,"wb");
-    if (gbRam)
-    {
-
-      if(gzFile == NULL) {
-        systemMessage(MSG_ERROR_CREATING_FILE, N_("Error creating file %s"), name);
-        return;
-      }
-
-      fwrite(gbRam,
-             1,
-             (gbRamSizeMask+1),
-             gzFile);
+    SaveBlock blocks[2];
+    int count = 0;
+    if (gbRam) {
+      blocks[count].data = gbRam;
+      blocks[count++].size = gbRamSizeMask+1;
     }
 
-    if(extendedSave)
-      fwrite(&gbDataMBC3.mapperSeconds,
-             1,
-             10*sizeof(int) + sizeof(time_t),
-             gzFile);
+    if(extendedSave) {
+      blocks[count].data = &gbDataMBC3.mapperSeconds;
+      blocks[count++].size = 10*sizeof(int) + sizeof(time_t);
+    }
 
-    fclose(gzFile);
+    gbWriteSave(name, blocks, count);
   }
 }
 
@@ -2794,19 +2835,10 @@ void gbWriteSaveMBC5(const char * name)
 {
   if (gbRam)
   {
-    FILE *gzFile = fopen(name,"wb");
-
-    if(gzFile == NULL) {
-      systemMessage(MSG_ERROR_CREATING_FILE, N_("Error creating file %s"), name);
-      return;
-    }
-
-    fwrite(gbRam,
-           1,
-           (gbRamSizeMask+1),
-           gzFile);
-
-    fclose(gzFile);
+    SaveBlock blocks[] = {
+      { gbRam, (size_t)(gbRamSizeMask+1) }
+    };
+    gbWriteSave(name, blocks, 1);
   }
 }
 
@@ -2814,67 +2846,41 @@ void gbWriteSaveMBC7(const char * name)
 {
   if (gbRam)
   {
-    FILE *file = fopen(name, "wb");
-
-    if(file == NULL) {
-      systemMessage(MSG_ERROR_CREATING_FILE, N_("Error creating file %s"), name);
-      return;
-    }
-
-    fwrite(&gbMemory[0xa000],
-           1,
-           256,
-           file);
-
-    fclose(file);
+    SaveBlock blocks[] = {
+      { &gbMemory[0xa000], 256 }
+    };
+    gbWriteSave(name, blocks, 1);
   }
 }
 
 void gbWriteSaveTAMA5(const char * name, bool extendedSave)
 {
-  FILE *gzFile = fopen(name,"wb");
+  SaveBlock blocks[3];
+  int count = 0;
+  if (gbRam) {
+    blocks[count].data = gbRam;
+    blocks[count++].size = gbRamSizeMask+1;
+  }
 
-  if(gzFile == NULL) {
-    systemMessage(MSG_ERROR_CREATING_FILE, N_("Error creating file %s"), name);
-    return;
+  blocks[count].data = gbTAMA5ram;
+  blocks[count++].size = gbTAMA5ramSize;
+
+  if(extendedSave) {
+    blocks[count].data = &gbDataTAMA5.mapperSeconds;
+    blocks[count++].size = 14*sizeof(int) + sizeof(time_t);
   }
-  if (gbRam)
-    fwrite(gbRam,
-           1,
-           (gbRamSizeMask+1),
-           gzFile);
-
-  fwrite(gbTAMA5ram,
-         1,
-         (gbTAMA5ramSize),
-         gzFile);
-
-  if(extendedSave)
-    fwrite(&gbDataTAMA5.mapperSeconds,
-           1,
-           14*sizeof(int) + sizeof(time_t),
-           gzFile);
-
-  fclose(gzFile);
+
+  gbWriteSave(name, blocks, count);
 }
 
 void gbWriteSaveMMM01(const char * name)
 {
   if (gbRam)
   {
-    FILE *gzFile = fopen(name,"wb");
-
-    if(gzFile == NULL) {
-      systemMessage(MSG_ERROR_CREATING_FILE, N_("Error creating file %s"), name);
-      return;
-    }
-
-    fwrite(gbRam,
-           1,
-           (gbRamSizeMask+1),
-           gzFile);
-
-    fclose(gzFile);
+    SaveBlock blocks[] = {
+      { gbRam, (size_t)(gbRamSizeMask+1) }
+    };
+    gbWriteSave(name, blocks, 1);
   }
 }
 
@@ -3298,6 +3304,8 @@ bool gbWriteBatteryFile(const char *file)
 bool gbReadBatteryFile(const char *file)
 {
   bool res = false;
+  gbStateHashInvalidate();
+  saveWriterRecover(file);
   if(gbBattery) {
     switch(gbRomType) {
     case 0x03:
@@ -3312,7 +3320,7 @@ bool gbReadBatteryFile(const char *file)
     case 0x0f:
     case 0x10:
       if(!gbReadSaveMBC3(file)) {
-        time(&gbDataMBC3.mapperLastTime);
+        movieTime(&gbDataMBC3.mapperLastTime);
         struct tm *lt;
         lt = localtime(&gbDataMBC3.mapperLastTime);
         gbDataMBC3.mapperSeconds = lt->tm_sec;
@@ -3340,7 +3348,7 @@ bool gbReadBatteryFile(const char *file)
     case 0xfd:
       if(!gbReadSaveTAMA5(file)) {
         u8 gbDaysinMonth [12] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
-        time(&gbDataTAMA5.mapperLastTime);
+        movieTime(&gbDataTAMA5.mapperLastTime);
         struct tm *lt;
         lt = localtime(&gbDataTAMA5.mapperLastTime);
         gbDataTAMA5.mapperSeconds = lt->tm_sec;
@@ -3394,6 +3402,8 @@ bool gbReadGSASnapshot(const char *fileName)
     return false;
   }
 
+  gbStateHashInvalidate();
+
   fseek(file, 0x4, SEEK_SET);
   char buffer[16];
   char buffer2[16];
@@ -3581,10 +3591,85 @@ static bool gbWriteSaveState(gzFile gzFile)
   utilWriteInt(gzFile, gbWindowLine);
   utilWriteInt(gzFile, inUseRegister_WY);
   utilWriteInt(gzFile, gbScreenOn);
+  // version 13: the rest of the timing, so a loaded state runs the same
+  utilWriteInt(gzFile, gbInternalTimer);
+  utilWriteInt(gzFile, gbLine99Ticks);
+  utilWriteInt(gzFile, gbScreenTicks);
+  utilWriteInt(gzFile, gbWhiteScreen);
+  utilWriteInt(gzFile, gbRegisterLYLCDCOffOn);
+  utilWriteInt(gzFile, gbLCDChangeHappened);
+  utilWriteInt(gzFile, gbLYChangeHappened);
+  // just the buttons, speed and capture are up to the frontend
+  for(int i = 0; i < 4; i++)
+    utilWriteInt(gzFile, gbJoymask[i] & 255);
   utilWriteInt(gzFile, 0x12345678); // end marker
   return true;
 }
 
+StateHashRegion gbHashMemory;
+StateHashRegion gbHashRam;
+StateHashRegion gbHashVram;
+StateHashRegion gbHashWram;
+
+// Hash of what gbWriteSaveState() writes, less the cheats
+u64 gbStateHash()
+{
+  int flags[3] = { useBios, inBios, IFF };
+  u64 h = stateHashData(flags, sizeof(flags), 0);
+  h = stateHashVariables(gbSaveGameStruct, h);
+
+  if(gbSgbMode)
+    h = gbSgbStateHash(h);
+
+  h = stateHashData(&gbDataMBC1, sizeof(gbDataMBC1), h);
+  h = stateHashData(&gbDataMBC2, sizeof(gbDataMBC2), h);
+  h = stateHashData(&gbDataMBC3, sizeof(gbDataMBC3), h);
+  h = stateHashData(&gbDataMBC5, sizeof(gbDataMBC5), h);
+  h = stateHashData(&gbDataHuC1, sizeof(gbDataHuC1), h);
+  h = stateHashData(&gbDataHuC3, sizeof(gbDataHuC3), h);
+  h = stateHashData(&gbDataTAMA5, sizeof(gbDataTAMA5), h);
+  if(gbTAMA5ram != NULL)
+    h = stateHashData(gbTAMA5ram, gbTAMA5ramSize, h);
+  h = stateHashData(&gbDataMMM01, sizeof(gbDataMMM01), h);
+
+  h = stateHashData(gbPalette, 128 * sizeof(u16), h);
+
+  // OAM, the registers and the high RAM are written directly all over
+  stateHashWritten(gbHashMemory, 0x7c00);
+  h = stateHashRegion(gbHashMemory, &gbMemory[0x8000], 0x8000, h);
+
+  if(gbRamSize && gbRam)
+    h = stateHashRegion(gbHashRam, gbRam, gbRamSize, h);
+
+  if(gbCgbMode) {
+    h = stateHashRegion(gbHashVram, gbVram, 0x4000, h);
+    h = stateHashRegion(gbHashWram, gbWram, 0x8000, h);
+  }
+
+  h = gbSoundStateHash(h);
+
+  int timing[23] = {
+    gbLcdModeDelayed, gbLcdTicksDelayed, gbLcdLYIncrementTicksDelayed,
+    gbSpritesTicks[299], gbTimerModeChange, gbTimerOnChange, gbHardware,
+    gbBlackScreen, oldRegister_WY, gbWindowLine, inUseRegister_WY,
+    gbScreenOn, gbInternalTimer, gbLine99Ticks, gbScreenTicks,
+    gbWhiteScreen, gbRegisterLYLCDCOffOn, gbLCDChangeHappened,
+    gbLYChangeHappened,
+    gbJoymask[0] & 255, gbJoymask[1] & 255,
+    gbJoymask[2] & 255, gbJoymask[3] & 255
+  };
+  return stateHashData(timing, sizeof(timing), h);
+}
+
+// For memory changed other than through gbWriteMemory() and the mappers
+void gbStateHashInvalidate()
+{
+  stateHashInvalidate(gbHashMemory);
+  stateHashInvalidate(gbHashRam);
+  stateHashInvalidate(gbHashVram);
+  stateHashInvalidate(gbHashWram);
+}
+
 bool gbWriteMemSaveState(char *memory, int available)
 {
   gzFile gzFile = utilMemGzOpen(memory, available, "w");
@@ -3748,6 +3833,7 @@ static bool gbReadSaveState(gzFile gzFile)
   }
 
   utilGzRead(gzFile, &gbMemory[0x8000], 0x8000);
+  gbStateHashInvalidate();
 
   if(gbRamSize && gbRam) {
     if(version < 11)
@@ -3974,7 +4060,17 @@ static bool gbReadSaveState(gzFile gzFile)
     gbScreenOn = (utilReadInt(gzFile) ? true : false);
   }
 
-  if (gbSpeed)
+  if(version >= GBSAVE_GAME_VERSION_13) {
+    gbInternalTimer = utilReadInt(gzFile);
+    gbLine99Ticks = utilReadInt(gzFile);
+    gbScreenTicks = utilReadInt(gzFile);
+    gbWhiteScreen = utilReadInt(gzFile);
+    gbRegisterLYLCDCOffOn = utilReadInt(gzFile);
+    gbLCDChangeHappened = (utilReadInt(gzFile) ? true : false);
+    gbLYChangeHappened = (utilReadInt(gzFile) ? true : false);
+    for(int i = 0; i < 4; i++)
+      gbJoymask[i] = utilReadInt(gzFile);
+  } else if (gbSpeed)
     gbLine99Ticks *= 2;
 
   systemSaveUpdateCounter = SYSTEM_SAVE_NOT_UPDATED;
@@ -4027,6 +4123,8 @@ bool gbWriteBMPFile(const char *fileName)
 
 void gbCleanUp()
 {
+  saveWriterFlush();
+
   if(gbRam != NULL) {
     free(gbRam);
     gbRam = NULL;
@@ -4104,6 +4202,8 @@ bool gbLoadRom(const char *szFile)
   }
   bios = (u8 *)calloc(1,0x100);
 
+  gbStateHashInvalidate();
+
   return gbUpdateSizes();
 }
 
@@ -4346,8 +4446,106 @@ bool gbUpdateSizes()
   return true;
 }
 
+static inline bool gbSerialTicking()
+{
+  if(!gbSerialOn)
+    return false;
+#ifdef OLD_GB_LINK
+  if(linkConnected)
+    return true;
+#endif
+  return (gbMemory[0xff02] & 1) != 0;
+}
+
+// Smallest number of ticks that makes one of the event handlers in
+// gbEmulate do more than count down
+static int gbGetEventTicks()
+{
+  int ticks = gbDivTicks;
+
+  if(register_LCDC & 0x80) {
+    int lcd = gbLCDChangeHappened ? gbLcdTicksDelayed : gbLcdTicks;
+    int ly = gbLYChangeHappened ? gbLcdLYIncrementTicksDelayed : gbLcdLYIncrementTicks;
+    if(lcd < ticks)
+      ticks = lcd;
+    if(ly < ticks)
+      ticks = ly;
+  } else {
+    if(gbLcdLYIncrementTicks < ticks)
+      ticks = gbLcdLYIncrementTicks;
+    if(!gbWhiteScreen && gbScreenTicks < ticks)
+      ticks = gbScreenTicks;
+  }
+
+  if(gbSerialTicking() && gbSerialTicks < ticks)
+    ticks = gbSerialTicks;
+
+  // soundTicks runs at twice the speed in single speed mode
+  int sound = (gbSpeed ? soundTicks : soundTicks / 2) + 1;
+  if(sound < ticks)
+    ticks = sound;
+
+  if(gbTimerOn) {
+    int timer = (gbInternalTimer & gbTimerMask[gbTimerMode]) + 1;
+    if(timer < ticks)
+      ticks = timer;
+  }
+
+  return ticks;
+}
+
+// What the event code in gbEmulate does when none of the counters runs out
+static inline void gbCountEventTicks(int ticks)
+{
+  gbDivTicks -= ticks;
+
+  if(register_LCDC & 0x80) {
+    gbLcdTicks -= ticks;
+    gbLcdTicksDelayed -= ticks;
+    gbLcdLYIncrementTicks -= ticks;
+    gbLcdLYIncrementTicksDelayed -= ticks;
+    gbMemory[0xff0f] = register_IF;
+    gbMemory[0xff41] = register_STAT = (register_STAT & 0xfc) | gbLcdModeDelayed;
+  } else {
+    if(!gbWhiteScreen)
+      gbScreenTicks -= ticks;
+    gbLcdLYIncrementTicks -= ticks;
+  }
+
+  gbMemory[0xff41] = register_STAT;
+
+  if(gbSerialTicking())
+    gbSerialTicks -= ticks;
+
+  soundTicks -= ticks;
+  if(!gbSpeed)
+    soundTicks -= ticks;
+
+  if(gbTimerOn) {
+    gbTimerTicks = ((gbInternalTimer) & gbTimerMask[gbTimerMode])+1-ticks;
+    gbTimerOnChange = false;
+    gbTimerModeChange = false;
+    gbMemory[0xff05] = register_TIMA;
+  }
+
+  gbInternalTimer -= ticks;
+  while (gbInternalTimer<0)
+    gbInternalTimer+=0x100;
+}
+
+static void gbSyncEventTicks()
+{
+  if(gbEventPending) {
+    gbCountEventTicks(gbEventPending);
+    gbEventTicks -= gbEventPending;
+    gbEventPending = 0;
+  }
+}
+
 int gbGetNextEvent (int _clockTicks)
 {
+  gbSyncEventTicks();
+
   if (register_LCDC & 0x80)
   {
     if(gbLcdTicks < _clockTicks)
@@ -4378,34 +4576,29 @@ int gbGetNextEvent (int _clockTicks)
   return _clockTicks;
 }
 
+// gbLineMix holds at most a few dozen distinct colours per line, usually
+// in long runs, so the colour map is only consulted when the colour
+// changes instead of once per pixel.
 void gbDrawLine()
 {
+  const u16 *src = gbLineMix;
+  const u16 *end = gbLineMix + 160;
+
   switch(systemColorDepth) {
     case 16:
     {
       u16 * dest = (u16 *)pix +
                    (gbBorderLineSkip+2) * (register_LY + gbBorderRowSkip+1)
                    + gbBorderColumnSkip;
-      for(int x = 0; x < 160; ) {
-        *dest++ = systemColorMap16[gbLineMix[x++]];
-        *dest++ = systemColorMap16[gbLineMix[x++]];
-        *dest++ = systemColorMap16[gbLineMix[x++]];
-        *dest++ = systemColorMap16[gbLineMix[x++]];
-
-        *dest++ = systemColorMap16[gbLineMix[x++]];
-        *dest++ = systemColorMap16[gbLineMix[x++]];
-        *dest++ = systemColorMap16[gbLineMix[x++]];
-        *dest++ = systemColorMap16[gbLineMix[x++]];
-
-        *dest++ = systemColorMap16[gbLineMix[x++]];
-        *dest++ = systemColorMap16[gbLineMix[x++]];
-        *dest++ = systemColorMap16[gbLineMix[x++]];
-        *dest++ = systemColorMap16[gbLineMix[x++]];
-
-        *dest++ = systemColorMap16[gbLineMix[x++]];
-        *dest++ = systemColorMap16[gbLineMix[x++]];
-        *dest++ = systemColorMap16[gbLineMix[x++]];
-        *dest++ = systemColorMap16[gbLineMix[x++]];
+      u16 last = *src;
+      u16 color = systemColorMap16[last];
+      while(src < end) {
+        u16 c = *src++;
+        if(c != last) {
+          last = c;
+          color = systemColorMap16[c];
+        }
+        *dest++ = color;
       }
       if(gbBorderOn)
         dest += gbBorderColumnSkip;
@@ -4418,41 +4611,15 @@ void gbDrawLine()
       u8 *dest = (u8 *)pix +
                  3*(gbBorderLineSkip * (register_LY + gbBorderRowSkip) +
                  gbBorderColumnSkip);
-      for(int x = 0; x < 160;) {
-        *((u32 *)dest) = systemColorMap32[gbLineMix[x++]];
-        dest+= 3;
-        *((u32 *)dest) = systemColorMap32[gbLineMix[x++]];
-        dest+= 3;
-        *((u32 *)dest) = systemColorMap32[gbLineMix[x++]];
-        dest+= 3;
-        *((u32 *)dest) = systemColorMap32[gbLineMix[x++]];
-        dest+= 3;
-
-        *((u32 *)dest) = systemColorMap32[gbLineMix[x++]];
-        dest+= 3;
-        *((u32 *)dest) = systemColorMap32[gbLineMix[x++]];
-        dest+= 3;
-        *((u32 *)dest) = systemColorMap32[gbLineMix[x++]];
-        dest+= 3;
-        *((u32 *)dest) = systemColorMap32[gbLineMix[x++]];
-        dest+= 3;
-
-        *((u32 *)dest) = systemColorMap32[gbLineMix[x++]];
-        dest+= 3;
-        *((u32 *)dest) = systemColorMap32[gbLineMix[x++]];
-        dest+= 3;
-        *((u32 *)dest) = systemColorMap32[gbLineMix[x++]];
-        dest+= 3;
-        *((u32 *)dest) = systemColorMap32[gbLineMix[x++]];
-        dest+= 3;
-
-        *((u32 *)dest) = systemColorMap32[gbLineMix[x++]];
-        dest+= 3;
-        *((u32 *)dest) = systemColorMap32[gbLineMix[x++]];
-        dest+= 3;
-        *((u32 *)dest) = systemColorMap32[gbLineMix[x++]];
-        dest+= 3;
-        *((u32 *)dest) = systemColorMap32[gbLineMix[x++]];
+      u16 last = *src;
+      u32 color = systemColorMap32[last];
+      while(src < end) {
+        u16 c = *src++;
+        if(c != last) {
+          last = c;
+          color = systemColorMap32[c];
+        }
+        *((u32 *)dest) = color;
         dest+= 3;
       }
     }
@@ -4463,26 +4630,15 @@ void gbDrawLine()
       u32 * dest = (u32 *)pix +
                    (gbBorderLineSkip+1) * (register_LY + gbBorderRowSkip+1)
                    + gbBorderColumnSkip;
-      for(int x = 0; x < 160;) {
-        *dest++ = systemColorMap32[gbLineMix[x++]];
-        *dest++ = systemColorMap32[gbLineMix[x++]];
-        *dest++ = systemColorMap32[gbLineMix[x++]];
-        *dest++ = systemColorMap32[gbLineMix[x++]];
-
-        *dest++ = systemColorMap32[gbLineMix[x++]];
-        *dest++ = systemColorMap32[gbLineMix[x++]];
-        *dest++ = systemColorMap32[gbLineMix[x++]];
-        *dest++ = systemColorMap32[gbLineMix[x++]];
-
-        *dest++ = systemColorMap32[gbLineMix[x++]];
-        *dest++ = systemColorMap32[gbLineMix[x++]];
-        *dest++ = systemColorMap32[gbLineMix[x++]];
-        *dest++ = systemColorMap32[gbLineMix[x++]];
-
-        *dest++ = systemColorMap32[gbLineMix[x++]];
-        *dest++ = systemColorMap32[gbLineMix[x++]];
-        *dest++ = systemColorMap32[gbLineMix[x++]];
-        *dest++ = systemColorMap32[gbLineMix[x++]];
+      u16 last = *src;
+      u32 color = systemColorMap32[last];
+      while(src < end) {
+        u16 c = *src++;
+        if(c != last) {
+          last = c;
+          color = systemColorMap32[c];
+        }
+        *dest++ = color;
       }
     }
     break;
@@ -4491,12 +4647,16 @@ void gbDrawLine()
 
 void gbEmulate(int ticksToStop)
 {
+  movieUpdate();
+
   gbRegister tempRegister;
   u8 tempValue;
   s8 offset;
 
   clockTicks = 0;
   gbDmaTicks = 0;
+  gbEventTicks = 0;
+  gbEventPending = 0;
 
   register int opcode = 0;
 
@@ -4522,6 +4682,7 @@ void gbEmulate(int ticksToStop)
     u16 oldPCW = PC.W;
 
     if(IFF & 0x80) {
+      gbSyncEventTicks();
       if(register_LCDC & 0x80) {
           clockTicks = gbLcdTicks;
       } else
@@ -4581,13 +4742,16 @@ void gbEmulate(int ticksToStop)
     }
 
 
-    if(!emulating)
+    if(!emulating) {
+      gbSyncEventTicks();
       return;
+    }
 
     // For 'breakpoint' support (opcode 0xFC is considered as a breakpoint)
     if ((clockTicks==0) && execute)
     {
       PC.W = oldPCW;
+      gbSyncEventTicks();
       return;
     }
 
@@ -4643,6 +4807,12 @@ void gbEmulate(int ticksToStop)
 
     ticksToStop -= clockTicks;
 
+    if(gbEventPending + clockTicks < gbEventTicks) {
+      gbEventPending += clockTicks;
+      goto gbEventsDone;
+    }
+    gbSyncEventTicks();
+
     // DIV register emulation
     gbDivTicks -= clockTicks;
     while(gbDivTicks <= 0) {
@@ -4921,6 +5091,8 @@ void gbEmulate(int ticksToStop)
 
                 gbFrameCount++;
                 systemFrame();
+                if(movieFrame())
+                  ticksToStop = 0;
 
                 if((gbFrameCount % 10) == 0)
                   system10Frames(60);
@@ -4939,16 +5111,16 @@ void gbEmulate(int ticksToStop)
                   // read joystick
                   if(gbSgbMode && gbSgbMultiplayer) {
                     if(gbSgbFourPlayers) {
-                      gbJoymask[0] = systemReadJoypad(0);
-                      gbJoymask[1] = systemReadJoypad(1);
-                      gbJoymask[2] = systemReadJoypad(2);
-                      gbJoymask[3] = systemReadJoypad(3);
+                      gbJoymask[0] = movieReadJoypad(0);
+                      gbJoymask[1] = movieReadJoypad(1);
+                      gbJoymask[2] = movieReadJoypad(2);
+                      gbJoymask[3] = movieReadJoypad(3);
                     } else {
-                      gbJoymask[0] = systemReadJoypad(0);
-                      gbJoymask[1] = systemReadJoypad(1);
+                      gbJoymask[0] = movieReadJoypad(0);
+                      gbJoymask[1] = movieReadJoypad(1);
                     }
                   } else {
-                    gbJoymask[0] = systemReadJoypad(-1);
+                    gbJoymask[0] = movieReadJoypad(-1);
                   }
                 }
                 int newmask = gbJoymask[0] & 255;
@@ -5186,21 +5358,23 @@ void gbEmulate(int ticksToStop)
               // read joystick
               if(gbSgbMode && gbSgbMultiplayer) {
                 if(gbSgbFourPlayers) {
-                  gbJoymask[0] = systemReadJoypad(0);
-                  gbJoymask[1] = systemReadJoypad(1);
-                  gbJoymask[2] = systemReadJoypad(2);
-                  gbJoymask[3] = systemReadJoypad(3);
+                  gbJoymask[0] = movieReadJoypad(0);
+                  gbJoymask[1] = movieReadJoypad(1);
+                  gbJoymask[2] = movieReadJoypad(2);
+                  gbJoymask[3] = movieReadJoypad(3);
                 } else {
-                  gbJoymask[0] = systemReadJoypad(0);
-                  gbJoymask[1] = systemReadJoypad(1);
+                  gbJoymask[0] = movieReadJoypad(0);
+                  gbJoymask[1] = movieReadJoypad(1);
                 }
               } else {
-                gbJoymask[0] = systemReadJoypad(-1);
+                gbJoymask[0] = movieReadJoypad(-1);
               }
             }
             gbFrameCount++;
 
             systemFrame();
+            if(movieFrame())
+              ticksToStop = 0;
 
             if((gbFrameCount % 10) == 0)
               system10Frames(60);
@@ -5313,6 +5487,9 @@ void gbEmulate(int ticksToStop)
     while (gbInternalTimer<0)
       gbInternalTimer+=0x100;
 
+    gbEventTicks = gbGetEventTicks();
+
+    gbEventsDone:
     clockTicks = 0;
 
     if (gbIntBreak == 1)
@@ -5434,19 +5611,20 @@ void gbEmulate(int ticksToStop)
           // read joystick
           if(gbSgbMode && gbSgbMultiplayer) {
             if(gbSgbFourPlayers) {
-              gbJoymask[0] = systemReadJoypad(0);
-              gbJoymask[1] = systemReadJoypad(1);
-              gbJoymask[2] = systemReadJoypad(2);
-              gbJoymask[3] = systemReadJoypad(3);
+              gbJoymask[0] = movieReadJoypad(0);
+              gbJoymask[1] = movieReadJoypad(1);
+              gbJoymask[2] = movieReadJoypad(2);
+              gbJoymask[3] = movieReadJoypad(3);
             } else {
-              gbJoymask[0] = systemReadJoypad(0);
-              gbJoymask[1] = systemReadJoypad(1);
+              gbJoymask[0] = movieReadJoypad(0);
+              gbJoymask[1] = movieReadJoypad(1);
             }
           } else {
-            gbJoymask[0] = systemReadJoypad(-1);
+            gbJoymask[0] = movieReadJoypad(-1);
           }
         }
       }
+      gbSyncEventTicks();
       return;
     }
   }
@@ -5485,4 +5663,6 @@ struct EmulatedSystem GBSystem = {
 #else
   1000,
 #endif
+  // emuStateHash
+  gbStateHash
 };
@@ -42,6 +42,8 @@ void gbSgbRenderBorder();
 bool gbWritePNGFile(const char *);
 bool gbWriteBMPFile(const char *);
 bool gbReadGSASnapshot(const char *);
+u64 gbStateHash();
+void gbStateHashInvalidate();
 
 extern int gbHardware;
 
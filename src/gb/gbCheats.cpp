@@ -15,6 +15,7 @@ gbCheat gbCheatList[100];
 int gbCheatNumber = 0;
 int gbNextCheat = 0;
 bool gbCheatMap[0x10000];
+u16 gbCheatPages = 0;
 
 extern bool cheatsEnabled;
 
@@ -24,10 +25,13 @@ extern bool cheatsEnabled;
 void gbCheatUpdateMap()
 {
   memset(gbCheatMap, 0, 0x10000);
+  gbCheatPages = 0;
 
   for(int i = 0; i < gbCheatNumber; i++) {
-    if(gbCheatList[i].enabled)
+    if(gbCheatList[i].enabled) {
       gbCheatMap[gbCheatList[i].address] = true;
+      gbCheatPages |= 1 << (gbCheatList[i].address >> 12);
+    }
   }
 }
 
@@ -366,6 +370,7 @@ bool gbAddGgCheat(const char *code, const char *desc)
   gbCheatList[i].enabled = true;
 
   gbCheatMap[gbCheatList[i].address] = true;
+  gbCheatPages |= 1 << (gbCheatList[i].address >> 12);
 
   gbCheatNumber++;
 
@@ -40,5 +40,7 @@ bool gbVerifyGgCode(const char *code);
 extern int gbCheatNumber;
 extern gbCheat gbCheatList[100];
 extern bool gbCheatMap[0x10000];
+// one bit per 4KB page that has an entry in gbCheatMap
+extern u16 gbCheatPages;
 
 #endif // GBCHEATS_H
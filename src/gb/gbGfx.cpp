@@ -45,6 +45,23 @@ u16 gbWindowColor[160];
 extern int inUseRegister_WY;
 extern int layerSettings;
 
+// Interleaves the two bitplanes of a tile row so that pixel n (counting
+// from the right, like the bit masks) has its colour in bits 2n+1..2n.
+// All eight pixels are decoded with a handful of register operations
+// instead of two mask tests per pixel.
+static inline u16 gbDecodeTileRow(u8 a, u8 b)
+{
+  u32 lo = a;
+  u32 hi = b;
+  lo = (lo | (lo << 4)) & 0x0F0F;
+  lo = (lo | (lo << 2)) & 0x3333;
+  lo = (lo | (lo << 1)) & 0x5555;
+  hi = (hi | (hi << 4)) & 0x0F0F;
+  hi = (hi | (hi << 2)) & 0x3333;
+  hi = (hi | (hi << 1)) & 0x5555;
+  return (u16)(lo | (hi << 1));
+}
+
 void gbRenderLine()
 {
   memset(gbLineMix, 0, sizeof(gbLineMix));
@@ -84,7 +101,7 @@ void gbRenderLine()
   int tx = sx >> 3;
   int ty = sy >> 3;
 
-  int bx = 1 << (7 - (sx & 7));
+  int bit = 7 - (sx & 7);
   int by = sy & 7;
 
   int tile_map_line_y = tile_map + ty * 32;
@@ -130,9 +147,10 @@ void gbRenderLine()
           tile_b = gbInvertTab[tile_b];
         }
 
-        while(bx > 0) {
-          u8 c = (tile_a & bx) ? 1 : 0;
-          c += ((tile_b & bx) ? 2 : 0);
+        u16 row = gbDecodeTileRow(tile_a, tile_b);
+
+        while(bit >= 0) {
+          u8 c = (row >> (bit << 1)) & 3;
 
           gbLineBuffer[x] = c; // mark the gbLineBuffer color
 
@@ -159,10 +177,10 @@ void gbRenderLine()
           x++;
           if(x >= 160)
             break;
-          bx >>= 1;
+          bit--;
         }
 
-        bx = 128;
+        bit = 7;
 
         SpritesTicks = gbSpritesTicks[x]*(gbSpeed ? 2 : 4);
 
@@ -252,7 +270,7 @@ void gbRenderLine()
           tx = 0;
           ty = gbWindowLine >> 3;
 
-          bx = 128;
+          bit = 7;
           by = gbWindowLine & 7;
 
           // Tries to emulate the 'window scrolling bug' when wx == 0 (ie. wx-7 == -7).
@@ -260,11 +278,11 @@ void gbRenderLine()
           if (wx == -7)
           {
             swx = 7-((gbSCXLine[0]-1) & 7);
-            bx >>= ((gbSCXLine[0]+((swx != 1) ? 1 : 0)) & 7);
+            bit -= ((gbSCXLine[0]+((swx != 1) ? 1 : 0)) & 7);
             if (swx == 1)
               swx = 2;
 
-            //bx >>= ((gbSCXLine[0]+(((swx>1) && (swx != 7)) ? 1 : 0)) & 7);
+            //bit -= ((gbSCXLine[0]+(((swx>1) && (swx != 7)) ? 1 : 0)) & 7);
 
             if (swx == 7)
             {
@@ -275,7 +293,7 @@ void gbRenderLine()
           }
           else
           if(wx < 0) {
-            bx >>= (-wx);
+            bit -= (-wx);
             wx = 0;
           }
 
@@ -323,9 +341,10 @@ void gbRenderLine()
               tile_b = gbInvertTab[tile_b];
             }
 
-            while(bx > 0) {
-              u8 c = (tile_a & bx) != 0 ? 1 : 0;
-              c += ((tile_b & bx) != 0 ? 2 : 0);
+            u16 row = gbDecodeTileRow(tile_a, tile_b);
+
+            while(bit >= 0) {
+              u8 c = (row >> (bit << 1)) & 3;
 
               if (x>=0)
               {
@@ -355,12 +374,12 @@ void gbRenderLine()
               x++;
               if(x >= 160)
                 break;
-              bx >>= 1;
+              bit--;
             }
             tx++;
             if(tx == 32)
               tx = 0;
-            bx = 128;
+            bit = 7;
             tile = bank0[tile_map_line_y + tx];
             if(bank1)
               attrs = bank1[tile_map_line_y + tx];
@@ -444,13 +463,12 @@ void gbDrawSpriteTile(int tile, int x,int y,int t, int flags,
     b = bank0[address++];
   }
 
+  u16 row = gbDecodeTileRow(a, b);
+  if(!row)
+    return;
+
   for(int xx = 0; xx < 8; xx++) {
-    u8 mask = 1 << (7-xx);
-    u8 c = 0;
-    if( (a & mask))
-      c++;
-    if( (b & mask))
-      c+=2;
+    u8 c = (row >> ((7-xx) << 1)) & 3;
 
     if(c==0) continue;
 
@@ -1,6 +1,8 @@
 #ifndef GBGLOBALS_H
 #define GBGLOBALS_H
 
+#include "../common/StateHash.h"
+
 extern int gbRomSizeMask;
 extern unsigned int gbRomSize;
 extern int gbRamSize;
@@ -74,4 +76,19 @@ extern void gbDrawSprites(bool);
 
 extern u8 (*gbSerialFunction)(u8);
 
+// The memory gbStateHash() hashes in pages
+extern StateHashRegion gbHashMemory;
+extern StateHashRegion gbHashRam;
+extern StateHashRegion gbHashVram;
+extern StateHashRegion gbHashWram;
+
+// Marks a write through gbMemoryMap, which may land in any of them
+static inline void gbStateHashWritten(const u8 *p)
+{
+  stateHashWrittenAt(gbHashMemory, p);
+  stateHashWrittenAt(gbHashRam, p);
+  stateHashWrittenAt(gbHashVram, p);
+  stateHashWrittenAt(gbHashWram, p);
+}
+
 #endif // GBGLOBALS_H
@@ -1,4 +1,5 @@
 #include "../System.h"
+#include "../common/Movie.h"
 #include "../common/Port.h"
 #include "gbGlobals.h"
 #include "gbMemory.h"
@@ -326,7 +327,7 @@ mapperMBC3 gbDataMBC3 = {
 
 void memoryUpdateMBC3Clock()
 {
-  time_t now = time(NULL);
+  time_t now = movieTime(NULL);
   time_t diff = now - gbDataMBC3.mapperLastTime;
   if(diff > 0) {
     // update the clock according to the last update time
@@ -435,7 +436,7 @@ void mapperMBC3RAM(u16 address, u8 value)
         systemSaveUpdateCounter = SYSTEM_SAVE_UPDATED;
       }
     } else {
-      time(&gbDataMBC3.mapperLastTime);
+      movieTime(&gbDataMBC3.mapperLastTime);
       switch(gbDataMBC3.mapperClockRegister) {
       case 0x08:
         gbDataMBC3.mapperSeconds = value;
@@ -731,16 +732,16 @@ u8 mapperMBC7ReadRAM(u16 address)
     return 0;
   case 0xa020:
     // sensor X low byte
-    return systemGetSensorX() & 255;
+    return movieGetSensorX() & 255;
   case 0xa030:
     // sensor X high byte
-    return systemGetSensorX() >> 8;
+    return movieGetSensorX() >> 8;
   case 0xa040:
     // sensor Y low byte
-    return systemGetSensorY() & 255;
+    return movieGetSensorY() & 255;
   case 0xa050:
     // sensor Y high byte
-    return systemGetSensorY() >> 8;
+    return movieGetSensorY() >> 8;
   case 0xa080:
     return gbDataMBC7.value;
   }
@@ -783,6 +784,7 @@ void mapperMBC7RAM(u16 address, u8 value)
     if(!oldCs && gbDataMBC7.cs) {
       if(gbDataMBC7.state==5) {
         if(gbDataMBC7.writeEnable) {
+          stateHashWritten(gbHashMemory, 0x2000+gbDataMBC7.address*2);
           gbMemory[0xa000+gbDataMBC7.address*2]=gbDataMBC7.buffer>>8;
           gbMemory[0xa000+gbDataMBC7.address*2+1]=gbDataMBC7.buffer&0xff;
           systemSaveUpdateCounter = SYSTEM_SAVE_UPDATED;
@@ -850,6 +852,7 @@ void mapperMBC7RAM(u16 address, u8 value)
                 gbDataMBC7.state=0;
               } else if((gbDataMBC7.address>>6)==1) {
                 if (gbDataMBC7.writeEnable) {
+                  stateHashWritten(gbHashMemory, 0x2000);
                   for(int i=0;i<256;i++) {
                     gbMemory[0xa000+i*2] = gbDataMBC7.buffer >> 8;
                     gbMemory[0xa000+i*2+1] = gbDataMBC7.buffer & 0xff;
@@ -859,6 +862,7 @@ void mapperMBC7RAM(u16 address, u8 value)
                 gbDataMBC7.state=5;
               } else if((gbDataMBC7.address>>6) == 2) {
                 if (gbDataMBC7.writeEnable) {
+                  stateHashWritten(gbHashMemory, 0x2000);
                   for(int i=0;i<256;i++)
                     WRITE16LE((u16 *)&gbMemory[0xa000+i*2], 0xffff);
                   systemSaveUpdateCounter = SYSTEM_SAVE_UPDATED;
@@ -1221,7 +1225,7 @@ void memoryUpdateTAMA5Clock()
   else
       gbDaysinMonth[1] = 28;
 
-  time_t now = time(NULL);
+  time_t now = movieTime(NULL);
   time_t diff = now - gbDataTAMA5.mapperLastTime;
   if(diff > 0) {
     // update the clock according to the last update time
@@ -1417,7 +1421,7 @@ void mapperTAMA5RAM(u16 address, u8 value)
               gbTAMA5ram[0x84] = DaysH*16+DaysL; // incorrect ? (not used by the game) ?
               gbTAMA5ram[0x94] = MonthsH*16+MonthsL; // incorrect ? (not used by the game) ?
 
-              time(&gbDataTAMA5.mapperLastTime);
+              movieTime(&gbDataTAMA5.mapperLastTime);
 
               gbMemoryMap[0xa][0] = 1;
             }
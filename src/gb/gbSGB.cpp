@@ -885,6 +885,17 @@ void gbSgbSaveGame(gzFile gzFile)
   utilGzWrite(gzFile, gbSgbATFList, 45 * 20 * 18);
 }
 
+u64 gbSgbStateHash(u64 seed)
+{
+  u64 h = stateHashVariables(gbSgbSaveStructV3, seed);
+  h = stateHashData(gbSgbBorder, 2048, h);
+  h = stateHashData(gbSgbBorderChar, 32*256, h);
+  h = stateHashData(gbSgbPacket, 16*7, h);
+  h = stateHashData(gbSgbSCPPalette, 4 * 512 * sizeof(u16), h);
+  h = stateHashData(gbSgbATF, 20 * 18, h);
+  return stateHashData(gbSgbATFList, 45 * 20 * 18, h);
+}
+
 void gbSgbReadGame(gzFile gzFile, int version)
 {
   if(version >= 3)
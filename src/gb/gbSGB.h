@@ -9,6 +9,7 @@ void gbSgbReset();
 void gbSgbDoBitTransfer(u8);
 void gbSgbSaveGame(gzFile);
 void gbSgbReadGame(gzFile, int version);
+u64 gbSgbStateHash(u64 seed);
 void gbSgbRenderBorder();
 
 extern u8  gbSgbATF[20*18];
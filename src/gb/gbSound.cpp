@@ -19,6 +19,7 @@ static Gb_Apu*                gb_apu;
 
 static float soundVolume_  = -1;
 static int prevSoundEnable = -1;
+static bool synthesis      = true;
 static bool declicking     = false;
 
 int const chan_count = 4;
@@ -48,7 +49,8 @@ void gbSoundEvent(register u16 address, register int data)
 static void end_frame( blip_time_t time )
 {
 	gb_apu       ->end_frame( time );
-	stereo_buffer->end_frame( time );
+	if ( synthesis )
+		stereo_buffer->end_frame( time );
 }
 
 static void apply_effects()
@@ -56,6 +58,11 @@ static void apply_effects()
 	prevSoundEnable = soundGetEnable();
 	gb_effects_config_current = gb_effects_config;
 
+	// Drop what was left from before synthesis was turned off
+	if ( soundGetSynthesis() && !synthesis )
+		stereo_buffer->clear();
+	synthesis = soundGetSynthesis();
+
 	stereo_buffer->config().enabled  = gb_effects_config_current.enabled;
 	stereo_buffer->config().echo     = gb_effects_config_current.echo;
 	stereo_buffer->config().stereo   = gb_effects_config_current.stereo;
@@ -65,7 +72,7 @@ static void apply_effects()
 	for ( int i = 0; i < chan_count; i++ )
 	{
 		Multi_Buffer::channel_t ch = { 0, 0, 0 };
-		if ( prevSoundEnable >> i & 1 )
+		if ( synthesis && (prevSoundEnable >> i & 1) )
 			ch = stereo_buffer->channel( i );
 		gb_apu->set_output( ch.center, ch.left, ch.right, i );
 	}
@@ -91,11 +98,13 @@ void gbSoundTick()
 		// Run sound hardware to present
 		end_frame( SOUND_CLOCK_TICKS * ticks_to_time );
 
-		flush_samples(stereo_buffer);
+		if ( synthesis )
+			flush_samples(stereo_buffer);
 
 		// Update effects config if it was changed
 		if ( memcmp( &gb_effects_config_current, &gb_effects_config,
-				sizeof gb_effects_config ) || soundGetEnable() != prevSoundEnable )
+				sizeof gb_effects_config ) || soundGetEnable() != prevSoundEnable ||
+				soundGetSynthesis() != synthesis )
 			apply_effects();
 
 		if ( soundVolume_ != soundGetVolume() )
@@ -172,7 +181,7 @@ bool gbSoundGetDeclicking()
 
 void gbSoundReset()
 {
-	SOUND_CLOCK_TICKS = 20000; // 1/100 second
+	SOUND_CLOCK_TICKS = soundFrameTicks( 20000 ); // 20000 is 1/100 second
 
 	remake_stereo_buffer();
 	reset_apu();
@@ -419,6 +428,16 @@ static variable_desc gb_state [] =
 
 void gbSoundSaveGame( gzFile out )
 {
+	// Loading starts a new sound frame, so start one here too; otherwise
+	// the loaded APU would run behind by the part of the frame already done
+	if ( gb_apu && stereo_buffer )
+	{
+		end_frame( blip_time() );
+		if ( synthesis )
+			flush_samples(stereo_buffer);
+		soundTicks = SOUND_CLOCK_TICKS;
+	}
+
 	gb_apu->save_state( &state.apu );
 
 	// Be sure areas for expansion get written as zero
@@ -428,6 +447,18 @@ void gbSoundSaveGame( gzFile out )
 	utilWriteData( out, gb_state );
 }
 
+// The APU as of now, without ending the sound frame
+u64 gbSoundStateHash( u64 seed )
+{
+	static Gb_Apu* hash_apu;
+	if ( !hash_apu )
+		hash_apu = new Gb_Apu; // TODO: handle errors
+	gb_apu->save_state( blip_time(), &state.apu, hash_apu );
+	memset( dummy_state, 0, sizeof dummy_state );
+	state.version = 1;
+	return stateHashVariables( gb_state, seed );
+}
+
 void gbSoundReadGame( int version, gzFile in )
 {
 	// Prepare APU and default state
@@ -72,5 +72,6 @@ extern int soundTicks;          // Number of 16.8 MHz clocks until gbSoundTick()
 // Saves/loads emulator state
 void gbSoundSaveGame( gzFile out );
 void gbSoundReadGame( int version, gzFile in );
+u64 gbSoundStateHash( u64 seed );
 
 #endif // GBSOUND_H
@@ -0,0 +1,214 @@
+#include <string.h>
+
+#include "GBA.h"
+#include "Globals.h"
+#include "../common/Port.h"
+#include "BreakCond.h"
+
+#ifdef BKPT_SUPPORT
+
+extern bool debugger;
+extern int cpuNextEvent;
+
+BreakCondEntry breakCondTable[BREAK_COND_HASH];
+int breakCondCount = 0;
+int breakCondHitNumber = -1;
+u32 breakCondSkip = 1;
+
+struct BreakCond {
+  bool active;
+  u32 address;
+  BreakCondProgram program;
+};
+
+static BreakCond breakConds[BREAK_COND_MAX];
+
+void breakCondStart(BreakCondProgram *p)
+{
+  p->length = 0;
+  p->depth = 0;
+}
+
+bool breakCondEmit(BreakCondProgram *p, int op, u32 value)
+{
+  int depth = p->depth;
+  switch(op) {
+  case BREAK_COND_CONST:
+  case BREAK_COND_MEM8:
+  case BREAK_COND_MEM16:
+  case BREAK_COND_MEM32:
+    depth++;
+    break;
+  case BREAK_COND_REG:
+    if(value > 16)
+      return false;
+    depth++;
+    break;
+  case BREAK_COND_END:
+    if(depth != 1)
+      return false;
+    break;
+  default:
+    if(op > BREAK_COND_END || depth < 2)
+      return false;
+    depth--;
+    break;
+  }
+  if(depth > BREAK_COND_STACK || p->length == BREAK_COND_MAX_INSNS)
+    return false;
+
+  BreakCondInsn &insn = p->insns[p->length++];
+  insn.op = op;
+  insn.value = value;
+  insn.ptr = NULL;
+  p->depth = depth;
+  return true;
+}
+
+static void breakCondResolve(BreakCondProgram *p)
+{
+  for(int i = 0; i < p->length; i++) {
+    BreakCondInsn &insn = p->insns[i];
+    switch(insn.op) {
+    case BREAK_COND_REG:
+      insn.ptr = (const u8 *)&reg[insn.value].I;
+      break;
+    case BREAK_COND_MEM8:
+    case BREAK_COND_MEM16:
+    case BREAK_COND_MEM32:
+      insn.ptr = &map[insn.value >> 24].address[insn.value &
+                                                 map[insn.value >> 24].mask];
+      break;
+    }
+  }
+}
+
+void breakCondResolve()
+{
+  for(int n = 0; n < BREAK_COND_MAX; n++)
+    if(breakConds[n].active)
+      breakCondResolve(&breakConds[n].program);
+}
+
+static void breakCondUpdateTable()
+{
+  breakCondCount = 0;
+  for(int i = 0; i < BREAK_COND_HASH; i++)
+    breakCondTable[i].address = 1;
+
+  for(int n = 0; n < BREAK_COND_MAX; n++) {
+    if(!breakConds[n].active)
+      continue;
+    u32 address = breakConds[n].address;
+    u32 i = (address >> 1) & (BREAK_COND_HASH - 1);
+    while(breakCondTable[i].address != 1)
+      i = (i + 1) & (BREAK_COND_HASH - 1);
+    breakCondTable[i].address = address;
+    breakCondTable[i].number = n;
+    breakCondCount++;
+  }
+}
+
+bool breakCondSet(int number, u32 address, const BreakCondProgram *p)
+{
+  if(number < 0 || number >= BREAK_COND_MAX || (address & 1) ||
+     p->length == 0 || p->insns[p->length - 1].op != BREAK_COND_END)
+    return false;
+
+  BreakCond &b = breakConds[number];
+  b.active = true;
+  b.address = address;
+  b.program = *p;
+  breakCondResolve(&b.program);
+  breakCondUpdateTable();
+  return true;
+}
+
+void breakCondClear(int number)
+{
+  if(number >= 0 && number < BREAK_COND_MAX) {
+    breakConds[number].active = false;
+    breakCondUpdateTable();
+  }
+}
+
+void breakCondClearAll()
+{
+  for(int n = 0; n < BREAK_COND_MAX; n++)
+    breakConds[n].active = false;
+  breakCondUpdateTable();
+}
+
+static bool breakCondRun(const BreakCondInsn *insn)
+{
+  u32 stack[BREAK_COND_STACK];
+  int sp = 0;
+
+  for(;; insn++) {
+    switch(insn->op) {
+    case BREAK_COND_CONST:
+      stack[sp++] = insn->value;
+      break;
+    case BREAK_COND_REG:
+      stack[sp++] = *(const u32 *)insn->ptr;
+      break;
+    case BREAK_COND_MEM8:
+      stack[sp++] = *insn->ptr;
+      break;
+    case BREAK_COND_MEM16:
+      stack[sp++] = READ16LE(insn->ptr);
+      break;
+    case BREAK_COND_MEM32:
+      stack[sp++] = READ32LE(insn->ptr);
+      break;
+    case BREAK_COND_EQ:
+      sp--;
+      stack[sp-1] = stack[sp-1] == stack[sp];
+      break;
+    case BREAK_COND_NE:
+      sp--;
+      stack[sp-1] = stack[sp-1] != stack[sp];
+      break;
+    case BREAK_COND_LT:
+      sp--;
+      stack[sp-1] = stack[sp-1] < stack[sp];
+      break;
+    case BREAK_COND_GT:
+      sp--;
+      stack[sp-1] = stack[sp-1] > stack[sp];
+      break;
+    case BREAK_COND_LE:
+      sp--;
+      stack[sp-1] = stack[sp-1] <= stack[sp];
+      break;
+    case BREAK_COND_GE:
+      sp--;
+      stack[sp-1] = stack[sp-1] >= stack[sp];
+      break;
+    case BREAK_COND_AND:
+      sp--;
+      stack[sp-1] = stack[sp-1] && stack[sp];
+      break;
+    case BREAK_COND_OR:
+      sp--;
+      stack[sp-1] = stack[sp-1] || stack[sp];
+      break;
+    default:
+      return stack[0] != 0;
+    }
+  }
+}
+
+bool breakCondHit(int number, u32 pc)
+{
+  if(!breakCondRun(breakConds[number].program.insns))
+    return false;
+
+  breakCondHitNumber = number;
+  breakCondSkip = pc;
+  debugger = true;
+  cpuNextEvent = 0;
+  return true;
+}
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef BREAKCOND_H
+#define BREAKCOND_H
+
+// Conditional breakpoints. Each condition is compiled to a small stack
+// program whose register and memory operands are pointers straight to the
+// values, and the CPU loops only run it when the pc is in the hash set of
+// the addresses that have one.
+
+enum {
+  BREAK_COND_CONST,  // push value
+  BREAK_COND_REG,    // push a register
+  BREAK_COND_MEM8,   // push memory at value
+  BREAK_COND_MEM16,
+  BREAK_COND_MEM32,
+  BREAK_COND_EQ,     // pop two, push the comparison
+  BREAK_COND_NE,
+  BREAK_COND_LT,
+  BREAK_COND_GT,
+  BREAK_COND_LE,
+  BREAK_COND_GE,
+  BREAK_COND_AND,    // pop two, push the logical and/or
+  BREAK_COND_OR,
+  BREAK_COND_END     // stop if the top is not zero
+};
+
+struct BreakCondInsn {
+  u8 op;
+  // the constant, register number or address
+  u32 value;
+  // where the register or memory value is, once resolved
+  const u8 *ptr;
+};
+
+#define BREAK_COND_MAX_INSNS 32
+#define BREAK_COND_STACK 8
+
+struct BreakCondProgram {
+  int length;
+  int depth;
+  BreakCondInsn insns[BREAK_COND_MAX_INSNS];
+};
+
+// Building a program; both return false when it gets too long or its
+// operands don't make sense
+void breakCondStart(BreakCondProgram *p);
+bool breakCondEmit(BreakCondProgram *p, int op, u32 value = 0);
+
+#define BREAK_COND_MAX 256
+#define BREAK_COND_HASH 512 // a power of two above BREAK_COND_MAX
+
+struct BreakCondEntry {
+  u32 address;
+  int number;
+};
+
+// The hash set, by (address >> 1); the empty entries have address 1
+extern BreakCondEntry breakCondTable[BREAK_COND_HASH];
+// Conditional breakpoints set
+extern int breakCondCount;
+
+// The number of the breakpoint that stopped the emulation last, or -1
+extern int breakCondHitNumber;
+// The address a stop happened at, passed once when resuming
+extern u32 breakCondSkip;
+
+// Number is the debugger's own numbering, below BREAK_COND_MAX
+bool breakCondSet(int number, u32 address, const BreakCondProgram *p);
+void breakCondClear(int number);
+void breakCondClearAll();
+// Points the operands at the memory again, when the map may have changed
+void breakCondResolve();
+
+bool breakCondHit(int number, u32 pc);
+
+// Whether to stop before executing the instruction at pc
+static inline bool breakCondCheck(u32 pc)
+{
+  if(breakCondSkip != 1) {
+    bool skip = pc == breakCondSkip;
+    breakCondSkip = 1;
+    if(skip)
+      return false;
+  }
+  for(u32 i = (pc >> 1) & (BREAK_COND_HASH - 1);
+      breakCondTable[i].address != 1; i = (i + 1) & (BREAK_COND_HASH - 1))
+    if(breakCondTable[i].address == pc &&
+       breakCondHit(breakCondTable[i].number, pc))
+      return true;
+  return false;
+}
+
+#endif // BREAKCOND_H
@@ -2817,28 +2817,17 @@ bool cheatsLoadCheatList(const char *file)
   return true;
 }
 
-extern int cpuNextEvent;
-
 extern void debuggerBreakOnWrite(u32 , u32, u32, int, int);
 
-#ifdef BKPT_SUPPORT
-static u8 cheatsGetType(u32 address)
+#if defined BKPT_SUPPORT && defined SDL
+// What kind of watch a store of value over oldValue at address triggers
+static int cheatsGetType(u32 address, int size, u32 oldValue, u32 value)
 {
-  switch(address >> 24) {
-  case 2:
-    return freezeWorkRAM[address & 0x3FFFF];
-  case 3:
-    return freezeInternalRAM[address & 0x7FFF];
-  case 5:
-    return freezePRAM[address & 0x3FC];
-  case 6:
-    if (address > 0x06010000)
-      return freezeVRAM[address & 0x17FFF];
-    else
-      return freezeVRAM[address & 0x1FFFF];
-  case 7:
-    return freezeOAM[address & 0x3FC];
-  }
+  int kinds = watchFind(address, size);
+  if(kinds & WATCH_WRITE)
+    return 1;
+  if((kinds & WATCH_CHANGE) && oldValue != value)
+    return 2;
   return 0;
 }
 #endif
@@ -2848,11 +2837,11 @@ void cheatsWriteMemory(u32 address, u32 value)
 #ifdef BKPT_SUPPORT
 #ifdef SDL
   if(cheatsNumber == 0) {
-    int type = cheatsGetType(address);
     u32 oldValue = debuggerReadMemory(address);
-    if(type == 1 || (type == 2 && oldValue != value)) {
+    int type = cheatsGetType(address, 4, oldValue, value);
+    if(type) {
+      watchHit(address, type == 1 ? WATCH_WRITE : WATCH_CHANGE);
       debuggerBreakOnWrite(address, oldValue, value, 2, type);
-      cpuNextEvent = 0;
     }
     debuggerWriteMemory(address, value);
   }
@@ -2865,11 +2854,11 @@ void cheatsWriteHalfWord(u32 address, u16 value)
 #ifdef BKPT_SUPPORT
 #ifdef SDL
   if(cheatsNumber == 0) {
-    int type = cheatsGetType(address);
     u16 oldValue = debuggerReadHalfWord(address);
-    if(type == 1 || (type == 2 && oldValue != value)) {
+    int type = cheatsGetType(address, 2, oldValue, value);
+    if(type) {
+      watchHit(address, type == 1 ? WATCH_WRITE : WATCH_CHANGE);
       debuggerBreakOnWrite(address, oldValue, value, 1, type);
-      cpuNextEvent = 0;
     }
     debuggerWriteHalfWord(address, value);
   }
@@ -2886,11 +2875,11 @@ void cheatsWriteByte(u32, u8)
 #ifdef BKPT_SUPPORT
 #ifdef SDL
   if(cheatsNumber == 0) {
-    int type = cheatsGetType(address);
     u8 oldValue = debuggerReadByte(address);
-    if(type == 1 || (type == 2 && oldValue != value)) {
+    int type = cheatsGetType(address, 1, oldValue, value);
+    if(type) {
+      watchHit(address, type == 1 ? WATCH_WRITE : WATCH_CHANGE);
       debuggerBreakOnWrite(address, oldValue, value, 0, type);
-      cpuNextEvent = 0;
     }
     debuggerWriteByte(address, value);
   }
@@ -3,6 +3,7 @@
 #include "GBA.h"
 #include "EEprom.h"
 #include "../Util.h"
+#include "../common/StateHash.h"
 
 extern int cpuDmaCount;
 
@@ -34,6 +35,26 @@ variable_desc eepromSaveData[] = {
   { NULL, 0 }
 };
 
+// eepromSaveData without the memory, which is hashed by pages
+static variable_desc eepromHashData[] = {
+  { &eepromMode, sizeof(int) },
+  { &eepromByte, sizeof(int) },
+  { &eepromBits , sizeof(int) },
+  { &eepromAddress , sizeof(int) },
+  { &eepromInUse, sizeof(bool) },
+  { &eepromBuffer[0], 16 },
+  { &eepromSize, sizeof(int) },
+  { NULL, 0 }
+};
+
+StateHashRegion eepromHashMemory;
+
+u64 eepromStateHash(u64 seed)
+{
+  return stateHashRegion(eepromHashMemory, eepromData, 0x2000,
+                         stateHashVariables(eepromHashData, seed));
+}
+
 void eepromInit()
 {
 #ifdef __LIBRETRO__
@@ -41,6 +62,7 @@ void eepromInit()
 #else
 	memset(eepromData, 255, sizeof(eepromData));
 #endif
+  stateHashInvalidate(eepromHashMemory);
 }
 
 void eepromReset()
@@ -210,6 +232,7 @@ void eepromWrite(u32 /* address */, u8 value)
       for(int i = 0; i < 8; i++) {
         eepromData[(eepromAddress << 3) + i] = eepromBuffer[i];
       }
+      stateHashWritten(eepromHashMemory, eepromAddress << 3);
       systemSaveUpdateCounter = SYSTEM_SAVE_UPDATED;
     } else if(eepromBits == 0x41) {
       eepromMode = EEPROM_IDLE;
@@ -21,6 +21,11 @@ extern u8 eepromData[0x2000];
 extern bool eepromInUse;
 extern int eepromSize;
 
+// eepromData pages written since the last eepromStateHash()
+struct StateHashRegion;
+extern StateHashRegion eepromHashMemory;
+extern u64 eepromStateHash(u64 seed);
+
 #define EEPROM_IDLE           0
 #define EEPROM_READADDRESS    1
 #define EEPROM_READDATA       2
@@ -6,6 +6,7 @@
 #include "Flash.h"
 #include "Sram.h"
 #include "../Util.h"
+#include "../common/StateHash.h"
 
 #define FLASH_READ_ARRAY         0
 #define FLASH_CMD_1              1
@@ -56,6 +57,23 @@ static variable_desc flashSaveData3[] = {
   { NULL, 0 }
 };
 
+// flashSaveData3 without the memory, which is hashed by pages
+static variable_desc flashHashData[] = {
+  { &flashState, sizeof(int) },
+  { &flashReadState, sizeof(int) },
+  { &flashSize, sizeof(int) },
+  { &flashBank, sizeof(int) },
+  { NULL, 0 }
+};
+
+StateHashRegion flashHashMemory;
+
+u64 flashStateHash(u64 seed)
+{
+  return stateHashRegion(flashHashMemory, flashSaveMemory, FLASH_128K_SZ,
+                         stateHashVariables(flashHashData, seed));
+}
+
 void flashInit()
 {
 #ifdef __LIBRETRO__
@@ -63,6 +81,7 @@ void flashInit()
 #else
 	memset(flashSaveMemory, 0xff, sizeof(flashSaveMemory));
 #endif
+  stateHashInvalidate(flashHashMemory);
 }
 
 void flashReset()
@@ -130,6 +149,7 @@ void flashSetSize(int size)
   if ((size == 0x20000) && (flashSize == 0x10000))
     memcpy((u8 *)(flashSaveMemory+0x10000), (u8 *)(flashSaveMemory), 0x10000);
   flashSize = size;
+  stateHashInvalidate(flashHashMemory);
 }
 
 u8 flashRead(u32 address)
@@ -241,11 +261,15 @@ void flashWrite(u32 address, u8 byte)
       memset(&flashSaveMemory[(flashBank << 16) + (address & 0xF000)],
              0,
              0x1000);
+      for(u32 i = 0; i < 0x1000; i += 1 << STATE_HASH_PAGE_SHIFT)
+        stateHashWritten(flashHashMemory,
+                         (flashBank << 16) + (address & 0xF000) + i);
       systemSaveUpdateCounter = SYSTEM_SAVE_UPDATED;
       flashReadState = FLASH_ERASE_COMPLETE;
     } else if(byte == 0x10) {
       // CHIP ERASE
       memset(flashSaveMemory, 0, flashSize);
+      stateHashInvalidate(flashHashMemory);
       systemSaveUpdateCounter = SYSTEM_SAVE_UPDATED;
       flashReadState = FLASH_ERASE_COMPLETE;
     } else {
@@ -266,6 +290,7 @@ void flashWrite(u32 address, u8 byte)
     break;
   case FLASH_PROGRAM:
     flashSaveMemory[(flashBank<<16)+address] = byte;
+    stateHashWritten(flashHashMemory, (flashBank<<16)+address);
     systemSaveUpdateCounter = SYSTEM_SAVE_UPDATED;
     flashState = FLASH_READ_ARRAY;
     flashReadState = FLASH_READ_ARRAY;
@@ -26,4 +26,9 @@ extern void flashInit();
 
 extern int flashSize;
 
+// flashSaveMemory pages written since the last flashStateHash()
+struct StateHashRegion;
+extern StateHashRegion flashHashMemory;
+extern u64 flashStateHash(u64 seed);
+
 #endif // FLASH_H
@@ -19,6 +19,8 @@
 #include "../Util.h"
 #include "../System.h"
 #include "agbprint.h"
+#include "BreakCond.h"
+#include "Trace.h"
 #ifdef PROFILING
 #include "prof/prof.h"
 #endif
@@ -2870,10 +2872,21 @@ int armExecute()
 			cpuMasterCodeCheck();
 		}
 
+#ifdef BKPT_SUPPORT
+        if (UNLIKELY(watchKinds & WATCH_EXEC) && watchExec(armNextPC))
+            return 0;
+        if (UNLIKELY(breakCondCount) && breakCondCheck(armNextPC))
+            return 0;
+#endif
+
         if ((armNextPC & 0x0803FFFF) == 0x08020000)
           busPrefetchCount = 0x100;
 
         u32 opcode = cpuPrefetch[0];
+#ifdef BKPT_SUPPORT
+        if (UNLIKELY(traceActive))
+            traceInsn(armNextPC, opcode, false);
+#endif
         cpuPrefetch[0] = cpuPrefetch[1];
 
         busPrefetch = false;
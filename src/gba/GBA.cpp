@@ -18,9 +18,12 @@
 #include "elf.h"
 #include "../Util.h"
 #include "../common/Port.h"
+#include "../common/Movie.h"
+#include "../common/SaveWriter.h"
 #include "../System.h"
 #include "agbprint.h"
 #include "GBALink.h"
+#include "Sampler.h"
 
 #ifdef PROFILING
 #include "prof/prof.h"
@@ -69,11 +72,6 @@ static profile_segment *profilSegment = NULL;
 #endif
 
 #ifdef BKPT_SUPPORT
-u8 freezeWorkRAM[0x40000];
-u8 freezeInternalRAM[0x8000];
-u8 freezeVRAM[0x18000];
-u8 freezePRAM[0x400];
-u8 freezeOAM[0x400];
 bool debugger_last;
 #endif
 
@@ -99,6 +97,13 @@ bool timer3On = false;
 int timer3Ticks = 0;
 int timer3Reload = 0;
 int timer3ClockReload  = 0;
+// Running timers count against timerClock, which only moves on at events
+// (and not in stop state): timerNTicks is the timerClock value of the next
+// overflow and the counter is worked out from it when TMxD is read.
+// timerEvent is the earliest overflow of the timers that aren't counting
+// up.
+int timerClock = 0;
+int timerEvent = 0x7FFFFFFF;
 u32 dma0Source = 0;
 u32 dma0Dest = 0;
 u32 dma1Source = 0;
@@ -485,18 +490,8 @@ inline int CPUUpdateTicks()
   if(soundTicks < cpuLoopTicks)
     cpuLoopTicks = soundTicks;
 
-  if(timer0On && (timer0Ticks < cpuLoopTicks)) {
-    cpuLoopTicks = timer0Ticks;
-  }
-  if(timer1On && !(TM1CNT & 4) && (timer1Ticks < cpuLoopTicks)) {
-    cpuLoopTicks = timer1Ticks;
-  }
-  if(timer2On && !(TM2CNT & 4) && (timer2Ticks < cpuLoopTicks)) {
-    cpuLoopTicks = timer2Ticks;
-  }
-  if(timer3On && !(TM3CNT & 4) && (timer3Ticks < cpuLoopTicks)) {
-    cpuLoopTicks = timer3Ticks;
-  }
+  if(timerEvent - timerClock < cpuLoopTicks)
+    cpuLoopTicks = timerEvent - timerClock;
 #ifdef PROFILING
   if(profilingTicksReload != 0) {
     if(profilingTicks < cpuLoopTicks) {
@@ -504,6 +499,10 @@ inline int CPUUpdateTicks()
     }
   }
 #endif
+#ifdef BKPT_SUPPORT
+  if(samplerActive && samplerTicks < cpuLoopTicks)
+    cpuLoopTicks = samplerTicks;
+#endif
 
   if (SWITicks) {
     if (SWITicks < cpuLoopTicks)
@@ -515,39 +514,55 @@ inline int CPUUpdateTicks()
         cpuLoopTicks = IRQTicks;
   }
 
+#ifndef NO_LINK
+  if((gba_joybus_enabled || gba_link_enabled) &&
+     linkEvent - linkClock < cpuLoopTicks)
+    cpuLoopTicks = linkEvent - linkClock;
+#endif
+
   return cpuLoopTicks;
 }
 
-void CPUUpdateWindow0()
+static void CPUTimerSchedule()
 {
-  int x00 = WIN0H>>8;
-  int x01 = WIN0H & 255;
-
-  if(x00 <= x01) {
-    for(int i = 0; i < 240; i++) {
-      gfxInWin0[i] = (i >= x00 && i < x01);
-    }
-  } else {
-    for(int i = 0; i < 240; i++) {
-      gfxInWin0[i] = (i >= x00 || i < x01);
-    }
-  }
+  timerEvent = 0x7FFFFFFF;
+  if(timer0On)
+    timerEvent = timer0Ticks;
+  if(timer1On && !(TM1CNT & 4) && timer1Ticks < timerEvent)
+    timerEvent = timer1Ticks;
+  if(timer2On && !(TM2CNT & 4) && timer2Ticks < timerEvent)
+    timerEvent = timer2Ticks;
+  if(timer3On && !(TM3CNT & 4) && timer3Ticks < timerEvent)
+    timerEvent = timer3Ticks;
 }
 
-void CPUUpdateWindow1()
+// Stores the running counters in TMxD and moves timerClock back to 0, so
+// the timerNTicks values are relative to now again, as save states and
+// the frontends expect.
+static void CPUTimerSync()
 {
-  int x00 = WIN1H>>8;
-  int x01 = WIN1H & 255;
-
-  if(x00 <= x01) {
-    for(int i = 0; i < 240; i++) {
-      gfxInWin1[i] = (i >= x00 && i < x01);
-    }
-  } else {
-    for(int i = 0; i < 240; i++) {
-      gfxInWin1[i] = (i >= x00 || i < x01);
-    }
+  if(timer0On) {
+    TM0D = 0xFFFF - ((timer0Ticks - timerClock) >> timer0ClockReload);
+    UPDATE_REG(0x100, TM0D);
+  }
+  if(timer1On && !(TM1CNT & 4)) {
+    TM1D = 0xFFFF - ((timer1Ticks - timerClock) >> timer1ClockReload);
+    UPDATE_REG(0x104, TM1D);
+  }
+  if(timer2On && !(TM2CNT & 4)) {
+    TM2D = 0xFFFF - ((timer2Ticks - timerClock) >> timer2ClockReload);
+    UPDATE_REG(0x108, TM2D);
   }
+  if(timer3On && !(TM3CNT & 4)) {
+    TM3D = 0xFFFF - ((timer3Ticks - timerClock) >> timer3ClockReload);
+    UPDATE_REG(0x10C, TM3D);
+  }
+  timer0Ticks -= timerClock;
+  timer1Ticks -= timerClock;
+  timer2Ticks -= timerClock;
+  timer3Ticks -= timerClock;
+  timerClock = 0;
+  CPUTimerSchedule();
 }
 
 extern u32 line0[240];
@@ -565,6 +580,9 @@ extern u32 line3[240];
 
 void CPUUpdateRenderBuffers(bool force)
 {
+#ifdef GBA_THREADED_RENDER
+  gfxThreadClear |= force ? 0x0F : (~layerEnable >> 8) & 0x0F;
+#endif
   if(!(layerEnable & 0x0100) || force) {
     CLEAR_ARRAY(line0);
   }
@@ -586,6 +604,8 @@ unsigned int CPUWriteState(u8* data, unsigned size)
 {
    uint8_t *orig = data;
 
+   CPUTimerSync();
+
    utilWriteIntMem(data, SAVE_GAME_VERSION);
    utilWriteMem(data, &rom[0xa0], 16);
    utilWriteIntMem(data, useBios);
@@ -619,6 +639,8 @@ bool CPUWriteMemState(char *memory, int available)
 #else
 static bool CPUWriteState(gzFile gzFile)
 {
+  CPUTimerSync();
+
   utilWriteInt(gzFile, SAVE_GAME_VERSION);
 
   utilGzWrite(gzFile, &rom[0xa0], 16);
@@ -692,6 +714,42 @@ bool CPUWriteMemState(char *memory, int available)
 }
 #endif
 
+StateHashRegion cpuHashWorkRAM;
+StateHashRegion cpuHashInternalRAM;
+StateHashRegion cpuHashVram;
+
+// Everything the savestates have but the picture and the cheats
+u64 CPUStateHash()
+{
+  CPUTimerSync();
+
+  int extra[2] = { stopState, IRQTicks };
+  u64 h = stateHashData(&reg[0], sizeof(reg), 0);
+  h = stateHashVariables(saveGameStruct, h);
+  h = stateHashData(extra, sizeof(extra), h);
+  h = stateHashRegion(cpuHashInternalRAM, internalRAM, 0x8000, h);
+  h = stateHashData(paletteRAM, 0x400, h);
+  h = stateHashRegion(cpuHashWorkRAM, workRAM, 0x40000, h);
+  h = stateHashRegion(cpuHashVram, vram, 0x18000, h);
+  h = stateHashData(oam, 0x400, h);
+  h = stateHashData(ioMem, 0x400, h);
+  h = eepromStateHash(h);
+  h = flashStateHash(h);
+  h = soundStateHash(h);
+  return rtcStateHash(h);
+}
+
+// For memory changed other than through the CPUWrite functions,
+// CPUHostWritten() and the save types
+void CPUStateHashInvalidate()
+{
+  stateHashInvalidate(cpuHashWorkRAM);
+  stateHashInvalidate(cpuHashInternalRAM);
+  stateHashInvalidate(cpuHashVram);
+  stateHashInvalidate(flashHashMemory);
+  stateHashInvalidate(eepromHashMemory);
+}
+
 
 #ifdef __LIBRETRO__
 bool CPUReadState(const u8* data, unsigned size)
@@ -712,6 +770,8 @@ bool CPUReadState(const u8* data, unsigned size)
    utilReadMem(&reg[0], data, sizeof(reg));
 
    utilReadDataMem(data, saveGameStruct);
+   timerClock = 0;
+   CPUTimerSchedule();
 
    stopState = utilReadIntMem(data) ? true : false;
 
@@ -729,6 +789,8 @@ bool CPUReadState(const u8* data, unsigned size)
    utilReadMem(workRAM, data, 0x40000);
    utilReadMem(vram, data, 0x20000);
    utilReadMem(oam, data, 0x400);
+   gfxInvalidateCaches();
+   CPUStateHashInvalidate();
    utilReadMem(pix, data, 4*241*162);
    utilReadMem(ioMem, data, 0x400);
 
@@ -859,6 +921,8 @@ static bool CPUReadState(gzFile gzFile)
   utilGzRead(gzFile, workRAM, 0x40000);
   utilGzRead(gzFile, vram, 0x20000);
   utilGzRead(gzFile, oam, 0x400);
+  gfxInvalidateCaches();
+  CPUStateHashInvalidate();
   if(version < SAVE_GAME_VERSION_6)
     utilGzRead(gzFile, pix, 4*240*160);
   else
@@ -918,6 +982,8 @@ static bool CPUReadState(gzFile gzFile)
     timer3Ticks = ((0x10000 - TM3D) << timer3ClockReload) - timer3Ticks;
     interp_rate();
   }
+  timerClock = 0;
+  CPUTimerSchedule();
 
   // set pointers!
   layerEnable = layerSettings & DISPCNT;
@@ -1031,34 +1097,22 @@ bool CPUWriteBatteryFile(const char *fileName)
   }
 
   if((gbaSaveType) && (gbaSaveType!=5)) {
-    FILE *file = fopen(fileName, "wb");
+    bool ok;
+    // only save if Flash/Sram in use or EEprom in use
+    if(gbaSaveType != 3) {
+      if(gbaSaveType == 2)
+        ok = saveWriterWrite(fileName, flashSaveMemory, flashSize);
+      else
+        ok = saveWriterWrite(fileName, flashSaveMemory, 0x10000);
+    } else {
+      ok = saveWriterWrite(fileName, eepromData, eepromSize);
+    }
 
-    if(!file) {
+    if(!ok) {
       systemMessage(MSG_ERROR_CREATING_FILE, N_("Error creating file %s"),
                     fileName);
       return false;
     }
-
-    // only save if Flash/Sram in use or EEprom in use
-    if(gbaSaveType != 3) {
-      if(gbaSaveType == 2) {
-        if(fwrite(flashSaveMemory, 1, flashSize, file) != (size_t)flashSize) {
-          fclose(file);
-          return false;
-        }
-      } else {
-        if(fwrite(flashSaveMemory, 1, 0x10000, file) != 0x10000) {
-          fclose(file);
-          return false;
-        }
-      }
-    } else {
-      if(fwrite(eepromData, 1, eepromSize, file) != (size_t)eepromSize) {
-        fclose(file);
-        return false;
-      }
-    }
-    fclose(file);
   }
   return true;
 }
@@ -1072,6 +1126,7 @@ bool CPUReadGSASnapshot(const char *fileName)
     systemMessage(MSG_CANNOT_OPEN_FILE, N_("Cannot open file %s"), fileName);
     return false;
   }
+  CPUStateHashInvalidate();
 
   // check file size to know what we should read
   fseek(file, 0, SEEK_END);
@@ -1141,6 +1196,7 @@ bool CPUReadGSASPSnapshot(const char *fileName)
     systemMessage(MSG_CANNOT_OPEN_FILE, N_("Cannot open file %s"), fileName);
     return false;
   }
+  CPUStateHashInvalidate();
 
   // read save name
   fseek(file, namepos, SEEK_SET);
@@ -1250,6 +1306,7 @@ bool CPUImportEepromFile(const char *fileName)
 
   if(!file)
     return false;
+  CPUStateHashInvalidate();
 
   // check file size to know what we should read
   fseek(file, 0, SEEK_END);
@@ -1290,10 +1347,13 @@ bool CPUImportEepromFile(const char *fileName)
 
 bool CPUReadBatteryFile(const char *fileName)
 {
+  saveWriterRecover(fileName);
+
   FILE *file = fopen(fileName, "rb");
 
   if(!file)
     return false;
+  CPUStateHashInvalidate();
 
   // check file size to know what we should read
   fseek(file, 0, SEEK_END);
@@ -1415,6 +1475,12 @@ bool CPUIsELF(const char *file)
 
 void CPUCleanUp()
 {
+#ifdef GBA_THREADED_RENDER
+  gfxThreadStop();
+#endif
+
+  saveWriterFlush();
+
 #ifdef PROFILING
   if(profilingTicksReload) {
     profCleanup();
@@ -1483,6 +1549,7 @@ int CPULoadRom(const char *szFile)
   }
 
   systemSaveUpdateCounter = SYSTEM_SAVE_NOT_UPDATED;
+  CPUStateHashInvalidate();
 
   rom = (u8 *)malloc(0x2000000);
   if(rom == NULL) {
@@ -1882,6 +1949,28 @@ void CPUSoftwareInterrupt()
   reg[15].I += 4;
 }
 
+// The copy and decompression calls that biosHLE keeps doing natively when a
+// BIOS file is loaded. Their cost is still charged through SWITicks.
+static bool CPUBiosHLE(int comment)
+{
+  if(!biosHLE)
+    return false;
+  switch(comment) {
+  case 0x0B:
+  case 0x0C:
+  case 0x11:
+  case 0x12:
+  case 0x13:
+  case 0x14:
+  case 0x15:
+  case 0x16:
+  case 0x17:
+  case 0x18:
+    return true;
+  }
+  return false;
+}
+
 void CPUSoftwareInterrupt(int comment)
 {
   static bool disableMessage = false;
@@ -1922,7 +2011,7 @@ void CPUSoftwareInterrupt(int comment)
     return;
   }
 #endif
-  if(useBios) {
+  if(useBios && !CPUBiosHLE(comment)) {
 #ifdef GBA_LOGGING
     if(systemVerbose & VERBOSE_SWI) {
       log("SWI: %08x at %08x (0x%08x,0x%08x,0x%08x,VCOUNT = %2d)\n", comment,
@@ -2211,6 +2300,199 @@ void CPUCompareVCOUNT()
 
 }
 
+// Returns the host memory behind a DMA source or destination if all c units
+// of the transfer stay inside one plain memory area without wrapping around
+// its mirror (or touching the VRAM mirror at 0x18000), NULL otherwise. lo
+// and hi receive the byte range covered, relative to the start of the area.
+static u8 *CPUDMAMemory(u32 address, int step, u32 c, int size, bool write,
+                        u32 &lo, u32 &hi)
+{
+  u8 *base;
+  u32 mirror;
+  u32 limit;
+  switch(address >> 24) {
+  case 2:
+    base = workRAM;
+    mirror = limit = 0x40000;
+    break;
+  case 3:
+    base = internalRAM;
+    mirror = limit = 0x8000;
+    break;
+  case 5:
+    base = paletteRAM;
+    mirror = limit = 0x400;
+    break;
+  case 6:
+    base = vram;
+    mirror = 0x20000;
+    limit = 0x18000;
+    break;
+  case 7:
+    base = oam;
+    mirror = limit = 0x400;
+    break;
+  case 8:
+  case 9:
+  case 10:
+  case 11:
+  case 12:
+    if(write)
+      return NULL;
+    base = rom;
+    mirror = limit = 0x2000000;
+    break;
+  default:
+    return NULL;
+  }
+
+  u32 first = address & (mirror - 1);
+  u32 span = (c - 1) * (step < 0 ? -step : step);
+  if(step < 0) {
+    if(first < span)
+      return NULL;
+    lo = first - span;
+    hi = first + size;
+  } else {
+    lo = first;
+    hi = first + span + size;
+  }
+  if(hi > limit)
+    return NULL;
+
+  // the RTC registers live in the ROM area
+  if(size == 2 && (address >> 24) == 8 && lo < 0xCA && hi > 0xC4)
+    return NULL;
+
+  return base + first;
+}
+
+#ifdef BKPT_SUPPORT
+// Whether any of bytes lo to hi of the area of address are watched for kinds
+static bool CPUDMAWatched(u32 address, u32 lo, u32 hi, int kinds)
+{
+  return (watchKinds & kinds) &&
+    (watchFind((address & 0xFF000000) | lo, hi - lo) & kinds);
+}
+#endif
+
+// Lets the graphics caches and the state hash know that bytes lo to hi of
+// the given memory area were written behind the back of the CPUWrite
+// functions.
+static void CPUMemoryWritten(u32 area, u32 lo, u32 hi)
+{
+  switch(area) {
+  case 2:
+    for(u32 i = lo & ~1023; i < hi; i += 1024)
+      stateHashWritten(cpuHashWorkRAM, i);
+    break;
+  case 3:
+    for(u32 i = lo & ~1023; i < hi; i += 1024)
+      stateHashWritten(cpuHashInternalRAM, i);
+    break;
+  case 5:
+    for(u32 i = lo & ~31; i < hi; i += 32)
+      gfxPaletteWritten(i);
+    break;
+  case 6:
+    for(u32 i = lo & ~31; i < hi; i += 32)
+      gfxVramWritten(i);
+    for(u32 i = lo & ~1023; i < hi; i += 1024)
+      stateHashWritten(cpuHashVram, i);
+    break;
+  case 7:
+    for(u32 i = lo & ~7; i < hi; i += 8)
+      gfxOAMWritten(i);
+    break;
+  }
+}
+
+// Returns the host memory behind length bytes at address, accessed in size
+// byte units, or NULL if any of it has to go through CPURead/CPUWrite.
+// Byte writes to video memory don't store a single byte, so they never get
+// a pointer. Call CPUHostWritten afterwards when writing.
+u8 *CPUHostMemory(u32 address, u32 length, int size, bool write)
+{
+  u32 lo, hi;
+  if(length == 0 || (address & (size - 1)))
+    return NULL;
+  if(write && size == 1 && (address >> 24) >= 5)
+    return NULL;
+  u8 *p = CPUDMAMemory(address, size, (length + size - 1) / size, size,
+                       write, lo, hi);
+#ifdef BKPT_SUPPORT
+  if(p != NULL && write && CPUDMAWatched(address, lo, hi, WATCH_STORE))
+    return NULL;
+#endif
+  return p;
+}
+
+void CPUHostWritten(u32 address, u32 length)
+{
+  static const u32 masks[8] = {
+    0, 0, 0x3FFFF, 0x7FFF, 0, 0x3FF, 0x1FFFF, 0x3FF
+  };
+  u32 area = address >> 24;
+  if(area < 8) {
+    u32 lo = address & masks[area];
+    CPUMemoryWritten(area, lo, lo + length);
+  }
+}
+
+// Memory to memory DMA without the per unit region dispatch. Returns false,
+// without having touched anything, when doDMA has to do it the slow way.
+static bool CPUDMAFast(u32 s, u32 d, int si, int di, u32 c, int size)
+{
+  // nothing to take cpuDmaLast from
+  if(c == 0)
+    return false;
+
+  u32 srcLo, srcHi, dstLo, dstHi;
+  u8 *src = CPUDMAMemory(s, si, c, size, false, srcLo, srcHi);
+  if(src == NULL)
+    return false;
+  d &= ~(size - 1);
+  u8 *dst = CPUDMAMemory(d, di, c, size, true, dstLo, dstHi);
+  if(dst == NULL)
+    return false;
+#ifdef BKPT_SUPPORT
+  if(CPUDMAWatched(s, srcLo, srcHi, WATCH_READ) ||
+     CPUDMAWatched(d, dstLo, dstHi, WATCH_STORE))
+    return false;
+#endif
+
+  u32 value;
+  if(si == di && si != 0 &&
+     ((s >> 24) != (d >> 24) || (si > 0 ? dst <= src : dst >= src))) {
+    // no unit is read after it has been overwritten, so this is a move
+    u32 back = si < 0 ? (c - 1) * size : 0;
+    memmove(dst - back, src - back, c * size);
+    src += (int)(c - 1) * si;
+    value = size == 4 ? READ32LE(((u32 *)src)) : READ16LE(((u16 *)src));
+  } else if(size == 4) {
+    while(c != 0) {
+      value = READ32LE(((u32 *)src));
+      WRITE32LE(((u32 *)dst), value);
+      src += si;
+      dst += di;
+      c--;
+    }
+  } else {
+    while(c != 0) {
+      value = READ16LE(((u16 *)src));
+      WRITE16LE(((u16 *)dst), value);
+      src += si;
+      dst += di;
+      c--;
+    }
+  }
+
+  CPUMemoryWritten(d >> 24, dstLo, dstHi);
+
+  cpuDmaLast = size == 4 ? value : value | (value << 16);
+  return true;
+}
+
 void doDMA(u32 &s, u32 &d, u32 si, u32 di, u32 c, int transfer32)
 {
   int sm = s >> 24;
@@ -2238,6 +2520,9 @@ void doDMA(u32 &s, u32 &d, u32 si, u32 di, u32 c, int transfer32)
         d += di;
         c--;
       }
+    } else if(CPUDMAFast(s, d, si, di, c, 4)) {
+      d += di * c;
+      s += si * c;
     } else {
       while(c != 0) {
         cpuDmaLast = CPUReadMemory(s);
@@ -2257,6 +2542,9 @@ void doDMA(u32 &s, u32 &d, u32 si, u32 di, u32 c, int transfer32)
         d += di;
         c--;
       }
+    } else if(CPUDMAFast(s, d, si, di, c, 2)) {
+      d += di * c;
+      s += si * c;
     } else {
       while(c != 0) {
         cpuDmaLast = CPUReadHalfWord(s);
@@ -3101,11 +3389,16 @@ void applyTimer ()
 {
   if (timerOnOffDelay & 1)
   {
+    if(timer0On && !(timer0Value & 0x80)) {
+      // keep the counter where it stopped
+      TM0D = 0xFFFF - ((timer0Ticks - timerClock) >> timer0ClockReload);
+      UPDATE_REG(0x100, TM0D);
+    }
     timer0ClockReload = TIMER_TICKS[timer0Value & 3];
     if(!timer0On && (timer0Value & 0x80)) {
       // reload the counter
       TM0D = timer0Reload;
-      timer0Ticks = (0x10000 - TM0D) << timer0ClockReload;
+      timer0Ticks = timerClock + ((0x10000 - TM0D) << timer0ClockReload);
       UPDATE_REG(0x100, TM0D);
     }
     timer0On = timer0Value & 0x80 ? true : false;
@@ -3116,11 +3409,17 @@ void applyTimer ()
   }
   if (timerOnOffDelay & 2)
   {
+    if(timer1On && !(TM1CNT & 4) && (timer1Value & 0x84) != 0x80) {
+      // keep the counter where it stopped or starts counting up
+      TM1D = 0xFFFF - ((timer1Ticks - timerClock) >> timer1ClockReload);
+      UPDATE_REG(0x104, TM1D);
+    }
     timer1ClockReload = TIMER_TICKS[timer1Value & 3];
-    if(!timer1On && (timer1Value & 0x80)) {
+    if((!timer1On || (TM1CNT & 4)) && (timer1Value & 0x80)) {
       // reload the counter
-      TM1D = timer1Reload;
-      timer1Ticks = (0x10000 - TM1D) << timer1ClockReload;
+      if(!timer1On)
+        TM1D = timer1Reload;
+      timer1Ticks = timerClock + ((0x10000 - TM1D) << timer1ClockReload);
       UPDATE_REG(0x104, TM1D);
     }
     timer1On = timer1Value & 0x80 ? true : false;
@@ -3130,11 +3429,17 @@ void applyTimer ()
   }
   if (timerOnOffDelay & 4)
   {
+    if(timer2On && !(TM2CNT & 4) && (timer2Value & 0x84) != 0x80) {
+      // keep the counter where it stopped or starts counting up
+      TM2D = 0xFFFF - ((timer2Ticks - timerClock) >> timer2ClockReload);
+      UPDATE_REG(0x108, TM2D);
+    }
     timer2ClockReload = TIMER_TICKS[timer2Value & 3];
-    if(!timer2On && (timer2Value & 0x80)) {
+    if((!timer2On || (TM2CNT & 4)) && (timer2Value & 0x80)) {
       // reload the counter
-      TM2D = timer2Reload;
-      timer2Ticks = (0x10000 - TM2D) << timer2ClockReload;
+      if(!timer2On)
+        TM2D = timer2Reload;
+      timer2Ticks = timerClock + ((0x10000 - TM2D) << timer2ClockReload);
       UPDATE_REG(0x108, TM2D);
     }
     timer2On = timer2Value & 0x80 ? true : false;
@@ -3143,21 +3448,119 @@ void applyTimer ()
   }
   if (timerOnOffDelay & 8)
   {
+    if(timer3On && !(TM3CNT & 4) && (timer3Value & 0x84) != 0x80) {
+      // keep the counter where it stopped or starts counting up
+      TM3D = 0xFFFF - ((timer3Ticks - timerClock) >> timer3ClockReload);
+      UPDATE_REG(0x10C, TM3D);
+    }
     timer3ClockReload = TIMER_TICKS[timer3Value & 3];
-    if(!timer3On && (timer3Value & 0x80)) {
+    if((!timer3On || (TM3CNT & 4)) && (timer3Value & 0x80)) {
       // reload the counter
-      TM3D = timer3Reload;
-      timer3Ticks = (0x10000 - TM3D) << timer3ClockReload;
+      if(!timer3On)
+        TM3D = timer3Reload;
+      timer3Ticks = timerClock + ((0x10000 - TM3D) << timer3ClockReload);
       UPDATE_REG(0x10C, TM3D);
     }
     timer3On = timer3Value & 0x80 ? true : false;
     TM3CNT = timer3Value & 0xC7;
     UPDATE_REG(0x10E, TM3CNT);
   }
+  CPUTimerSchedule();
   cpuNextEvent = CPUUpdateTicks();
   timerOnOffDelay = 0;
 }
 
+// Handles the timers that reached timerEvent, counting up the cascaded
+// ones as their predecessor overflows.
+static void CPUTimerOverflow()
+{
+  int timerOverflow = 0;
+
+  if(timer0On && timer0Ticks <= timerClock) {
+    timer0Ticks += (0x10000 - timer0Reload) << timer0ClockReload;
+    timerOverflow |= 1;
+    soundTimerOverflow(0);
+    if(TM0CNT & 0x40) {
+      IF |= 0x08;
+      UPDATE_REG(0x202, IF);
+    }
+  }
+
+  if(timer1On) {
+    if(TM1CNT & 4) {
+      if(timerOverflow & 1) {
+        TM1D++;
+        if(TM1D == 0) {
+          TM1D += timer1Reload;
+          timerOverflow |= 2;
+          soundTimerOverflow(1);
+          if(TM1CNT & 0x40) {
+            IF |= 0x10;
+            UPDATE_REG(0x202, IF);
+          }
+        }
+        UPDATE_REG(0x104, TM1D);
+      }
+    } else if(timer1Ticks <= timerClock) {
+      timer1Ticks += (0x10000 - timer1Reload) << timer1ClockReload;
+      timerOverflow |= 2;
+      soundTimerOverflow(1);
+      if(TM1CNT & 0x40) {
+        IF |= 0x10;
+        UPDATE_REG(0x202, IF);
+      }
+    }
+  }
+
+  if(timer2On) {
+    if(TM2CNT & 4) {
+      if(timerOverflow & 2) {
+        TM2D++;
+        if(TM2D == 0) {
+          TM2D += timer2Reload;
+          timerOverflow |= 4;
+          if(TM2CNT & 0x40) {
+            IF |= 0x20;
+            UPDATE_REG(0x202, IF);
+          }
+        }
+        UPDATE_REG(0x108, TM2D);
+      }
+    } else if(timer2Ticks <= timerClock) {
+      timer2Ticks += (0x10000 - timer2Reload) << timer2ClockReload;
+      timerOverflow |= 4;
+      if(TM2CNT & 0x40) {
+        IF |= 0x20;
+        UPDATE_REG(0x202, IF);
+      }
+    }
+  }
+
+  if(timer3On) {
+    if(TM3CNT & 4) {
+      if(timerOverflow & 4) {
+        TM3D++;
+        if(TM3D == 0) {
+          TM3D += timer3Reload;
+          if(TM3CNT & 0x40) {
+            IF |= 0x40;
+            UPDATE_REG(0x202, IF);
+          }
+        }
+        UPDATE_REG(0x10C, TM3D);
+      }
+    } else if(timer3Ticks <= timerClock) {
+      timer3Ticks += (0x10000 - timer3Reload) << timer3ClockReload;
+      if(TM3CNT & 0x40) {
+        IF |= 0x40;
+        UPDATE_REG(0x202, IF);
+      }
+    }
+  }
+
+  CPUTimerSchedule();
+}
+
 u8 cpuBitsSet[256];
 u8 cpuLowestBitSet[256];
 
@@ -3283,6 +3686,8 @@ void CPUReset()
   memset(pix, 0, 4*160*240);
   // clean vram
   memset(vram, 0, 0x20000);
+  gfxInvalidateCaches();
+  CPUStateHashInvalidate();
   // clean io memory
   memset(ioMem, 0, 0x400);
 
@@ -3432,6 +3837,8 @@ void CPUReset()
   timer3Ticks = 0;
   timer3Reload = 0;
   timer3ClockReload  = 0;
+  timerClock = 0;
+  timerEvent = 0x7FFFFFFF;
   dma0Source = 0;
   dma0Dest = 0;
   dma1Source = 0;
@@ -3585,8 +3992,9 @@ void CPUInterrupt()
 
 void CPULoop(int ticks)
 {
+  movieUpdate();
+
   int clockTicks;
-  int timerOverflow = 0;
   // variable used by the CPU core
   cpuTotalTicks = 0;
 
@@ -3596,6 +4004,11 @@ void CPULoop(int ticks)
     cpuNextEvent = 1;
 #endif
 
+#ifdef GBA_THREADED_RENDER
+  // picks up a change of threadedRender made since the last call
+  gfxThreadSync();
+#endif
+
   cpuBreakLoop = false;
   cpuNextEvent = CPUUpdateTicks();
   if(cpuNextEvent > ticks)
@@ -3631,12 +4044,22 @@ void CPULoop(int ticks)
     if(!holdState && !SWITicks) {
       if(armState) {
 		  armOpcodeCount++;
-        if (!armExecute())
+        if (!armExecute()) {
+          CPUTimerSync();
+#ifdef GBA_THREADED_RENDER
+          gfxThreadSync();
+#endif
           return;
+        }
       } else {
 		  thumbOpcodeCount++;
-        if (!thumbExecute())
+        if (!thumbExecute()) {
+          CPUTimerSync();
+#ifdef GBA_THREADED_RENDER
+          gfxThreadSync();
+#endif
           return;
+        }
       }
       clockTicks = 0;
     } else
@@ -3710,8 +4133,14 @@ void CPULoop(int ticks)
             lcdTicks += 1008;
             DISPSTAT &= 0xFFFD;
             if(VCOUNT == 160) {
+#ifdef GBA_THREADED_RENDER
+              // the frame has to be complete before anyone looks at pix
+              gfxThreadSync();
+#endif
               count++;
               systemFrame();
+              if(movieFrame())
+                ticks = 0;
 
               if((count % 10) == 0) {
                 system10Frames(60);
@@ -3730,7 +4159,7 @@ void CPULoop(int ticks)
               // update joystick information
               if(systemReadJoypads())
                 // read default joystick
-                joy = systemReadJoypad(-1);
+                joy = movieReadJoypad(-1);
               P1 = 0x03FF ^ (joy & 0x3FF);
               if(cpuEEPROMSensorEnabled)
                 systemUpdateMotionSensor();
@@ -3802,107 +4231,13 @@ void CPULoop(int ticks)
             CPUCompareVCOUNT();
 
           } else {
-            if(frameCount >= framesToSkip)
-            {
-              (*renderLine)();
-              switch(systemColorDepth) {
-                case 16:
-                {
-                  u16 *dest = (u16 *)pix + 242 * (VCOUNT+1);
-                  for(int x = 0; x < 240;) {
-                    *dest++ = systemColorMap16[lineMix[x++]&0xFFFF];
-                    *dest++ = systemColorMap16[lineMix[x++]&0xFFFF];
-                    *dest++ = systemColorMap16[lineMix[x++]&0xFFFF];
-                    *dest++ = systemColorMap16[lineMix[x++]&0xFFFF];
-
-                    *dest++ = systemColorMap16[lineMix[x++]&0xFFFF];
-                    *dest++ = systemColorMap16[lineMix[x++]&0xFFFF];
-                    *dest++ = systemColorMap16[lineMix[x++]&0xFFFF];
-                    *dest++ = systemColorMap16[lineMix[x++]&0xFFFF];
-
-                    *dest++ = systemColorMap16[lineMix[x++]&0xFFFF];
-                    *dest++ = systemColorMap16[lineMix[x++]&0xFFFF];
-                    *dest++ = systemColorMap16[lineMix[x++]&0xFFFF];
-                    *dest++ = systemColorMap16[lineMix[x++]&0xFFFF];
-
-                    *dest++ = systemColorMap16[lineMix[x++]&0xFFFF];
-                    *dest++ = systemColorMap16[lineMix[x++]&0xFFFF];
-                    *dest++ = systemColorMap16[lineMix[x++]&0xFFFF];
-                    *dest++ = systemColorMap16[lineMix[x++]&0xFFFF];
-                  }
-                  // for filters that read past the screen
-                  *dest++ = 0;
-                }
-                break;
-                case 24:
-                {
-                  u8 *dest = (u8 *)pix + 240 * VCOUNT * 3;
-                  for(int x = 0; x < 240;) {
-                    *((u32 *)dest) = systemColorMap32[lineMix[x++] & 0xFFFF];
-                    dest += 3;
-                    *((u32 *)dest) = systemColorMap32[lineMix[x++] & 0xFFFF];
-                    dest += 3;
-                    *((u32 *)dest) = systemColorMap32[lineMix[x++] & 0xFFFF];
-                    dest += 3;
-                    *((u32 *)dest) = systemColorMap32[lineMix[x++] & 0xFFFF];
-                    dest += 3;
-
-                    *((u32 *)dest) = systemColorMap32[lineMix[x++] & 0xFFFF];
-                    dest += 3;
-                    *((u32 *)dest) = systemColorMap32[lineMix[x++] & 0xFFFF];
-                    dest += 3;
-                    *((u32 *)dest) = systemColorMap32[lineMix[x++] & 0xFFFF];
-                    dest += 3;
-                    *((u32 *)dest) = systemColorMap32[lineMix[x++] & 0xFFFF];
-                    dest += 3;
-
-                    *((u32 *)dest) = systemColorMap32[lineMix[x++] & 0xFFFF];
-                    dest += 3;
-                    *((u32 *)dest) = systemColorMap32[lineMix[x++] & 0xFFFF];
-                    dest += 3;
-                    *((u32 *)dest) = systemColorMap32[lineMix[x++] & 0xFFFF];
-                    dest += 3;
-                    *((u32 *)dest) = systemColorMap32[lineMix[x++] & 0xFFFF];
-                    dest += 3;
-
-                    *((u32 *)dest) = systemColorMap32[lineMix[x++] & 0xFFFF];
-                    dest += 3;
-                    *((u32 *)dest) = systemColorMap32[lineMix[x++] & 0xFFFF];
-                    dest += 3;
-                    *((u32 *)dest) = systemColorMap32[lineMix[x++] & 0xFFFF];
-                    dest += 3;
-                    *((u32 *)dest) = systemColorMap32[lineMix[x++] & 0xFFFF];
-                    dest += 3;
-                  }
-                }
-                break;
-                case 32:
-                {
-                  u32 *dest = (u32 *)pix + 241 * (VCOUNT+1);
-                  for(int x = 0; x < 240; ) {
-                    *dest++ = systemColorMap32[lineMix[x++] & 0xFFFF];
-                    *dest++ = systemColorMap32[lineMix[x++] & 0xFFFF];
-                    *dest++ = systemColorMap32[lineMix[x++] & 0xFFFF];
-                    *dest++ = systemColorMap32[lineMix[x++] & 0xFFFF];
-
-                    *dest++ = systemColorMap32[lineMix[x++] & 0xFFFF];
-                    *dest++ = systemColorMap32[lineMix[x++] & 0xFFFF];
-                    *dest++ = systemColorMap32[lineMix[x++] & 0xFFFF];
-                    *dest++ = systemColorMap32[lineMix[x++] & 0xFFFF];
-
-                    *dest++ = systemColorMap32[lineMix[x++] & 0xFFFF];
-                    *dest++ = systemColorMap32[lineMix[x++] & 0xFFFF];
-                    *dest++ = systemColorMap32[lineMix[x++] & 0xFFFF];
-                    *dest++ = systemColorMap32[lineMix[x++] & 0xFFFF];
-
-                    *dest++ = systemColorMap32[lineMix[x++] & 0xFFFF];
-                    *dest++ = systemColorMap32[lineMix[x++] & 0xFFFF];
-                    *dest++ = systemColorMap32[lineMix[x++] & 0xFFFF];
-                    *dest++ = systemColorMap32[lineMix[x++] & 0xFFFF];
-                  }
-                }
-                break;
-              }
+            if(frameCount >= framesToSkip) {
+#ifdef GBA_THREADED_RENDER
+              if(threadedRender)
+                gfxThreadPostLine();
+              else
+#endif
+                CPUDrawLine();
             }
             // entering H-Blank
             DISPSTAT |= 2;
@@ -3927,111 +4262,11 @@ void CPULoop(int ticks)
       }
 
       if(!stopState) {
-        if(timer0On) {
-          timer0Ticks -= clockTicks;
-          if(timer0Ticks <= 0) {
-            timer0Ticks += (0x10000 - timer0Reload) << timer0ClockReload;
-            timerOverflow |= 1;
-            soundTimerOverflow(0);
-            if(TM0CNT & 0x40) {
-              IF |= 0x08;
-              UPDATE_REG(0x202, IF);
-            }
-          }
-          TM0D = 0xFFFF - (timer0Ticks >> timer0ClockReload);
-          UPDATE_REG(0x100, TM0D);
-        }
-
-        if(timer1On) {
-          if(TM1CNT & 4) {
-            if(timerOverflow & 1) {
-              TM1D++;
-              if(TM1D == 0) {
-                TM1D += timer1Reload;
-                timerOverflow |= 2;
-                soundTimerOverflow(1);
-                if(TM1CNT & 0x40) {
-                  IF |= 0x10;
-                  UPDATE_REG(0x202, IF);
-                }
-              }
-              UPDATE_REG(0x104, TM1D);
-            }
-          } else {
-            timer1Ticks -= clockTicks;
-            if(timer1Ticks <= 0) {
-              timer1Ticks += (0x10000 - timer1Reload) << timer1ClockReload;
-              timerOverflow |= 2;
-              soundTimerOverflow(1);
-              if(TM1CNT & 0x40) {
-                IF |= 0x10;
-                UPDATE_REG(0x202, IF);
-              }
-            }
-            TM1D = 0xFFFF - (timer1Ticks >> timer1ClockReload);
-            UPDATE_REG(0x104, TM1D);
-          }
-        }
-
-        if(timer2On) {
-          if(TM2CNT & 4) {
-            if(timerOverflow & 2) {
-              TM2D++;
-              if(TM2D == 0) {
-                TM2D += timer2Reload;
-                timerOverflow |= 4;
-                if(TM2CNT & 0x40) {
-                  IF |= 0x20;
-                  UPDATE_REG(0x202, IF);
-                }
-              }
-              UPDATE_REG(0x108, TM2D);
-            }
-          } else {
-            timer2Ticks -= clockTicks;
-            if(timer2Ticks <= 0) {
-              timer2Ticks += (0x10000 - timer2Reload) << timer2ClockReload;
-              timerOverflow |= 4;
-              if(TM2CNT & 0x40) {
-                IF |= 0x20;
-                UPDATE_REG(0x202, IF);
-              }
-            }
-            TM2D = 0xFFFF - (timer2Ticks >> timer2ClockReload);
-            UPDATE_REG(0x108, TM2D);
-          }
-        }
-
-        if(timer3On) {
-          if(TM3CNT & 4) {
-            if(timerOverflow & 4) {
-              TM3D++;
-              if(TM3D == 0) {
-                TM3D += timer3Reload;
-                if(TM3CNT & 0x40) {
-                  IF |= 0x40;
-                  UPDATE_REG(0x202, IF);
-                }
-              }
-              UPDATE_REG(0x10C, TM3D);
-            }
-          } else {
-              timer3Ticks -= clockTicks;
-            if(timer3Ticks <= 0) {
-              timer3Ticks += (0x10000 - timer3Reload) << timer3ClockReload;
-              if(TM3CNT & 0x40) {
-                IF |= 0x40;
-                UPDATE_REG(0x202, IF);
-              }
-            }
-            TM3D = 0xFFFF - (timer3Ticks >> timer3ClockReload);
-            UPDATE_REG(0x10C, TM3D);
-          }
-        }
+        timerClock += clockTicks;
+        if(timerEvent <= timerClock)
+          CPUTimerOverflow();
       }
 
-      timerOverflow = 0;
-
 
 
 #ifdef PROFILING
@@ -4054,14 +4289,22 @@ void CPULoop(int ticks)
       }
 #endif
 
-      ticks -= clockTicks;
+#ifdef BKPT_SUPPORT
+      if(samplerActive) {
+        samplerTicks -= clockTicks;
+        if(samplerTicks <= 0)
+          samplerTake();
+      }
+#endif
 
-	  if (gba_joybus_enabled)
-		  JoyBusUpdate(clockTicks);
+      ticks -= clockTicks;
 
 #ifndef NO_LINK
-	  if (gba_link_enabled)
-		  LinkUpdate(clockTicks);
+	  if (gba_joybus_enabled || gba_link_enabled) {
+		  linkClock += clockTicks;
+		  if (linkClock >= linkEvent)
+			  LinkProcessEvents();
+	  }
 #endif
 
       cpuNextEvent = CPUUpdateTicks();
@@ -4146,31 +4389,13 @@ void CPULoop(int ticks)
 
     }
   }
+  CPUTimerSync();
+#ifdef GBA_THREADED_RENDER
+  gfxThreadSync();
+#endif
 }
 
 #ifdef TILED_RENDERING
-union u8h
-{
-   struct
-   {
-      /* 0*/	unsigned lo:4;
-      /* 4*/	unsigned hi:4;
-   } __attribute__ ((packed));
-   u8 val;
-};
-
-union TileEntry
-{
-   struct
-   {
-      /* 0*/	unsigned tileNum:10;
-      /*12*/	unsigned hFlip:1;
-      /*13*/	unsigned vFlip:1;
-      /*14*/	unsigned palette:4;
-   };
-   u16 val;
-};
-
 struct TileLine
 {
    u32 pixels[8];
@@ -4178,83 +4403,17 @@ struct TileLine
 
 typedef const TileLine (*TileReader) (const u16 *, const int, const u8 *, u16 *, const u32);
 
-static inline void gfxDrawPixel(u32 *dest, const u8 color, const u16 *palette, const u32 prio)
-{
-   *dest = color ? (READ16LE(&palette[color]) | prio): 0x80000000;
-}
-
-inline const TileLine gfxReadTile(const u16 *screenSource, const int yyy, const u8 *charBase, u16 *palette, const u32 prio)
+inline const TileLine gfxReadTile(const u16 *screenSource, const int yyy, const u8 *charBase, u16 *, const u32 prio)
 {
-   TileEntry tile;
-   tile.val = READ16LE(screenSource);
-
-   int tileY = yyy & 7;
-   if (tile.vFlip) tileY = 7 - tileY;
    TileLine tileLine;
-
-   const u8 *tileBase = &charBase[tile.tileNum * 64 + tileY * 8];
-
-   if (!tile.hFlip)
-   {
-      gfxDrawPixel(&tileLine.pixels[0], tileBase[0], palette, prio);
-      gfxDrawPixel(&tileLine.pixels[1], tileBase[1], palette, prio);
-      gfxDrawPixel(&tileLine.pixels[2], tileBase[2], palette, prio);
-      gfxDrawPixel(&tileLine.pixels[3], tileBase[3], palette, prio);
-      gfxDrawPixel(&tileLine.pixels[4], tileBase[4], palette, prio);
-      gfxDrawPixel(&tileLine.pixels[5], tileBase[5], palette, prio);
-      gfxDrawPixel(&tileLine.pixels[6], tileBase[6], palette, prio);
-      gfxDrawPixel(&tileLine.pixels[7], tileBase[7], palette, prio);
-   }
-   else
-   {
-      gfxDrawPixel(&tileLine.pixels[0], tileBase[7], palette, prio);
-      gfxDrawPixel(&tileLine.pixels[1], tileBase[6], palette, prio);
-      gfxDrawPixel(&tileLine.pixels[2], tileBase[5], palette, prio);
-      gfxDrawPixel(&tileLine.pixels[3], tileBase[4], palette, prio);
-      gfxDrawPixel(&tileLine.pixels[4], tileBase[3], palette, prio);
-      gfxDrawPixel(&tileLine.pixels[5], tileBase[2], palette, prio);
-      gfxDrawPixel(&tileLine.pixels[6], tileBase[1], palette, prio);
-      gfxDrawPixel(&tileLine.pixels[7], tileBase[0], palette, prio);
-   }
-
+   memcpy(tileLine.pixels, gfxReadTileRow(charBase - vram, READ16LE(screenSource), yyy & 7, true, prio), sizeof(tileLine.pixels));
    return tileLine;
 }
 
-inline const TileLine gfxReadTilePal(const u16 *screenSource, const int yyy, const u8 *charBase, u16 *palette, const u32 prio)
+inline const TileLine gfxReadTilePal(const u16 *screenSource, const int yyy, const u8 *charBase, u16 *, const u32 prio)
 {
-   TileEntry tile;
-   tile.val = READ16LE(screenSource);
-
-   int tileY = yyy & 7;
-   if (tile.vFlip) tileY = 7 - tileY;
-   palette += tile.palette * 16;
    TileLine tileLine;
-
-   const u8h *tileBase = (u8h*) &charBase[tile.tileNum * 32 + tileY * 4];
-
-   if (!tile.hFlip)
-   {
-      gfxDrawPixel(&tileLine.pixels[0], tileBase[0].lo, palette, prio);
-      gfxDrawPixel(&tileLine.pixels[1], tileBase[0].hi, palette, prio);
-      gfxDrawPixel(&tileLine.pixels[2], tileBase[1].lo, palette, prio);
-      gfxDrawPixel(&tileLine.pixels[3], tileBase[1].hi, palette, prio);
-      gfxDrawPixel(&tileLine.pixels[4], tileBase[2].lo, palette, prio);
-      gfxDrawPixel(&tileLine.pixels[5], tileBase[2].hi, palette, prio);
-      gfxDrawPixel(&tileLine.pixels[6], tileBase[3].lo, palette, prio);
-      gfxDrawPixel(&tileLine.pixels[7], tileBase[3].hi, palette, prio);
-   }
-   else
-   {
-      gfxDrawPixel(&tileLine.pixels[0], tileBase[3].hi, palette, prio);
-      gfxDrawPixel(&tileLine.pixels[1], tileBase[3].lo, palette, prio);
-      gfxDrawPixel(&tileLine.pixels[2], tileBase[2].hi, palette, prio);
-      gfxDrawPixel(&tileLine.pixels[3], tileBase[2].lo, palette, prio);
-      gfxDrawPixel(&tileLine.pixels[4], tileBase[1].hi, palette, prio);
-      gfxDrawPixel(&tileLine.pixels[5], tileBase[1].lo, palette, prio);
-      gfxDrawPixel(&tileLine.pixels[6], tileBase[0].hi, palette, prio);
-      gfxDrawPixel(&tileLine.pixels[7], tileBase[0].lo, palette, prio);
-   }
-
+   memcpy(tileLine.pixels, gfxReadTileRow(charBase - vram, READ16LE(screenSource), yyy & 7, false, prio), sizeof(tileLine.pixels));
    return tileLine;
 }
 
@@ -4433,8 +4592,10 @@ struct EmulatedSystem GBASystem = {
   true,
   // emuCount
 #ifdef FINAL_VERSION
-  250000
+  250000,
 #else
-  5000
+  5000,
 #endif
+  // emuStateHash
+  CPUStateHash
 };
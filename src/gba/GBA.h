@@ -67,11 +67,6 @@ extern int armMode;
 extern void (*cpuSaveGameFunc)(u32,u8);
 
 #ifdef BKPT_SUPPORT
-extern u8 freezeWorkRAM[0x40000];
-extern u8 freezeInternalRAM[0x8000];
-extern u8 freezeVRAM[0x18000];
-extern u8 freezeOAM[0x400];
-extern u8 freezePRAM[0x400];
 extern bool debugger_last;
 extern int  oldreg[18];
 extern char oldbuffer[10];
@@ -106,6 +101,13 @@ extern void CPUInit(const char *,bool);
 extern void CPUReset();
 extern void CPULoop(int);
 extern void CPUCheckDMA(int,int);
+extern u8 *CPUHostMemory(u32, u32, int, bool);
+extern void CPUHostWritten(u32, u32);
+// Drops the renderer caches of decoded tiles, palettes and sprite lines,
+// after VRAM, palette RAM or OAM changed behind the write functions
+extern void gfxInvalidateCaches();
+extern u64 CPUStateHash();
+extern void CPUStateHashInvalidate();
 extern bool CPUIsGBAImage(const char *);
 extern bool CPUIsZipFile(const char *);
 #ifdef PROFILING
@@ -1,4 +1,5 @@
 #include "../System.h"
+#include "GBAGfx.h"
 
 int coeff[32] = {
   0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
@@ -23,3 +24,225 @@ int gfxBG2Y = 0;
 int gfxBG3X = 0;
 int gfxBG3Y = 0;
 int gfxLastVCOUNT = 0;
+
+GfxTileRow gfxTileCache[GFX_TILE_CACHE_SIZE];
+u32 gfxVramVersion[0x20000 >> 5];
+u32 gfxPaletteVersion[16];
+u32 gfxPaletteVersionAll = 0;
+
+u32 gfxOBJLineMask[228][4];
+u32 gfxOBJDirty[4] = { 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF };
+static int gfxOBJTop[128];
+static int gfxOBJLines[128];
+
+// Needed whenever VRAM, palette RAM or OAM is changed behind the back of
+// the CPUWrite* functions (reset, save states, debugger edits).
+void gfxInvalidateCaches()
+{
+  for(int i = 0; i < GFX_TILE_CACHE_SIZE; i++)
+    gfxTileCache[i].tag = 0;
+  for(int i = 0; i < 4; i++)
+    gfxOBJDirty[i] = 0xFFFFFFFF;
+#ifdef GBA_THREADED_RENDER
+  gfxThreadInvalidate();
+#endif
+}
+
+// Moves the sprites flagged in gfxOBJDirty to the lines their (possibly
+// double sized) bounding box covers now. Uses the same size decoding and
+// vertical wrap as gfxDrawSprites/gfxDrawOBJWin.
+void gfxUpdateOBJLines()
+{
+  u16 *sprites = (u16 *)oam;
+  for(int word = 0; word < 4; word++) {
+    u32 dirty = gfxOBJDirty[word];
+    gfxOBJDirty[word] = 0;
+    for(int bit = 0; dirty; bit++, dirty >>= 1) {
+      if(!(dirty & 1))
+        continue;
+
+      int x = (word << 5) + bit;
+      u32 mask = 1u << bit;
+
+      for(int i = 0; i < gfxOBJLines[x]; i++)
+        gfxOBJLineMask[gfxOBJTop[x] + i][word] &= ~mask;
+
+      u16 a0 = READ16LE(&sprites[x << 2]);
+      u16 a1 = READ16LE(&sprites[(x << 2) + 1]);
+
+      if ((a0>>14) == 3)
+      {
+        a0 &= 0x3FFF;
+        a1 &= 0x3FFF;
+      }
+
+      int sizeY = 8<<(a1>>14);
+
+      if ((a0>>14) & 1)
+      {
+        if (sizeY>8)
+          sizeY>>=1;
+      }
+      else if ((a0>>14) & 2)
+      {
+        if (sizeY<32)
+          sizeY<<=1;
+      }
+
+      if ((a0 & 0x0300) == 0x0300)
+        sizeY <<= 1;
+
+      int sy = (a0 & 255);
+      if((sy+sizeY) > 256)
+        sy -= 256;
+
+      int top = sy < 0 ? 0 : sy;
+      int bottom = sy + sizeY;
+      if(bottom > 228)
+        bottom = 228;
+      if(bottom < top)
+        bottom = top;
+
+      for(int i = top; i < bottom; i++)
+        gfxOBJLineMask[i][word] |= mask;
+
+      gfxOBJTop[x] = top;
+      gfxOBJLines[x] = bottom - top;
+    }
+  }
+}
+
+void CPUUpdateWindow0()
+{
+  int x00 = WIN0H>>8;
+  int x01 = WIN0H & 255;
+
+  if(x00 <= x01) {
+    for(int i = 0; i < 240; i++) {
+      gfxInWin0[i] = (i >= x00 && i < x01);
+    }
+  } else {
+    for(int i = 0; i < 240; i++) {
+      gfxInWin0[i] = (i >= x00 || i < x01);
+    }
+  }
+}
+
+void CPUUpdateWindow1()
+{
+  int x00 = WIN1H>>8;
+  int x01 = WIN1H & 255;
+
+  if(x00 <= x01) {
+    for(int i = 0; i < 240; i++) {
+      gfxInWin1[i] = (i >= x00 && i < x01);
+    }
+  } else {
+    for(int i = 0; i < 240; i++) {
+      gfxInWin1[i] = (i >= x00 || i < x01);
+    }
+  }
+}
+
+void CPUDrawLine()
+{
+  (*renderLine)();
+  switch(systemColorDepth) {
+    case 16:
+    {
+      u16 *dest = (u16 *)pix + 242 * (VCOUNT+1);
+      for(int x = 0; x < 240;) {
+        *dest++ = systemColorMap16[lineMix[x++]&0xFFFF];
+        *dest++ = systemColorMap16[lineMix[x++]&0xFFFF];
+        *dest++ = systemColorMap16[lineMix[x++]&0xFFFF];
+        *dest++ = systemColorMap16[lineMix[x++]&0xFFFF];
+
+        *dest++ = systemColorMap16[lineMix[x++]&0xFFFF];
+        *dest++ = systemColorMap16[lineMix[x++]&0xFFFF];
+        *dest++ = systemColorMap16[lineMix[x++]&0xFFFF];
+        *dest++ = systemColorMap16[lineMix[x++]&0xFFFF];
+
+        *dest++ = systemColorMap16[lineMix[x++]&0xFFFF];
+        *dest++ = systemColorMap16[lineMix[x++]&0xFFFF];
+        *dest++ = systemColorMap16[lineMix[x++]&0xFFFF];
+        *dest++ = systemColorMap16[lineMix[x++]&0xFFFF];
+
+        *dest++ = systemColorMap16[lineMix[x++]&0xFFFF];
+        *dest++ = systemColorMap16[lineMix[x++]&0xFFFF];
+        *dest++ = systemColorMap16[lineMix[x++]&0xFFFF];
+        *dest++ = systemColorMap16[lineMix[x++]&0xFFFF];
+      }
+      // for filters that read past the screen
+      *dest++ = 0;
+    }
+    break;
+    case 24:
+    {
+      u8 *dest = (u8 *)pix + 240 * VCOUNT * 3;
+      for(int x = 0; x < 240;) {
+        *((u32 *)dest) = systemColorMap32[lineMix[x++] & 0xFFFF];
+        dest += 3;
+        *((u32 *)dest) = systemColorMap32[lineMix[x++] & 0xFFFF];
+        dest += 3;
+        *((u32 *)dest) = systemColorMap32[lineMix[x++] & 0xFFFF];
+        dest += 3;
+        *((u32 *)dest) = systemColorMap32[lineMix[x++] & 0xFFFF];
+        dest += 3;
+
+        *((u32 *)dest) = systemColorMap32[lineMix[x++] & 0xFFFF];
+        dest += 3;
+        *((u32 *)dest) = systemColorMap32[lineMix[x++] & 0xFFFF];
+        dest += 3;
+        *((u32 *)dest) = systemColorMap32[lineMix[x++] & 0xFFFF];
+        dest += 3;
+        *((u32 *)dest) = systemColorMap32[lineMix[x++] & 0xFFFF];
+        dest += 3;
+
+        *((u32 *)dest) = systemColorMap32[lineMix[x++] & 0xFFFF];
+        dest += 3;
+        *((u32 *)dest) = systemColorMap32[lineMix[x++] & 0xFFFF];
+        dest += 3;
+        *((u32 *)dest) = systemColorMap32[lineMix[x++] & 0xFFFF];
+        dest += 3;
+        *((u32 *)dest) = systemColorMap32[lineMix[x++] & 0xFFFF];
+        dest += 3;
+
+        *((u32 *)dest) = systemColorMap32[lineMix[x++] & 0xFFFF];
+        dest += 3;
+        *((u32 *)dest) = systemColorMap32[lineMix[x++] & 0xFFFF];
+        dest += 3;
+        *((u32 *)dest) = systemColorMap32[lineMix[x++] & 0xFFFF];
+        dest += 3;
+        *((u32 *)dest) = systemColorMap32[lineMix[x++] & 0xFFFF];
+        dest += 3;
+      }
+    }
+    break;
+    case 32:
+    {
+      u32 *dest = (u32 *)pix + 241 * (VCOUNT+1);
+      for(int x = 0; x < 240; ) {
+        *dest++ = systemColorMap32[lineMix[x++] & 0xFFFF];
+        *dest++ = systemColorMap32[lineMix[x++] & 0xFFFF];
+        *dest++ = systemColorMap32[lineMix[x++] & 0xFFFF];
+        *dest++ = systemColorMap32[lineMix[x++] & 0xFFFF];
+
+        *dest++ = systemColorMap32[lineMix[x++] & 0xFFFF];
+        *dest++ = systemColorMap32[lineMix[x++] & 0xFFFF];
+        *dest++ = systemColorMap32[lineMix[x++] & 0xFFFF];
+        *dest++ = systemColorMap32[lineMix[x++] & 0xFFFF];
+
+        *dest++ = systemColorMap32[lineMix[x++] & 0xFFFF];
+        *dest++ = systemColorMap32[lineMix[x++] & 0xFFFF];
+        *dest++ = systemColorMap32[lineMix[x++] & 0xFFFF];
+        *dest++ = systemColorMap32[lineMix[x++] & 0xFFFF];
+
+        *dest++ = systemColorMap32[lineMix[x++] & 0xFFFF];
+        *dest++ = systemColorMap32[lineMix[x++] & 0xFFFF];
+        *dest++ = systemColorMap32[lineMix[x++] & 0xFFFF];
+        *dest++ = systemColorMap32[lineMix[x++] & 0xFFFF];
+      }
+    }
+    break;
+  }
+}
@@ -1,6 +1,8 @@
 #ifndef GFX_H
 #define GFX_H
 
+#include <string.h>
+
 #include "GBA.h"
 #include "Globals.h"
 
@@ -95,6 +97,43 @@ extern int gfxBG3X;
 extern int gfxBG3Y;
 extern int gfxLastVCOUNT;
 
+// One decoded, palette resolved row of a text background tile. Entries
+// are checked against the per block VRAM and per bank palette versions
+// bumped in GBAinline.h, so unchanged tiles are never decoded twice.
+struct GfxTileRow {
+  u32 tag;
+  u32 vramVersion;
+  u32 palVersion;
+  u32 pixels[8];
+};
+
+#define GFX_TILE_CACHE_SIZE 8192
+
+extern GfxTileRow gfxTileCache[GFX_TILE_CACHE_SIZE];
+extern u32 gfxVramVersion[0x20000 >> 5];
+extern u32 gfxPaletteVersion[16];
+extern u32 gfxPaletteVersionAll;
+
+// One bit per OAM entry for every line its bounding box covers, kept up
+// to date from the OAM writes flagged in gfxOBJDirty.
+extern u32 gfxOBJLineMask[228][4];
+extern u32 gfxOBJDirty[4];
+extern void gfxUpdateOBJLines();
+
+extern void (*renderLine)();
+extern void CPUDrawLine();
+extern void CPUUpdateWindow0();
+extern void CPUUpdateWindow1();
+
+#ifdef GBA_THREADED_RENDER
+// Line buffers to clear on the render thread before its next line.
+extern int gfxThreadClear;
+extern void gfxThreadPostLine();
+extern void gfxThreadSync();
+extern void gfxThreadStop();
+extern void gfxThreadInvalidate();
+#endif
+
 static inline void gfxClearArray(u32 *array)
 {
   for(int i = 0; i < 240; i++) {
@@ -102,12 +141,102 @@ static inline void gfxClearArray(u32 *array)
   }
 }
 
+static inline int gfxLowestBit(u32 mask)
+{
+#ifdef __GNUC__
+  return __builtin_ctz(mask);
+#else
+  int bit = 0;
+  while(!(mask & 1)) {
+    mask >>= 1;
+    bit++;
+  }
+  return bit;
+#endif
+}
+
+// Returns the first sprite from x on that may touch the given line, or
+// 128 when there is none.
+static inline int gfxNextOBJ(int line, int x)
+{
+  while(x < 128) {
+    u32 bits = gfxOBJLineMask[line][x >> 5] >> (x & 31);
+    if(bits)
+      return x + gfxLowestBit(bits);
+    x = (x | 31) + 1;
+  }
+  return 128;
+}
+
+static inline const u32 *gfxReadTileRow(u32 charBase, u16 data, int tileY,
+                                        bool colors256, u32 prio)
+{
+  int tile = data & 0x3FF;
+  if(data & 0x0800)
+    tileY = 7 - tileY;
+
+  u32 address;
+  u32 bank;
+  u32 palVersion;
+  if(colors256) {
+    address = charBase + (tile << 6) + (tileY << 3);
+    bank = 16;
+    palVersion = gfxPaletteVersionAll;
+  } else {
+    address = charBase + (tile << 5) + (tileY << 2);
+    bank = data >> 12;
+    palVersion = gfxPaletteVersion[bank];
+  }
+
+  // address | hflip | palette bank (16 = 256 colours) | priority | valid
+  u32 tag = address | ((data & 0x0400) << 7) | (bank << 18) |
+    (((prio >> 25) & 3) << 23) | 0x80000000;
+  GfxTileRow *entry = &gfxTileCache[((address >> 2) ^ ((tag >> 17) * 0x9E5)) &
+                                    (GFX_TILE_CACHE_SIZE - 1)];
+  u32 vramVersion = gfxVramVersion[address >> 5];
+
+  if(entry->tag == tag && entry->vramVersion == vramVersion &&
+     entry->palVersion == palVersion)
+    return entry->pixels;
+
+  u16 *palette = (u16 *)paletteRAM;
+  u8 *src = &vram[address];
+  u32 *dest = entry->pixels;
+  int step = 1;
+  if(data & 0x0400) {
+    dest += 7;
+    step = -1;
+  }
+
+  if(colors256) {
+    for(int i = 0; i < 8; i++) {
+      u8 color = src[i];
+      *dest = color ? (READ16LE(&palette[color]) | prio) : 0x80000000;
+      dest += step;
+    }
+  } else {
+    palette += bank << 4;
+    for(int i = 0; i < 4; i++) {
+      u8 color = src[i] & 0x0F;
+      *dest = color ? (READ16LE(&palette[color]) | prio) : 0x80000000;
+      dest += step;
+      color = src[i] >> 4;
+      *dest = color ? (READ16LE(&palette[color]) | prio) : 0x80000000;
+      dest += step;
+    }
+  }
+
+  entry->tag = tag;
+  entry->vramVersion = vramVersion;
+  entry->palVersion = palVersion;
+  return entry->pixels;
+}
+
 #ifndef TILED_RENDERING
 static inline void gfxDrawTextScreen(u16 control, u16 hofs, u16 vofs,
 				     u32 *line)
 {
-  u16 *palette = (u16 *)paletteRAM;
-  u8 *charBase = &vram[((control >> 2) & 0x03) * 0x4000];
+  u32 charBase = ((control >> 2) & 0x03) * 0x4000;
   u16 *screenBase = (u16 *)&vram[((control >> 8) & 0x1f) * 0x800];
   u32 prio = ((control & 3)<<25) + 0x1000000;
   int sizeX = 256;
@@ -131,6 +260,7 @@ static inline void gfxDrawTextScreen(u16 control, u16 hofs, u16 vofs,
   int maskY = sizeY-1;
 
   bool mosaicOn = (control & 0x40) ? true : false;
+  bool colors256 = (control & 0x80) ? true : false;
 
   int xxx = hofs & maskX;
   int yyy = (vofs + VCOUNT) & maskY;
@@ -152,81 +282,35 @@ static inline void gfxDrawTextScreen(u16 control, u16 hofs, u16 vofs,
   }
 
   int yshift = ((yyy>>3)<<5);
-  if((control) & 0x80) {
-    u16 *screenSource = screenBase + 0x400 * (xxx>>8) + ((xxx & 255)>>3) + yshift;
-    for(int x = 0; x < 240; x++) {
-      u16 data = READ16LE(screenSource);
-
-      int tile = data & 0x3FF;
-      int tileX = (xxx & 7);
-      int tileY = yyy & 7;
-
-      if(tileX == 7)
-        screenSource++;
-
-      if(data & 0x0400)
-        tileX = 7 - tileX;
-      if(data & 0x0800)
-        tileY = 7 - tileY;
-
-      u8 color = charBase[tile * 64 + tileY * 8 + tileX];
-
-      line[x] = color ? (READ16LE(&palette[color]) | prio): 0x80000000;
-
-      xxx++;
-      if(xxx == 256) {
-        if(sizeX > 256)
-          screenSource = screenBase + 0x400 + yshift;
-        else {
-          screenSource = screenBase + yshift;
-          xxx = 0;
-        }
-      } else if(xxx >= sizeX) {
-        xxx = 0;
+  int tileY = yyy & 7;
+  u16 *screenSource = screenBase + 0x400 * (xxx>>8) + ((xxx & 255)>>3) + yshift;
+
+  // whole tile rows are copied from the cache; the first and the last
+  // tile are clipped when the scroll is not a multiple of 8
+  int x = 0;
+  int skip = xxx & 7;
+  while(x < 240) {
+    const u32 *pixels = gfxReadTileRow(charBase, READ16LE(screenSource),
+                                       tileY, colors256, prio);
+    int count = 8 - skip;
+    if(count > 240 - x)
+      count = 240 - x;
+    memcpy(&line[x], pixels + skip, count * sizeof(u32));
+    x += count;
+    xxx += count;
+    skip = 0;
+
+    screenSource++;
+    if(xxx == 256) {
+      if(sizeX > 256)
+        screenSource = screenBase + 0x400 + yshift;
+      else {
         screenSource = screenBase + yshift;
-      }
-    }
-  } else {
-    u16 *screenSource = screenBase + 0x400*(xxx>>8)+((xxx&255)>>3) +
-      yshift;
-    for(int x = 0; x < 240; x++) {
-      u16 data = READ16LE(screenSource);
-
-      int tile = data & 0x3FF;
-      int tileX = (xxx & 7);
-      int tileY = yyy & 7;
-
-      if(tileX == 7)
-        screenSource++;
-
-      if(data & 0x0400)
-        tileX = 7 - tileX;
-      if(data & 0x0800)
-        tileY = 7 - tileY;
-
-      u8 color = charBase[(tile<<5) + (tileY<<2) + (tileX>>1)];
-
-      if(tileX & 1) {
-        color = (color >> 4);
-      } else {
-        color &= 0x0F;
-      }
-
-      int pal = (data>>8) & 0xF0;
-      line[x] = color ? (READ16LE(&palette[pal + color])|prio): 0x80000000;
-
-      xxx++;
-      if(xxx == 256) {
-        if(sizeX > 256)
-          screenSource = screenBase + 0x400 + yshift;
-        else {
-          screenSource = screenBase + yshift;
-          xxx = 0;
-        }
-      } else if(xxx >= sizeX) {
         xxx = 0;
-        screenSource = screenBase + yshift;
       }
+    } else if(xxx >= sizeX) {
+      xxx = 0;
+      screenSource = screenBase + yshift;
     }
   }
   if(mosaicOn) {
@@ -686,15 +770,21 @@ static inline void gfxDrawSprites(u32 *lineOBJ)
   int m=0;
   gfxClearArray(lineOBJ);
   if(layerEnable & 0x1000) {
-    u16 *sprites = (u16 *)oam;
     u16 *spritePalette = &((u16 *)paletteRAM)[256];
     int mosaicY = ((MOSAIC & 0xF000)>>12) + 1;
     int mosaicX = ((MOSAIC & 0xF00)>>8) + 1;
-    for(int x = 0; x < 128 ; x++) {
-      u16 a0 = READ16LE(sprites++);
-      u16 a1 = READ16LE(sprites++);
-      u16 a2 = READ16LE(sprites++);
-      sprites++;
+    if(gfxOBJDirty[0] | gfxOBJDirty[1] | gfxOBJDirty[2] | gfxOBJDirty[3])
+      gfxUpdateOBJLines();
+    // sprites that don't touch this line only use up their 2 cycles
+    int next = 0;
+    for(int x = gfxNextOBJ(VCOUNT, 0); x < 128 ; x = gfxNextOBJ(VCOUNT, x+1)) {
+      u16 *sprites = &((u16 *)oam)[x << 2];
+      u16 a0 = READ16LE(sprites);
+      u16 a1 = READ16LE(sprites + 1);
+      u16 a2 = READ16LE(sprites + 2);
+
+      lineOBJpix -= (x - next) << 1;
+      next = x + 1;
 
       lineOBJpixleft[x]=lineOBJpix;
 
@@ -1033,9 +1123,9 @@ static inline void gfxDrawSprites(u32 *lineOBJ)
               if(a1 & 0x1000)
                 xxx = sizeX - 1;
 
-                if(a0 & 0x1000) {
-                  t -= (t % mosaicY);
-                }
+              if(a0 & 0x1000) {
+                t -= (t % mosaicY);
+              }
 
               int address = 0x10000 + ((((c + (t>>3) * inc)<<5)
                 + ((t & 7)<<2) + ((xxx>>3)<<5) + ((xxx & 7) >> 1))&0x7FFF);
@@ -1144,14 +1234,15 @@ static inline void gfxDrawOBJWin(u32 *lineOBJWin)
 {
   gfxClearArray(lineOBJWin);
   if((layerEnable & 0x9000) == 0x9000) {
-    u16 *sprites = (u16 *)oam;
     // u16 *spritePalette = &((u16 *)paletteRAM)[256];
-    for(int x = 0; x < 128 ; x++) {
+    if(gfxOBJDirty[0] | gfxOBJDirty[1] | gfxOBJDirty[2] | gfxOBJDirty[3])
+      gfxUpdateOBJLines();
+    for(int x = gfxNextOBJ(VCOUNT, 0); x < 128 ; x = gfxNextOBJ(VCOUNT, x+1)) {
       int lineOBJpix = lineOBJpixleft[x];
-      u16 a0 = READ16LE(sprites++);
-      u16 a1 = READ16LE(sprites++);
-      u16 a2 = READ16LE(sprites++);
-      sprites++;
+      u16 *sprites = &((u16 *)oam)[x << 2];
+      u16 a0 = READ16LE(sprites);
+      u16 a1 = READ16LE(sprites + 1);
+      u16 a2 = READ16LE(sprites + 2);
 
       if (lineOBJpix<=0)
         continue;
@@ -0,0 +1,391 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "../System.h"
+#include "GBA.h"
+#include "Globals.h"
+#include "GBAinline.h"
+#include "GBAGfx.h"
+
+#ifdef GBA_THREADED_RENDER
+
+#ifdef TILED_RENDERING
+#error GBA_THREADED_RENDER does not support TILED_RENDERING
+#endif
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+// Scanline rendering on a second thread.
+//
+// Instead of drawing a line itself CPULoop calls gfxThreadPostLine(), which
+// fills the next job of a preallocated ring with the display registers and
+// the palette RAM, OAM and VRAM blocks written since the previous line. The
+// render thread runs its own copy of the renderers (namespace
+// gfxRenderThread below), built from the same sources but reading its own
+// registers and memory, which it brings up to date from each job. The core
+// keeps its state in plain globals and never shares them with the thread.
+// CPULoop waits for the thread with gfxThreadSync() at VBlank and before it
+// returns, so the picture is the same as with inline rendering.
+
+#define GFX_THREAD_REGS \
+  GFX_REG(DISPCNT) GFX_REG(VCOUNT) \
+  GFX_REG(BG0CNT) GFX_REG(BG1CNT) GFX_REG(BG2CNT) GFX_REG(BG3CNT) \
+  GFX_REG(BG0HOFS) GFX_REG(BG0VOFS) GFX_REG(BG1HOFS) GFX_REG(BG1VOFS) \
+  GFX_REG(BG2HOFS) GFX_REG(BG2VOFS) GFX_REG(BG3HOFS) GFX_REG(BG3VOFS) \
+  GFX_REG(BG2PA) GFX_REG(BG2PB) GFX_REG(BG2PC) GFX_REG(BG2PD) \
+  GFX_REG(BG2X_L) GFX_REG(BG2X_H) GFX_REG(BG2Y_L) GFX_REG(BG2Y_H) \
+  GFX_REG(BG3PA) GFX_REG(BG3PB) GFX_REG(BG3PC) GFX_REG(BG3PD) \
+  GFX_REG(BG3X_L) GFX_REG(BG3X_H) GFX_REG(BG3Y_L) GFX_REG(BG3Y_H) \
+  GFX_REG(WIN0H) GFX_REG(WIN1H) GFX_REG(WIN0V) GFX_REG(WIN1V) \
+  GFX_REG(WININ) GFX_REG(WINOUT) GFX_REG(MOSAIC) \
+  GFX_REG(BLDMOD) GFX_REG(COLEV) GFX_REG(COLY)
+
+enum {
+#define GFX_REG(r) GFX_THREAD_##r,
+  GFX_THREAD_REGS
+#undef GFX_REG
+  GFX_THREAD_REG_COUNT
+};
+
+struct GfxThreadLine {
+  void (*render)();
+  u16 regs[GFX_THREAD_REG_COUNT];
+  int layerEnable;
+  int bg2Changed;
+  int bg3Changed;
+  int clear;
+  // the blocks of this line in gfxThreadBlocks
+  u32 firstBlock;
+  u32 blockCount;
+};
+
+// A 32 byte block of palette RAM, OAM or VRAM at its gfxThreadDirty offset
+struct GfxThreadBlock {
+  u32 offset;
+  u8 data[32];
+};
+
+// more than the 160 lines that can be posted between two syncs
+#define GFX_THREAD_LINES 256
+// two lines that wrote every block fit
+#define GFX_THREAD_BLOCKS 8192
+#define GFX_DIRTY_BLOCKS (GFX_DIRTY_SIZE >> 5)
+
+u32 gfxThreadDirty[GFX_DIRTY_SIZE >> 10];
+int gfxThreadClear = 0;
+
+static GfxThreadLine gfxThreadLines[GFX_THREAD_LINES];
+static GfxThreadBlock gfxThreadBlocks[GFX_THREAD_BLOCKS];
+static std::thread *gfxThread = NULL;
+static std::mutex gfxThreadMutex;
+static std::condition_variable gfxThreadWake;
+static std::condition_variable gfxThreadIdle;
+static u32 gfxThreadPosted = 0;
+static u32 gfxThreadDone = 0;
+static u32 gfxThreadBlocksPosted = 0;
+static u32 gfxThreadBlocksDone = 0;
+static bool gfxThreadQuit = false;
+
+// Where a gfxThreadDirty offset is in the core's memory
+static inline u8 *gfxThreadSource(u32 offset)
+{
+  if(offset < GFX_DIRTY_OAM)
+    return &paletteRAM[offset - GFX_DIRTY_PALETTE];
+  if(offset < GFX_DIRTY_VRAM)
+    return &oam[offset - GFX_DIRTY_OAM];
+  return &vram[offset - GFX_DIRTY_VRAM];
+}
+
+// The renderers as run on the render thread. Inside this namespace the
+// registers, layerEnable, paletteRAM/oam/vram and all the renderer state
+// of GBAGfx.h name the copies defined here rather than the core's globals.
+namespace gfxRenderThread {
+
+#define GFX_REG(r) u16 r = 0;
+GFX_THREAD_REGS
+#undef GFX_REG
+int layerEnable = 0;
+
+static u8 gfxThreadPalette[0x400];
+static u8 gfxThreadOAM[0x400];
+static u8 gfxThreadVram[0x20000];
+u8 *paletteRAM = gfxThreadPalette;
+u8 *oam = gfxThreadOAM;
+u8 *vram = gfxThreadVram;
+
+void (*renderLine)() = NULL;
+
+#undef GFX_H
+#include "GBAGfx.h"
+#include "GBAGfx.cpp"
+#include "Mode0.cpp"
+#include "Mode1.cpp"
+#include "Mode2.cpp"
+#include "Mode3.cpp"
+#include "Mode4.cpp"
+#include "Mode5.cpp"
+
+// this copy is only ever brought up to date through the jobs
+void gfxThreadInvalidate()
+{
+}
+
+// Pairs each renderLine that CPUUpdateRender() picks with its copy here
+static void (* const gfxThreadRenderers[][2])() = {
+  { ::mode0RenderLine, mode0RenderLine },
+  { ::mode0RenderLineNoWindow, mode0RenderLineNoWindow },
+  { ::mode0RenderLineAll, mode0RenderLineAll },
+  { ::mode1RenderLine, mode1RenderLine },
+  { ::mode1RenderLineNoWindow, mode1RenderLineNoWindow },
+  { ::mode1RenderLineAll, mode1RenderLineAll },
+  { ::mode2RenderLine, mode2RenderLine },
+  { ::mode2RenderLineNoWindow, mode2RenderLineNoWindow },
+  { ::mode2RenderLineAll, mode2RenderLineAll },
+  { ::mode3RenderLine, mode3RenderLine },
+  { ::mode3RenderLineNoWindow, mode3RenderLineNoWindow },
+  { ::mode3RenderLineAll, mode3RenderLineAll },
+  { ::mode4RenderLine, mode4RenderLine },
+  { ::mode4RenderLineNoWindow, mode4RenderLineNoWindow },
+  { ::mode4RenderLineAll, mode4RenderLineAll },
+  { ::mode5RenderLine, mode5RenderLine },
+  { ::mode5RenderLineNoWindow, mode5RenderLineNoWindow },
+  { ::mode5RenderLineAll, mode5RenderLineAll },
+};
+
+// Takes over from the inline renderer, before the thread starts. The
+// caches start out empty; the first job carries all of palette RAM, OAM
+// and VRAM.
+static void gfxThreadLoadState()
+{
+#define GFX_REG(r) r = ::r;
+  GFX_THREAD_REGS
+#undef GFX_REG
+  layerEnable = ::layerEnable;
+  CPUUpdateWindow0();
+  CPUUpdateWindow1();
+
+  memcpy(line0, ::line0, sizeof(line0));
+  memcpy(line1, ::line1, sizeof(line1));
+  memcpy(line2, ::line2, sizeof(line2));
+  memcpy(line3, ::line3, sizeof(line3));
+  memcpy(lineOBJ, ::lineOBJ, sizeof(lineOBJ));
+  memcpy(lineOBJWin, ::lineOBJWin, sizeof(lineOBJWin));
+  memcpy(lineMix, ::lineMix, sizeof(lineMix));
+  memcpy(lineOBJpixleft, ::lineOBJpixleft, sizeof(lineOBJpixleft));
+  gfxBG2Changed = 0;
+  gfxBG3Changed = 0;
+  gfxBG2X = ::gfxBG2X;
+  gfxBG2Y = ::gfxBG2Y;
+  gfxBG3X = ::gfxBG3X;
+  gfxBG3Y = ::gfxBG3Y;
+  gfxLastVCOUNT = ::gfxLastVCOUNT;
+  gfxInvalidateCaches();
+}
+
+// Hands back to the inline renderer once the thread has stopped. The BG2/BG3
+// change flags kept accumulating in the core, so they are merged.
+static void gfxThreadSaveState()
+{
+  memcpy(::line0, line0, sizeof(line0));
+  memcpy(::line1, line1, sizeof(line1));
+  memcpy(::line2, line2, sizeof(line2));
+  memcpy(::line3, line3, sizeof(line3));
+  memcpy(::lineOBJ, lineOBJ, sizeof(lineOBJ));
+  memcpy(::lineOBJWin, lineOBJWin, sizeof(lineOBJWin));
+  memcpy(::lineMix, lineMix, sizeof(lineMix));
+  memcpy(::lineOBJpixleft, lineOBJpixleft, sizeof(lineOBJpixleft));
+  ::gfxBG2Changed |= gfxBG2Changed;
+  ::gfxBG3Changed |= gfxBG3Changed;
+  ::gfxBG2X = gfxBG2X;
+  ::gfxBG2Y = gfxBG2Y;
+  ::gfxBG3X = gfxBG3X;
+  ::gfxBG3Y = gfxBG3Y;
+  ::gfxLastVCOUNT = gfxLastVCOUNT;
+}
+
+static void gfxThreadDrawLine(const GfxThreadLine *line)
+{
+  for(u32 i = 0; i < line->blockCount; i++) {
+    const GfxThreadBlock *block =
+      &gfxThreadBlocks[(line->firstBlock + i) & (GFX_THREAD_BLOCKS - 1)];
+    u32 offset = block->offset;
+
+    // same bookkeeping as the gfx*Written hooks, minus the dirty bits
+    if(offset >= GFX_DIRTY_VRAM) {
+      offset -= GFX_DIRTY_VRAM;
+      memcpy(&vram[offset], block->data, 32);
+      gfxVramVersion[offset >> 5]++;
+    } else if(offset >= GFX_DIRTY_OAM) {
+      offset -= GFX_DIRTY_OAM;
+      memcpy(&oam[offset], block->data, 32);
+      gfxOBJDirty[offset >> 8] |= 0x0F << ((offset >> 3) & 31);
+    } else {
+      offset -= GFX_DIRTY_PALETTE;
+      memcpy(&paletteRAM[offset], block->data, 32);
+      if(offset < 0x200) {
+        gfxPaletteVersion[offset >> 5]++;
+        gfxPaletteVersionAll++;
+      }
+    }
+  }
+
+  u16 win0h = WIN0H;
+  u16 win1h = WIN1H;
+#define GFX_REG(r) r = line->regs[GFX_THREAD_##r];
+  GFX_THREAD_REGS
+#undef GFX_REG
+  if(WIN0H != win0h)
+    CPUUpdateWindow0();
+  if(WIN1H != win1h)
+    CPUUpdateWindow1();
+
+  layerEnable = line->layerEnable;
+  gfxBG2Changed |= line->bg2Changed;
+  gfxBG3Changed |= line->bg3Changed;
+
+  if(line->clear & 1)
+    gfxClearArray(line0);
+  if(line->clear & 2)
+    gfxClearArray(line1);
+  if(line->clear & 4)
+    gfxClearArray(line2);
+  if(line->clear & 8)
+    gfxClearArray(line3);
+
+  for(size_t i = 0; i < sizeof(gfxThreadRenderers) / sizeof(gfxThreadRenderers[0]); i++) {
+    if(gfxThreadRenderers[i][0] == line->render) {
+      renderLine = gfxThreadRenderers[i][1];
+      break;
+    }
+  }
+  CPUDrawLine();
+}
+
+} // namespace gfxRenderThread
+
+static void gfxThreadMain()
+{
+  std::unique_lock<std::mutex> lock(gfxThreadMutex);
+  for(;;) {
+    while(gfxThreadDone == gfxThreadPosted && !gfxThreadQuit)
+      gfxThreadWake.wait(lock);
+    if(gfxThreadDone == gfxThreadPosted)
+      break;
+
+    GfxThreadLine *line = &gfxThreadLines[gfxThreadDone & (GFX_THREAD_LINES - 1)];
+    lock.unlock();
+    gfxRenderThread::gfxThreadDrawLine(line);
+    lock.lock();
+
+    gfxThreadBlocksDone = line->firstBlock + line->blockCount;
+    gfxThreadDone++;
+    gfxThreadIdle.notify_all();
+  }
+}
+
+static void gfxThreadStart()
+{
+  gfxThreadInvalidate();
+  gfxThreadClear = 0;
+  gfxRenderThread::gfxThreadLoadState();
+
+  gfxThreadPosted = 0;
+  gfxThreadDone = 0;
+  gfxThreadBlocksPosted = 0;
+  gfxThreadBlocksDone = 0;
+  gfxThreadQuit = false;
+  gfxThread = new std::thread(gfxThreadMain);
+}
+
+void gfxThreadPostLine()
+{
+  if(gfxThread == NULL)
+    gfxThreadStart();
+
+  // a free job, and room for as many blocks as a line can write
+  std::unique_lock<std::mutex> lock(gfxThreadMutex);
+  while(gfxThreadPosted - gfxThreadDone >= GFX_THREAD_LINES ||
+        gfxThreadBlocksPosted - gfxThreadBlocksDone >
+        GFX_THREAD_BLOCKS - GFX_DIRTY_BLOCKS)
+    gfxThreadIdle.wait(lock);
+  lock.unlock();
+
+  GfxThreadLine *line = &gfxThreadLines[gfxThreadPosted & (GFX_THREAD_LINES - 1)];
+  line->render = renderLine;
+#define GFX_REG(r) line->regs[GFX_THREAD_##r] = r;
+  GFX_THREAD_REGS
+#undef GFX_REG
+  line->layerEnable = layerEnable;
+  line->bg2Changed = gfxBG2Changed;
+  line->bg3Changed = gfxBG3Changed;
+  gfxBG2Changed = 0;
+  gfxBG3Changed = 0;
+  line->clear = gfxThreadClear;
+  gfxThreadClear = 0;
+
+  u32 next = gfxThreadBlocksPosted;
+  for(int i = 0; i < (GFX_DIRTY_SIZE >> 10); i++) {
+    u32 dirty = gfxThreadDirty[i];
+    if(!dirty)
+      continue;
+    gfxThreadDirty[i] = 0;
+    while(dirty) {
+      int bit = gfxLowestBit(dirty);
+      dirty &= dirty - 1;
+      GfxThreadBlock *block = &gfxThreadBlocks[next++ & (GFX_THREAD_BLOCKS - 1)];
+      block->offset = (i << 10) + (bit << 5);
+      memcpy(block->data, gfxThreadSource(block->offset), 32);
+    }
+  }
+  line->firstBlock = gfxThreadBlocksPosted;
+  line->blockCount = next - gfxThreadBlocksPosted;
+
+  lock.lock();
+  gfxThreadBlocksPosted = next;
+  gfxThreadPosted++;
+  gfxThreadWake.notify_one();
+}
+
+// Waits for every posted line to be drawn. Once threadedRender has been
+// turned off the thread is shut down as well.
+void gfxThreadSync()
+{
+  if(gfxThread == NULL)
+    return;
+
+  if(!threadedRender) {
+    gfxThreadStop();
+    return;
+  }
+
+  std::unique_lock<std::mutex> lock(gfxThreadMutex);
+  while(gfxThreadDone != gfxThreadPosted)
+    gfxThreadIdle.wait(lock);
+}
+
+void gfxThreadStop()
+{
+  if(gfxThread == NULL)
+    return;
+
+  {
+    std::lock_guard<std::mutex> lock(gfxThreadMutex);
+    gfxThreadQuit = true;
+    gfxThreadWake.notify_one();
+  }
+  gfxThread->join();
+  delete gfxThread;
+  gfxThread = NULL;
+
+  // carry on inline where the render thread left off
+  gfxRenderThread::gfxThreadSaveState();
+}
+
+void gfxThreadInvalidate()
+{
+  memset(gfxThreadDirty, 0xFF, sizeof(gfxThreadDirty));
+}
+
+#endif // GBA_THREADED_RENDER
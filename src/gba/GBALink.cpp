@@ -41,6 +41,7 @@ bool gba_link_enabled = false;
 #include "GBA.h"
 #include "GBALink.h"
 #include "GBASockClient.h"
+#include <atomic>
 #ifdef ENABLE_NLS
 #include <libintl.h>
 #define _(x) gettext(x)
@@ -56,6 +57,11 @@ bool gba_link_enabled = false;
 #include <semaphore.h>
 #include <fcntl.h>
 #include <errno.h>
+#ifdef __linux__
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
 #define ReleaseSemaphore(sem, nrel, orel) do { \
 	for(int i = 0; i < nrel; i++) \
 		sem_post(sem); \
@@ -160,6 +166,13 @@ int WaitForSingleObject(sem_t *s, int t)
 #define UPDATE_REG(address, value) WRITE16LE(((u16 *)&ioMem[address]),value)
 
 int linktime = 0;
+int linkClock = 0;
+int linkEvent = 0;
+
+// how long to wait before looking again while waiting for the other side,
+// and for anything at all while idle (a scanline and a frame)
+#define LINK_POLL_TICKS 1232
+#define LINK_IDLE_TICKS 280896
 
 GBASockClient* dol = NULL;
 sf::IpAddress joybusHostAddr = sf::IpAddress::LocalHost;
@@ -191,7 +204,6 @@ LANLINKDATA lanlink;
 u16 linkdata[4];
 lserver ls;
 lclient lc;
-bool oncewait = false, after = false;
 
 // RFU crap (except for numtransfers note...should probably check that out)
 bool rfu_enabled = false;
@@ -229,6 +241,114 @@ int trtimeend[3][4] = {
 
 int gbtime = 1024;
 
+// the next local multiplayer transfer, and the GBAs in the current one
+static u32 linkseq = 0;
+static int linkgbas = 0;
+
+// linktime stops here between transfers on the local link, so it cannot
+// wrap around while idle
+#define LINK_TIME_MAX 0x40000000
+
+static void LinkSchedule(int ticks)
+{
+	if (ticks < 1)
+		ticks = 1;
+	if (ticks < linkEvent)
+		linkEvent = ticks;
+}
+
+void LinkProcessEvents()
+{
+	int ticks = linkClock;
+	linkClock = 0;
+	linkEvent = LINK_IDLE_TICKS;
+
+	if (gba_joybus_enabled)
+		JoyBusUpdate(ticks);
+	if (gba_link_enabled)
+		LinkUpdate(ticks);
+}
+
+// The local link rings
+//
+// Each GBA writes a record to its own ring in linkmem when it starts a
+// multiplayer transfer, and reads everyone else's at the end of it. Between
+// transfers the GBAs run on without looking at each other; the end of a
+// transfer is the only place they wait, on the futex of the ring they need.
+
+static u32 LinkLoad(volatile u32 *p)
+{
+	u32 v = *p;
+	std::atomic_thread_fence(std::memory_order_acquire);
+	return v;
+}
+
+static void LinkStore(volatile u32 *p, u32 v)
+{
+	std::atomic_thread_fence(std::memory_order_release);
+	*p = v;
+}
+
+// Waits for up to ms milliseconds while *word is value
+static void LinkFutexWait(volatile u32 *word, u32 value, int ms)
+{
+#ifdef __linux__
+	struct timespec ts;
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000;
+	syscall(SYS_futex, word, FUTEX_WAIT, value, &ts, NULL, 0);
+#elif (defined __WIN32__ || defined _WIN32)
+	Sleep(0);
+#else
+	usleep(50);
+#endif
+}
+
+static void LinkFutexWake(volatile u32 *word)
+{
+#ifdef __linux__
+	syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+static void LinkRingWrite(u32 seq, u16 data, s32 time, int speed, int gbas)
+{
+	LINKRING *ring = &linkmem->linkring[linkid];
+	LINKRECORD *rec = &ring->rec[seq % LINK_RING_SIZE];
+	rec->seq = seq;
+	rec->time = time;
+	rec->data = data;
+	rec->speed = speed;
+	rec->gbas = gbas;
+	LinkStore(&ring->head, seq + 1);
+	LinkFutexWake(&ring->head);
+}
+
+// Fetches what GBA g sent in transfer seq. False if it was not part of it,
+// or did not get there before linktimeout ms had passed on clock.
+static bool LinkRingRead(int g, u32 seq, u16 &data, sf::Clock &clock)
+{
+	LINKRING *ring = &linkmem->linkring[g];
+
+	for (int spin = 0; ; spin++) {
+		u32 head = LinkLoad(&ring->head);
+		if ((s32)(head - seq) > 0) {
+			LINKRECORD *rec = &ring->rec[seq % LINK_RING_SIZE];
+			if (rec->seq != seq)
+				return false;
+			data = rec->data;
+			return true;
+		}
+
+		int left = linktimeout - clock.getElapsedTime().asMilliseconds();
+		if (left <= 0)
+			return false;
+		// the others are usually only a little behind
+		if (spin >= 64)
+			LinkFutexWait(&ring->head, head, left);
+	}
+}
+
 int GetSIOMode(u16, u16);
 
 void LinkClientThread(void *);
@@ -243,6 +363,11 @@ void StartLink(u16 value)
 	if (ioMem == NULL)
 		return;
 
+	// bring linktime up to date, and have the new state looked at on the
+	// next event
+	LinkProcessEvents();
+	linkEvent = 1;
+
 	if (rfu_enabled) {
 		UPDATE_REG(COMM_SIOCNT, StartRFU(value));
 		return;
@@ -275,9 +400,6 @@ void StartLink(u16 value)
 					UPDATE_REG(COMM_SIOMULTI0, linkdata[0]);
 					UPDATE_REG(COMM_SIOMULTI1, 0xffff);
 					WRITE32LE(&ioMem[COMM_SIOMULTI2], 0xffffffff);
-					if (lanlink.speed&&oncewait == false)
-						ls.howmanytimes++;
-					after = false;
 					value &= ~0x40;
 				} else
 					value |= 0x40; // comm error
@@ -295,33 +417,16 @@ void StartLink(u16 value)
 					m = (1 << n) - 1;
 				} while((f & m) != m);
 				linkmem->trgbas = n;
-
-				// before starting xfer, make pathetic attempt
-				// at clearing out any previous stuck xfer
-				// this will fail if a slave was stuck for
-				// too long
-				for(int i = 0; i < 4; i++)
-					while(WaitForSingleObject(linksync[i], 0) != WAIT_TIMEOUT);
-
-				// transmit first value
-				linkmem->linkcmd = ('M' << 8) + (value & 3);
-				linkmem->linkdata[0] = READ16LE(&ioMem[COMM_SIODATA8]);
+				linkgbas = n;
 
 				// start up slaves & sync clocks
-				numtransfers = linkmem->numtransfers;
-				if (numtransfers != 0)
-					linkmem->lastlinktime = linktime;
-				else
-					linkmem->lastlinktime = 0;
-
-				if ((++numtransfers) == 0)
-					linkmem->numtransfers = 2;
-				else
-					linkmem->numtransfers = numtransfers;
+				tspeed = value & 3;
+				linkdata[0] = READ16LE(&ioMem[COMM_SIODATA8]);
+				LinkRingWrite(linkseq, linkdata[0], linkseq ? linktime : 0,
+					      tspeed, n);
 
 				transfer = 1;
 				linktime = 0;
-				tspeed = value & 3;
 				WRITE32LE(&ioMem[COMM_SIOMULTI0], 0xffffffff);
 				WRITE32LE(&ioMem[COMM_SIOMULTI2], 0xffffffff);
 				value &= ~0x40;
@@ -353,6 +458,9 @@ void StartLink(u16 value)
 
 void StartGPLink(u16 value)
 {
+	LinkProcessEvents();
+	linkEvent = 1;
+
 	UPDATE_REG(COMM_RCNT, value);
 
 	if (!value)
@@ -397,6 +505,7 @@ void JoyBusUpdate(int ticks)
 	if (linktime > lastjoybusupdate + 0x3000)
 	{
 		lastjoybusupdate = linktime;
+		LinkSchedule(0x3001);
 
 		char data[5] = {0x10, 0, 0, 0, 0}; // init with invalid cmd
 		std::vector<char> resp;
@@ -445,15 +554,60 @@ void JoyBusUpdate(int ticks)
 			UPDATE_REG(0x202, IF);
 		}
 	}
+	else
+		LinkSchedule(lastjoybusupdate + 0x3001 - linktime);
 }
 
 static void ReInitLink();
+static void LinkStopThread();
 
-void LinkUpdate(int ticks)
+// A slave starts the transfer the master has started once it has caught up
+// with the time the master started it at
+static void LinkJoinTransfer()
 {
-	// this actually gets called every single instruction, so keep default
-	// path as short as possible
+	LINKRING *ring = &linkmem->linkring[0];
+	u32 head = LinkLoad(&ring->head);
+	if ((s32)(head - linkseq) <= 0)
+		return;
 
+	LINKRECORD rec = ring->rec[linkseq % LINK_RING_SIZE];
+	if (rec.seq != linkseq) {
+		// too far behind; go for the latest one
+		linkseq = head - 1;
+		return;
+	}
+	if (linktime < rec.time)
+		return;
+
+	// if this or any previous machine was dropped, no transfer
+	// can take place
+	if (rec.gbas <= linkid) {
+		linkseq++;
+		// if this is the one that was dropped, reconnect
+		if(!(linkmem->linkflags & (1 << linkid)))
+			ReInitLink();
+		return;
+	}
+
+	tspeed = rec.speed;
+	linkgbas = rec.gbas;
+	linkdata[linkid] = READ16LE(&ioMem[COMM_SIODATA8]);
+	LinkRingWrite(linkseq, linkdata[linkid], 0, tspeed, linkgbas);
+
+	// sync clock
+	if (rec.time == 0)
+		linktime = 0;
+	else
+		linktime -= rec.time;
+
+	transfer = 1;
+	WRITE32LE(&ioMem[COMM_SIOMULTI0], 0xffffffff);
+	WRITE32LE(&ioMem[COMM_SIOMULTI2], 0xffffffff);
+	UPDATE_REG(COMM_SIOCNT, READ16LE(&ioMem[COMM_SIOCNT]) & ~0x40 | 0x80);
+}
+
+static void LinkUpdateTransfer(int ticks)
+{
 	linktime += ticks;
 
 	if (rfu_enabled)
@@ -476,32 +630,37 @@ void LinkUpdate(int ticks)
 	{
 		if (lanlink.connected)
 		{
-			if (after)
+			if (linkid)
 			{
-				if (linkid && linktime > 6044) {
+				// the master's next transfer, if it has started one
+				if (!transfer)
 					lc.Recv();
-					oncewait = true;
-				}
-				else
-					return;
-			}
 
-			if (linkid && !transfer && lc.numtransfers > 0 && linktime >= savedlinktime)
-			{
-				linkdata[linkid] = READ16LE(&ioMem[COMM_SIODATA8]);
+				if (!transfer && lc.ready && linktime >= savedlinktime)
+				{
+					linkdata[linkid] = READ16LE(&ioMem[COMM_SIODATA8]);
 
-				lc.Send();
+					lc.Send();
+					lc.ready = false;
 
-				UPDATE_REG(COMM_SIODATA32_L, linkdata[0]);
-				UPDATE_REG(COMM_SIOCNT, READ16LE(&ioMem[COMM_SIOCNT]) | 0x80);
-				transfer = 1;
-				if (lc.numtransfers==1)
-					linktime = 0;
-				else
-					linktime -= savedlinktime;
+					UPDATE_REG(COMM_SIODATA32_L, linkdata[0]);
+					UPDATE_REG(COMM_SIOCNT, READ16LE(&ioMem[COMM_SIOCNT]) | 0x80);
+					transfer = 1;
+					if (lc.numtransfers==1)
+						linktime = 0;
+					else
+						linktime -= savedlinktime;
+				}
 			}
-
-			if (transfer && linktime >= trtimeend[lanlink.numslaves-1][tspeed])
+			else
+				ls.Recv();
+
+			// without the speed hack the master holds the end of the
+			// transfer until all the slaves' data is in, or they time out
+			if (transfer && linktime >= trtimeend[lanlink.numslaves-1][tspeed] &&
+			    (linkid || lanlink.speed ||
+			     ls.replies == (2 << lanlink.numslaves) - 2 ||
+			     ls.sent.getElapsedTime() >= sf::milliseconds(linktimeout)))
 			{
 				if (READ16LE(&ioMem[COMM_SIOCNT]) & 0x4000)
 				{
@@ -512,131 +671,30 @@ void LinkUpdate(int ticks)
 				UPDATE_REG(COMM_SIOCNT, (READ16LE(&ioMem[COMM_SIOCNT]) & 0xff0f) | (linkid << 4));
 				transfer = 0;
 				linktime -= trtimeend[lanlink.numslaves-1][tspeed];
-				oncewait = false;
-
-				if (!lanlink.speed)
-				{
-					if (linkid)
-						lc.Recv();
-					else
-						ls.Recv(); // WTF is the point of this?
 
-					UPDATE_REG(COMM_SIOMULTI1, linkdata[1]);
-					UPDATE_REG(COMM_SIOMULTI2, linkdata[2]);
-					UPDATE_REG(COMM_SIOMULTI3, linkdata[3]);
-					oncewait = true;
-
-				} else {
-
-					after = true;
-					if (lanlink.numslaves == 1)
-					{
-						UPDATE_REG(COMM_SIOMULTI1, linkdata[1]);
-						UPDATE_REG(COMM_SIOMULTI2, linkdata[2]);
-						UPDATE_REG(COMM_SIOMULTI3, linkdata[3]);
-					}
-				}
+				UPDATE_REG(COMM_SIOMULTI1, linkdata[1]);
+				UPDATE_REG(COMM_SIOMULTI2, linkdata[2]);
+				UPDATE_REG(COMM_SIOMULTI3, linkdata[3]);
 			}
 		}
 		return;
 	}
 
-	// slave startup depends on detecting change in numtransfers
-	// and syncing clock with master (after first transfer)
-	// this will fail if > ~2 minutes have passed since last transfer due
-	// to integer overflow
-	if(!transfer && numtransfers && linktime < 0) {
-		linktime = 0;
-		// there is a very, very, small chance that this will abort
-		// a transfer that was just started
-		linkmem->numtransfers = numtransfers = 0;
-	}
-	if (linkid && !transfer && linktime >= linkmem->lastlinktime &&
-	    linkmem->numtransfers != numtransfers)
-	{
-		numtransfers = linkmem->numtransfers;
-		if(!numtransfers)
-			return;
-
-		// if this or any previous machine was dropped, no transfer
-		// can take place
-		if(linkmem->trgbas <= linkid) {
-			transfer = 0;
-			numtransfers = 0;
-			// if this is the one that was dropped, reconnect
-			if(!(linkmem->linkflags & (1 << linkid)))
-				ReInitLink();
-			return;
-		}
-
-		// sync clock
-		if (numtransfers == 1)
-			linktime = 0;
-		else
-			linktime -= linkmem->lastlinktime;
-
-		// there's really no point to this switch; 'M' is the only
-		// possible command.
-#if 0
-		switch ((linkmem->linkcmd) >> 8)
-		{
-		case 'M':
-#endif
-			tspeed = linkmem->linkcmd & 3;
-			transfer = 1;
-			WRITE32LE(&ioMem[COMM_SIOMULTI0], 0xffffffff);
-			WRITE32LE(&ioMem[COMM_SIOMULTI2], 0xffffffff);
-			UPDATE_REG(COMM_SIOCNT, READ16LE(&ioMem[COMM_SIOCNT]) & ~0x40 | 0x80);
-#if 0
-			break;
-		}
-#endif
-	}
-
 	if (!transfer)
+	{
+		if (linktime > LINK_TIME_MAX)
+			linktime = LINK_TIME_MAX;
+		if (linkid)
+			LinkJoinTransfer();
 		return;
+	}
 
-	if (transfer <= linkmem->trgbas && linktime >= trtimedata[transfer-1][tspeed])
+	if (transfer <= linkgbas && linktime >= trtimedata[transfer-1][tspeed])
 	{
-		// transfer #n -> wait for value n - 1
-		if(transfer > 1 && linkid != transfer - 1) {
-			if(WaitForSingleObject(linksync[transfer - 1], linktimeout) == WAIT_TIMEOUT) {
-				// assume slave has dropped off if timed out
-				if(!linkid) {
-					linkmem->trgbas = transfer - 1;
-					int f = linkmem->linkflags;
-					f &= ~(1 << (transfer - 1));
-					linkmem->linkflags = f;
-					if(f < (1 << transfer) - 1)
-						linkmem->numgbas = transfer - 1;
-					char message[30];
-					sprintf(message, _("Player %d disconnected."), transfer - 1);
-					systemScreenMessage(message);
-				}
-				transfer = linkmem->trgbas + 1;
-				// next cycle, transfer will finish up
-				return;
-			}
-		}
-		// now that value is available, store it
-		UPDATE_REG((COMM_SIOMULTI0 - 2) + (transfer<<1), linkmem->linkdata[transfer-1]);
-
-		// transfer machine's value at start of its transfer cycle
 		if(linkid == transfer) {
-			// skip if dropped
-			if(linkmem->trgbas <= linkid) {
-				transfer = 0;
-				numtransfers = 0;
-				// if this is the one that was dropped, reconnect
-				if(!(linkmem->linkflags & (1 << linkid)))
-					ReInitLink();
-				return;
-			}
 			// SI becomes low
 			UPDATE_REG(COMM_SIOCNT, READ16LE(&ioMem[COMM_SIOCNT]) & ~4);
 			UPDATE_REG(COMM_RCNT, 10);
-			linkmem->linkdata[linkid] = READ16LE(&ioMem[COMM_SIODATA8]);
-			ReleaseSemaphore(linksync[linkid], linkmem->numgbas-1, NULL);
 		}
 		if(linkid == transfer - 1) {
 			// SO becomes low to begin next trasnfer
@@ -648,23 +706,30 @@ void LinkUpdate(int ticks)
 		transfer++;
 	}
 
-	if (transfer > linkmem->trgbas && linktime >= trtimeend[transfer-3][tspeed])
+	if (transfer > linkgbas && linktime >= trtimeend[transfer-3][tspeed])
 	{
-		// wait for slaves to finish
-		// this keeps unfinished slaves from screwing up last xfer
-		// not strictly necessary; may just slow things down
-		if(!linkid) {
-			for(int i = 2; i < transfer; i++)
-				if(WaitForSingleObject(linksync[0], linktimeout) == WAIT_TIMEOUT) {
-					// impossible to determine which slave died
-					// so leave them alone for now
-					systemScreenMessage(_("Unknown slave timed out; resetting comm"));
-					linkmem->numtransfers = numtransfers = 0;
-					break;
+		// everyone's values, waiting for the GBAs that are behind
+		sf::Clock clock;
+		for(int g = 0; g < linkgbas; g++) {
+			u16 data = linkdata[linkid];
+			if(g != linkid && !LinkRingRead(g, linkseq, data, clock)) {
+				data = 0xffff;
+				// assume slave has dropped off if timed out
+				if(!linkid) {
+					int f = linkmem->linkflags;
+					f &= ~(1 << g);
+					linkmem->linkflags = f;
+					if(f < (1 << linkgbas) - 1)
+						linkmem->numgbas = g;
+					char message[30];
+					sprintf(message, _("Player %d disconnected."), g);
+					systemScreenMessage(message);
 				}
-		} else if(linkmem->trgbas > linkid)
-			// signal master that this slave is finished
-			ReleaseSemaphore(linksync[0], 1, NULL);
+			}
+			UPDATE_REG(COMM_SIOMULTI0 + (g<<1), data);
+		}
+		linkseq++;
+
 		linktime -= trtimeend[transfer - 3][tspeed];
 		transfer = 0;
 		u16 value = READ16LE(&ioMem[COMM_SIOCNT]);
@@ -683,6 +748,44 @@ void LinkUpdate(int ticks)
 	return;
 }
 
+// Ticks until LinkUpdateTransfer() has something to do again
+static int LinkNextEvent()
+{
+	int left;
+
+	if (rfu_enabled)
+		return transfer ? rfu_transfer_end : LINK_IDLE_TICKS;
+
+	if (lanlink.active)
+	{
+		if (!lanlink.connected)
+			return LINK_IDLE_TICKS;
+		if (transfer)
+		{
+			left = trtimeend[lanlink.numslaves-1][tspeed] - linktime;
+			return left > 0 ? left : LINK_POLL_TICKS;
+		}
+		if (linkid && lc.ready)
+			return savedlinktime - linktime;
+		return linkid ? LINK_POLL_TICKS : LINK_IDLE_TICKS;
+	}
+
+	// slaves find out about new transfers by looking at linkmem
+	if (!transfer)
+		return linkid ? LINK_POLL_TICKS : LINK_IDLE_TICKS;
+	if (transfer <= linkgbas)
+		left = trtimedata[transfer-1][tspeed] - linktime;
+	else
+		left = trtimeend[transfer-3][tspeed] - linktime;
+	return left;
+}
+
+void LinkUpdate(int ticks)
+{
+	LinkUpdateTransfer(ticks);
+	LinkSchedule(LinkNextEvent());
+}
+
 inline int GetSIOMode(u16 siocnt, u16 rcnt)
 {
 	if (!(rcnt & 0x8000))
@@ -970,6 +1073,8 @@ u16 StartRFU(u16 value)
 bool InitLink()
 {
 	linkid = 0;
+	linkClock = 0;
+	linkEvent = 0;
 
 #if (defined __WIN32__ || defined _WIN32)
 	if((mmf=CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(LINKDATA), LOCAL_LINK_NAME))==NULL){
@@ -1015,6 +1120,8 @@ bool InitLink()
 		linkmem->numtransfers=0;
 		for(i=0;i<4;i++)
 			linkmem->linkdata[i] = 0xffff;
+		memset(linkmem->linkring, 0, sizeof(linkmem->linkring));
+		linkseq = 0;
 	} else {
 		// FIXME: this should be done while linkmem is locked
 		// (no xfer in progress, no other vba trying to connect)
@@ -1041,6 +1148,8 @@ bool InitLink()
 		if(vbaid == n)
 			linkmem->numgbas = n + 1;
 		linkmem->linkflags = f | (1 << vbaid);
+		// join at the master's next transfer
+		linkseq = LinkLoad(&linkmem->linkring[0].head);
 	}
 	linkid = vbaid;
 
@@ -1095,11 +1204,13 @@ static void ReInitLink()
 	linkmem->linkflags |= 1 << linkid;
 	if(n < linkid + 1)
 		linkmem->numgbas = linkid + 1;
-	numtransfers = linkmem->numtransfers;
+	linkseq = LinkLoad(&linkmem->linkring[0].head);
 	systemScreenMessage(_("Lost link; reconnected"));
 }
 
 void CloseLink(void){
+	LinkStopThread();
+
 	if(lanlink.connected){
 		if(linkid){
 			char outbuffer[4];
@@ -1175,13 +1286,173 @@ void CleanLocalLink()
 #endif
 }
 
+// Socket thread
+//
+// Once everyone has joined, the connection threads stay on to do all the
+// socket I/O: they send what the emulation queued in linkOut, and queue the
+// messages that come in in linkIn, so LinkUpdate() never waits for the
+// network. Each queue has a single producer and a single consumer.
+
+// data[0] is the size, as on the wire
+struct LinkMessage {
+	int socket;
+	char data[16];
+};
+
+#define LINK_QUEUE_SIZE 64
+
+class LinkQueue {
+	LinkMessage slots[LINK_QUEUE_SIZE];
+	std::atomic<unsigned> head, tail;
+public:
+	LinkQueue() : head(0), tail(0) {}
+
+	// only while the socket thread is not running
+	void Clear()
+	{
+		head = 0;
+		tail = 0;
+	}
+
+	bool Push(const LinkMessage &m)
+	{
+		unsigned t = tail.load(std::memory_order_relaxed);
+		if (t - head.load(std::memory_order_acquire) == LINK_QUEUE_SIZE)
+			return false;
+		slots[t % LINK_QUEUE_SIZE] = m;
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool Pop(LinkMessage &m)
+	{
+		unsigned h = head.load(std::memory_order_relaxed);
+		if (h == tail.load(std::memory_order_acquire))
+			return false;
+		m = slots[h % LINK_QUEUE_SIZE];
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+};
+
+static LinkQueue linkIn, linkOut;
+
+// A datagram to linkWake wakes the socket thread up for new messages in
+// linkOut. Only the socket thread uses linkWake, only the emulation
+// linkWakeSend.
+static sf::UdpSocket linkWake, linkWakeSend;
+static unsigned short linkWakePort = 0;
+
+static void LinkBindWake()
+{
+	linkWake.unbind();
+	linkWake.bind(sf::Socket::AnyPort);
+	linkWake.setBlocking(false);
+	linkWakePort = linkWake.getLocalPort();
+}
+
+static void LinkSendMessage(int socket, const char *data)
+{
+	LinkMessage m;
+	m.socket = socket;
+	memcpy(m.data, data, data[0]);
+	if (linkOut.Push(m)) {
+		char wake = 0;
+		linkWakeSend.send(&wake, 1, sf::IpAddress::LocalHost, linkWakePort);
+	}
+}
+
+// Passes a lost connection on as if the other side had said goodbye
+static void LinkSocketClosed(sf::SocketSelector &fdset, sf::TcpSocket **sockets, int socket)
+{
+	LinkMessage m;
+	m.socket = socket;
+	m.data[0] = 4;
+	m.data[1] = -32;
+	linkIn.Push(m);
+	fdset.remove(*sockets[socket]);
+	sockets[socket] = NULL;
+}
+
+static void LinkSocketLoop(sf::TcpSocket **sockets, int count)
+{
+	sf::SocketSelector fdset;
+	char inbuffer[4][32];
+	size_t used[4] = { 0, 0, 0, 0 };
+	LinkMessage m;
+
+	fdset.add(linkWake);
+	for (int s = 0; s < count; s++)
+		if (sockets[s])
+			fdset.add(*sockets[s]);
+
+	while (!lanlink.terminate) {
+		while (linkOut.Pop(m))
+			if (sockets[m.socket])
+				sockets[m.socket]->send(m.data, m.data[0]);
+
+		if (!fdset.wait(sf::seconds(0.1)))
+			continue;
+
+		if (fdset.isReady(linkWake)) {
+			char wake[16];
+			size_t nr;
+			sf::IpAddress addr;
+			unsigned short port;
+			while (linkWake.receive(wake, sizeof(wake), nr, addr, port) == sf::Socket::Done)
+				;
+		}
+
+		for (int s = 0; s < count; s++) {
+			if (!sockets[s] || !fdset.isReady(*sockets[s]))
+				continue;
+
+			size_t nr = 0;
+			sf::Socket::Status st = sockets[s]->receive(inbuffer[s] + used[s], sizeof(inbuffer[s]) - used[s], nr);
+			if (st == sf::Socket::Disconnected || st == sf::Socket::Error) {
+				LinkSocketClosed(fdset, sockets, s);
+				continue;
+			}
+			used[s] += nr;
+
+			// messages start with their size
+			while (used[s]) {
+				int size = inbuffer[s][0];
+				if (size < 2 || size > (int)sizeof(m.data)) {
+					LinkSocketClosed(fdset, sockets, s);
+					break;
+				}
+				if (used[s] < (size_t)size)
+					break;
+				m.socket = s;
+				memcpy(m.data, inbuffer[s], size);
+				linkIn.Push(m);
+				used[s] -= size;
+				memmove(inbuffer[s], inbuffer[s] + size, used[s]);
+			}
+		}
+	}
+}
+
+static void LinkStopThread()
+{
+	if (lanlink.thread == NULL)
+		return;
+
+	lanlink.terminate = true;
+	lanlink.thread->wait();
+	delete lanlink.thread;
+	lanlink.thread = NULL;
+
+	linkIn.Clear();
+	linkOut.Clear();
+}
+
 // Server
 lserver::lserver(void){
-	intinbuffer = (s32*)inbuffer;
-	u16inbuffer = (u16*)inbuffer;
 	intoutbuffer = (s32*)outbuffer;
 	u16outbuffer = (u16*)outbuffer;
-	oncewait = false;
+	replies = 0;
 }
 
 bool lserver::Init(ServerInfoDisplay *sid){
@@ -1191,11 +1462,7 @@ bool lserver::Init(ServerInfoDisplay *sid){
 		// Note: old code closed socket & retried once on bind failure
 		return false; // FIXME: error code?
 
-	if(lanlink.thread!=NULL){
-		lanlink.terminate = true;
-		WaitForSingleObject(linksync[vbaid], 500);
-		lanlink.thread = NULL;
-	}
+	LinkStopThread();
 	lanlink.terminate = false;
 	linkid = 0;
 
@@ -1245,6 +1512,7 @@ void LinkServerThread(void *_sid){
 		sid->Ping();
 	}
 
+	LinkBindWake();
 	lanlink.connected = true;
 
 	sid->Connected();
@@ -1254,106 +1522,79 @@ void LinkServerThread(void *_sid){
 		ls.tcpsocket[i].send(outbuffer, 4);
 	}
 
+	delete sid;
+
+	{
+		sf::TcpSocket *sockets[4] = { NULL, &ls.tcpsocket[1], &ls.tcpsocket[2], &ls.tcpsocket[3] };
+		LinkSocketLoop(sockets, lanlink.numslaves + 1);
+	}
+	return;
+
 CloseInfoDisplay:
 	delete sid;
 	return;
 }
 
 void lserver::Send(void){
+	replies = 0;
+	sent.restart();
+
 	if(lanlink.type==0){	// TCP
-		if(savedlinktime==-1){
-			outbuffer[0] = 4;
-			outbuffer[1] = -32;	//0xe0
-			for(i=1;i<=lanlink.numslaves;i++){
-				tcpsocket[i].send(outbuffer, 4);
-				size_t nr;
-				tcpsocket[i].receive(inbuffer, 4, nr);
-			}
-		}
 		outbuffer[1] = tspeed;
 		WRITE16LE(&u16outbuffer[1], linkdata[0]);
 		WRITE32LE(&intoutbuffer[1], savedlinktime);
 		if(lanlink.numslaves==1){
-			if(lanlink.type==0){
-				outbuffer[0] = 8;
-				tcpsocket[1].send(outbuffer, 8);
-			}
+			outbuffer[0] = 8;
+			LinkSendMessage(1, outbuffer);
 		}
 		else if(lanlink.numslaves==2){
 			WRITE16LE(&u16outbuffer[4], linkdata[2]);
-			if(lanlink.type==0){
-				outbuffer[0] = 10;
-				tcpsocket[1].send(outbuffer, 10);
-				WRITE16LE(&u16outbuffer[4], linkdata[1]);
-				tcpsocket[2].send(outbuffer, 10);
-			}
+			outbuffer[0] = 10;
+			LinkSendMessage(1, outbuffer);
+			WRITE16LE(&u16outbuffer[4], linkdata[1]);
+			LinkSendMessage(2, outbuffer);
 		} else {
-			if(lanlink.type==0){
-				outbuffer[0] = 12;
-				WRITE16LE(&u16outbuffer[4], linkdata[2]);
-				WRITE16LE(&u16outbuffer[5], linkdata[3]);
-				tcpsocket[1].send(outbuffer, 12);
-				WRITE16LE(&u16outbuffer[4], linkdata[1]);
-				tcpsocket[2].send(outbuffer, 12);
-				WRITE16LE(&u16outbuffer[5], linkdata[2]);
-				tcpsocket[3].send(outbuffer, 12);
-			}
+			outbuffer[0] = 12;
+			WRITE16LE(&u16outbuffer[4], linkdata[2]);
+			WRITE16LE(&u16outbuffer[5], linkdata[3]);
+			LinkSendMessage(1, outbuffer);
+			WRITE16LE(&u16outbuffer[4], linkdata[1]);
+			LinkSendMessage(2, outbuffer);
+			WRITE16LE(&u16outbuffer[5], linkdata[2]);
+			LinkSendMessage(3, outbuffer);
 		}
 	}
 	return;
 }
 
+// Takes whatever the slaves have sent, without waiting for anything
 void lserver::Recv(void){
-	int numbytes;
-	if(lanlink.type==0){	// TCP
-		fdset.clear();
-		for(i=0;i<lanlink.numslaves;i++) fdset.add(tcpsocket[i+1]);
-		// was linktimeout/1000 (i.e., drop ms part), but that's wrong
-		if (fdset.wait(sf::seconds((float)(linktimeout / 1000.))) == 0)
-		{
+	LinkMessage m;
+	while(linkIn.Pop(m)){
+		if(m.data[1]==-32){
+			char message[30];
+			lanlink.connected = false;
+			sprintf(message, _("Player %d disconnected."), m.socket+1);
+			systemScreenMessage(message);
+			outbuffer[0] = 4;
+			outbuffer[1] = -32;
+			for(int s=1;s<=lanlink.numslaves;s++)
+				if(s!=m.socket)
+					LinkSendMessage(s, outbuffer);
 			return;
 		}
-		howmanytimes++;
-		for(i=0;i<lanlink.numslaves;i++){
-			numbytes = 0;
-			inbuffer[0] = 1;
-			while(numbytes<howmanytimes*inbuffer[0]) {
-				size_t nr;
-				tcpsocket[i+1].receive(inbuffer+numbytes, howmanytimes*inbuffer[0]-numbytes, nr);
-				numbytes += nr;
-			}
-			if(howmanytimes>1) memmove(inbuffer, inbuffer+inbuffer[0]*(howmanytimes-1), inbuffer[0]);
-			if(inbuffer[1]==-32){
-				char message[30];
-				lanlink.connected = false;
-				sprintf(message, _("Player %d disconnected."), i+2);
-				systemScreenMessage(message);
-				outbuffer[0] = 4;
-				outbuffer[1] = -32;
-				for(i=1;i<lanlink.numslaves;i++){
-					tcpsocket[i].send(outbuffer, 12);
-					size_t nr;
-					tcpsocket[i].receive(inbuffer, 256, nr);
-					tcpsocket[i].disconnect();
-				}
-				return;
-			}
-			linkdata[i+1] = READ16LE(&u16inbuffer[1]);
-		}
-		howmanytimes = 0;
+		linkdata[m.socket] = READ16LE(&m.data[2]);
+		replies |= 1 << m.socket;
 	}
-	after = false;
 	return;
 }
 
 
 // Client
 lclient::lclient(void){
-	intinbuffer = (s32*)inbuffer;
-	u16inbuffer = (u16*)inbuffer;
-	intoutbuffer = (s32*)outbuffer;
 	u16outbuffer = (u16*)outbuffer;
 	numtransfers = 0;
+	ready = false;
 	return;
 }
 
@@ -1362,11 +1603,9 @@ bool lclient::Init(sf::IpAddress addr, ClientInfoDisplay *cid){
 	serverport = IP_LINK_PORT;
 	lanlink.tcpsocket.setBlocking(false);
 
-	if(lanlink.thread!=NULL){
-		lanlink.terminate = true;
-		WaitForSingleObject(linksync[vbaid], 500);
-		lanlink.thread = NULL;
-	}
+	LinkStopThread();
+	numtransfers = 0;
+	ready = false;
 
 	cid->ConnectStart(addr);
 	lanlink.terminate = false;
@@ -1434,88 +1673,62 @@ void LinkClientThread(void *_cid){
 		}
 	}
 
+	LinkBindWake();
 	lanlink.connected = true;
 
 	cid->Connected();
 
+	delete cid;
+
+	{
+		sf::TcpSocket *sockets[1] = { &lanlink.tcpsocket };
+		LinkSocketLoop(sockets, 1);
+	}
+	return;
+
 CloseInfoDisplay:
 	delete cid;
 	return;
 }
 
+// LinkUpdate() looks for the first transfer by itself as well
 void lclient::CheckConn(void){
-	size_t nr;
-	lanlink.tcpsocket.receive(inbuffer, 1, nr);
-	numbytes = nr;
-	if(numbytes>0){
-		while(numbytes<inbuffer[0]) {
-			lanlink.tcpsocket.receive(inbuffer+numbytes, inbuffer[0] - numbytes, nr);
-			numbytes += nr;
-		}
-		if(inbuffer[1]==-32){
-			outbuffer[0] = 4;
-			lanlink.tcpsocket.send(outbuffer, 4);
-			lanlink.connected = false;
-			systemScreenMessage(_("Server disconnected."));
-			return;
-		}
-		numtransfers = 1;
-		savedlinktime = 0;
-		linkdata[0] = READ16LE(&u16inbuffer[1]);
-		tspeed = inbuffer[1] & 3;
-		for(i=1, numbytes=4;i<=lanlink.numslaves;i++)
-			if(i!=linkid) {
-				linkdata[i] = READ16LE(&u16inbuffer[numbytes]);
-				numbytes++;
-			}
-		after = false;
-		oncewait = true;
-	}
+	Recv();
 	return;
 }
 
+// Takes the master's next transfer if it has arrived, without waiting
 void lclient::Recv(void){
-	fdset.clear();
-	// old code used socket # instead of mask again
-	fdset.add(lanlink.tcpsocket);
-	// old code stripped off ms again
-	if (fdset.wait(sf::seconds((float)(linktimeout / 1000.))) == 0)
-	{
-		numtransfers = 0;
+	LinkMessage m;
+	if(ready || !linkIn.Pop(m))
 		return;
-	}
-	numbytes = 0;
-	inbuffer[0] = 1;
-	size_t nr;
-	while(numbytes<inbuffer[0]) {
-		lanlink.tcpsocket.receive(inbuffer+numbytes, inbuffer[0] - numbytes, nr);
-		numbytes += nr;
-	}
-	if(inbuffer[1]==-32){
+	if(m.data[1]==-32){
 		outbuffer[0] = 4;
-		lanlink.tcpsocket.send(outbuffer, 4);
+		LinkSendMessage(0, outbuffer);
 		lanlink.connected = false;
 		systemScreenMessage(_("Server disconnected."));
 		return;
 	}
-	tspeed = inbuffer[1] & 3;
-	linkdata[0] = READ16LE(&u16inbuffer[1]);
-	savedlinktime = (s32)READ32LE(&intinbuffer[1]);
-	for(i=1, numbytes=4;i<lanlink.numslaves+1;i++)
-		if(i!=linkid) {
-			linkdata[i] = READ16LE(&u16inbuffer[numbytes]);
-			numbytes++;
+	u16 *u16data = (u16*)m.data;
+	tspeed = m.data[1] & 3;
+	linkdata[0] = READ16LE(&u16data[1]);
+	// the first transfer starts straight away
+	savedlinktime = numtransfers ? (s32)READ32LE(&m.data[4]) : 0;
+	for(int s=1, n=4;s<lanlink.numslaves+1;s++)
+		if(s!=linkid) {
+			linkdata[s] = READ16LE(&u16data[n]);
+			n++;
 		}
 	numtransfers++;
 	if(numtransfers==0) numtransfers = 2;
-	after = false;
+	ready = true;
 }
 
 void lclient::Send(){
 	outbuffer[0] = 4;
 	outbuffer[1] = linkid<<2;
 	WRITE16LE(&u16outbuffer[1], linkdata[linkid]);
-	lanlink.tcpsocket.send(outbuffer, 4);
+	LinkSendMessage(0, outbuffer);
 	return;
 }
 #endif
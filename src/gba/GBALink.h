@@ -71,6 +71,23 @@ public:
     virtual void Connected() = 0;
 };
 
+// What one GBA sent in one multiplayer transfer of the local link
+typedef struct {
+	u32 seq; // the transfer
+	s32 time; // master: linktime when it started the transfer
+	u16 data;
+	u8 speed;
+	u8 gbas; // master: the number of GBAs taking part
+} LINKRECORD;
+
+// Only written by its own GBA. head is one past the last transfer it took
+// part in; the others wait on it.
+#define LINK_RING_SIZE 8
+typedef struct {
+	u32 head;
+	LINKRECORD rec[LINK_RING_SIZE];
+} LINKRING;
+
 typedef struct {
 	u16 linkdata[5];
 	u16 linkcmd;
@@ -84,21 +101,18 @@ typedef struct {
 	int rfu_linktime[4];
 	u32 rfu_bdata[4][7];
 	u32 rfu_data[4][32];
+	LINKRING linkring[4];
 } LINKDATA;
 
 class lserver{
-	int numbytes;
-	sf::SocketSelector fdset;
-	//timeval udptimeout;
-	char inbuffer[256], outbuffer[256];
-	s32 *intinbuffer;
-	u16 *u16inbuffer;
+	char outbuffer[256];
 	s32 *intoutbuffer;
 	u16 *u16outbuffer;
-	int counter;
-	int done;
 public:
-	int howmanytimes;
+	// the slaves whose data for the current transfer is in, and the time
+	// since it started
+	int replies;
+	sf::Clock sent;
 	sf::TcpSocket tcpsocket[4];
 	sf::IpAddress udpaddr[4];
 	lserver(void);
@@ -116,18 +130,15 @@ public:
 };
 
 class lclient{
-	sf::SocketSelector fdset;
-	char inbuffer[256], outbuffer[256];
-	s32 *intinbuffer;
-	u16 *u16inbuffer;
-	s32 *intoutbuffer;
+	char outbuffer[256];
 	u16 *u16outbuffer;
-	int numbytes;
 public:
 	sf::IpAddress serveraddr;
 	unsigned short serverport;
 	sf::TcpSocket noblock;
 	int numtransfers;
+	// the master has started a transfer this one has not joined yet
+	bool ready;
 	lclient(void);
 	bool Init(sf::IpAddress, ClientInfoDisplay *);
 	void Send(void);
@@ -163,6 +174,11 @@ extern void StartLink(u16);
 extern void StartGPLink(u16);
 extern void LinkUpdate(int);
 extern void CleanLocalLink();
+// Ticks since JoyBusUpdate() and LinkUpdate() last ran, and until they
+// have something to do again. CPULoop only calls LinkProcessEvents() then.
+extern int linkClock;
+extern int linkEvent;
+extern void LinkProcessEvents();
 extern LANLINKDATA lanlink;
 extern int vbaid;
 extern bool rfu_enabled;
@@ -187,6 +203,7 @@ inline void StartLink(u16) { }
 inline void StartGPLink(u16) { }
 inline void LinkUpdate(int) { }
 inline void CleanLocalLink() { }
+inline void LinkProcessEvents() { }
 #endif
 
 #endif /* GBA_GBALINK_H */
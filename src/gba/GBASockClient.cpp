@@ -12,7 +12,8 @@ GBASockClient::GBASockClient(sf::IpAddress _server_addr)
 		server_addr = _server_addr;
 
 	client.connect(server_addr, 0xd6ba);
-	//client.SetBlocking(false);
+	// JoyBusUpdate() only takes a command if one is there
+	client.setBlocking(false);
 }
 
 GBASockClient::~GBASockClient()
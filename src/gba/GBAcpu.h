@@ -1,6 +1,8 @@
 #ifndef GBACPU_H
 #define GBACPU_H
 
+#include "../common/Movie.h"
+
 extern int armExecute();
 extern int thumbExecute();
 
@@ -278,7 +280,7 @@ inline void cpuMasterCodeCheck()
   {
     u32 joy = 0;
     if(systemReadJoypads())
-      joy = systemReadJoypad(-1);
+      joy = movieReadJoypad(-1);
     u32 ext = (joy >> 10);
     cpuTotalTicks += cheatsCheckKeys(P1^0x3FF, ext);
   }
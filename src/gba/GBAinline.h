@@ -2,10 +2,14 @@
 #define GBAINLINE_H
 
 #include "../System.h"
+#include "../common/Movie.h"
+#include "../common/StateHash.h"
 #include "../common/Port.h"
 #include "RTC.h"
 #include "Sound.h"
 #include "agbprint.h"
+#include "Watch.h"
+#include "Trace.h"
 #include "GBAcpu.h"
 #include "GBALink.h"
 
@@ -34,6 +38,63 @@ extern bool timer3On;
 extern int timer3Ticks;
 extern int timer3ClockReload;
 extern int cpuTotalTicks;
+extern int timerClock;
+extern u32 gfxVramVersion[0x20000 >> 5];
+extern u32 gfxPaletteVersion[16];
+extern u32 gfxPaletteVersionAll;
+extern u32 gfxOBJDirty[4];
+
+#ifdef GBA_THREADED_RENDER
+// Palette RAM, OAM and VRAM blocks (32 bytes each) written since the last
+// line was handed to the render thread, see GBAGfxThread.cpp.
+#define GFX_DIRTY_PALETTE 0x00000
+#define GFX_DIRTY_OAM     0x00400
+#define GFX_DIRTY_VRAM    0x00800
+#define GFX_DIRTY_SIZE    0x18800
+
+extern u32 gfxThreadDirty[GFX_DIRTY_SIZE >> 10];
+
+static inline void gfxThreadMarkDirty(u32 offset)
+{
+  gfxThreadDirty[offset >> 10] |= 1u << ((offset >> 5) & 31);
+}
+#endif
+
+// Write tracking for the text background tile cache (GBAGfx.h). VRAM is
+// versioned per 32 byte block, BG palette RAM per 16 colour bank.
+static inline void gfxVramWritten(u32 address)
+{
+  gfxVramVersion[address >> 5]++;
+#ifdef GBA_THREADED_RENDER
+  gfxThreadMarkDirty(GFX_DIRTY_VRAM + address);
+#endif
+}
+
+static inline void gfxPaletteWritten(u32 address)
+{
+#ifdef GBA_THREADED_RENDER
+  gfxThreadMarkDirty(GFX_DIRTY_PALETTE + address);
+#endif
+  if(address < 0x200) {
+    gfxPaletteVersion[address >> 5]++;
+    gfxPaletteVersionAll++;
+  }
+}
+
+// Only attributes 0 and 1 move a sprite between the per line lists.
+static inline void gfxOAMWritten(u32 address)
+{
+#ifdef GBA_THREADED_RENDER
+  gfxThreadMarkDirty(GFX_DIRTY_OAM + address);
+#endif
+  if(!(address & 4))
+    gfxOBJDirty[address >> 8] |= 1u << ((address >> 3) & 31);
+}
+
+// Pages written since the last CPUStateHash()
+extern StateHashRegion cpuHashWorkRAM;
+extern StateHashRegion cpuHashInternalRAM;
+extern StateHashRegion cpuHashVram;
 
 #define CPUReadByteQuick(addr) \
   map[(addr)>>24].address[(addr) & map[(addr)>>24].mask]
@@ -44,6 +105,31 @@ extern int cpuTotalTicks;
 #define CPUReadMemoryQuick(addr) \
   READ32LE(((u32*)&map[(addr)>>24].address[(addr) & map[(addr)>>24].mask]))
 
+// TMxD of a running timer isn't kept up to date in ioMem, work it out
+static inline u16 CPUReadTimer(u32 offset, u16 value)
+{
+  int ticks = timerClock + cpuTotalTicks;
+  switch(offset) {
+  case 0x100:
+    if(timer0On)
+      value = 0xFFFF - ((timer0Ticks - ticks) >> timer0ClockReload);
+    break;
+  case 0x104:
+    if(timer1On && !(TM1CNT & 4))
+      value = 0xFFFF - ((timer1Ticks - ticks) >> timer1ClockReload);
+    break;
+  case 0x108:
+    if(timer2On && !(TM2CNT & 4))
+      value = 0xFFFF - ((timer2Ticks - ticks) >> timer2ClockReload);
+    break;
+  case 0x10C:
+    if(timer3On && !(TM3CNT & 4))
+      value = 0xFFFF - ((timer3Ticks - ticks) >> timer3ClockReload);
+    break;
+  }
+  return value;
+}
+
 static inline u32 CPUReadMemory(u32 address)
 {
   u32 value;
@@ -71,15 +157,24 @@ static inline u32 CPUReadMemory(u32 address)
       value = READ32LE(((u32 *)&bios[address & 0x3FFC]));
     break;
   case 2:
+#ifdef BKPT_SUPPORT
+    watchLoad(watchWorkRAM, address & 0x3FFFC, address & 0x203FFFC, 4);
+#endif
     value = READ32LE(((u32 *)&workRAM[address & 0x3FFFC]));
     break;
   case 3:
+#ifdef BKPT_SUPPORT
+    watchLoad(watchInternalRAM, address & 0x7ffc, address & 0x3007ffc, 4);
+#endif
     value = READ32LE(((u32 *)&internalRAM[address & 0x7ffC]));
     break;
   case 4:
 	if((address < 0x4000400) && ioReadable[address & 0x3fc]) {
       if(ioReadable[(address & 0x3fc) + 2]) {
         value = READ32LE(((u32 *)&ioMem[address & 0x3fC]));
+        if(((address & 0x3fc) >> 4) == 0x10)
+          value = (value & 0xFFFF0000) |
+            CPUReadTimer(address & 0x3fc, value);
         if ((address & 0x3fc) == COMM_JOY_RECV_L)
           UPDATE_REG(COMM_JOYSTAT, READ16LE(&ioMem[COMM_JOYSTAT]) & ~JOYSTAT_RECV);
       } else {
@@ -90,6 +185,9 @@ static inline u32 CPUReadMemory(u32 address)
       goto unreadable;
 	break;
   case 5:
+#ifdef BKPT_SUPPORT
+    watchLoad(watchPRAM, address & 0x3fc, address & 0x50003fc, 4);
+#endif
     value = READ32LE(((u32 *)&paletteRAM[address & 0x3fC]));
     break;
   case 6:
@@ -101,9 +199,15 @@ static inline u32 CPUReadMemory(u32 address)
     }
     if ((address & 0x18000) == 0x18000)
       address &= 0x17fff;
+#ifdef BKPT_SUPPORT
+    watchLoad(watchVRAM, address, address + 0x06000000, 4);
+#endif
     value = READ32LE(((u32 *)&vram[address]));
     break;
   case 7:
+#ifdef BKPT_SUPPORT
+    watchLoad(watchOAM, address & 0x3fc, address & 0x70003fc, 4);
+#endif
     value = READ32LE(((u32 *)&oam[address & 0x3FC]));
     break;
   case 8:
@@ -202,9 +306,15 @@ static inline u32 CPUReadHalfWord(u32 address)
       value = READ16LE(((u16 *)&bios[address & 0x3FFE]));
     break;
   case 2:
+#ifdef BKPT_SUPPORT
+    watchLoad(watchWorkRAM, address & 0x3FFFE, address & 0x203FFFE, 2);
+#endif
     value = READ16LE(((u16 *)&workRAM[address & 0x3FFFE]));
     break;
   case 3:
+#ifdef BKPT_SUPPORT
+    watchLoad(watchInternalRAM, address & 0x7ffe, address & 0x3007ffe, 2);
+#endif
     value = READ16LE(((u16 *)&internalRAM[address & 0x7ffe]));
     break;
   case 4:
@@ -212,19 +322,7 @@ static inline u32 CPUReadHalfWord(u32 address)
     {
       value =  READ16LE(((u16 *)&ioMem[address & 0x3fe]));
       if (((address & 0x3fe)>0xFF) && ((address & 0x3fe)<0x10E))
-      {
-        if (((address & 0x3fe) == 0x100) && timer0On)
-          value = 0xFFFF - ((timer0Ticks-cpuTotalTicks) >> timer0ClockReload);
-        else
-          if (((address & 0x3fe) == 0x104) && timer1On && !(TM1CNT & 4))
-            value = 0xFFFF - ((timer1Ticks-cpuTotalTicks) >> timer1ClockReload);
-          else
-            if (((address & 0x3fe) == 0x108) && timer2On && !(TM2CNT & 4))
-              value = 0xFFFF - ((timer2Ticks-cpuTotalTicks) >> timer2ClockReload);
-            else
-              if (((address & 0x3fe) == 0x10C) && timer3On && !(TM3CNT & 4))
-                value = 0xFFFF - ((timer3Ticks-cpuTotalTicks) >> timer3ClockReload);
-      }
+        value = CPUReadTimer(address & 0x3fe, value);
     }
 	else if((address < 0x4000400) && ioReadable[address & 0x3fc])
 	{
@@ -233,6 +331,9 @@ static inline u32 CPUReadHalfWord(u32 address)
     else goto unreadable;
     break;
   case 5:
+#ifdef BKPT_SUPPORT
+    watchLoad(watchPRAM, address & 0x3fe, address & 0x50003fe, 2);
+#endif
     value = READ16LE(((u16 *)&paletteRAM[address & 0x3fe]));
     break;
   case 6:
@@ -244,9 +345,15 @@ static inline u32 CPUReadHalfWord(u32 address)
     }
     if ((address & 0x18000) == 0x18000)
       address &= 0x17fff;
+#ifdef BKPT_SUPPORT
+    watchLoad(watchVRAM, address, address + 0x06000000, 2);
+#endif
     value = READ16LE(((u16 *)&vram[address]));
     break;
   case 7:
+#ifdef BKPT_SUPPORT
+    watchLoad(watchOAM, address & 0x3fe, address & 0x70003fe, 2);
+#endif
     value = READ16LE(((u16 *)&oam[address & 0x3fe]));
     break;
   case 8:
@@ -331,14 +438,27 @@ static inline u8 CPUReadByte(u32 address)
     }
     return bios[address & 0x3FFF];
   case 2:
+#ifdef BKPT_SUPPORT
+    watchLoad(watchWorkRAM, address & 0x3FFFF, address & 0x203FFFF, 1);
+#endif
     return workRAM[address & 0x3FFFF];
   case 3:
+#ifdef BKPT_SUPPORT
+    watchLoad(watchInternalRAM, address & 0x7fff, address & 0x3007fff, 1);
+#endif
     return internalRAM[address & 0x7fff];
   case 4:
-    if((address < 0x4000400) && ioReadable[address & 0x3ff])
+    if((address < 0x4000400) && ioReadable[address & 0x3ff]) {
+      if(((address & 0x3ff) >> 4) == 0x10)
+        return CPUReadTimer(address & 0x3fe,
+          READ16LE(((u16 *)&ioMem[address & 0x3fe]))) >> ((address & 1) << 3);
       return ioMem[address & 0x3ff];
+    }
     else goto unreadable;
   case 5:
+#ifdef BKPT_SUPPORT
+    watchLoad(watchPRAM, address & 0x3ff, address & 0x50003ff, 1);
+#endif
     return paletteRAM[address & 0x3ff];
   case 6:
     address = (address & 0x1ffff);
@@ -346,8 +466,14 @@ static inline u8 CPUReadByte(u32 address)
       return 0;
     if ((address & 0x18000) == 0x18000)
       address &= 0x17fff;
+#ifdef BKPT_SUPPORT
+    watchLoad(watchVRAM, address, address + 0x06000000, 1);
+#endif
     return vram[address];
   case 7:
+#ifdef BKPT_SUPPORT
+    watchLoad(watchOAM, address & 0x3ff, address & 0x70003ff, 1);
+#endif
     return oam[address & 0x3ff];
   case 8:
   case 9:
@@ -363,13 +489,13 @@ static inline u8 CPUReadByte(u32 address)
 	if (cpuEEPROMSensorEnabled) {
 		switch (address & 0x00008f00) {
 		case 0x8200:
-			return systemGetSensorX() & 255;
+			return movieGetSensorX() & 255;
 		case 0x8300:
-			return (systemGetSensorX() >> 8) | 0x80;
+			return (movieGetSensorX() >> 8) | 0x80;
 		case 0x8400:
-			return systemGetSensorY() & 255;
+			return movieGetSensorY() & 255;
 		case 0x8500:
-			return systemGetSensorY() >> 8;
+			return movieGetSensorY() >> 8;
 		}
 	}
 	return flashRead(address);
@@ -411,10 +537,16 @@ static inline void CPUWriteMemory(u32 address, u32 value)
 
   address &= 0xFFFFFFFC;
 
+#ifdef BKPT_SUPPORT
+  if(UNLIKELY(traceActive))
+    traceWrite(address, value, 4);
+#endif
+
   switch(address >> 24) {
   case 0x02:
+    stateHashWritten(cpuHashWorkRAM, address & 0x3FFFC);
 #ifdef BKPT_SUPPORT
-    if(*((u32 *)&freezeWorkRAM[address & 0x3FFFC]))
+    if(watchStore(watchWorkRAM, address & 0x3FFFC, address & 0x203FFFC, 4))
       cheatsWriteMemory(address & 0x203FFFC,
       value);
     else
@@ -422,8 +554,9 @@ static inline void CPUWriteMemory(u32 address, u32 value)
       WRITE32LE(((u32 *)&workRAM[address & 0x3FFFC]), value);
     break;
   case 0x03:
+    stateHashWritten(cpuHashInternalRAM, address & 0x7ffc);
 #ifdef BKPT_SUPPORT
-    if(*((u32 *)&freezeInternalRAM[address & 0x7ffc]))
+    if(watchStore(watchInternalRAM, address & 0x7ffc, address & 0x3007FFC, 4))
       cheatsWriteMemory(address & 0x3007FFC,
       value);
     else
@@ -437,9 +570,10 @@ static inline void CPUWriteMemory(u32 address, u32 value)
     } else goto unwritable;
     break;
   case 0x05:
+    gfxPaletteWritten(address & 0x3FC);
 #ifdef BKPT_SUPPORT
-    if(*((u32 *)&freezePRAM[address & 0x3fc]))
-      cheatsWriteMemory(address & 0x70003FC,
+    if(watchStore(watchPRAM, address & 0x3fc, address & 0x50003FC, 4))
+      cheatsWriteMemory(address & 0x50003FC,
       value);
     else
 #endif
@@ -451,9 +585,11 @@ static inline void CPUWriteMemory(u32 address, u32 value)
       return;
     if ((address & 0x18000) == 0x18000)
       address &= 0x17fff;
+    gfxVramWritten(address);
+    stateHashWritten(cpuHashVram, address);
 
 #ifdef BKPT_SUPPORT
-    if(*((u32 *)&freezeVRAM[address]))
+    if(watchStore(watchVRAM, address, address + 0x06000000, 4))
       cheatsWriteMemory(address + 0x06000000, value);
     else
 #endif
@@ -461,8 +597,9 @@ static inline void CPUWriteMemory(u32 address, u32 value)
       WRITE32LE(((u32 *)&vram[address]), value);
     break;
   case 0x07:
+    gfxOAMWritten(address & 0x3fc);
 #ifdef BKPT_SUPPORT
-    if(*((u32 *)&freezeOAM[address & 0x3fc]))
+    if(watchStore(watchOAM, address & 0x3fc, address & 0x70003FC, 4))
       cheatsWriteMemory(address & 0x70003FC,
       value);
     else
@@ -511,10 +648,16 @@ static inline void CPUWriteHalfWord(u32 address, u16 value)
 
   address &= 0xFFFFFFFE;
 
+#ifdef BKPT_SUPPORT
+  if(UNLIKELY(traceActive))
+    traceWrite(address, value, 2);
+#endif
+
   switch(address >> 24) {
   case 2:
+    stateHashWritten(cpuHashWorkRAM, address & 0x3FFFE);
 #ifdef BKPT_SUPPORT
-    if(*((u16 *)&freezeWorkRAM[address & 0x3FFFE]))
+    if(watchStore(watchWorkRAM, address & 0x3FFFE, address & 0x203FFFE, 2))
       cheatsWriteHalfWord(address & 0x203FFFE,
       value);
     else
@@ -522,8 +665,9 @@ static inline void CPUWriteHalfWord(u32 address, u16 value)
       WRITE16LE(((u16 *)&workRAM[address & 0x3FFFE]),value);
     break;
   case 3:
+    stateHashWritten(cpuHashInternalRAM, address & 0x7ffe);
 #ifdef BKPT_SUPPORT
-    if(*((u16 *)&freezeInternalRAM[address & 0x7ffe]))
+    if(watchStore(watchInternalRAM, address & 0x7ffe, address & 0x3007ffe, 2))
       cheatsWriteHalfWord(address & 0x3007ffe,
       value);
     else
@@ -536,9 +680,10 @@ static inline void CPUWriteHalfWord(u32 address, u16 value)
     else goto unwritable;
     break;
   case 5:
+    gfxPaletteWritten(address & 0x3fe);
 #ifdef BKPT_SUPPORT
-    if(*((u16 *)&freezePRAM[address & 0x03fe]))
-      cheatsWriteHalfWord(address & 0x70003fe,
+    if(watchStore(watchPRAM, address & 0x3fe, address & 0x50003fe, 2))
+      cheatsWriteHalfWord(address & 0x50003fe,
       value);
     else
 #endif
@@ -550,8 +695,10 @@ static inline void CPUWriteHalfWord(u32 address, u16 value)
       return;
     if ((address & 0x18000) == 0x18000)
       address &= 0x17fff;
+    gfxVramWritten(address);
+    stateHashWritten(cpuHashVram, address);
 #ifdef BKPT_SUPPORT
-    if(*((u16 *)&freezeVRAM[address]))
+    if(watchStore(watchVRAM, address, address + 0x06000000, 2))
       cheatsWriteHalfWord(address + 0x06000000,
       value);
     else
@@ -559,8 +706,9 @@ static inline void CPUWriteHalfWord(u32 address, u16 value)
       WRITE16LE(((u16 *)&vram[address]), value);
     break;
   case 7:
+    gfxOAMWritten(address & 0x3fe);
 #ifdef BKPT_SUPPORT
-    if(*((u16 *)&freezeOAM[address & 0x03fe]))
+    if(watchStore(watchOAM, address & 0x3fe, address & 0x70003fe, 2))
       cheatsWriteHalfWord(address & 0x70003fe,
       value);
     else
@@ -603,18 +751,25 @@ unwritable:
 
 static inline void CPUWriteByte(u32 address, u8 b)
 {
+#ifdef BKPT_SUPPORT
+  if(UNLIKELY(traceActive))
+    traceWrite(address, b, 1);
+#endif
+
   switch(address >> 24) {
   case 2:
+    stateHashWritten(cpuHashWorkRAM, address & 0x3FFFF);
 #ifdef BKPT_SUPPORT
-    if(freezeWorkRAM[address & 0x3FFFF])
+    if(watchStore(watchWorkRAM, address & 0x3FFFF, address & 0x203FFFF, 1))
       cheatsWriteByte(address & 0x203FFFF, b);
     else
 #endif
       workRAM[address & 0x3FFFF] = b;
     break;
   case 3:
+    stateHashWritten(cpuHashInternalRAM, address & 0x7fff);
 #ifdef BKPT_SUPPORT
-    if(freezeInternalRAM[address & 0x7fff])
+    if(watchStore(watchInternalRAM, address & 0x7fff, address & 0x3007fff, 1))
       cheatsWriteByte(address & 0x3007fff, b);
     else
 #endif
@@ -685,6 +840,7 @@ static inline void CPUWriteByte(u32 address, u8 b)
     break;
   case 5:
     // no need to switch
+    gfxPaletteWritten(address & 0x3FE);
     *((u16 *)&paletteRAM[address & 0x3FE]) = (b << 8) | b;
     break;
   case 6:
@@ -698,8 +854,10 @@ static inline void CPUWriteByte(u32 address, u8 b)
     // byte writes to OBJ VRAM are ignored
     if ((address) < objTilesAddress[((DISPCNT&7)+1)>>2])
     {
+      gfxVramWritten(address);
+      stateHashWritten(cpuHashVram, address);
 #ifdef BKPT_SUPPORT
-      if(freezeVRAM[address])
+      if(watchStore(watchVRAM, address, address + 0x06000000, 1))
         cheatsWriteByte(address + 0x06000000, b);
       else
 #endif
@@ -40,6 +40,12 @@ bool skipSaveGameCheats = false;
 // 0x0000 to 0x7FFF: set custom 15 bit color
 int customBackdropColor = -1;
 
+// keeps the copy and decompression SWIs high level with a BIOS file loaded
+bool biosHLE = false;
+
+// renders scanlines on a second thread (needs GBA_THREADED_RENDER)
+bool threadedRender = false;
+
 u8 *bios = 0;
 u8 *rom = 0;
 u8 *internalRAM = 0;
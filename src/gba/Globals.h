@@ -45,6 +45,8 @@ extern bool mirroringEnable;
 extern bool skipSaveGameBattery; // skip battery data when reading save states
 extern bool skipSaveGameCheats;  // skip cheat list data when reading save states
 extern int customBackdropColor;
+extern bool biosHLE;
+extern bool threadedRender;
 
 extern u8 *bios;
 extern u8 *rom;
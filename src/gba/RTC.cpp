@@ -1,6 +1,8 @@
 #include "../System.h"
 #include "GBA.h"
 #include "Globals.h"
+#include "../common/Movie.h"
+#include "../common/StateHash.h"
 #include "../common/Port.h"
 #include "../Util.h"
 #include "../NLS.h"
@@ -119,7 +121,7 @@ bool rtcWrite(u32 address, u16 value)
                 struct tm *newtime;
                 time_t long_time;
 
-                time( &long_time );                /* Get time as long integer. */
+                movieTime( &long_time );           /* Get time as long integer. */
                 newtime = localtime( &long_time ); /* Convert to local time. */
 
                 rtcClockData.dataLen = 7;
@@ -138,7 +140,7 @@ bool rtcWrite(u32 address, u16 value)
                 struct tm *newtime;
                 time_t long_time;
 
-                time( &long_time );                /* Get time as long integer. */
+                movieTime( &long_time );           /* Get time as long integer. */
                 newtime = localtime( &long_time ); /* Convert to local time. */
 
                 rtcClockData.dataLen = 3;
@@ -204,6 +206,11 @@ void rtcReset()
   rtcClockData.state = IDLE;
 }
 
+u64 rtcStateHash(u64 seed)
+{
+  return stateHashData(&rtcClockData, sizeof(rtcClockData), seed);
+}
+
 #ifdef __LIBRETRO__
 void rtcSaveGame(u8 *&data)
 {
@@ -6,6 +6,7 @@ bool rtcWrite(u32 address, u16 value);
 void rtcEnable(bool);
 bool rtcIsEnabled();
 void rtcReset();
+u64 rtcStateHash(u64 seed);
 
 #ifdef __LIBRETRO__
 void rtcReadGame(const u8 *&data);
@@ -0,0 +1,386 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "GBA.h"
+#include "Globals.h"
+#include "../common/Port.h"
+#include "elf.h"
+#include "Sampler.h"
+
+#ifdef BKPT_SUPPORT
+
+bool samplerActive = false;
+int samplerTicks = 0;
+
+// frames kept per sample, the pc included
+#define SAMPLER_DEPTH 8
+// stack words searched for return addresses
+#define SAMPLER_SCAN 64
+// a power of two; new stacks are dropped once it is three quarters full
+#define SAMPLER_HASH 16384
+
+// The pc, then the return addresses, with bit 0 set for THUMB code
+struct SamplerEntry {
+  u32 count;
+  int depth;
+  u32 frames[SAMPLER_DEPTH];
+};
+
+static SamplerEntry *samplerTable = NULL;
+static int samplerUsed = 0;
+static u32 samplerDropped = 0;
+static int samplerPeriod = 0;
+static u32 samplerSeed = 0;
+static std::string samplerFileName;
+
+#define samplerRead16(addr) \
+  READ16LE(((u16*)&map[(addr)>>24].address[(addr) & map[(addr)>>24].mask]))
+
+#define samplerRead32(addr) \
+  READ32LE(((u32*)&map[(addr)>>24].address[(addr) & map[(addr)>>24].mask]))
+
+// Whether address is in the BIOS, work RAM, internal RAM or the ROM
+static bool samplerCode(u32 address)
+{
+  switch(address >> 24) {
+  case 0:
+    return address < 0x4000;
+  case 2:
+    return (address & 0xffffff) < 0x40000;
+  case 3:
+    return (address & 0xffffff) < 0x8000;
+  case 8:
+  case 9:
+  case 10:
+  case 11:
+  case 12:
+  case 13:
+    return true;
+  }
+  return false;
+}
+
+// Whether value is a return address: the instruction before it has to be a
+// BL or BLX, or a "mov lr, pc" for ARM
+static bool samplerReturnAddress(u32 value)
+{
+  if(value & 1) {
+    u32 address = value - 1;
+    if(!samplerCode(address - 4))
+      return false;
+    u32 first = samplerRead16(address - 4);
+    u32 second = samplerRead16(address - 2);
+    return ((first & 0xf800) == 0xf000 && (second & 0xe800) == 0xe800) ||
+      (second & 0xff87) == 0x4780;
+  }
+  if((value & 3) || !samplerCode(value - 8))
+    return false;
+  u32 opcode = samplerRead32(value - 4);
+  return ((opcode & 0x0f000000) == 0x0b000000) ||
+    ((opcode & 0x0ffffff0) == 0x012fff30) ||
+    samplerRead32(value - 8) == 0xe1a0e00f;
+}
+
+static u32 samplerNextPeriod()
+{
+  // spread around the period, so the samples don't lock onto the frame
+  samplerSeed ^= samplerSeed << 13;
+  samplerSeed ^= samplerSeed >> 17;
+  samplerSeed ^= samplerSeed << 5;
+  return samplerPeriod / 2 + samplerSeed % samplerPeriod + 1;
+}
+
+void samplerTake()
+{
+  do
+    samplerTicks += samplerNextPeriod();
+  while(samplerTicks <= 0);
+
+  SamplerEntry sample;
+  sample.frames[0] = armNextPC | (armState ? 0 : 1);
+  sample.depth = 1;
+
+  // lr is the caller in a function that hasn't called anything else; in
+  // one that has, it points back into the function and gets merged with
+  // the pc when symbolised
+  if(samplerReturnAddress(reg[14].I))
+    sample.frames[sample.depth++] = reg[14].I;
+
+  u32 sp = reg[13].I & ~3;
+  for(int i = 0; i < SAMPLER_SCAN && sample.depth < SAMPLER_DEPTH; i++) {
+    if((sp >> 24) != 2 && (sp >> 24) != 3)
+      break;
+    if(!samplerCode(sp))
+      break;
+    u32 value = samplerRead32(sp);
+    if(value != sample.frames[sample.depth - 1] &&
+       samplerReturnAddress(value))
+      sample.frames[sample.depth++] = value;
+    sp += 4;
+  }
+
+  u32 hash = sample.depth;
+  for(int i = 0; i < sample.depth; i++)
+    hash = (hash ^ sample.frames[i]) * 0x01000193;
+
+  for(u32 i = hash & (SAMPLER_HASH - 1);; i = (i + 1) & (SAMPLER_HASH - 1)) {
+    SamplerEntry &e = samplerTable[i];
+    if(e.count == 0) {
+      if(samplerUsed >= SAMPLER_HASH / 4 * 3) {
+        samplerDropped++;
+        return;
+      }
+      sample.count = 1;
+      e = sample;
+      samplerUsed++;
+      return;
+    }
+    if(e.depth == sample.depth &&
+       !memcmp(e.frames, sample.frames, sample.depth * sizeof(u32))) {
+      e.count++;
+      return;
+    }
+  }
+}
+
+bool samplerStart(const char *fileName, int hz)
+{
+  samplerStop();
+
+  if(hz <= 0)
+    hz = 1000;
+  if(samplerTable == NULL)
+    samplerTable = (SamplerEntry *)malloc(SAMPLER_HASH * sizeof(SamplerEntry));
+  if(samplerTable == NULL)
+    return false;
+  memset(samplerTable, 0, SAMPLER_HASH * sizeof(SamplerEntry));
+  samplerUsed = 0;
+  samplerDropped = 0;
+  samplerFileName = fileName;
+  samplerPeriod = 16777216 / hz;
+  if(samplerPeriod < 1)
+    samplerPeriod = 1;
+  samplerSeed = 0x12345678;
+  samplerTicks = samplerNextPeriod();
+  samplerActive = true;
+  return true;
+}
+
+// The address looked up for a frame: the pc, or the call before a return
+// address
+static u32 samplerFrameAddress(const SamplerEntry &e, int i)
+{
+  u32 address = e.frames[i] & ~1;
+  if(i != 0)
+    address -= (e.frames[i] & 1) ? 2 : 4;
+  return address;
+}
+
+// The function a frame is in, without the offset elfGetAddressSymbol()
+// adds; the address when there is no symbol for it
+static std::string samplerFrameName(u32 address)
+{
+  std::string name = elfGetAddressSymbol(address);
+  size_t plus = name.rfind('+');
+  if(plus != std::string::npos && plus + 1 < name.size() &&
+     strspn(name.c_str() + plus + 1, "0123456789") == name.size() - plus - 1)
+    name.erase(plus);
+  if(name.empty()) {
+    char buffer[16];
+    sprintf(buffer, "%08x", address);
+    name = buffer;
+  }
+  return name;
+}
+
+struct SamplerFrame {
+  u32 address;
+  std::string name;
+};
+
+// The frames of an entry, leaf first, with calls within one function
+// merged
+static void samplerFrames(const SamplerEntry &e, std::vector<SamplerFrame> &frames)
+{
+  frames.clear();
+  for(int i = 0; i < e.depth; i++) {
+    SamplerFrame f;
+    f.address = samplerFrameAddress(e, i);
+    f.name = samplerFrameName(f.address);
+    if(frames.empty() || frames.back().name != f.name)
+      frames.push_back(f);
+  }
+}
+
+static bool samplerWriteCollapsed(FILE *f)
+{
+  std::map<std::string, u32> stacks;
+  std::vector<SamplerFrame> frames;
+  for(int i = 0; i < SAMPLER_HASH; i++) {
+    const SamplerEntry &e = samplerTable[i];
+    if(e.count == 0)
+      continue;
+    samplerFrames(e, frames);
+    std::string stack;
+    for(size_t j = frames.size(); j-- > 0;) {
+      stack += frames[j].name;
+      if(j)
+        stack += ';';
+    }
+    stacks[stack] += e.count;
+  }
+  if(samplerDropped)
+    stacks["[dropped]"] += samplerDropped;
+
+  for(std::map<std::string, u32>::iterator it = stacks.begin();
+      it != stacks.end(); ++it)
+    fprintf(f, "%s %u\n", it->first.c_str(), it->second);
+  return ferror(f) == 0;
+}
+
+// A little of the protocol buffers encoding, for pprof
+static void samplerVarint(std::string &out, u64 value)
+{
+  while(value >= 0x80) {
+    out += (char)(value | 0x80);
+    value >>= 7;
+  }
+  out += (char)value;
+}
+
+static void samplerField(std::string &out, int field, u64 value)
+{
+  samplerVarint(out, field << 3);
+  samplerVarint(out, value);
+}
+
+static void samplerField(std::string &out, int field, const std::string &value)
+{
+  samplerVarint(out, (field << 3) | 2);
+  samplerVarint(out, value.size());
+  out += value;
+}
+
+struct SamplerStrings {
+  std::map<std::string, int> index;
+  std::string table;
+
+  int get(const std::string &s)
+  {
+    std::map<std::string, int>::iterator it = index.find(s);
+    if(it != index.end())
+      return it->second;
+    int n = (int)index.size();
+    index[s] = n;
+    samplerField(table, 6, s);
+    return n;
+  }
+};
+
+static bool samplerWritePprof(const char *fileName)
+{
+  std::string profile;
+  SamplerStrings strings;
+  strings.get("");
+
+  std::string type;
+  samplerField(type, 1, strings.get("samples"));
+  samplerField(type, 2, strings.get("count"));
+  samplerField(profile, 1, type);
+
+  std::map<u32, int> locations;
+  std::map<std::string, int> functions;
+  std::string locationData;
+  std::string functionData;
+  std::vector<SamplerFrame> frames;
+
+  for(int i = 0; i < SAMPLER_HASH; i++) {
+    const SamplerEntry &e = samplerTable[i];
+    if(e.count == 0)
+      continue;
+    samplerFrames(e, frames);
+
+    std::string ids;
+    for(size_t j = 0; j < frames.size(); j++) {
+      int &location = locations[frames[j].address];
+      if(location == 0) {
+        location = (int)locations.size();
+        int &function = functions[frames[j].name];
+        if(function == 0) {
+          function = (int)functions.size();
+          std::string data;
+          samplerField(data, 1, function);
+          samplerField(data, 2, strings.get(frames[j].name));
+          samplerField(data, 3, strings.get(frames[j].name));
+          samplerField(functionData, 5, data);
+        }
+        std::string line;
+        samplerField(line, 1, function);
+        std::string data;
+        samplerField(data, 1, location);
+        samplerField(data, 3, frames[j].address);
+        samplerField(data, 4, line);
+        samplerField(locationData, 4, data);
+      }
+      samplerVarint(ids, location);
+    }
+
+    std::string value;
+    samplerVarint(value, e.count);
+    std::string sample;
+    samplerField(sample, 1, ids);
+    samplerField(sample, 2, value);
+    samplerField(profile, 2, sample);
+  }
+
+  profile += locationData;
+  profile += functionData;
+  std::string periodType;
+  samplerField(periodType, 1, strings.get("cpu"));
+  samplerField(periodType, 2, strings.get("cycles"));
+  profile += strings.table;
+  samplerField(profile, 11, periodType);
+  samplerField(profile, 12, samplerPeriod);
+
+  gzFile f = gzopen(fileName, "wb");
+  if(f == NULL)
+    return false;
+  bool ok = gzwrite(f, profile.data(), (unsigned)profile.size()) ==
+    (int)profile.size();
+  if(gzclose(f) != Z_OK)
+    ok = false;
+  return ok;
+}
+
+static bool samplerEndsWith(const std::string &s, const char *end)
+{
+  size_t length = strlen(end);
+  return s.size() >= length && !s.compare(s.size() - length, length, end);
+}
+
+bool samplerStop()
+{
+  if(!samplerActive)
+    return true;
+  samplerActive = false;
+
+  if(samplerEndsWith(samplerFileName, ".pb.gz") ||
+     samplerEndsWith(samplerFileName, ".pprof"))
+    return samplerWritePprof(samplerFileName.c_str());
+
+  FILE *f = fopen(samplerFileName.c_str(), "w");
+  if(f == NULL)
+    return false;
+  bool ok = samplerWriteCollapsed(f);
+  if(fclose(f) != 0)
+    ok = false;
+  return ok;
+}
+
+#endif
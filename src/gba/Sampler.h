@@ -0,0 +1,23 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+// Sampling profiler for the emulated code. At a given rate the pc and a
+// short call stack are counted in a hash table; the call stack comes from
+// lr and from the return addresses found on the stack, checked against the
+// instruction before them. On stop the stacks are symbolised with the ELF
+// symbols and written out, as a pprof profile if the file name ends in
+// .pb.gz or .pprof, else as collapsed stacks for flamegraph.pl.
+
+extern bool samplerActive;
+// CPU ticks until the next sample
+extern int samplerTicks;
+
+// Both are called from the emulation thread only. samplerStop() returns
+// false if writing the file failed.
+bool samplerStart(const char *fileName, int hz);
+bool samplerStop();
+
+// Counts the current stack and sets samplerTicks for the next sample
+void samplerTake();
+
+#endif // SAMPLER_H
@@ -6,6 +6,7 @@
 #include "Globals.h"
 #include "../Util.h"
 #include "../common/Port.h"
+#include "../common/StateHash.h"
 
 #include "../apu/Gb_Apu.h"
 #include "../apu/Multi_Buffer.h"
@@ -45,11 +46,13 @@ long  soundSampleRate    = 44100;
 bool  soundInterpolation = true;
 bool  soundPaused        = true;
 float soundFiltering     = 0.5f;
+int   soundFrameLength   = 10;
 int   SOUND_CLOCK_TICKS  = SOUND_CLOCK_TICKS_;
 int   soundTicks         = SOUND_CLOCK_TICKS_;
 
 static float soundVolume     = 1.0f;
 static int soundEnableFlag   = 0x3ff; // emulator channels enabled
+static bool soundSynthesis   = true;  // samples are generated
 static float soundFiltering_ = -1;
 static float soundVolume_    = -1;
 
@@ -114,7 +117,7 @@ void Gba_Pcm::apply_control( int idx )
 	shift = ~ioMem [SGCNT0_H] >> (2 + idx) & 1;
 
 	int ch = 0;
-	if ( (soundEnableFlag >> idx & 0x100) && (ioMem [NR52] & 0x80) )
+	if ( soundSynthesis && (soundEnableFlag >> idx & 0x100) && (ioMem [NR52] & 0x80) )
 		ch = ioMem [SGCNT0_H+1] >> (idx * 4) & 3;
 
 	Blip_Buffer* out = 0;
@@ -347,7 +350,8 @@ static void end_frame( blip_time_t time )
 	pcm [1].pcm.end_frame( time );
 
 	gb_apu       ->end_frame( time );
-	stereo_buffer->end_frame( time );
+	if ( soundSynthesis )
+		stereo_buffer->end_frame( time );
 }
 
 void flush_samples(Multi_Buffer * buffer)
@@ -405,7 +409,8 @@ void psoundTickfn()
 		// Run sound hardware to present
 		end_frame( SOUND_CLOCK_TICKS );
 
-		flush_samples(stereo_buffer);
+		if ( soundSynthesis )
+			flush_samples(stereo_buffer);
 
 		if ( soundFiltering_ != soundFiltering )
 			apply_filtering();
@@ -428,7 +433,7 @@ static void apply_muting()
 		// APU
 		for ( int i = 0; i < 4; i++ )
 		{
-			if ( soundEnableFlag >> i & 1 )
+			if ( soundSynthesis && (soundEnableFlag >> i & 1) )
 				gb_apu->set_output( stereo_buffer->center(),
 						stereo_buffer->left(), stereo_buffer->right(), i );
 			else
@@ -527,6 +532,36 @@ int soundGetEnable()
 	return (soundEnableFlag & 0x30f);
 }
 
+void soundSetSynthesis( bool enable )
+{
+	if ( soundSynthesis != enable )
+	{
+		soundSynthesis = enable;
+
+		// Drop what was left from before synthesis was turned off
+		if ( enable && stereo_buffer )
+			stereo_buffer->clear();
+
+		apply_muting();
+	}
+}
+
+bool soundGetSynthesis()
+{
+	return soundSynthesis;
+}
+
+int soundFrameTicks( int ticks )
+{
+	// the Blip_Buffers hold 1/4 second
+	int length = soundFrameLength;
+	if ( length < 1 )
+		length = 1;
+	if ( length > 100 )
+		length = 100;
+	return ticks * length / 10;
+}
+
 void soundReset()
 {
 	soundDriver->reset();
@@ -535,8 +570,8 @@ void soundReset()
 	reset_apu();
 
 	soundPaused = true;
-	SOUND_CLOCK_TICKS = SOUND_CLOCK_TICKS_;
-	soundTicks        = SOUND_CLOCK_TICKS_;
+	SOUND_CLOCK_TICKS = soundFrameTicks( SOUND_CLOCK_TICKS_ );
+	soundTicks        = SOUND_CLOCK_TICKS;
 
 	soundEvent( NR52, (u8) 0x80 );
 }
@@ -772,6 +807,17 @@ void soundSaveGame( gzFile out )
 #endif
 }
 
+// The APU as of now, without ending the sound frame
+u64 soundStateHash( u64 seed )
+{
+	static Gb_Apu* hash_apu;
+	if ( !hash_apu )
+		hash_apu = new Gb_Apu; // TODO: handle out of memory
+	gb_apu->save_state( blip_time(), &state.apu, hash_apu );
+	memset( dummy_state, 0, sizeof dummy_state );
+	return stateHashVariables( gba_state, seed );
+}
+
 #ifndef __LIBRETRO__
 static void soundReadGameOld( gzFile in, int version )
 {
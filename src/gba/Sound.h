@@ -28,6 +28,12 @@ float soundGetVolume();
 void soundSetEnable( int mask );
 int  soundGetEnable();
 
+// Turns generating samples off and on. While off, the sound hardware is
+// still emulated exactly (registers, length, sweep and envelope state,
+// save states), but nothing is synthesized, mixed or sent to the driver.
+void soundSetSynthesis( bool enable );
+bool soundGetSynthesis();
+
 // Pauses/resumes system sound output
 void soundPause();
 void soundResume();
@@ -45,6 +51,14 @@ void soundSetSampleRate(long sampleRate);
 extern bool soundInterpolation; // 1 if PCM should have low-pass filtering
 extern float soundFiltering;    // 0.0 = none, 1.0 = max
 
+// Milliseconds of sound (1-100, 10 by default) generated between flushes of
+// the samples to the driver, used from the next reset. Longer frames cost
+// less CPU but add latency. Affects GB sound too.
+extern int soundFrameLength;
+
+// Length of a sound frame in clocks, given the clocks in 1/100 second
+int soundFrameTicks( int ticks );
+
 
 //// GBA sound emulation
 
@@ -82,6 +96,9 @@ void soundSaveGame( gzFile );
 void soundReadGame( gzFile, int version );
 #endif
 
+// Hashes what soundSaveGame() saves
+u64 soundStateHash( u64 seed );
+
 class Multi_Buffer;
 
 void flush_samples(Multi_Buffer * buffer);
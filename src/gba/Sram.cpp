@@ -2,6 +2,7 @@
 #include "Globals.h"
 #include "Flash.h"
 #include "Sram.h"
+#include "../common/StateHash.h"
 
 u8 sramRead(u32 address)
 {
@@ -17,5 +18,6 @@ void sramDelayedWrite(u32 address, u8 byte)
 void sramWrite(u32 address, u8 byte)
 {
   flashSaveMemory[address & 0xFFFF] = byte;
+  stateHashWritten(flashHashMemory, address & 0xFFFF);
   systemSaveUpdateCounter = SYSTEM_SAVE_UPDATED;
 }
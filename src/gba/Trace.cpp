@@ -0,0 +1,427 @@
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include "GBA.h"
+#include "GBAcpu.h"
+#include "Globals.h"
+#include "../common/Port.h"
+#include "armdis.h"
+#include "Trace.h"
+
+#ifdef BKPT_SUPPORT
+
+bool traceActive = false;
+
+// followed by the version, 32 bits
+#define TRACE_MAGIC "VBATRACE"
+#define TRACE_VERSION 1
+
+// The record header. The effects come first, then the instruction:
+//   TRACE_REGS    16 bit mask of r0-r14, a delta for each register in it
+//   TRACE_CPSR    the new CPSR, 32 bits
+//   TRACE_WRITES  the count, then the size, address delta and value of each
+//   TRACE_PC      the pc as a delta from the one after the last instruction
+//   TRACE_OPCODE  32 bits, when it isn't the one in the cache for the pc
+// Numbers are LEB128 varints; deltas are zigzag encoded first.
+#define TRACE_THUMB   0x01
+#define TRACE_PC      0x02
+#define TRACE_OPCODE  0x04
+#define TRACE_REGS    0x08
+#define TRACE_CPSR    0x10
+#define TRACE_WRITES  0x20
+// no instruction, only effects: stores that didn't fit in one record, and
+// the last instruction's when the trace ends
+#define TRACE_EFFECTS 0x40
+
+#define TRACE_CACHE 4096
+#define TRACE_MAX_WRITES 64
+#define TRACE_RING (4 << 20)
+#define TRACE_RECORD_MAX (1 + 2 + 15 * 5 + 4 + 1 + TRACE_MAX_WRITES * 11 + 5 + 4)
+
+// What both the encoder and the decoder know after each record
+struct TraceState {
+  u32 nextPC;
+  u32 regs[15];
+  u32 cpsr;
+  u32 writeAddress;
+  u32 cachePC[TRACE_CACHE];
+  u32 cacheOpcode[TRACE_CACHE];
+};
+
+struct TraceStore {
+  u32 address;
+  u32 value;
+  int size;
+};
+
+static TraceState traceState;
+static TraceStore traceWrites[TRACE_MAX_WRITES];
+static int traceWriteCount = 0;
+
+// Single producer (the emulation thread), single consumer (the writer).
+// Head and tail only grow; the ring offset is taken modulo its size.
+static u8 *traceRing = NULL;
+static std::atomic<size_t> traceHead;
+static std::atomic<size_t> traceTail;
+static std::atomic<bool> traceDone;
+static std::thread traceThread;
+static gzFile traceFile = NULL;
+// only touched by the writer until it is joined
+static bool traceFailed = false;
+
+static const char *traceRegNames[15] = {
+  "r0", "r1", "r2", "r3", "r4", "r5", "r6", "r7",
+  "r8", "r9", "r10", "r11", "r12", "sp", "lr"
+};
+
+static void traceReset(TraceState *s)
+{
+  memset(s, 0, sizeof(TraceState));
+  // no pc is odd
+  memset(s->cachePC, 0xff, sizeof(s->cachePC));
+}
+
+static u8 *tracePutVarint(u8 *p, u32 value)
+{
+  while(value >= 0x80) {
+    *p++ = (u8)(value | 0x80);
+    value >>= 7;
+  }
+  *p++ = (u8)value;
+  return p;
+}
+
+static u8 *tracePutDelta(u8 *p, u32 value, u32 old)
+{
+  u32 delta = value - old;
+  return tracePutVarint(p, (delta << 1) ^ (u32)((s32)delta >> 31));
+}
+
+static u8 *tracePut32(u8 *p, u32 value)
+{
+  *p++ = (u8)value;
+  *p++ = (u8)(value >> 8);
+  *p++ = (u8)(value >> 16);
+  *p++ = (u8)(value >> 24);
+  return p;
+}
+
+static u8 *traceEncodeEffects(u8 *header, u8 *p)
+{
+  TraceState &s = traceState;
+
+  int mask = 0;
+  for(int i = 0; i < 15; i++)
+    if(reg[i].I != s.regs[i])
+      mask |= 1 << i;
+  if(mask) {
+    *header |= TRACE_REGS;
+    *p++ = (u8)mask;
+    *p++ = (u8)(mask >> 8);
+    for(int i = 0; i < 15; i++) {
+      if(mask & (1 << i)) {
+        p = tracePutDelta(p, reg[i].I, s.regs[i]);
+        s.regs[i] = reg[i].I;
+      }
+    }
+  }
+
+  CPUUpdateCPSR();
+  if(reg[16].I != s.cpsr) {
+    *header |= TRACE_CPSR;
+    p = tracePut32(p, reg[16].I);
+    s.cpsr = reg[16].I;
+  }
+
+  if(traceWriteCount) {
+    *header |= TRACE_WRITES;
+    *p++ = (u8)traceWriteCount;
+    for(int i = 0; i < traceWriteCount; i++) {
+      TraceStore &w = traceWrites[i];
+      *p++ = (u8)w.size;
+      p = tracePutDelta(p, w.address, s.writeAddress);
+      p = tracePutVarint(p, w.value);
+      s.writeAddress = w.address;
+    }
+    traceWriteCount = 0;
+  }
+  return p;
+}
+
+static void tracePut(const u8 *data, size_t length)
+{
+  size_t head = traceHead.load(std::memory_order_relaxed);
+  while(head + length - traceTail.load(std::memory_order_acquire) > TRACE_RING)
+    std::this_thread::yield();
+
+  size_t at = head % TRACE_RING;
+  size_t first = std::min(length, (size_t)TRACE_RING - at);
+  memcpy(traceRing + at, data, first);
+  memcpy(traceRing, data + first, length - first);
+  traceHead.store(head + length, std::memory_order_release);
+}
+
+static void tracePutEffects()
+{
+  u8 record[TRACE_RECORD_MAX];
+  record[0] = TRACE_EFFECTS;
+  u8 *p = traceEncodeEffects(record, record + 1);
+  tracePut(record, p - record);
+}
+
+static void traceWriter()
+{
+  for(;;) {
+    bool done = traceDone.load(std::memory_order_acquire);
+    size_t tail = traceTail.load(std::memory_order_relaxed);
+    size_t head = traceHead.load(std::memory_order_acquire);
+    if(head == tail) {
+      if(done)
+        break;
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      continue;
+    }
+
+    size_t at = tail % TRACE_RING;
+    size_t length = std::min(head - tail, (size_t)TRACE_RING - at);
+    // after a failure the records are still taken, so the CPU doesn't stall
+    if(!traceFailed &&
+       gzwrite(traceFile, traceRing + at, (unsigned)length) != (int)length)
+      traceFailed = true;
+    traceTail.store(tail + length, std::memory_order_release);
+  }
+}
+
+bool traceStart(const char *fileName)
+{
+  traceStop();
+
+  traceFile = gzopen(fileName, "wb1");
+  if(traceFile == NULL)
+    return false;
+
+  u8 header[12];
+  memcpy(header, TRACE_MAGIC, 8);
+  tracePut32(header + 8, TRACE_VERSION);
+  if(gzwrite(traceFile, header, sizeof(header)) != sizeof(header)) {
+    gzclose(traceFile);
+    traceFile = NULL;
+    return false;
+  }
+
+  if(traceRing == NULL)
+    traceRing = new u8[TRACE_RING];
+  traceReset(&traceState);
+  traceWriteCount = 0;
+  traceHead.store(0);
+  traceTail.store(0);
+  traceDone.store(false);
+  traceFailed = false;
+  traceThread = std::thread(traceWriter);
+  traceActive = true;
+  return true;
+}
+
+bool traceStop()
+{
+  if(!traceActive)
+    return true;
+
+  tracePutEffects();
+  traceActive = false;
+  traceDone.store(true, std::memory_order_release);
+  traceThread.join();
+
+  bool ok = !traceFailed;
+  if(gzclose(traceFile) != Z_OK)
+    ok = false;
+  traceFile = NULL;
+  return ok;
+}
+
+// finishes the file when the program exits while tracing
+static struct TraceExit {
+  ~TraceExit()
+  {
+    traceStop();
+  }
+} traceExit;
+
+void traceInsn(u32 pc, u32 opcode, bool thumb)
+{
+  TraceState &s = traceState;
+  u8 record[TRACE_RECORD_MAX];
+  record[0] = thumb ? TRACE_THUMB : 0;
+  u8 *p = traceEncodeEffects(record, record + 1);
+
+  if(pc != s.nextPC) {
+    record[0] |= TRACE_PC;
+    p = tracePutDelta(p, pc, s.nextPC);
+  }
+  int i = (pc >> 1) & (TRACE_CACHE - 1);
+  if(s.cachePC[i] != pc || s.cacheOpcode[i] != opcode) {
+    record[0] |= TRACE_OPCODE;
+    p = tracePut32(p, opcode);
+    s.cachePC[i] = pc;
+    s.cacheOpcode[i] = opcode;
+  }
+  s.nextPC = pc + (thumb ? 2 : 4);
+
+  tracePut(record, p - record);
+}
+
+void traceWrite(u32 address, u32 value, int size)
+{
+  // a BIOS call or a DMA can store any amount in one instruction
+  if(traceWriteCount == TRACE_MAX_WRITES)
+    tracePutEffects();
+
+  TraceStore &w = traceWrites[traceWriteCount++];
+  w.address = address;
+  w.value = value;
+  w.size = size;
+}
+
+static bool traceGetVarint(gzFile f, u32 &value)
+{
+  value = 0;
+  for(int shift = 0; shift < 35; shift += 7) {
+    int c = gzgetc(f);
+    if(c < 0)
+      return false;
+    value |= (u32)(c & 0x7f) << shift;
+    if(!(c & 0x80))
+      return true;
+  }
+  return false;
+}
+
+static bool traceGetDelta(gzFile f, u32 &value)
+{
+  u32 delta;
+  if(!traceGetVarint(f, delta))
+    return false;
+  value += (delta >> 1) ^ (0 - (delta & 1));
+  return true;
+}
+
+static bool traceGet32(gzFile f, u32 &value)
+{
+  u8 data[4];
+  if(gzread(f, data, 4) != 4)
+    return false;
+  value = READ32LE(data);
+  return true;
+}
+
+static bool traceDecodeEffects(gzFile f, int header, TraceState &s, FILE *out)
+{
+  if(header & TRACE_REGS) {
+    int low = gzgetc(f);
+    int high = gzgetc(f);
+    if(low < 0 || high < 0)
+      return false;
+    int mask = low | (high << 8);
+    for(int i = 0; i < 15; i++) {
+      if(mask & (1 << i)) {
+        if(!traceGetDelta(f, s.regs[i]))
+          return false;
+        fprintf(out, " %s=%08x", traceRegNames[i], s.regs[i]);
+      }
+    }
+  }
+
+  if(header & TRACE_CPSR) {
+    if(!traceGet32(f, s.cpsr))
+      return false;
+    fprintf(out, " cpsr=%08x", s.cpsr);
+  }
+
+  if(header & TRACE_WRITES) {
+    int count = gzgetc(f);
+    if(count < 0)
+      return false;
+    for(int i = 0; i < count; i++) {
+      int size = gzgetc(f);
+      u32 value;
+      if(size < 0 || !traceGetDelta(f, s.writeAddress) ||
+         !traceGetVarint(f, value))
+        return false;
+      fprintf(out, " [%08x]=%0*x", s.writeAddress, size * 2, value);
+    }
+  }
+  return true;
+}
+
+bool traceDecode(const char *fileName, FILE *out)
+{
+  gzFile f = gzopen(fileName, "rb");
+  if(f == NULL)
+    return false;
+
+  u8 header[12];
+  if(gzread(f, header, sizeof(header)) != sizeof(header) ||
+     memcmp(header, TRACE_MAGIC, 8) != 0 ||
+     READ32LE(&header[8]) != TRACE_VERSION) {
+    gzclose(f);
+    return false;
+  }
+
+  TraceState *s = new TraceState;
+  traceReset(s);
+
+  // the first record's effects are the registers at the start
+  fputs("start:", out);
+  bool ok = true;
+  for(;;) {
+    int flags = gzgetc(f);
+    if(flags < 0)
+      break;
+    if(!traceDecodeEffects(f, flags, *s, out)) {
+      ok = false;
+      break;
+    }
+    if(flags & TRACE_EFFECTS)
+      continue;
+
+    u32 pc = s->nextPC;
+    if((flags & TRACE_PC) && !traceGetDelta(f, pc)) {
+      ok = false;
+      break;
+    }
+    int i = (pc >> 1) & (TRACE_CACHE - 1);
+    if(flags & TRACE_OPCODE) {
+      if(!traceGet32(f, s->cacheOpcode[i])) {
+        ok = false;
+        break;
+      }
+      s->cachePC[i] = pc;
+    } else if(s->cachePC[i] != pc) {
+      ok = false;
+      break;
+    }
+    bool thumb = (flags & TRACE_THUMB) != 0;
+    s->nextPC = pc + (thumb ? 2 : 4);
+
+    char buffer[256];
+    int dis = DIS_VIEW_ADDRESS | DIS_VIEW_CODE | DIS_NO_MEMORY;
+    if(thumb)
+      disThumbOpcode(pc, s->cacheOpcode[i], buffer, dis);
+    else
+      disArmOpcode(pc, s->cacheOpcode[i], buffer, dis);
+    fprintf(out, "\n%-48s", buffer);
+  }
+  fputc('\n', out);
+
+  delete s;
+  gzclose(f);
+  return ok;
+}
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+
+// Binary execution trace. Each instruction becomes a record with its pc,
+// opcode and what the instruction before it changed (registers, CPSR and
+// the stores it made), all delta encoded against the previous record. The
+// records go into a ring buffer that a background thread empties into a
+// gzipped file, so the CPU loop never waits on the disk unless the ring is
+// full.
+
+extern bool traceActive;
+
+// Both are called from the emulation thread only. traceStop() returns false
+// if writing the file failed.
+bool traceStart(const char *fileName);
+bool traceStop();
+
+// Called before executing the instruction at pc; for THUMB the next
+// halfword is in the top half of opcode, as disThumbOpcode() wants it
+void traceInsn(u32 pc, u32 opcode, bool thumb);
+// A store of size (1, 2 or 4) bytes made by the current instruction
+void traceWrite(u32 address, u32 value, int size);
+
+// Prints a trace file as disassembly, each instruction followed by what it
+// changed. Returns false if the file can't be read or is cut short.
+bool traceDecode(const char *fileName, FILE *out);
+
+#endif // TRACE_H
@@ -0,0 +1,214 @@
+#include <string.h>
+
+#include "GBA.h"
+#include "Watch.h"
+
+#ifdef BKPT_SUPPORT
+
+extern bool debugger;
+extern int cpuNextEvent;
+
+u8 watchWorkRAM[0x40000 >> WATCH_PAGE_SHIFT];
+u8 watchInternalRAM[0x8000 >> WATCH_PAGE_SHIFT];
+u8 watchPRAM[0x400 >> WATCH_PAGE_SHIFT];
+u8 watchVRAM[0x18000 >> WATCH_PAGE_SHIFT];
+u8 watchOAM[0x400 >> WATCH_PAGE_SHIFT];
+int watchKinds = 0;
+
+u32 watchHitAddress = 0;
+int watchHitKind = 0;
+
+struct WatchArea {
+  u32 size;
+  u8 *pages;
+};
+
+static const WatchArea watchAreas[8] = {
+  { 0, NULL },
+  { 0, NULL },
+  { 0x40000, watchWorkRAM },
+  { 0x8000, watchInternalRAM },
+  { 0, NULL },
+  { 0x400, watchPRAM },
+  { 0x18000, watchVRAM },
+  { 0x400, watchOAM }
+};
+
+// Sorted and not overlapping; next to each other only with different kinds
+struct WatchRange {
+  u32 start;
+  u32 end;
+  int kinds;
+};
+
+#define WATCH_MAX_RANGES 4096
+
+static WatchRange watchRanges[WATCH_MAX_RANGES];
+static int watchCount = 0;
+
+// The instruction an execute watch stopped before, run once when resuming
+static u32 watchExecSkip = 0xFFFFFFFF;
+
+static void watchUpdatePages()
+{
+  watchKinds = 0;
+  for(int a = 0; a < 8; a++)
+    if(watchAreas[a].pages)
+      memset(watchAreas[a].pages, 0,
+             watchAreas[a].size >> WATCH_PAGE_SHIFT);
+
+  for(int i = 0; i < watchCount; i++) {
+    const WatchRange &r = watchRanges[i];
+    u8 *pages = watchAreas[r.start >> 24].pages;
+    u32 first = (r.start & 0xFFFFFF) >> WATCH_PAGE_SHIFT;
+    u32 last = ((r.end - 1) & 0xFFFFFF) >> WATCH_PAGE_SHIFT;
+    for(u32 p = first; p <= last; p++)
+      pages[p] |= r.kinds;
+    watchKinds |= r.kinds;
+  }
+}
+
+static bool watchEmit(WatchRange *out, int &n, u32 start, u32 end, int kinds)
+{
+  if(start >= end || kinds == 0)
+    return true;
+  if(n != 0 && out[n-1].end == start && out[n-1].kinds == kinds) {
+    out[n-1].end = end;
+    return true;
+  }
+  if(n == WATCH_MAX_RANGES)
+    return false;
+  out[n].start = start;
+  out[n].end = end;
+  out[n].kinds = kinds;
+  n++;
+  return true;
+}
+
+// Adds the kinds in set to, and takes the ones in clear from, the length
+// bytes at address
+static bool watchSet(u32 address, u32 length, int set, int clear)
+{
+  u32 area = address >> 24;
+  if(area >= 8 || watchAreas[area].size == 0 || length == 0 ||
+     (address & 0xFFFFFF) >= watchAreas[area].size ||
+     length > watchAreas[area].size - (address & 0xFFFFFF))
+    return false;
+  if((set & WATCH_EXEC) && area != 2 && area != 3)
+    return false;
+
+  static WatchRange out[WATCH_MAX_RANGES];
+  int n = 0;
+  u32 start = address;
+  u32 end = address + length;
+  // the part of start to end not yet written out
+  u32 pos = start;
+  bool ok = true;
+
+  for(int i = 0; i < watchCount && ok; i++) {
+    const WatchRange &r = watchRanges[i];
+    if(r.end <= start) {
+      ok = watchEmit(out, n, r.start, r.end, r.kinds);
+      continue;
+    }
+    if(r.start >= end) {
+      ok = watchEmit(out, n, pos, end, set) &&
+        watchEmit(out, n, r.start, r.end, r.kinds);
+      pos = end;
+      continue;
+    }
+    u32 s = r.start > start ? r.start : start;
+    u32 e = r.end < end ? r.end : end;
+    ok = watchEmit(out, n, r.start, start, r.kinds) &&
+      watchEmit(out, n, pos, s, set) &&
+      watchEmit(out, n, s, e, (r.kinds | set) & ~clear) &&
+      watchEmit(out, n, end, r.end, r.kinds);
+    pos = e;
+  }
+  if(ok && pos < end)
+    ok = watchEmit(out, n, pos, end, set);
+  if(!ok)
+    return false;
+
+  memcpy(watchRanges, out, n * sizeof(WatchRange));
+  watchCount = n;
+  watchUpdatePages();
+  return true;
+}
+
+bool watchAdd(u32 address, u32 length, int kinds)
+{
+  return watchSet(address, length, kinds, 0);
+}
+
+bool watchRemove(u32 address, u32 length, int kinds)
+{
+  return watchSet(address, length, 0, kinds);
+}
+
+void watchRemoveAll(int kinds)
+{
+  int n = 0;
+  for(int i = 0; i < watchCount; i++)
+    watchEmit(watchRanges, n, watchRanges[i].start, watchRanges[i].end,
+              watchRanges[i].kinds & ~kinds);
+  watchCount = n;
+  watchUpdatePages();
+}
+
+int watchFind(u32 address, u32 length)
+{
+  // the first range ending after address
+  int lo = 0;
+  int hi = watchCount;
+  while(lo < hi) {
+    int mid = (lo + hi) / 2;
+    if(watchRanges[mid].end <= address)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  int kinds = 0;
+  for(int i = lo; i < watchCount && watchRanges[i].start < address + length;
+      i++)
+    kinds |= watchRanges[i].kinds;
+  return kinds;
+}
+
+void watchHit(u32 address, int kind)
+{
+  watchHitAddress = address;
+  watchHitKind = kind;
+  if(kind == WATCH_EXEC)
+    watchExecSkip = address;
+  debugger = true;
+  cpuNextEvent = 0;
+}
+
+bool watchExec(u32 pc)
+{
+  if(pc == watchExecSkip) {
+    watchExecSkip = 0xFFFFFFFF;
+    return false;
+  }
+  watchExecSkip = 0xFFFFFFFF;
+
+  u8 kinds;
+  switch(pc >> 24) {
+  case 2:
+    kinds = watchWorkRAM[(pc & 0x3FFFF) >> WATCH_PAGE_SHIFT];
+    break;
+  case 3:
+    kinds = watchInternalRAM[(pc & 0x7FFF) >> WATCH_PAGE_SHIFT];
+    break;
+  default:
+    return false;
+  }
+  if(!(kinds & WATCH_EXEC) || !(watchFind(pc, 2) & WATCH_EXEC))
+    return false;
+  watchHit(pc, WATCH_EXEC);
+  return true;
+}
+
+#endif
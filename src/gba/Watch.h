@@ -0,0 +1,60 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+// Watchpoints on the RAM areas (2, 3, 5, 6 and 7). They are kept as a
+// sorted list of address ranges, and each area has a byte per page with the
+// kinds watched anywhere in it, so an access only searches the list when its
+// page is watched.
+
+#define WATCH_WRITE  1 // any write
+#define WATCH_CHANGE 2 // a write that changes the value
+#define WATCH_READ   4
+#define WATCH_EXEC   8 // only in work RAM and internal RAM
+
+#define WATCH_STORE  (WATCH_WRITE | WATCH_CHANGE)
+
+#define WATCH_PAGE_SHIFT 8
+
+extern u8 watchWorkRAM[0x40000 >> WATCH_PAGE_SHIFT];
+extern u8 watchInternalRAM[0x8000 >> WATCH_PAGE_SHIFT];
+extern u8 watchPRAM[0x400 >> WATCH_PAGE_SHIFT];
+extern u8 watchVRAM[0x18000 >> WATCH_PAGE_SHIFT];
+extern u8 watchOAM[0x400 >> WATCH_PAGE_SHIFT];
+// All the kinds watched anywhere
+extern int watchKinds;
+
+// What stopped the emulation last, if it was a watchpoint
+extern u32 watchHitAddress;
+extern int watchHitKind;
+
+// Addresses are the unmirrored ones (VRAM below 0x06018000). Both return
+// false for ranges outside the watchable memory, and watchAdd() when there
+// are too many ranges.
+bool watchAdd(u32 address, u32 length, int kinds);
+bool watchRemove(u32 address, u32 length, int kinds);
+void watchRemoveAll(int kinds);
+// The kinds watched in any of the length bytes at address
+int watchFind(u32 address, u32 length);
+// Stops the emulation at the end of the instruction
+void watchHit(u32 address, int kind);
+// Whether to stop before executing the instruction at pc
+bool watchExec(u32 pc);
+
+// Whether a store of size bytes at address, offset bytes into the area of
+// pages, has to go through the cheatsWrite functions
+static inline bool watchStore(const u8 *pages, u32 offset, u32 address,
+                              int size)
+{
+  return (pages[offset >> WATCH_PAGE_SHIFT] & WATCH_STORE) &&
+         (watchFind(address, size) & WATCH_STORE);
+}
+
+static inline void watchLoad(const u8 *pages, u32 offset, u32 address,
+                             int size)
+{
+  if((pages[offset >> WATCH_PAGE_SHIFT] & WATCH_READ) &&
+     (watchFind(address, size) & WATCH_READ))
+    watchHit(address, WATCH_READ);
+}
+
+#endif // WATCH_H
@@ -213,8 +213,10 @@ char* addHex(char *dest, int siz, u32 val){
 }
 
 int disArm(u32 offset, char *dest, int flags){
-  u32 opcode = debuggerReadMemory(offset);
+  return disArmOpcode(offset, debuggerReadMemory(offset), dest, flags);
+}
 
+int disArmOpcode(u32 offset, u32 opcode, char *dest, int flags){
   const Opcodes *sp = armOpcodes;
   while( sp->cval != (opcode & sp->mask) )
     sp++;
@@ -328,10 +330,12 @@ int disArm(u32 offset, char *dest, int flags){
             adr -= add;
           dest = addHex(dest, 32, adr);
           *dest++ = ']';
-          dest = addStr(dest, " (=");
-          *dest++ = '$';
-          dest = addHex(dest ,32, debuggerReadMemory(adr));
-          *dest++=')';
+          if (!(flags&DIS_NO_MEMORY)){
+            dest = addStr(dest, " (=");
+            *dest++ = '$';
+            dest = addHex(dest ,32, debuggerReadMemory(adr));
+            *dest++=')';
+          }
         }
         if ((opcode&0x072f0000)==0x050f0000){
           *dest++ = '[';
@@ -343,10 +347,12 @@ int disArm(u32 offset, char *dest, int flags){
             adr -= opcode&0xfff;
           dest = addHex(dest, 32, adr);
           *dest++ = ']';
-          dest = addStr(dest, " (=");
-          *dest++ = '$';
-          dest = addHex(dest ,32, debuggerReadMemory(adr));
-          *dest++=')';
+          if (!(flags&DIS_NO_MEMORY)){
+            dest = addStr(dest, " (=");
+            *dest++ = '$';
+            dest = addHex(dest ,32, debuggerReadMemory(adr));
+            *dest++=')';
+          }
         } else {
           int reg = (opcode>>16)&15;
           *dest++ = '[';
@@ -527,7 +533,13 @@ int disArm(u32 offset, char *dest, int flags){
 }
 
 int disThumb(u32 offset, char *dest, int flags){
-  u32 opcode = debuggerReadHalfWord(offset);
+  return disThumbOpcode(offset, debuggerReadHalfWord(offset) |
+                        (debuggerReadHalfWord(offset+2) << 16), dest, flags);
+}
+
+int disThumbOpcode(u32 offset, u32 opcode, char *dest, int flags){
+  u32 nopcode = opcode >> 16;
+  opcode &= 0xffff;
 
   const Opcodes *sp = thumbOpcodes;
   int ret = 2;
@@ -597,7 +609,12 @@ int disThumb(u32 offset, char *dest, int flags){
         dest = addHex(dest, 32, (offset&0xfffffffc)+4+((opcode&0xff)<<2));
         break;
       case 'J':
-        {
+        if (flags&DIS_NO_MEMORY){
+          *dest++ = '[';
+          *dest++ = '$';
+          dest = addHex(dest, 32, (offset&0xfffffffc)+4+((opcode&0xff)<<2));
+          *dest++ = ']';
+        } else {
           u32 value = debuggerReadMemory((offset&0xfffffffc)+4+
                                          ((opcode & 0xff)<<2));
           *dest++ = '$';
@@ -698,7 +715,6 @@ int disThumb(u32 offset, char *dest, int flags){
         break;
       case 'A':
         {
-          int nopcode = debuggerReadHalfWord(offset+2);
           int add = opcode&0x7ff;
           if (add&0x400)
             add |= 0xfff800;
@@ -7,8 +7,14 @@
 
 #define DIS_VIEW_ADDRESS 1
 #define DIS_VIEW_CODE 2
+// don't show the values loaded from literal pools
+#define DIS_NO_MEMORY 4
 
 int disThumb(u32 offset, char *dest, int flags);
 int disArm(u32 offset, char *dest, int flags);
+// Disassembling an opcode given rather than the one in memory; for THUMB the
+// next halfword is in the top half, for BL
+int disThumbOpcode(u32 offset, u32 opcode, char *dest, int flags);
+int disArmOpcode(u32 offset, u32 opcode, char *dest, int flags);
 
 #endif // __ARMDIS_H__
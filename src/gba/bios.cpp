@@ -42,6 +42,178 @@ s16 sineTable[256] = {
   (s16)0xF384, (s16)0xF50F, (s16)0xF69C, (s16)0xF82B, (s16)0xF9BB, (s16)0xFB4B, (s16)0xFCDD, (s16)0xFE6E
 };
 
+// The fast paths below work on host memory directly and are only taken when
+// CPUHostMemory says all of the source and destination is plain memory, so
+// they must leave memory exactly as the CPURead/CPUWrite loops would.
+
+static bool BIOS_Overlaps(u8 *a, u32 aLen, u8 *b, u32 bLen)
+{
+  return a < b + bLen && b < a + aLen;
+}
+
+// CpuSet/CpuFastSet for count units of size bytes
+static bool BIOS_HostSet(u32 source, u32 dest, int count, int size, bool fill)
+{
+  if(count <= 0)
+    return false;
+  u32 len = count * size;
+  u8 *src = CPUHostMemory(source, fill ? size : len, size, false);
+  if(src == NULL)
+    return false;
+  u8 *dst = CPUHostMemory(dest, len, size, true);
+  if(dst == NULL)
+    return false;
+
+  if(fill) {
+    if(size == 4) {
+      u32 value = READ32LE(((u32 *)src));
+      for(u32 i = 0; i < len; i += 4)
+        WRITE32LE(((u32 *)(dst + i)), value);
+    } else {
+      u16 value = READ16LE(((u16 *)src));
+      for(u32 i = 0; i < len; i += 2)
+        WRITE16LE(((u16 *)(dst + i)), value);
+    }
+  } else if(dst <= src || !BIOS_Overlaps(src, len, dst, len)) {
+    memmove(dst, src, len);
+  } else {
+    // copying forward over itself repeats the start
+    for(u32 i = 0; i < len; i += size)
+      memcpy(dst + i, src + i, size);
+  }
+
+  CPUHostWritten(dest, len);
+  return true;
+}
+
+// Diff8bitUnFilter* and Diff16bitUnFilter for n units of size bytes
+static bool BIOS_HostUnFilter(u32 source, u32 dest, int n, int size,
+                              int writeSize)
+{
+  if(n <= 0)
+    return false;
+  u32 len = n * size;
+  u8 *src = CPUHostMemory(source, len, size, false);
+  u8 *dst = CPUHostMemory(dest, len, writeSize, true);
+  if(src == NULL || dst == NULL || BIOS_Overlaps(src, len, dst, len))
+    return false;
+
+  if(size == 1) {
+    u8 data = 0;
+    for(u32 i = 0; i < len; i++) {
+      data += src[i];
+      dst[i] = data;
+    }
+  } else {
+    u16 data = 0;
+    for(u32 i = 0; i < len; i += 2) {
+      data += READ16LE(((u16 *)(src + i)));
+      WRITE16LE(((u16 *)(dst + i)), data);
+    }
+  }
+
+  CPUHostWritten(dest, len);
+  return true;
+}
+
+// RLUnComp* producing len bytes. The Vram version writes halfwords, so an
+// odd last byte is never stored.
+static bool BIOS_HostRLUnComp(u32 source, u32 dest, int len, int size)
+{
+  int n = size == 2 ? len & ~1 : len;
+  if(n <= 0)
+    return false;
+  // at worst every byte costs a header and a data byte
+  u32 srcLen = 2 * len + 2;
+  u8 *src = CPUHostMemory(source, srcLen, 1, false);
+  u8 *dst = CPUHostMemory(dest, n, size, true);
+  if(src == NULL || dst == NULL || BIOS_Overlaps(src, srcLen, dst, n))
+    return false;
+
+  int pos = 0;
+  while(pos < n) {
+    u8 d = *src++;
+    int l = d & 0x7F;
+    if(d & 0x80) {
+      l += 3;
+      if(l > n - pos)
+        l = n - pos;
+      memset(dst + pos, *src++, l);
+    } else {
+      l++;
+      if(l > n - pos)
+        l = n - pos;
+      memcpy(dst + pos, src, l);
+      src += l;
+    }
+    pos += l;
+  }
+
+  CPUHostWritten(dest, n);
+  return true;
+}
+
+// LZ77UnComp* producing len bytes. The Vram version holds an even byte
+// back until its halfword is complete, so a back reference to it still
+// sees the old memory, just like the halfword writes of the real thing.
+static bool BIOS_HostLZ77UnComp(u32 source, u32 dest, int len, int size)
+{
+  int n = size == 2 ? len & ~1 : len;
+  if(n <= 0)
+    return false;
+  // a flag byte per 8 units and no unit longer than what it produces, bar
+  // the last one
+  u32 srcLen = len + len / 8 + 4;
+  u8 *src = CPUHostMemory(source, srcLen, 1, false);
+  u8 *dst = CPUHostMemory(dest, n, size, true);
+  if(src == NULL || dst == NULL || BIOS_Overlaps(src, srcLen, dst, n))
+    return false;
+
+  int pos = 0;
+  u8 pending = 0;
+  while(pos < n) {
+    u8 d = *src++;
+    for(int i = 0; i < 8 && pos < n; i++, d <<= 1) {
+      if(d & 0x80) {
+        int length = (src[0] >> 4) + 3;
+        int window = pos - (((src[0] & 0x0F) << 8) | src[1]) - 1;
+        src += 2;
+        if(length > n - pos)
+          length = n - pos;
+        if(size == 1 && window >= 0 && pos - window >= length) {
+          memcpy(dst + pos, dst + window, length);
+          pos += length;
+          continue;
+        }
+        for(int j = 0; j < length; j++, window++, pos++) {
+          // the window may start before dest, outside what we checked
+          u8 b = window >= 0 ? dst[window] : CPUReadByte(dest + window);
+          if(size == 1)
+            dst[pos] = b;
+          else if(pos & 1) {
+            dst[pos - 1] = pending;
+            dst[pos] = b;
+          } else
+            pending = b;
+        }
+      } else {
+        u8 b = *src++;
+        if(size == 1)
+          dst[pos] = b;
+        else if(pos & 1) {
+          dst[pos - 1] = pending;
+          dst[pos] = b;
+        } else
+          pending = b;
+        pos++;
+      }
+    }
+  }
+
+  CPUHostWritten(dest, n);
+  return true;
+}
+
 void BIOS_ArcTan()
 {
 #ifdef GBA_LOGGING
@@ -267,6 +439,8 @@ void BIOS_CpuSet()
     // needed for 32-bit mode!
     source &= 0xFFFFFFFC;
     dest &= 0xFFFFFFFC;
+    if(BIOS_HostSet(source, dest, count, 4, (cnt >> 24) & 1))
+      return;
     // fill ?
     if((cnt >> 24) & 1) {
         u32 value = (source>0x0EFFFFFF ? 0x1CAD1CAD : CPUReadMemory(source));
@@ -285,6 +459,8 @@ void BIOS_CpuSet()
       }
     }
   } else {
+    if(BIOS_HostSet(source, dest, count, 2, (cnt >> 24) & 1))
+      return;
     // 16-bit fill?
     if((cnt >> 24) & 1) {
       u16 value = (source>0x0EFFFFFF ? 0x1CAD : CPUReadHalfWord(source));
@@ -328,6 +504,10 @@ void BIOS_CpuFastSet()
 
   int count = cnt & 0x1FFFFF;
 
+  // BIOS always transfers 32 bytes at a time
+  if(BIOS_HostSet(source, dest, (count + 7) & ~7, 4, (cnt >> 24) & 1))
+    return;
+
   // fill?
   if((cnt >> 24) & 1) {
     while(count > 0) {
@@ -374,6 +554,9 @@ void BIOS_Diff8bitUnFilterWram()
 
   int len = header >> 8;
 
+  if(BIOS_HostUnFilter(source, dest, len > 0 ? len : 1, 1, 1))
+    return;
+
   u8 data = CPUReadByte(source++);
   CPUWriteByte(dest++, data);
   len--;
@@ -407,6 +590,9 @@ void BIOS_Diff8bitUnFilterVram()
 
   int len = header >> 8;
 
+  if(BIOS_HostUnFilter(source, dest, len & ~1, 1, 2))
+    return;
+
   u8 data = CPUReadByte(source++);
   u16 writeData = data;
   int shift = 8;
@@ -450,6 +636,9 @@ void BIOS_Diff16bitUnFilter()
 
   int len = header >> 8;
 
+  if(BIOS_HostUnFilter(source, dest, len >= 2 ? len >> 1 : 1, 2, 2))
+    return;
+
   u16 data = CPUReadHalfWord(source);
   source += 2;
   CPUWriteHalfWord(dest, data);
@@ -512,6 +701,22 @@ void BIOS_DivARM()
   BIOS_Div();
 }
 
+static inline u8 BIOS_HuffNode(u8 *tree, int treeLen, u32 treeStart, int pos)
+{
+  if(tree != NULL && pos < treeLen)
+    return tree[pos];
+  return CPUReadByte(treeStart + pos);
+}
+
+static inline void BIOS_HuffWrite(u8 *&out, u32 dest, u32 value)
+{
+  if(out != NULL) {
+    WRITE32LE(((u32 *)out), value);
+    out += 4;
+  } else
+    CPUWriteMemory(dest, value);
+}
+
 void BIOS_HuffUnComp()
 {
 #ifdef GBA_LOGGING
@@ -541,6 +746,14 @@ void BIOS_HuffUnComp()
 
   int len = header >> 8;
 
+  // the tree is walked once per bit, so read it straight from host memory
+  // while it stays inside what the header says it is
+  int treeLen = ((treeSize+1)<<1)-1;
+  u8 *tree = CPUHostMemory(treeStart, treeLen, 1, false);
+  u32 outStart = dest;
+  u32 outLen = len > 0 ? (len + 3) & ~3 : 0;
+  u8 *out = CPUHostMemory(dest, outLen, 4, true);
+
   u32 mask = 0x80000000;
   u32 data = CPUReadMemory(source);
   source += 4;
@@ -565,12 +778,12 @@ void BIOS_HuffUnComp()
         // right
         if(currentNode & 0x40)
           writeData = true;
-        currentNode = CPUReadByte(treeStart+pos+1);
+        currentNode = BIOS_HuffNode(tree, treeLen, treeStart, pos+1);
       } else {
         // left
         if(currentNode & 0x80)
           writeData = true;
-        currentNode = CPUReadByte(treeStart+pos);
+        currentNode = BIOS_HuffNode(tree, treeLen, treeStart, pos);
       }
 
       if(writeData) {
@@ -585,7 +798,7 @@ void BIOS_HuffUnComp()
         if(byteCount == 4) {
           byteCount = 0;
           byteShift = 0;
-          CPUWriteMemory(dest, writeValue);
+          BIOS_HuffWrite(out, dest, writeValue);
           writeValue = 0;
           dest += 4;
           len -= 4;
@@ -612,12 +825,12 @@ void BIOS_HuffUnComp()
         // right
         if(currentNode & 0x40)
           writeData = true;
-        currentNode = CPUReadByte(treeStart+pos+1);
+        currentNode = BIOS_HuffNode(tree, treeLen, treeStart, pos+1);
       } else {
         // left
         if(currentNode & 0x80)
           writeData = true;
-        currentNode = CPUReadByte(treeStart+pos);
+        currentNode = BIOS_HuffNode(tree, treeLen, treeStart, pos);
       }
 
       if(writeData) {
@@ -638,7 +851,7 @@ void BIOS_HuffUnComp()
           if(byteCount == 4) {
             byteCount = 0;
             byteShift = 0;
-            CPUWriteMemory(dest, writeValue);
+            BIOS_HuffWrite(out, dest, writeValue);
             dest += 4;
             writeValue = 0;
             len -= 4;
@@ -656,6 +869,9 @@ void BIOS_HuffUnComp()
       }
     }
   }
+
+  if(out != NULL)
+    CPUHostWritten(outStart, outLen);
 }
 
 void BIOS_LZ77UnCompVram()
@@ -685,6 +901,9 @@ void BIOS_LZ77UnCompVram()
 
   int len = header >> 8;
 
+  if(BIOS_HostLZ77UnComp(source, dest, len, 2))
+    return;
+
   while(len > 0) {
     u8 d = CPUReadByte(source++);
 
@@ -770,6 +989,9 @@ void BIOS_LZ77UnCompWram()
 
   int len = header >> 8;
 
+  if(BIOS_HostLZ77UnComp(source, dest, len, 1))
+    return;
+
   while(len > 0) {
     u8 d = CPUReadByte(source++);
 
@@ -879,6 +1101,9 @@ void BIOS_RegisterRamReset(u32 flags)
       // clean OAM
       memset(oam, 0, 0x400);
     }
+    if(flags & 0x1c)
+      gfxInvalidateCaches();
+    CPUStateHashInvalidate();
 
     if(flags & 0x80) {
       int i;
@@ -966,6 +1191,9 @@ void BIOS_RLUnCompVram()
   int byteShift = 0;
   u32 writeValue = 0;
 
+  if(BIOS_HostRLUnComp(source, dest, len, 2))
+    return;
+
   while(len > 0) {
     u8 d = CPUReadByte(source++);
     int l = d & 0x7F;
@@ -1032,6 +1260,9 @@ void BIOS_RLUnCompWram()
 
   int len = header >> 8;
 
+  if(BIOS_HostRLUnComp(source, dest, len, 1))
+    return;
+
   while(len > 0) {
     u8 d = CPUReadByte(source++);
     int l = d & 0x7F;
@@ -1080,6 +1311,7 @@ void BIOS_SoftReset()
   u8 b = internalRAM[0x7ffa];
 
   memset(&internalRAM[0x7e00], 0, 0x200);
+  CPUStateHashInvalidate();
 
   if(b) {
     armNextPC = 0x02000000;
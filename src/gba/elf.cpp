@@ -226,6 +226,8 @@ ELFSectionHeader **elfSectionHeaders = NULL;
 char *elfSectionHeadersStringTable = NULL;
 int elfSectionHeadersCount = 0;
 u8 *elfFileData = NULL;
+int elfFileSize = 0;
+char *elfFileName = NULL;
 
 CompileUnit *elfCompileUnits = NULL;
 DebugInfo *elfDebugInfo = NULL;
@@ -2809,6 +2811,9 @@ bool elfRead(const char *name, int& siz, FILE *f)
     return false;
   }
 
+  elfFileSize = size;
+  elfFileName = (char *)malloc(strlen(name) + 1);
+  strcpy(elfFileName, name);
   return true;
 }
 
@@ -2980,4 +2985,7 @@ void elfCleanUp()
     free(elfFileData);
     elfFileData = NULL;
   }
+  elfFileSize = 0;
+  free(elfFileName);
+  elfFileName = NULL;
 }
@@ -247,6 +247,11 @@ struct Symbol {
   u32 size;
 };
 
+// The whole ELF file last read, for the GDB stub to serve
+extern u8 *elfFileData;
+extern int elfFileSize;
+extern char *elfFileName;
+
 extern u32 elfReadLEB128(u8 *, int *);
 extern s32 elfReadSignedLEB128(u8 *, int *);
 extern bool elfRead(const char *, int &, FILE *f);
@@ -26,6 +26,8 @@
 #endif // _WIN32
 
 #include "GBA.h"
+#include "Watch.h"
+#include "elf.h"
 
 extern bool debugger;
 extern void CPUUpdateCPSR();
@@ -41,6 +43,11 @@ SOCKET remoteSocket = -1;
 SOCKET remoteListenSocket = -1;
 bool remoteConnected = false;
 bool remoteResumed = false;
+// Once GDB has asked for it, packets are no longer acknowledged
+bool remoteNoAck = false;
+
+// The largest packet either side sends, in bytes between the $ and the #
+#define REMOTE_PACKET_SIZE 0x4000
 
 int (*remoteSendFnc)(char *, int) = NULL;
 int (*remoteRecvFnc)(char *, int) = NULL;
@@ -214,37 +221,81 @@ void remoteInit()
     remoteInitFnc();
 }
 
-void remotePutPacket(const char *packet)
+static const char remoteHex[] = "0123456789abcdef";
+
+// What has been received but not handled yet
+static char remoteInput[REMOTE_PACKET_SIZE + 1024];
+static int remoteInputLength = 0;
+
+static int remoteRecvAck(char *c)
 {
-  const char *hex = "0123456789abcdef";
-  char buffer[1024];
+  if(remoteInputLength == 0)
+    return remoteRecvFnc(c, 1);
+  *c = remoteInput[0];
+  remoteInputLength--;
+  memmove(remoteInput, remoteInput + 1, remoteInputLength);
+  return 1;
+}
 
-  size_t count = strlen(packet);
+static void remoteSend(const char *data, int len)
+{
+  while(len > 0) {
+    int res = remoteSendFnc((char *)data, len);
+    if(res <= 0)
+      return;
+    data += res;
+    len -= res;
+  }
+}
+
+// Sends count bytes of packet, escaping whatever GDB would take as framing,
+// so that binary data can go out too
+void remotePutPacketLength(const char *packet, int count)
+{
+  static char buffer[REMOTE_PACKET_SIZE * 2 + 8];
+
+  if(count > REMOTE_PACKET_SIZE * 2)
+    count = REMOTE_PACKET_SIZE * 2;
 
   unsigned char csum = 0;
 
   char *p = buffer;
   *p++ = '$';
 
-  for(size_t i = 0 ;i < count; i++) {
-    csum += packet[i];
-    *p++ = packet[i];
+  for(int i = 0; i < count && p < buffer + sizeof(buffer) - 5; i++) {
+    char c = packet[i];
+    if(c == '$' || c == '#' || c == '}' || c == '*') {
+      csum += '}';
+      *p++ = '}';
+      c ^= 0x20;
+    }
+    csum += c;
+    *p++ = c;
   }
   *p++ = '#';
-  *p++ = hex[csum>>4];
-  *p++ = hex[csum & 15];
-  *p++ = 0;
+  *p++ = remoteHex[csum>>4];
+  *p++ = remoteHex[csum & 15];
   //  printf("Sending %s\n", buffer);
 
+  if(remoteNoAck) {
+    remoteSend(buffer, (int)(p - buffer));
+    return;
+  }
+
   char c = 0;
   while(c != '+'){
-    remoteSendFnc(buffer, (int)count + 4);
-    if(remoteRecvFnc(&c, 1) < 0)
+    remoteSend(buffer, (int)(p - buffer));
+    if(remoteRecvAck(&c) < 0)
 	  return;
 //    fprintf(stderr,"sent:%s recieved:%c\n",buffer,c);
   }
 }
 
+void remotePutPacket(const char *packet)
+{
+  remotePutPacketLength(packet, (int)strlen(packet));
+}
+
 #define debuggerReadMemory(addr) \
   (*(u32*)&map[(addr)>>24].address[(addr) & map[(addr)>>24].mask])
 
@@ -301,6 +352,10 @@ void remoteSendSignal()
 void remoteSendStatus()
 {
   char buffer[1024];
+#ifdef BKPT_SUPPORT
+  if(watchHitKind)
+    remoteSignal = 5;
+#endif
   sprintf(buffer, "T%02x", remoteSignal);
   char *s = buffer;
   s += 3;
@@ -327,37 +382,73 @@ void remoteSendStatus()
           (v >> 24) & 255);
   s += 12;
   *s = 0;
+#ifdef BKPT_SUPPORT
+  if(watchHitKind & (WATCH_STORE | WATCH_READ)) {
+    sprintf(s, "%s:%08x;", watchHitKind == WATCH_READ ? "rwatch" : "watch",
+            watchHitAddress);
+  }
+  watchHitKind = 0;
+#endif
   //  printf("Sending %s\n", buffer);
   remotePutPacket(buffer);
 }
 
-void remoteBinaryWrite(char *p)
+// Where address is in host memory, and how many of the count bytes from
+// there on are next to each other
+static u8 *remoteMemory(u32 address, int &count)
+{
+  memoryMap &m = map[address >> 24];
+  u32 offset = address & m.mask;
+  if((u32)count > m.mask - offset + 1)
+    count = m.mask - offset + 1;
+  return &m.address[offset];
+}
+
+static void remoteMemoryWritten()
+{
+  gfxInvalidateCaches();
+  CPUStateHashInvalidate();
+}
+
+void remoteBinaryWrite(char *p, int length)
 {
   u32 address;
   int count;
   sscanf(p,"%x,%x:", &address, &count);
   //  printf("Binary write for %08x %d\n", address, count);
 
-  p = strchr(p, ':');
+  char *end = p + length;
+  p = (char *)memchr(p, ':', length);
+  if(!p) {
+    remotePutPacket("E01");
+    return;
+  }
   p++;
-  for(int i = 0; i < count; i++) {
-    u8 b = *p++;
-    switch(b) {
-    case 0x7d:
-      b = *p++;
-      debuggerWriteByte(address, (b^0x20));
-      address++;
-      break;
-    default:
-      debuggerWriteByte(address, b);
-      address++;
-      break;
+  while(count > 0 && p < end) {
+    int n = count;
+    u8 *d = remoteMemory(address, n);
+    int i = 0;
+    while(i < n && p < end) {
+      u8 b = *p++;
+      if(b == 0x7d && p < end)
+        b = *p++ ^ 0x20;
+      d[i++] = b;
     }
+    address += i;
+    count -= i;
   }
+  remoteMemoryWritten();
   //  printf("ROM is %08x\n", debuggerReadMemory(0x8000254));
   remotePutPacket("OK");
 }
 
+static int remoteHexDigit(char c)
+{
+  if(c <= '9')
+    return c - '0';
+  return (c | 0x20) + 10 - 'a';
+}
+
 void remoteMemoryWrite(char *p)
 {
   u32 address;
@@ -366,44 +457,79 @@ void remoteMemoryWrite(char *p)
   //  printf("Memory write for %08x %d\n", address, count);
 
   p = strchr(p, ':');
+  if(!p || count < 0 || count > REMOTE_PACKET_SIZE ||
+     (size_t)count > strlen(p + 1) / 2) {
+    remotePutPacket("E01");
+    return;
+  }
   p++;
-  for(int i = 0; i < count; i++) {
-    u8 v = 0;
-    char c = *p++;
-    if(c <= '9')
-      v = (c - '0') << 4;
-    else
-      v = (c + 10 - 'a') << 4;
-    c = *p++;
-    if(c <= '9')
-      v += (c - '0');
-    else
-      v += (c + 10 - 'a');
-    debuggerWriteByte(address, v);
-    address++;
+  while(count > 0) {
+    int n = count;
+    u8 *d = remoteMemory(address, n);
+    for(int i = 0; i < n; i++, p += 2)
+      d[i] = (remoteHexDigit(p[0]) << 4) | remoteHexDigit(p[1]);
+    address += n;
+    count -= n;
   }
+  remoteMemoryWritten();
   //  printf("ROM is %08x\n", debuggerReadMemory(0x8000254));
   remotePutPacket("OK");
 }
 
-void remoteMemoryRead(char *p)
+// Answers m (hex) and x (binary) reads, a block of host memory at a time.
+// Longer reads than fit in a packet get a short reply, and GDB asks for the
+// rest.
+void remoteMemoryRead(char *p, bool binary)
 {
   u32 address;
   int count;
   sscanf(p,"%x,%x:", &address, &count);
   //  printf("Memory read for %08x %d\n", address, count);
 
-  char buffer[1024];
+  static char buffer[REMOTE_PACKET_SIZE + 1];
 
   char *s = buffer;
-  for(int i = 0; i < count; i++) {
-    u8 b = debuggerReadByte(address);
-    sprintf(s, "%02x", b);
-    address++;
-    s += 2;
+  if(binary) {
+    *s++ = 'b';
+    if(count > REMOTE_PACKET_SIZE - 1)
+      count = REMOTE_PACKET_SIZE - 1;
+  } else if(count > REMOTE_PACKET_SIZE / 2)
+    count = REMOTE_PACKET_SIZE / 2;
+
+  while(count > 0) {
+    int n = count;
+    const u8 *b = remoteMemory(address, n);
+    if(binary) {
+      memcpy(s, b, n);
+      s += n;
+    } else {
+      for(int i = 0; i < n; i++) {
+        *s++ = remoteHex[b[i] >> 4];
+        *s++ = remoteHex[b[i] & 15];
+      }
+    }
+    address += n;
+    count -= n;
+  }
+  remotePutPacketLength(buffer, (int)(s - buffer));
+}
+
+// Steps until the pc leaves address to final, all without talking to GDB
+static void remoteStepRange(u32 address, u32 final)
+{
+  remoteResumed = true;
+  remoteSignal = 5;
+  // breakpoints and watchpoints set it again
+  debugger = false;
+  do {
+    CPULoop(1);
+  } while(!debugger && armNextPC >= address && armNextPC < final);
+  debugger = true;
+
+  if(remoteResumed) {
+    remoteResumed = false;
+    remoteSendStatus();
   }
-  *s = 0;
-  remotePutPacket(buffer);
 }
 
 void remoteStepOverRange(char *p)
@@ -414,57 +540,27 @@ void remoteStepOverRange(char *p)
 
   remotePutPacket("OK");
 
-  remoteResumed = true;
-  do {
-    CPULoop(1);
-    if(debugger)
-      break;
-  } while(armNextPC >= address && armNextPC < final);
-
-  remoteResumed = false;
-
-  remoteSendStatus();
+  remoteStepRange(address, final);
 }
 
-void remoteWriteWatch(char *p, bool active)
+void remoteWatch(char *p, int kinds, bool active)
 {
   u32 address;
   int count;
   sscanf(p, ",%x,%x#", &address, &count);
 
-  fprintf(stderr, "Write watch for %08x %d\n", address, count);
-
-  if(address < 0x2000000 || address > 0x3007fff) {
-    remotePutPacket("E01");
-    return;
-  }
-
-  if(address > 0x203ffff && address < 0x3000000) {
-    remotePutPacket("E01");
-    return;
-  }
-
-  u32 final = address + count;
-
-  if(address < 0x2040000 && final > 0x2040000) {
-    remotePutPacket("E01");
-    return;
-  } else if(address < 0x3008000 && final > 0x3008000) {
-    remotePutPacket("E01");
-    return;
-  }
+  fprintf(stderr, "Watch %d for %08x %d\n", kinds, address, count);
 
 #ifdef BKPT_SUPPORT
-  for(int i = 0; i < count; i++) {
-    if((address >> 24) == 2)
-      freezeWorkRAM[address & 0x3ffff] = active;
-    else
-      freezeInternalRAM[address & 0x7fff] = active;
-    address++;
-  }
+  bool ok;
+  if(active)
+    ok = watchAdd(address, count, kinds);
+  else
+    ok = watchRemove(address, count, kinds);
+  remotePutPacket(ok ? "OK" : "E01");
+#else
+  remotePutPacket("");
 #endif
-
-  remotePutPacket("OK");
 }
 
 void remoteReadRegisters(char *p)
@@ -522,7 +618,7 @@ void remoteWriteRegister(char *p)
 
   int i = 0;
 
-  while(c != '#') {
+  while(c && c != '#' && i < 4) {
     u8 b = 0;
     if(c <= '9')
       b = (c - '0') << 4;
@@ -551,6 +647,254 @@ void remoteWriteRegister(char *p)
   remotePutPacket("OK");
 }
 
+// Replies to a qXfer read of offset,length from the size bytes of data
+static void remoteXferRead(const char *p, const char *data, int size)
+{
+  u32 offset;
+  u32 length;
+  if(sscanf(p, "%x,%x", &offset, &length) != 2) {
+    remotePutPacket("E00");
+    return;
+  }
+  if(offset >= (u32)size) {
+    remotePutPacket("l");
+    return;
+  }
+  if(length > REMOTE_PACKET_SIZE - 1)
+    length = REMOTE_PACKET_SIZE - 1;
+
+  static char buffer[REMOTE_PACKET_SIZE];
+  bool last = length >= size - offset;
+  if(last)
+    length = size - offset;
+  buffer[0] = last ? 'l' : 'm';
+  memcpy(buffer + 1, data + offset, length);
+  remotePutPacketLength(buffer, length + 1);
+}
+
+// Everything is writable, so that GDB puts software breakpoints in the ROM
+// too
+static const char remoteMemoryMap[] =
+  "<?xml version=\"1.0\"?>\n"
+  "<!DOCTYPE memory-map PUBLIC \"+//IDN gnu.org//DTD GDB Memory Map V1.0//EN\""
+  " \"http://sourceware.org/gdb/gdb-memory-map.dtd\">\n"
+  "<memory-map>\n"
+  "<memory type=\"ram\" start=\"0x00000000\" length=\"0x4000\"/>\n"
+  "<memory type=\"ram\" start=\"0x02000000\" length=\"0x40000\"/>\n"
+  "<memory type=\"ram\" start=\"0x03000000\" length=\"0x8000\"/>\n"
+  "<memory type=\"ram\" start=\"0x04000000\" length=\"0x400\"/>\n"
+  "<memory type=\"ram\" start=\"0x05000000\" length=\"0x400\"/>\n"
+  "<memory type=\"ram\" start=\"0x06000000\" length=\"0x18000\"/>\n"
+  "<memory type=\"ram\" start=\"0x07000000\" length=\"0x400\"/>\n"
+  "<memory type=\"ram\" start=\"0x08000000\" length=\"0x6000000\"/>\n"
+  "<memory type=\"ram\" start=\"0x0e000000\" length=\"0x10000\"/>\n"
+  "</memory-map>\n";
+
+void remoteQuery(char *p)
+{
+  if(strncmp(p, "Supported", 9) == 0) {
+    char buffer[256];
+    sprintf(buffer, "PacketSize=%x;QStartNoAckMode+;binary-upload+;"
+            "qXfer:memory-map:read+;qXfer:exec-file:read+",
+            REMOTE_PACKET_SIZE);
+    remotePutPacket(buffer);
+  } else if(strncmp(p, "Xfer:memory-map:read::", 22) == 0) {
+    remoteXferRead(p + 22, remoteMemoryMap, sizeof(remoteMemoryMap) - 1);
+  } else if(strncmp(p, "Xfer:exec-file:read:", 20) == 0) {
+    // GDB reads the file itself with vFile
+    p = strchr(p + 20, ':');
+    if(!elfFileName || !p)
+      remotePutPacket("E01");
+    else
+      remoteXferRead(p + 1, elfFileName, (int)strlen(elfFileName));
+  } else if(strcmp(p, "Attached") == 0) {
+    remotePutPacket("1");
+  } else
+    remotePutPacket("");
+}
+
+#define REMOTE_FILE_FD 1
+
+static bool remoteFileOpen = false;
+
+// The host I/O packets, enough for GDB to read the ELF (and its symbols)
+// off the machine running the emulator
+static void remoteFile(char *p)
+{
+  char buffer[128];
+  if(strncmp(p, "setfs:", 6) == 0) {
+    remotePutPacket("F0");
+  } else if(strncmp(p, "open:", 5) == 0) {
+    // the name is in hex, then the flags and mode
+    char name[1024];
+    int n = 0;
+    p += 5;
+    while(p[0] && p[0] != ',' && p[1] && n < (int)sizeof(name) - 1) {
+      name[n++] = (remoteHexDigit(p[0]) << 4) | remoteHexDigit(p[1]);
+      p += 2;
+    }
+    name[n] = 0;
+    int flags = 0;
+    sscanf(p, ",%x", &flags);
+    if(!elfFileData || !elfFileName || strcmp(name, elfFileName))
+      remotePutPacket("F-1,2"); // ENOENT
+    else if(flags & 3)
+      remotePutPacket("F-1,d"); // EACCES
+    else {
+      remoteFileOpen = true;
+      sprintf(buffer, "F%x", REMOTE_FILE_FD);
+      remotePutPacket(buffer);
+    }
+  } else if(strncmp(p, "pread:", 6) == 0) {
+    int fd;
+    u32 count;
+    u32 offset;
+    if(sscanf(p + 6, "%x,%x,%x", &fd, &count, &offset) != 3 ||
+       fd != REMOTE_FILE_FD || !remoteFileOpen || !elfFileData) {
+      remotePutPacket("F-1,9"); // EBADF
+      return;
+    }
+    if(offset > (u32)elfFileSize)
+      offset = elfFileSize;
+    if(count > (u32)elfFileSize - offset)
+      count = elfFileSize - offset;
+    if(count > REMOTE_PACKET_SIZE - 16)
+      count = REMOTE_PACKET_SIZE - 16;
+    static char data[REMOTE_PACKET_SIZE];
+    int n = sprintf(data, "F%x;", count);
+    memcpy(data + n, elfFileData + offset, count);
+    remotePutPacketLength(data, n + count);
+  } else if(strncmp(p, "fstat:", 6) == 0) {
+    int fd = -1;
+    sscanf(p + 6, "%x", &fd);
+    if(fd != REMOTE_FILE_FD || !remoteFileOpen || !elfFileData) {
+      remotePutPacket("F-1,9");
+      return;
+    }
+    // struct stat as GDB's File-I/O has it, big endian
+    u8 st[64];
+    memset(st, 0, sizeof(st));
+    st[10] = 0x81; // st_mode: a regular file
+    st[11] = 0x24; // read only
+    st[15] = 1; // st_nlink
+    for(int i = 0; i < 4; i++)
+      st[35 - i] = (u8)(elfFileSize >> (i * 8)); // st_size
+    st[43] = 1; // st_blksize
+    char *d = buffer + sprintf(buffer, "F%x;", (int)sizeof(st));
+    memcpy(d, st, sizeof(st));
+    remotePutPacketLength(buffer, (int)(d - buffer) + sizeof(st));
+  } else if(strncmp(p, "close:", 6) == 0) {
+    remoteFileOpen = false;
+    remotePutPacket("F0");
+  } else
+    remotePutPacket("");
+}
+
+// Handles vCont, the one action that applies to the only thread. Returns
+// whether the emulation is to go on.
+static bool remoteContinue(char *p)
+{
+  if(*p == '?') {
+    remotePutPacket("vCont;c;C;s;S;r");
+    return false;
+  }
+  if(*p++ != ';') {
+    remotePutPacket("E01");
+    return false;
+  }
+
+  switch(*p) {
+  case 'c':
+  case 'C':
+    remoteResumed = true;
+    debugger = false;
+    return true;
+  case 's':
+  case 'S':
+    remoteResumed = true;
+    remoteSignal = 5;
+    CPULoop(1);
+    if(remoteResumed) {
+      remoteResumed = false;
+      remoteSendStatus();
+    }
+    return false;
+  case 'r':
+    {
+      u32 address;
+      u32 final;
+      if(sscanf(p + 1, "%x,%x", &address, &final) != 2) {
+        remotePutPacket("E01");
+        return false;
+      }
+      remoteStepRange(address, final);
+    }
+    return false;
+  }
+  remotePutPacket("E01");
+  return false;
+}
+
+// Reads the next packet into packet, acknowledging it. Returns its length,
+// -1 when the connection is lost or -2 when there is nothing to read yet.
+// What arrives after the packet is kept for the next call.
+static int remoteGetPacket(char *packet)
+{
+  while(1) {
+    // drop the acks and whatever else comes before the next packet
+    int start = 0;
+    while(start < remoteInputLength && remoteInput[start] != '$') {
+      if(remoteInput[start] != '+')
+        fprintf(stderr, "not sure what to do with:%c\n", remoteInput[start]);
+      start++;
+    }
+    remoteInputLength -= start;
+    memmove(remoteInput, remoteInput + start, remoteInputLength);
+
+    char *end = remoteInputLength ? (char *)memchr(remoteInput, '#', remoteInputLength) : NULL;
+    if(end && end + 2 < remoteInput + remoteInputLength) {
+      int length = (int)(end - remoteInput) - 1;
+      unsigned char csum = 0;
+      for(int i = 0; i < length; i++)
+        csum += remoteInput[i + 1];
+      bool ok = remoteNoAck ||
+        (end[1] == remoteHex[csum>>4] && end[2] == remoteHex[csum & 15]);
+      if(ok) {
+        memcpy(packet, remoteInput + 1, length);
+        packet[length] = 0;
+      } else
+        fprintf(stderr, "bad chksum csum=%x msg=%c%c\n",csum,end[1],end[2]);
+      remoteInputLength -= length + 4;
+      memmove(remoteInput, end + 3, remoteInputLength);
+
+      if(!remoteNoAck) {
+        char ack = ok ? '+' : '-';
+        remoteSendFnc(&ack, 1);
+      }
+      if(ok)
+        return length;
+      continue;
+    }
+
+    if(remoteInputLength == (int)sizeof(remoteInput)) {
+      fprintf(stderr, "Packet too long\n");
+      remoteInputLength = 0;
+      if(!remoteNoAck) {
+        char ack = '-';
+        remoteSendFnc(&ack, 1);
+      }
+    }
+
+    int res = remoteRecvFnc(remoteInput + remoteInputLength,
+                            (int)sizeof(remoteInput) - remoteInputLength);
+    if(res == -2)
+      return -2;
+    if(res <= 0)
+      return -1;
+    remoteInputLength += res;
+  }
+}
+
 extern int emulating;
 
 void remoteStubMain()
@@ -563,13 +907,11 @@ void remoteStubMain()
     remoteResumed = false;
   }
 
-  const char *hex = "0123456789abcdef";
   while(1) {
-    char ack;
-    char buffer[1024];
-    int res = remoteRecvFnc(buffer, 1024);
+    static char packet[REMOTE_PACKET_SIZE + 1024];
+    int length = remoteGetPacket(packet);
 
-    if(res == -1) {
+    if(length == -1) {
       fprintf(stderr, "GDB connection lost\n");
 #ifdef SDL
       dbgMain = debuggerMain;
@@ -577,137 +919,118 @@ void remoteStubMain()
 #endif
       debugger = false;
       break;
-    } else if(res == -2)
+    } else if(length == -2)
       break;
-    if(res < 1024){
-      buffer[res] = 0;
-    }else{
-      fprintf(stderr, "res=%d\n",res);
-    }
 
-//    fprintf(stderr, "res=%d Received %s\n",res, buffer);
-    char c = buffer[0];
-    char *p = &buffer[0];
-    int i = 0;
-    unsigned char csum = 0;
-    while(i < res){
-      if(buffer[i] == '$'){
-        i++;
-        csum = 0;
-        c = buffer[i];
-        p = &buffer[i+1];
-        while((i<res) && (buffer[i] !='#')){
-          csum += buffer[i];
-          i++;
-        }
-      }else if(buffer[i] == '#'){
-        buffer[i] = 0;
-        if((i+2)<res){
-          if((buffer[i+1] == hex[csum>>4]) && (buffer[i+2] == hex[csum & 0xf])){
-            ack = '+';
-            remoteSendFnc(&ack, 1);
-            //fprintf(stderr, "SentACK c=%c\n",c);
-            //process message...
-             switch(c) {
-             case '?':
-               remoteSendSignal();
-               break;
-             case 'D':
-               remotePutPacket("OK");
+//    fprintf(stderr, "Received %s\n", packet);
+    char c = packet[0];
+    char *p = &packet[1];
+    switch(c) {
+    case '?':
+      remoteSendSignal();
+      break;
+    case 'D':
+      remotePutPacket("OK");
 #ifdef SDL
-               dbgMain = debuggerMain;
-               dbgSignal = debuggerSignal;
+      dbgMain = debuggerMain;
+      dbgSignal = debuggerSignal;
 #endif
-               remoteResumed = true;
-               debugger = false;
-               return;
-             case 'e':
-               remoteStepOverRange(p);
-               break;
-             case 'k':
-               remotePutPacket("OK");
+      remoteResumed = true;
+      remoteNoAck = false;
+      debugger = false;
+      return;
+    case 'e':
+      remoteStepOverRange(p);
+      break;
+    case 'k':
+      remotePutPacket("OK");
 #ifdef SDL
-               dbgMain = debuggerMain;
-               dbgSignal = debuggerSignal;
+      dbgMain = debuggerMain;
+      dbgSignal = debuggerSignal;
 #endif
-               debugger = false;
-               emulating = false;
-               return;
-             case 'C':
-               remoteResumed = true;
-               debugger = false;
-               return;
-             case 'c':
-               remoteResumed = true;
-               debugger = false;
-               return;
-             case 's':
-               remoteResumed = true;
-               remoteSignal = 5;
-               CPULoop(1);
-               if(remoteResumed) {
-                 remoteResumed = false;
-                 remoteSendStatus();
-               }
-               break;
-             case 'g':
-               remoteReadRegisters(p);
-               break;
-             case 'P':
-               remoteWriteRegister(p);
-               break;
-             case 'M':
-               remoteMemoryWrite(p);
-               break;
-             case 'm':
-               remoteMemoryRead(p);
-               break;
-             case 'X':
-               remoteBinaryWrite(p);
-               break;
-             case 'H':
-               remotePutPacket("OK");
-               break;
-             case 'q':
-               remotePutPacket("");
-               break;
-             case 'Z':
-               if(*p++ == '2') {
-                 remoteWriteWatch(p, true);
-               } else
-                 remotePutPacket("");
-               break;
-             case 'z':
-               if(*p++ == '2') {
-                 remoteWriteWatch(p, false);
-               } else
-                 remotePutPacket("");
-               break;
-             default:
-               {
-                 fprintf(stderr, "Unknown packet %s\n", --p);
-                 remotePutPacket("");
-               }
-               break;
-             }
-          }else{
-            fprintf(stderr, "bad chksum csum=%x msg=%c%c\n",csum,buffer[i+1],buffer[i+2]);
-            ack = '-';
-            remoteSendFnc(&ack, 1);
-            fprintf(stderr, "SentNACK\n");
-          }//if
-          i+=3;
-        }else{
-          fprintf(stderr, "didn't receive chksum i=%d res=%d\n",i,res);
-          i++;
-        }//if
-      }else{
-        if(buffer[i] != '+'){ //ingnore ACKs
-          fprintf(stderr, "not sure what to do with:%c i=%d res=%d\n",buffer[i],i,res);
-        }
-        i++;
-      }//if
-    }//while
+      remoteNoAck = false;
+      debugger = false;
+      emulating = false;
+      return;
+    case 'C':
+      remoteResumed = true;
+      debugger = false;
+      return;
+    case 'c':
+      remoteResumed = true;
+      debugger = false;
+      return;
+    case 's':
+      remoteResumed = true;
+      remoteSignal = 5;
+      CPULoop(1);
+      if(remoteResumed) {
+        remoteResumed = false;
+        remoteSendStatus();
+      }
+      break;
+    case 'g':
+      remoteReadRegisters(p);
+      break;
+    case 'P':
+      remoteWriteRegister(p);
+      break;
+    case 'M':
+      remoteMemoryWrite(p);
+      break;
+    case 'm':
+      remoteMemoryRead(p, false);
+      break;
+    case 'x':
+      remoteMemoryRead(p, true);
+      break;
+    case 'X':
+      remoteBinaryWrite(p, length - 1);
+      break;
+    case 'H':
+      remotePutPacket("OK");
+      break;
+    case 'q':
+      remoteQuery(p);
+      break;
+    case 'Q':
+      if(strcmp(p, "StartNoAckMode") == 0) {
+        remotePutPacket("OK");
+        remoteNoAck = true;
+      } else
+        remotePutPacket("");
+      break;
+    case 'v':
+      if(strncmp(p, "Cont", 4) == 0) {
+        if(remoteContinue(p + 4))
+          return;
+      } else if(strncmp(p, "File:", 5) == 0)
+        remoteFile(p + 5);
+      else
+        remotePutPacket("");
+      break;
+    case 'Z':
+    case 'z':
+      {
+        // hardware breakpoint, write, read and access watchpoint
+        static const int kinds[5] = {
+          0, WATCH_EXEC, WATCH_WRITE, WATCH_READ,
+          WATCH_READ | WATCH_WRITE
+        };
+        int type = *p++ - '0';
+        if(type >= 1 && type <= 4)
+          remoteWatch(p, kinds[type], p[-2] == 'Z');
+        else
+          remotePutPacket("");
+      }
+      break;
+    default:
+      {
+        fprintf(stderr, "Unknown packet %s\n", --p);
+        remotePutPacket("");
+      }
+      break;
+    }
   }
 }
 
@@ -23,6 +23,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <cmath>
+#include <vector>
 #ifdef __APPLE__
     #include <OpenGL/glu.h>
     #include <OpenGL/glext.h>
@@ -37,13 +38,17 @@
 
 #include <SDL.h>
 
+#include "../common/Movie.h"
 #include "../common/Patch.h"
+#include "../common/SaveWriter.h"
 #include "../gba/GBA.h"
 #include "../gba/agbprint.h"
 #include "../gba/Flash.h"
 #include "../gba/Cheats.h"
 #include "../gba/RTC.h"
 #include "../gba/Sound.h"
+#include "../gba/Sampler.h"
+#include "../gba/Trace.h"
 #include "../gb/gb.h"
 #include "../gb/gbGlobals.h"
 #include "../gb/gbCheats.h"
@@ -58,6 +63,7 @@
 
 #ifndef _WIN32
 # include <unistd.h>
+# include <sys/wait.h>
 # define GETCWD getcwd
 #else // _WIN32
 # include <direct.h>
@@ -100,7 +106,8 @@ struct EmulatedSystem emulator = {
   NULL,
   NULL,
   false,
-  0
+  0,
+  NULL
 };
 
 static SDL_Surface *surface = NULL;
@@ -184,6 +191,15 @@ static int saveSlotPosition = 0; // default is the slot from normal F1
 static int sdlOpenglScale = 1;
 // will scale window on init by this much
 static int sdlSoundToggledOff = 0;
+
+// --verify-movie: replays the movie headless instead of running the game
+static char *sdlVerifyMovieName = NULL;
+static int sdlVerifyJobs = 0;
+// --trace: records every instruction executed into this file
+static char *sdlTraceName = NULL;
+// --sample: profiles the game into this file
+static char *sdlSampleName = NULL;
+static int sdlSampleHz = 1000;
 // allow up to 100 IPS/UPS/PPF patches given on commandline
 #define PATCH_MAX_NUM 100
 int	sdl_patch_num	= 0;
@@ -287,6 +303,12 @@ struct option sdlOptions[] = {
   { "verbose", required_argument, 0, 'v' },
   { "cheat", required_argument, 0, 1000 },
   { "autofire", required_argument, 0, 1001 },
+  { "verify-movie", required_argument, 0, 1002 },
+  { "verify-jobs", required_argument, 0, 1003 },
+  { "trace", required_argument, 0, 1004 },
+  { "decode-trace", required_argument, 0, 1005 },
+  { "sample", required_argument, 0, 1006 },
+  { "sample-hz", required_argument, 0, 1007 },
   { NULL, no_argument, NULL, 0 }
 };
 
@@ -692,6 +714,12 @@ void sdlReadPreferences(FILE *f)
       useBios = sdlFromHex(value) ? true : false;
     } else if(!strcmp(key, "skipBios")) {
       skipBios = sdlFromHex(value) ? true : false;
+    } else if(!strcmp(key, "biosHLE")) {
+      biosHLE = sdlFromHex(value) ? true : false;
+    } else if(!strcmp(key, "threadedRender")) {
+      threadedRender = sdlFromHex(value) ? true : false;
+    } else if(!strcmp(key, "saveJournal")) {
+      saveJournal = sdlFromHex(value) ? true : false;
     } else if(!strcmp(key, "biosFile")) {
       strcpy(biosFileName, value);
     } else if(!strcmp(key, "gbBiosFile")) {
@@ -757,6 +785,8 @@ void sdlReadPreferences(FILE *f)
       }
     } else if(!strcmp(key, "declicking")) {
       gbSoundSetDeclicking(sdlFromHex(value) != 0);
+    } else if(!strcmp(key, "soundFrameLength")) {
+      soundFrameLength = sdlFromDec(value);
     } else if(!strcmp(key, "soundVolume")) {
       float volume = sdlFromDec(value) / 100.0;
       if (volume < 0.0 || volume > SDL_SOUND_MAX_VOLUME)
@@ -1830,9 +1860,97 @@ Long options only:\n\
       --show-speed-normal      Show emulation speed\n\
       --show-speed-detailed    Show detailed speed data\n\
       --cheat 'CHEAT'          Add a cheat\n\
+      --verify-movie=FILE      Replay the movie from all its keyframes and\n\
+                               check each part ends in the next keyframe\n\
+      --verify-jobs=JOBS       Number of processes for --verify-movie\n\
+      --trace=FILE             Record the instructions executed (GBA only)\n\
+      --decode-trace=FILE      Print a recorded trace as disassembly and exit\n\
+      --sample=FILE            Profile the game (GBA only); a pprof profile if\n\
+                               FILE ends in .pb.gz, else collapsed stacks\n\
+      --sample-hz=HZ           Samples per emulated second (default 1000)\n\
 ");
 }
 
+// Replays the segments worker, worker + jobs, ... of the movie and returns
+// how many of them didn't end in the state of their next keyframe.
+static int sdlVerifySegments(int worker, int jobs)
+{
+  if(!movieStartPlayback(&emulator, sdlVerifyMovieName)) {
+    systemMessage(0, "Failed to load movie %s", sdlVerifyMovieName);
+    return 1;
+  }
+
+  int failed = 0;
+  int segments = movieGetSegments();
+  for(int i = worker; i < segments; i += jobs) {
+    if(!movieVerifySegment(i)) {
+      if(movieGetMode() != MOVIE_PLAYING) {
+        systemMessage(0, "Failed to replay movie %s", sdlVerifyMovieName);
+        return failed + 1;
+      }
+      fprintf(stdout, "Segment %d from frame %u doesn't match\n", i,
+              movieGetSegmentStart(i));
+      failed++;
+    }
+  }
+  movieStop();
+  return failed;
+}
+
+// The cores are global state, so the segments are shared out between
+// processes rather than threads.
+static int sdlVerifyMovie()
+{
+  if(!movieStartPlayback(&emulator, sdlVerifyMovieName)) {
+    systemMessage(0, "Failed to load movie %s", sdlVerifyMovieName);
+    return 1;
+  }
+  int segments = movieGetSegments();
+  movieStop();
+
+  int jobs = sdlVerifyJobs;
+#ifndef _WIN32
+  if(jobs < 1)
+    jobs = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  if(jobs > segments)
+    jobs = segments;
+  if(jobs < 1)
+    jobs = 1;
+  fprintf(stdout, "Verifying %d segments with %d jobs\n", segments, jobs);
+  fflush(stdout);
+
+  int failed = 0;
+#ifndef _WIN32
+  if(jobs > 1) {
+    std::vector<pid_t> workers;
+    for(int i = 0; i < jobs; i++) {
+      pid_t pid = fork();
+      if(pid == 0) {
+        int result = sdlVerifySegments(i, jobs);
+        fflush(stdout);
+        _exit(result ? 1 : 0);
+      }
+      if(pid < 0) {
+        failed += sdlVerifySegments(i, jobs);
+        continue;
+      }
+      workers.push_back(pid);
+    }
+    for(size_t i = 0; i < workers.size(); i++) {
+      int status;
+      if(waitpid(workers[i], &status, 0) < 0 ||
+         !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        failed++;
+    }
+  } else
+#endif
+    failed = sdlVerifySegments(0, 1);
+
+  fprintf(stdout, failed ? "Movie verification failed\n" : "Movie verified\n");
+  return failed ? 1 : 0;
+}
+
 /*
  * 04.02.2008 (xKiv) factored out, reformatted, more usefuler rewinds browsing scheme
  */
@@ -1940,6 +2058,33 @@ int main(int argc, char **argv)
       if (autoFireMaxCount < 1)
          autoFireMaxCount = 1;
       break;
+    case 1002:
+      // --verify-movie
+      sdlVerifyMovieName = optarg;
+      break;
+    case 1003:
+      // --verify-jobs
+      sdlVerifyJobs = sdlFromDec(optarg);
+      break;
+    case 1004:
+      // --trace
+      sdlTraceName = optarg;
+      break;
+    case 1005:
+      // --decode-trace
+      if(!traceDecode(optarg, stdout)) {
+        systemMessage(0, "Failed to decode trace %s", optarg);
+        exit(-1);
+      }
+      exit(0);
+    case 1006:
+      // --sample
+      sdlSampleName = optarg;
+      break;
+    case 1007:
+      // --sample-hz
+      sdlSampleHz = sdlFromDec(optarg);
+      break;
     case 'b':
       useBios = true;
       if(optarg == NULL) {
@@ -2148,6 +2293,12 @@ int main(int argc, char **argv)
       sdl_patch_names[sdl_patch_num] = tmp;
       sdl_patch_num++;
 
+      // no patch given yet - look for ROMBASENAME.bps
+      tmp = (char *)malloc(strlen(filename) + 4 + 1);
+      sprintf(tmp, "%s.bps", filename);
+      sdl_patch_names[sdl_patch_num] = tmp;
+      sdl_patch_num++;
+
       // no patch given yet - look for ROMBASENAME.ppf
       tmp = (char *)malloc(strlen(filename) + 4 + 1);
       sprintf(tmp, "%s.ppf", filename);
@@ -2209,6 +2360,13 @@ int main(int argc, char **argv)
             applyPatch(sdl_patch_names[patchnum], &rom, &size) ? " [success]" : "");
         }
         CPUReset();
+
+        if(sdlTraceName && !traceStart(sdlTraceName)) {
+          systemMessage(0, "Failed to create trace %s", sdlTraceName);
+          exit(-1);
+        }
+        if(sdlSampleName)
+          samplerStart(sdlSampleName, sdlSampleHz);
       }
     }
 
@@ -2236,6 +2394,9 @@ int main(int argc, char **argv)
     CPUReset();
   }
 
+  if(sdlVerifyMovieName)
+    exit(sdlVerifyMovie());
+
   sdlReadBattery();
 
   if(debuggerStub)
@@ -2371,6 +2532,10 @@ int main(int argc, char **argv)
 
   emulating = 0;
   fprintf(stdout,"Shutting down\n");
+  if(!traceStop())
+    systemMessage(0, "Error writing trace %s", sdlTraceName);
+  if(!samplerStop())
+    systemMessage(0, "Error writing profile %s", sdlSampleName);
   remoteCleanUp();
   soundShutdown();
 
@@ -2442,6 +2607,9 @@ static void drawSpeed(u8 *screen, int pitch, int x, int y)
 
 void systemDrawScreen()
 {
+  if(sdlVerifyMovieName)
+    return;
+
   unsigned int destPitch = destWidth * (systemColorDepth >> 3);
   u8 *screen;
 
@@ -2562,7 +2730,7 @@ void system10Frames(int rate)
     }
   }
 
-  if(systemSaveUpdateCounter) {
+  if(systemSaveUpdateCounter && !sdlVerifyMovieName) {
     if(--systemSaveUpdateCounter <= SYSTEM_SAVE_NOT_UPDATED) {
       sdlWriteBattery();
       systemSaveUpdateCounter = SYSTEM_SAVE_NOT_UPDATED;
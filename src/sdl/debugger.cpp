@@ -27,6 +27,10 @@
 #include "../gba/Sound.h"
 #include "../gba/armdis.h"
 #include "../gba/elf.h"
+#include "../gba/Watch.h"
+#include "../gba/BreakCond.h"
+#include "../gba/Sampler.h"
+#include "../gba/Trace.h"
 #include "../common/Port.h"
 #include "exprNode.h"
 
@@ -46,26 +50,33 @@ extern struct EmulatedSystem emulator;
 #define debuggerReadByte(addr) \
   map[(addr)>>24].address[(addr) & map[(addr)>>24].mask]
 
+// the state hash doesn't see these writes
 #define debuggerWriteMemory(addr, value) \
-  WRITE32LE(&map[(addr)>>24].address[(addr) & map[(addr)>>24].mask], value)
+  do { \
+    WRITE32LE(&map[(addr)>>24].address[(addr) & map[(addr)>>24].mask], value); \
+    CPUStateHashInvalidate(); \
+  } while(0)
 
 #define debuggerWriteHalfWord(addr, value) \
-  WRITE16LE(&map[(addr)>>24].address[(addr) & map[(addr)>>24].mask], value)
+  do { \
+    WRITE16LE(&map[(addr)>>24].address[(addr) & map[(addr)>>24].mask], value); \
+    CPUStateHashInvalidate(); \
+  } while(0)
 
 #define debuggerWriteByte(addr, value) \
-  map[(addr)>>24].address[(addr) & map[(addr)>>24].mask] = (value)
+  do { \
+    map[(addr)>>24].address[(addr) & map[(addr)>>24].mask] = (value); \
+    CPUStateHashInvalidate(); \
+  } while(0)
 
 struct breakpointInfo {
   u32 address;
   u32 value;
   int size;
 
-  u32 cond_address;
-  char cond_rel;
-  u32 cond_value;
-  int cond_size;
-  bool ia1;
-  bool ia2;
+  // empty for the ones that are always taken
+  BreakCondProgram cond;
+  char condText[64];
 };
 
 struct DebuggerCommand {
@@ -98,6 +109,8 @@ static void debuggerBreakChange(int, char **);
 static void debuggerBreakChangeClear(int, char **);
 static void debuggerBreakWriteClear(int, char **);
 static void debuggerBreakWrite(int, char **);
+static void debuggerBreakReadClear(int, char **);
+static void debuggerBreakRead(int, char **);
 #ifndef FINAL_VERSION
 static void debuggerDebug(int, char **);
 #endif
@@ -123,6 +136,8 @@ static void debuggerMemory(int, char **);
 static void debuggerPrint(int, char **);
 static void debuggerQuit(int, char **);
 static void debuggerSetRadix(int, char **);
+static void debuggerRecord(int, char **);
+static void debuggerSample(int, char **);
 static void debuggerSymbols(int, char **);
 #ifdef GBA_LOGGING
 static void debuggerVerbose(int, char **);
@@ -134,7 +149,7 @@ static void debuggerWriteState(int, char **);
 static void debuggerDumpLoad(int, char**);
 static void debuggerDumpSave(int, char**);
 static void debuggerCondValidate(int n, char **args, int start);
-static bool debuggerCondEvaluate(int num);
+static void debuggerCondUpdate();
 static void debuggerCondBreakThumb(int, char **);
 static void debuggerCondBreakArm(int, char **);
 
@@ -145,13 +160,15 @@ static DebuggerCommand debuggerCommands[] = {
   { "bl", debuggerBreakList,  "List breakpoints" },
   { "bpc", debuggerBreakChange, "Break on change", "<address> <size>" },
   { "bpcc", debuggerBreakChangeClear, "Clear break on change", "[<address> <size>]" },
+  { "bpr", debuggerBreakRead, "Break on read", "<address> <size>" },
+  { "bprc", debuggerBreakReadClear, "Clear break on read", "[<address> <size>]" },
   { "bpw", debuggerBreakWrite, "Break on write", "<address> <size>" },
   { "bpwc", debuggerBreakWriteClear, "Clear break on write", "[<address> <size>]" },
   { "break", debuggerBreak,    "Add a breakpoint on the given function", "<function>|<line>|<file:line>" },
   { "bt", debuggerBreakThumb, "Add a THUMB breakpoint", "<address>" },
   { "c", debuggerContinue,    "Continue execution" , NULL },
-  { "cba", debuggerCondBreakArm, "Add a conditional ARM breakpoint", "<address> $<address>|R<register> <comp> <value> [<size>]\n<comp> either ==, !=, <, >, <=, >=\n<size> either b, h, w" },
-  { "cbt", debuggerCondBreakThumb, "Add a conditional THUMB breakpoint", "<address> $<address>|R<register> <comp> <value> [<size>]\n<comp> either ==, !=, <, >, <=, >=\n<size> either b, h, w" },
+  { "cba", debuggerCondBreakArm, "Add a conditional ARM breakpoint", "<address> $<address>|R<register> <comp> <value> [<size>] [&&|| ...]\n<comp> either ==, !=, <, >, <=, >=\n<size> either b, h, w\nconditions joined with && and || are taken from left to right" },
+  { "cbt", debuggerCondBreakThumb, "Add a conditional THUMB breakpoint", "<address> $<address>|R<register> <comp> <value> [<size>] [&&|| ...]\n<comp> either ==, !=, <, >, <=, >=\n<size> either b, h, w\nconditions joined with && and || are taken from left to right" },
   { "d", debuggerDisassemble, "Disassemble instructions", "[<address> [<number>]]" },
   { "da", debuggerDisassembleArm, "Disassemble ARM instructions", "[<address> [<number>]]" },
   { "dload",debuggerDumpLoad, "Load raw data dump from file","<file> <address>"},
@@ -180,6 +197,8 @@ static DebuggerCommand debuggerCommands[] = {
   { "q", debuggerQuit,        "Quit the emulator", NULL },
   { "r", debuggerRegisters,   "Show ARM registers", NULL },
   { "radix", debuggerSetRadix,   "Set the print radix", "<radix>" },
+  { "record", debuggerRecord, "Record the instructions executed to a trace file; stop recording without one", "[<file>]" },
+  { "sample", debuggerSample, "Start profiling into a file (pprof for .pb.gz, else collapsed stacks); stop and write it without one", "[<file> [<hz>]]" },
   { "save", debuggerWriteState,	"Create a savegame", "<number>" },
   { "symbols", debuggerSymbols, "List symbols", "[<symbol>]" },
 #ifndef FINAL_VERSION
@@ -236,6 +255,8 @@ static void debuggerApplyBreakpoint(u32 address, int num, int size)
 static void debuggerDisableBreakpoints()
 {
   for(int i = 0; i < debuggerNumOfBreakpoints; i++) {
+    if(debuggerBreakpointList[i].cond.length)
+      continue;
     if(debuggerBreakpointList[i].size)
       debuggerWriteMemory(debuggerBreakpointList[i].address,
                           debuggerBreakpointList[i].value);
@@ -245,9 +266,13 @@ static void debuggerDisableBreakpoints()
   }
 }
 
+// The conditional ones are checked by the CPU loops instead
 static void debuggerEnableBreakpoints(bool skipPC)
 {
+  breakCondResolve();
   for(int i = 0; i < debuggerNumOfBreakpoints; i++) {
+    if(debuggerBreakpointList[i].cond.length)
+      continue;
     if(debuggerBreakpointList[i].address == armNextPC && skipPC)
       continue;
 
@@ -866,17 +891,8 @@ static void debuggerContinue(int n, char **args)
     break;
   case 5:
     {
-      bool cond = debuggerCondEvaluate(number & 255);
-      if(cond) {
-        printf("Breakpoint %d reached\n", number);
-        debugger = true;
-      } else {
-        debuggerDisableBreakpoints();
-        debuggerPrefetch();
-        emulator.emuMain(1);
-        debuggerEnableBreakpoints(false);
-        return;
-      }
+      printf("Breakpoint %d reached\n", number);
+      debugger = true;
       debuggerAtBreakpoint = true;
       debuggerBreakpointNumber = number;
       debuggerDisableBreakpoints();
@@ -906,6 +922,8 @@ static void debuggerBreakList(int, char **)
     printf("%3d %08x %s %s\n",i, debuggerBreakpointList[i].address,
            debuggerBreakpointList[i].size ? "ARM" : "THUMB",
            elfGetAddressSymbol(debuggerBreakpointList[i].address));
+    if(debuggerBreakpointList[i].cond.length)
+      printf("    if %s\n", debuggerBreakpointList[i].condText);
   }
 }
 
@@ -918,16 +936,11 @@ static void debuggerBreakDelete(int n, char **args)
       printf("Deleting breakpoint %d (%d)\n", n, debuggerNumOfBreakpoints);
       n++;
       if(n < debuggerNumOfBreakpoints) {
-        for(int i = n; i < debuggerNumOfBreakpoints; i++) {
-          debuggerBreakpointList[i-1].address =
-            debuggerBreakpointList[i].address;
-          debuggerBreakpointList[i-1].value =
-            debuggerBreakpointList[i].value;
-          debuggerBreakpointList[i-1].size =
-            debuggerBreakpointList[i].size;
-        }
+        for(int i = n; i < debuggerNumOfBreakpoints; i++)
+          debuggerBreakpointList[i-1] = debuggerBreakpointList[i];
       }
       debuggerNumOfBreakpoints--;
+      debuggerCondUpdate();
     }
     else
       printf("No breakpoints are set\n");
@@ -1013,6 +1026,7 @@ static void debuggerBreak(int n, char **args)
       debuggerBreakpointList[i].value = type == 0x02 ?
         debuggerReadMemory(address) : debuggerReadHalfWord(address);
       debuggerBreakpointList[i].size = size;
+      debuggerBreakpointList[i].cond.length = 0;
       //      debuggerApplyBreakpoint(address, i, size);
       debuggerNumOfBreakpoints++;
       if(size)
@@ -1035,6 +1049,7 @@ static void debuggerBreakThumb(int n, char **args)
     debuggerBreakpointList[i].address = address;
     debuggerBreakpointList[i].value = debuggerReadHalfWord(address);
     debuggerBreakpointList[i].size = 0;
+    debuggerBreakpointList[i].cond.length = 0;
     //    debuggerApplyBreakpoint(address, i, 0);
     debuggerNumOfBreakpoints++;
     printf("Added THUMB breakpoint at %08x\n", address);
@@ -1051,6 +1066,7 @@ static void debuggerBreakArm(int n, char **args)
     debuggerBreakpointList[i].address = address;
     debuggerBreakpointList[i].value = debuggerReadMemory(address);
     debuggerBreakpointList[i].size = 1;
+    debuggerBreakpointList[i].cond.length = 0;
     //    debuggerApplyBreakpoint(address, i, 1);
     debuggerNumOfBreakpoints++;
     printf("Added ARM breakpoint at %08x\n", address);
@@ -1077,114 +1093,11 @@ static void debuggerBreakArm(int n, char **args)
   debugger = true;
 }
 
-static void debuggerBreakWriteClear(int n, char **args)
+static void debuggerBreakWatch(int n, char **args, int kind, const char *type,
+                               const char *command)
 {
   if(n == 3) {
-    u32 address = 0;
-    sscanf(args[1], "%x", &address);
-    int n = 0;
-    sscanf(args[2], "%d", &n);
-
-	if (! ((address >= 0x02000000 && address < 0x02040000) ||
-		  (address >= 0x03000000 && address < 0x03008000) ||
-      (address >= 0x05000000 && address < 0x05000400) ||
-		  (address >= 0x06000000 && address < 0x06018000) ||
-      (address >= 0x07000000 && address < 0x07000400))) {
-	  printf("Invalid address: %08x\n", address);
-      return;
-  }
-
-    u32 final = address + n;
-    switch(address >> 24) {
-    case 2:
-      {
-        address &= 0x3ffff;
-        final &= 0x3ffff;
-        for(u32 i = address; i < final; i++)
-          if(freezeWorkRAM[i] == 1)
-            freezeWorkRAM[i] = 0;
-        printf("Cleared break on write from %08x to %08x\n",
-               0x2000000+address, 0x2000000+final);
-      }
-      break;
-    case 3:
-      {
-        address &= 0x7fff;
-        final &= 0x7fff;
-        for(u32 i = address; i < final; i++)
-          if(freezeInternalRAM[i] == 1)
-            freezeInternalRAM[i] = 0;
-        printf("Cleared break on write from %08x to %08x\n",
-               0x3000000+address, 0x3000000+final);
-      }
-      break;
-    case 5:
-      {
-        address &= 0x3ff;
-        final &= 0x3ff;
-        for(u32 i = address; i < final; i++)
-          if(freezePRAM[i] == 1)
-            freezePRAM[i] = 0;
-        printf("Cleared break on write from %08x to %08x\n",
-               0x5000000+address, 0x5000000+final);
-      }
-      break;
-	  case 6:
-      {
-        if (address > 0x6010000) {
-          address &= 0x17fff;
-          final &= 0x17fff;
-        } else {
-          address &= 0xffff;
-          final &= 0xffff;
-        }
-
-        for (u32 i = address; i < final; i++)
-          if(freezeVRAM[i] == 1)
-            freezeVRAM[i] = 0;
-        printf("Cleared break on write from %08x to %08x\n",
-               0x06000000+address, 0x06000000+final);
-      }
-      break;
-    case 7:
-      {
-        address &= 0x3ff;
-        final &= 0x3ff;
-        for(u32 i = address; i < final; i++)
-          if(freezeOAM[i] == 1)
-            freezeOAM[i] = 0;
-        printf("Cleared break on write from %08x to %08x\n",
-               0x7000000+address, 0x7000000+final);
-      }
-      break;
-    }
-  } else if(n == 1) {
-    int i;
-    for(i = 0; i < 0x40000; i++)
-      if(freezeWorkRAM[i] == 1)
-        freezeWorkRAM[i] = 0;
-    for(i = 0; i < 0x8000; i++)
-      if(freezeInternalRAM[i] == 1)
-        freezeInternalRAM[i] = 0;
-    for(i = 0; i < 0x400; i++)
-      if(freezePRAM[i] == 1)
-        freezePRAM[i] = 0;
-    for(i = 0; i< 0x18000; i++)
-      if(freezeVRAM[i] == 1)
-        freezeVRAM[i] = 0;
-    for(i = 0; i < 0x400; i++)
-      if(freezeOAM[i] == 1)
-        freezeOAM[i] = 0;
-
-    printf("Cleared all break on write\n");
-  } else
-    debuggerUsage("bpwc");
-}
-
-static void debuggerBreakWrite(int n, char **args)
-{
-  if(n == 3) {
-    if(cheatsNumber != 0) {
+    if((kind & WATCH_STORE) && cheatsNumber != 0) {
       printf("Cheats are enabled. Cannot continue.\n");
       return;
     }
@@ -1193,65 +1106,18 @@ static void debuggerBreakWrite(int n, char **args)
     int n = 0;
     sscanf(args[2], "%d", &n);
 
-	  if (! ((address >= 0x02000000 && address < 0x02040000) ||
-		    (address >= 0x03000000 && address < 0x03008000) ||
-        (address >= 0x05000000 && address < 0x05000400) ||
-  		  (address >= 0x06000000 && address < 0x06018000) ||
-        (address >= 0x07000000 && address < 0x07000400))) {
-	    printf("Invalid address: %08x\n", address);
-        return;
-    }
-
-    u32 final = address + n;
-
-    if(address < 0x2040000 && final > 0x2040000) {
-      printf("Invalid byte count: %d\n", n);
-      return;
-    } else if(address < 0x3008000 && final > 0x3008000) {
-      printf("Invalid byte count: %d\n", n);
-      return;
-    } else if(address < 0x05000400 && final > 0x05000400) {
-      printf("Invalid byte count: %d\n", n);
-      return;
-    } else if(address < 0x06018000 && final > 0x06018000) {
-      printf("Invalid byte count: %d\n", n);
-      return;
-    } else if(address < 0x07000400 && final > 0x07000400) {
-      printf("Invalid byte count: %d\n", n);
+    if(n <= 0 || !watchAdd(address, n, kind)) {
+      printf("Invalid address or byte count: %08x %d\n", address, n);
       return;
     }
 
-    printf("Added break on write at %08x for %d bytes\n", address, n);
-
-    switch(address >> 24) {
-      case 2:
-        for (int i = 0; i < n; i++)
-          freezeWorkRAM[(address + i) & 0x3ffff] = 1;
-        break;
-      case 3:
-        for (int i = 0; i < n; i++)
-          freezeInternalRAM[(address + i) & 0x7fff] = 1;
-        break;
-      case 5:
-        for (int i = 0; i < n; i++)
-          freezePRAM[(address + i) & 0x3ff] = 1;
-        break;
-      case 6:
-        // address/range must be valid, so we can use a lazy mask
-        for (int i = 0; i < n; i++)
-          freezeVRAM[(address + i) & 0x1ffff] = 1;
-        break;
-      case 7:
-        for (int i = 0; i < n; i++)
-          freezeOAM[(address + i) & 0x3ff] = 1;
-        break;
-    }
-
+    printf("Added break on %s at %08x for %d bytes\n", type, address, n);
   } else
-    debuggerUsage("bpw");
+    debuggerUsage(command);
 }
 
-static void debuggerBreakChangeClear(int n, char **args)
+static void debuggerBreakWatchClear(int n, char **args, int kind,
+                                    const char *type, const char *command)
 {
   if(n == 3) {
     u32 address = 0;
@@ -1259,165 +1125,48 @@ static void debuggerBreakChangeClear(int n, char **args)
     int n = 0;
     sscanf(args[2], "%d", &n);
 
-	  if (! ((address >= 0x02000000 && address < 0x02040000) ||
-		    (address >= 0x03000000 && address < 0x03008000) ||
-        (address >= 0x05000000 && address < 0x05000400) ||
-  		  (address >= 0x06000000 && address < 0x06018000) ||
-        (address >= 0x07000000 && address < 0x07000400))) {
-	    printf("Invalid address: %08x\n", address);
-        return;
+    if(n <= 0 || !watchRemove(address, n, kind)) {
+      printf("Invalid address or byte count: %08x %d\n", address, n);
+      return;
     }
 
-    u32 final = address + n;
-    switch(address >> 24) {
-    case 2:
-      {
-        address &= 0x3ffff;
-        final &= 0x3ffff;
-        for(u32 i = address; i < final; i++)
-          if(freezeWorkRAM[i] == 2)
-            freezeWorkRAM[i] = 0;
-        printf("Cleared break on change from %08x to %08x\n",
-               0x2000000+address, 0x2000000+final);
-      }
-      break;
-    case 3:
-      {
-        address &= 0x7fff;
-        final &= 0x7fff;
-        for(u32 i = address; i < final; i++)
-          if(freezeInternalRAM[i] == 2)
-            freezeInternalRAM[i] = 0;
-        printf("Cleared break on change from %08x to %08x\n",
-               0x3000000+address, 0x3000000+final);
-      }
-      break;
-    case 5:
-      {
-        address &= 0x3ff;
-        final &= 0x3ff;
-        for(u32 i = address; i < final; i++)
-          if(freezePRAM[i] == 2)
-            freezePRAM[i] = 0;
-        printf("Cleared break on change from %08x to %08x\n",
-               0x5000000+address, 0x5000000+final);
-      }
-      break;
-    case 6:
-      {
-        if (address > 0x6010000) {
-          address &= 0x17fff;
-          final &= 0x17fff;
-        } else {
-          address &= 0xffff;
-          final &= 0xffff;
-        }
-        for(u32 i = address; i < final; i++)
-          if(freezeVRAM[i] == 2)
-            freezeVRAM[i] = 0;
-        printf("Cleared break on change from %08x to %08x\n",
-               0x3000000+address, 0x3000000+final);
-      }
-      break;
-    case 7:
-      {
-        address &= 0x3ff;
-        final &= 0x3ff;
-        for(u32 i = address; i < final; i++)
-          if(freezeOAM[i] == 2)
-            freezeOAM[i] = 0;
-        printf("Cleared break on change from %08x to %08x\n",
-               0x7000000+address, 0x7000000+final);
-      }
-      break;
-    }
+    printf("Cleared break on %s from %08x to %08x\n",
+           type, address, address + n);
   } else if(n == 1) {
-    int i;
-    for(i = 0; i < 0x40000; i++)
-      if(freezeWorkRAM[i] == 2)
-        freezeWorkRAM[i] = 0;
-    for(i = 0; i < 0x8000; i++)
-      if(freezeInternalRAM[i] == 2)
-        freezeInternalRAM[i] = 0;
-    for(i = 0; i < 0x400; i++)
-      if(freezePRAM[i] == 2)
-        freezePRAM[i] = 0;
-    for(i = 0; i < 0x18000; i++)
-      if(freezeVRAM[i] == 2)
-        freezeVRAM[i] = 0;
-    for(i = 0; i < 0x400; i++)
-      if(freezeOAM[i] == 2)
-        freezeOAM[i] = 0;
-
-    printf("Cleared all break on change\n");
+    watchRemoveAll(kind);
+    printf("Cleared all break on %s\n", type);
   } else
-    debuggerUsage("bpcc");
+    debuggerUsage(command);
 }
 
-static void debuggerBreakChange(int n, char **args)
+static void debuggerBreakWriteClear(int n, char **args)
 {
-  if(n == 3) {
-    if(cheatsNumber != 0) {
-      printf("Cheats are enabled. Cannot continue.\n");
-      return;
-    }
-    u32 address = 0;
-    sscanf(args[1], "%x", &address);
-    int n = 0;
-    sscanf(args[2], "%d", &n);
+  debuggerBreakWatchClear(n, args, WATCH_WRITE, "write", "bpwc");
+}
 
-	  if (! ((address >= 0x02000000 && address < 0x02040000) ||
-		    (address >= 0x03000000 && address < 0x03008000) ||
-        (address >= 0x05000000 && address < 0x05000400) ||
-  		  (address >= 0x06000000 && address < 0x06018000) ||
-        (address >= 0x07000000 && address < 0x07000400))) {
-	    printf("Invalid address: %08x\n", address);
-        return;
-    }
+static void debuggerBreakWrite(int n, char **args)
+{
+  debuggerBreakWatch(n, args, WATCH_WRITE, "write", "bpw");
+}
 
-    u32 final = address + n;
+static void debuggerBreakChangeClear(int n, char **args)
+{
+  debuggerBreakWatchClear(n, args, WATCH_CHANGE, "change", "bpcc");
+}
 
-    if(address < 0x2040000 && final > 0x2040000) {
-      printf("Invalid byte count: %d\n", n);
-      return;
-    } else if(address < 0x3008000 && final > 0x3008000) {
-      printf("Invalid byte count: %d\n", n);
-      return;
-    } else if(address < 0x6018000 && final > 0x6018000) {
-      printf("Invalid byte count: %d\n", n);
-      return;
-    } else if(address < 0x7000400 && final > 0x7000400) {
-      printf("Invalid byte count: %d\n", n);
-      return;
-    }
-    printf("Added break on change at %08x for %d bytes\n", address, n);
+static void debuggerBreakChange(int n, char **args)
+{
+  debuggerBreakWatch(n, args, WATCH_CHANGE, "change", "bpc");
+}
 
-    switch(address >> 24) {
-      case 2:
-        for (int i = 0; i < n; i++)
-          freezeWorkRAM[(address + i) & 0x3ffff] = 2;
-        break;
-      case 3:
-        for (int i = 0; i < n; i++)
-          freezeInternalRAM[(address + i) & 0x7fff] = 2;
-        break;
-      case 5:
-        for (int i = 0; i < n; i++)
-          freezePRAM[(address + i) & 0x3ff] = 2;
-        break;
-      case 6:
-        // address/range must be valid, so we can use a lazy mask
-        for (int i = 0; i < n; i++)
-          freezeVRAM[(address + i) & 0x1ffff] = 2;
-        break;
-      case 7:
-        for (int i = 0; i < n; i++)
-          freezeOAM[(address + i) & 0x3ff] = 2;
-        break;
-    }
+static void debuggerBreakReadClear(int n, char **args)
+{
+  debuggerBreakWatchClear(n, args, WATCH_READ, "read", "bprc");
+}
 
-  } else
-    debuggerUsage("bpc");
+static void debuggerBreakRead(int n, char **args)
+{
+  debuggerBreakWatch(n, args, WATCH_READ, "read", "bpr");
 }
 
 static void debuggerDisassembleArm(FILE *f, u32 pc, int count)
@@ -1935,6 +1684,7 @@ static void debuggerEditByte(int n, char **args)
     sscanf(args[1], "%x", &address);
     sscanf(args[2], "%x", &byte);
     debuggerWriteByte(address, (u8)byte);
+    gfxInvalidateCaches();
   } else
     debuggerUsage("eb");
 }
@@ -1951,6 +1701,7 @@ static void debuggerEditHalfWord(int n, char **args)
     }
     sscanf(args[2], "%x", &HalfWord);
     debuggerWriteHalfWord(address, (u16)HalfWord);
+    gfxInvalidateCaches();
   } else
     debuggerUsage("eh");
 }
@@ -1985,6 +1736,7 @@ static void debuggerEdit(int n, char **args)
     }
     sscanf(args[2], "%x", &byte);
     debuggerWriteMemory(address, (u32)byte);
+    gfxInvalidateCaches();
   } else
     debuggerUsage("ew");
 }
@@ -2208,6 +1960,43 @@ static void debuggerDumpSave(int n, char** args)
     debuggerUsage("dsave");
 }
 
+static void debuggerRecord(int n, char **args)
+{
+  if(n == 2) {
+    if(traceStart(args[1]))
+      printf("Recording to %s\n", args[1]);
+    else
+      printf("Error opening file.\n");
+  } else if(n == 1) {
+    if(!traceActive)
+      printf("Not recording\n");
+    else if(traceStop())
+      printf("Recording stopped\n");
+    else
+      printf("Error writing file.\n");
+  } else
+    debuggerUsage("record");
+}
+
+static void debuggerSample(int n, char **args)
+{
+  if(n == 2 || n == 3) {
+    int hz = n == 3 ? atoi(args[2]) : 1000;
+    if(samplerStart(args[1], hz))
+      printf("Profiling to %s\n", args[1]);
+    else
+      printf("Error starting the profiler.\n");
+  } else if(n == 1) {
+    if(!samplerActive)
+      printf("Not profiling\n");
+    else if(samplerStop())
+      printf("Profile written\n");
+    else
+      printf("Error writing file.\n");
+  } else
+    debuggerUsage("sample");
+}
+
 static void debuggerCondBreakThumb(int n, char **args)
 {
   if(n > 4) { //conditional args handled separately
@@ -2242,320 +2031,157 @@ static void debuggerCondBreakArm(int n, char **args)
     debuggerUsage("cba");
 }
 
-static void debuggerCondValidate(int n, char **args,int start)
+static bool debuggerCondEmit(BreakCondProgram *p, int op, u32 value = 0)
 {
-  /*
-    0: address/register
-    1: op
-    2: value
-    3: size
-  */
-
-  int i=debuggerNumOfBreakpoints;
-
-  char *address=args[start];
-  const char *op=args[start+1];
-  char *value=args[start+2];
-  const char *tsize,*taddress,*tvalue;
-
-  int rel=0;
-
-  u32 value1=0;
-  u32 value2=0;
-
-  char size=0;
-  int j=1;
-
-  if(n==6) {
-    size = args[start+3][0];
-    if(size != 'b' && size != 'h' && size != 'w') {
-      printf("Invalid size.\n");
-      return;
-    }
+  if(breakCondEmit(p, op, value))
+    return true;
+  printf("Condition too long.\n");
+  return false;
+}
 
-    switch(size) {
-    case 'b':
-      debuggerBreakpointList[i].cond_size=1;
-      tsize="byte";
-      break;
-    case 'h':
-      debuggerBreakpointList[i].cond_size=2;
-      tsize="halfword";
-      break;
-    case 'w':
-      debuggerBreakpointList[i].cond_size=4;
-      tsize="word";
-      break;
-    }
-  }
+// $<address>, R<register> or an immediate value
+static bool debuggerCondOperand(BreakCondProgram *p, const char *s, char size)
+{
+  u32 value = 0;
 
-  switch(toupper(address[0])) {
+  switch(toupper(s[0])) {
   case '$': //is address
-    while (address[j]) {
-      address[j-1]=address[j];
-      j++;
-    }
-    address[j-1]=0;
-
-    sscanf(address,"%x",&value1);
+    sscanf(s + 1, "%x", &value);
     switch(size) {
+    case 'b':
+      return debuggerCondEmit(p, BREAK_COND_MEM8, value);
     case 'h':
-      if(value1 & 1) {
-        printf("Misaligned Conditional Address.\n");
-        return;
-      }
-      break;
+      if(value & 1)
+        break;
+      return debuggerCondEmit(p, BREAK_COND_MEM16, value);
     case 'w':
-      if(value1 & 3) {
-        printf("Misaligned Conditional Address.\n");
-        return;
-      }
-    case 'b':
-      break;
+      if(value & 3)
+        break;
+      return debuggerCondEmit(p, BREAK_COND_MEM32, value);
     default:
       printf("Erroneous Condition\n");
-      debuggerUsage((char *)((toupper(args[0][2])=='T') ? "cbt" : "cba"));
-      return;
+      return false;
     }
-    debuggerBreakpointList[i].ia1=true;
-    taddress="$";
-    break;
+    printf("Misaligned Conditional Address.\n");
+    return false;
   case 'R': //is register
-    while(address[j]) {
-      address[j-1]=address[j];
-      j++;
-    }
-    address[j-1]=0;
-    sscanf(address,"%d",&value1);
-
-    if(value1 > 16) {
+    sscanf(s + 1, "%d", &value);
+    if(value > 16) {
       printf("Invalid Register.\n");
-      return;
+      return false;
     }
-    if(size)
-      size=0;
-    debuggerBreakpointList[i].ia1=true;
-    taddress="r";
-    break;
+    return debuggerCondEmit(p, BREAK_COND_REG, value);
   default: //immediate;
-    printf("First Comparison Parameter should not be Immediate\n");
-    return;
-  }
-
-  debuggerBreakpointList[i].cond_address = value1;
-
-  // Check op
-  switch(op[0]) {
-  case '=': // 1
-    if (op[1] == '=' && op[2]==0)
-      rel=1;
-    else
-      goto error;
-    break;
-  case '!': //2
-    if (op[1]=='=' && op[2]==0)
-      rel=2;
-    else
-      goto error;
-    break;
-  case '<': //3
-    if(op[1]=='=')
-      rel=5;
-    else if (op[1]==0)
-      rel=3;
-    else
-      goto error;
-    break;
-  case '>': //4
-    if (op[1]=='=')
-      rel=6;
-    else if (op[1]==0)
-      rel=4;
-    else
-      goto error;
-    break;
-  default:
-  error:
-    printf("Invalid comparison operator.\n");
-    return;
+    sscanf(s, "%x", &value);
+    if(size == 'b')
+      value &= 0xFF;
+    else if(size == 'h')
+      value &= 0xFFFF;
+    return debuggerCondEmit(p, BREAK_COND_CONST, value);
   }
+}
 
-  if(op==0) {
-    printf("Invalid comparison operator.\n");
-    return;
-  }
-  debuggerBreakpointList[i].cond_rel=rel;
+static int debuggerCondRelation(const char *op)
+{
+  static const char *ops[] = { "==", "!=", "<", ">", "<=", ">=" };
+  static const int rels[] = {
+    BREAK_COND_EQ, BREAK_COND_NE, BREAK_COND_LT, BREAK_COND_GT,
+    BREAK_COND_LE, BREAK_COND_GE
+  };
+  for(int i = 0; i < 6; i++)
+    if(!strcmp(op, ops[i]))
+      return rels[i];
+  return 0;
+}
 
-  switch(toupper(value[0])) {
-  case '$': //is address
-    while(value[j]) {
-      value[j-1]=value[j];
-      j++;
+// Compiles the condition in args[start] onwards into a program for the
+// breakpoint being added
+static void debuggerCondValidate(int n, char **args,int start)
+{
+  int i=debuggerNumOfBreakpoints;
+  BreakCondProgram *p = &debuggerBreakpointList[i].cond;
+  const char *cmd = (toupper(args[0][2])=='T') ? "cbt" : "cba";
+  int join = 0;
+  int k = start;
+
+  breakCondStart(p);
+  for(;;) {
+    if(k + 3 > n) {
+      debuggerUsage(cmd);
+      p->length = 0;
+      return;
     }
-    value[j-1]=0;
-
-    sscanf(value,"%x",&value2);
-    debuggerBreakpointList[i].ia2=true;
-    tvalue="$";
-    switch(size) {
-    case 'h':
-      if(value2 & 1) {
-        printf("Misaligned Conditional Address.\n");
-        return;
-      }
-      break;
-    case 'w':
-      if(value2 & 3) {
-        printf("Misaligned Conditional Address.\n");
-        return;
-      }
-    case 'b':
-      break;
-    default:
-      printf("Erroneous Condition\n");
-      debuggerUsage((char *)((toupper(args[0][2])=='T') ? "cbt" : "cba"));
+    const char *op = args[k+1];
+    char size = 0;
+    if(k + 3 < n && args[k+3][0] && !args[k+3][1] &&
+       strchr("bhw", args[k+3][0]))
+      size = args[k+3][0];
+
+    int rel = debuggerCondRelation(op);
+    if(!rel) {
+      printf("Invalid comparison operator.\n");
+      p->length = 0;
       return;
     }
-    break;
-  case 'R': //is register
-    while(value[j]) {
-      value[j-1]=value[j];
-      j++;
+    if(args[k][0] != '$' && toupper(args[k][0]) != 'R') {
+      printf("First Comparison Parameter should not be Immediate\n");
+      p->length = 0;
+      return;
     }
-    value[j-1]=0;
-    sscanf(value,"%d",&value2);
-
-    if(value2 > 16) {
-      printf("Invalid Register.\n");
+    if(!debuggerCondOperand(p, args[k], size) ||
+       !debuggerCondOperand(p, args[k+2], size) ||
+       !debuggerCondEmit(p, rel) ||
+       (join && !debuggerCondEmit(p, join))) {
+      p->length = 0;
       return;
     }
-    debuggerBreakpointList[i].ia2=true;
-    tvalue="r";
-    break;
-  default: //immediate;
-    sscanf(value, "%x",&value2);
-    debuggerBreakpointList[i].ia2=false;
-    tvalue="0x";
+    k += size ? 4 : 3;
 
-    switch(size) {
-    case 'b':
-      value2 &=0xFF;
-      break;
-    case 'h':
-      value2 &=0xFFFF;
-      break;
-    default:
-    case 'w':
-      value2 &=0xFFFFFFFF;
+    if(k == n)
       break;
+    if(!strcmp(args[k], "&&"))
+      join = BREAK_COND_AND;
+    else if(!strcmp(args[k], "||"))
+      join = BREAK_COND_OR;
+    else {
+      debuggerUsage(cmd);
+      p->length = 0;
+      return;
     }
-    break;
+    k++;
   }
 
-  debuggerBreakpointList[i].cond_value = value2;
-  debuggerNumOfBreakpoints++;
-
-  // At here, everything's set. Display message.
-  switch(size) {
-  case 0:
-    printf("Added breakpoint on %08X if R%02d %s %08X\n",
-           debuggerBreakpointList[i].address,
-           debuggerBreakpointList[i].cond_address,
-           op,
-           debuggerBreakpointList[i].cond_value);
-    break;
-  case 'b':
-    printf("Added breakpoint on %08X if %s%08X %s %s%02X\n",
-           debuggerBreakpointList[i].address,
-           taddress,
-           debuggerBreakpointList[i].cond_address,
-           op,tvalue,
-           debuggerBreakpointList[i].cond_value);
-    break;
-  case 'h':
-    printf("Added breakpoint on %08X if %s%08X %s %s%04X\n",
-           debuggerBreakpointList[i].address,
-           taddress,
-           debuggerBreakpointList[i].cond_address,
-           op,
-           tvalue,
-           debuggerBreakpointList[i].cond_value);
-    break;
-  case 'w':
-    printf("Added breakpoint on %08X if %s%08X %s %s%08X\n",
-           debuggerBreakpointList[i].address,
-           taddress,
-           debuggerBreakpointList[i].cond_address,
-           op,tvalue,
-           debuggerBreakpointList[i].cond_value);
-    break;
+  if(!debuggerCondEmit(p, BREAK_COND_END) ||
+     !breakCondSet(i, debuggerBreakpointList[i].address, p)) {
+    printf("Invalid breakpoint.\n");
+    p->length = 0;
+    return;
   }
-}
 
-static bool debuggerCondEvaluate(int num)
-{
-  // check if there is a condition
-  if(debuggerBreakpointList[num].cond_rel == 0)
-    return true;
-
-  u32 address=debuggerBreakpointList[num].cond_address;
-  char size=debuggerBreakpointList[num].cond_size;
-  u32 value=debuggerBreakpointList[num].cond_value;
-  u32 value1=0;
-  u32 value2=0;
-
-  if(address<17)
-    value1=reg[address].I;
-  else {
-    switch(size) {
-    case 1:
-      value1=debuggerReadByte(address);
-      break;
-    case 2:
-      value1=debuggerReadHalfWord(address);
+  char *text = debuggerBreakpointList[i].condText;
+  text[0] = 0;
+  for(k = start; k < n; k++) {
+    if(strlen(text) + strlen(args[k]) + 2 > sizeof(debuggerBreakpointList[i].condText))
       break;
-    default:
-      value1=debuggerReadMemory(address);
-      break;
-    }
+    if(k > start)
+      strcat(text, " ");
+    strcat(text, args[k]);
   }
+  debuggerNumOfBreakpoints++;
 
-  //value2
-  if(debuggerBreakpointList[num].ia2) { //is address or register
-    if(value<17)
-      value2=reg[address].I;
-    else {
-      switch(size) {
-      case 'b':
-        value2=debuggerReadByte(value);
-        break;
-      case 'h':
-        value2=debuggerReadHalfWord(value);
-        break;
-      default:
-        value2=debuggerReadMemory(value);
-        break;
-      }
-    }
-  } else
-    value2=value;
-
-  switch(debuggerBreakpointList[num].cond_rel) {
-  case 1: // ==
-    return (value1 == value2);
-  case 2: // !=
-    return (value1 != value2);
-  case 3: // <
-    return (value1 < value2);
-  case 4: // >
-    return (value1 > value2);
-  case 5: // <=
-    return (value1 <= value2);
-  case 6: // >=
-    return (value1 >= value2);
-  default:
-    return false; //should never happen
-  }
+  printf("Added breakpoint %d on %08X if %s\n", i,
+         debuggerBreakpointList[i].address, text);
+}
+
+// Hands the conditional breakpoints to the CPU loops again, once their
+// numbers have changed
+static void debuggerCondUpdate()
+{
+  breakCondClearAll();
+  for(int i = 0; i < debuggerNumOfBreakpoints; i++)
+    if(debuggerBreakpointList[i].cond.length)
+      breakCondSet(i, debuggerBreakpointList[i].address,
+                   &debuggerBreakpointList[i].cond);
 }
 
 /*extern*/ void debuggerOutput(const char *s, u32 addr)
@@ -2636,9 +2262,19 @@ char* strqtok (char* string, const char* ctrl)
 /*extern*/ void debuggerMain()
 {
   char buffer[1024];
-  char *commands[10];
+  char *commands[32];
   int commandCount = 0;
 
+  // the store watches were reported by debuggerBreakOnWrite()
+  if(watchHitKind & WATCH_READ)
+    printf("Breakpoint (on read) address %08x\n", watchHitAddress);
+  else if(watchHitKind & WATCH_EXEC)
+    printf("Breakpoint (on execute) address %08x\n", watchHitAddress);
+  watchHitKind = 0;
+  if(breakCondHitNumber >= 0)
+    printf("Breakpoint %d reached\n", breakCondHitNumber);
+  breakCondHitNumber = -1;
+
   if(emulator.emuUpdateCPSR)
     emulator.emuUpdateCPSR();
   debuggerRegisters(0, NULL);
@@ -2656,7 +2292,7 @@ char* strqtok (char* string, const char* ctrl)
     commandCount++;
     while((s = strqtok(NULL, " \t\n"))) {
       commands[commandCount++] = s;
-      if(commandCount == 10)
+      if(commandCount == 32)
         break;
     }
 
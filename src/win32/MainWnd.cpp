@@ -457,10 +457,13 @@ bool MainWnd::FileRun()
   if( !fileExists( patchName ) ) {
 	  patchName.Format("%s.ups", theApp.filename);
 	  if( !fileExists( patchName ) ) {
-		  patchName.Format("%s.ppf", theApp.filename);
+		  patchName.Format("%s.bps", theApp.filename);
 		  if( !fileExists( patchName ) ) {
-			  // don't use any patches
-			  patchName.Empty();
+			  patchName.Format("%s.ppf", theApp.filename);
+			  if( !fileExists( patchName ) ) {
+				  // don't use any patches
+				  patchName.Empty();
+			  }
 		  }
 	  }
   }
@@ -16,6 +16,7 @@ extern "C" {
 #include <libavformat/avformat.h>
 }
 #endif
+#include "../common/Movie.h"
 #include "../gb/gbPrinter.h"
 #include "../gba/agbprint.h"
 
@@ -1126,7 +1127,11 @@ EVT_HANDLER_MASK(EmulatorSpeedupToggle, "Turbo mode (toggle)", CMDEN_GB|CMDEN_GB
 
 EVT_HANDLER_MASK(Reset, "Reset", CMDEN_GB|CMDEN_GBA)
 {
-    panel->emusys->emuReset();
+    // a recording movie resets at the next frame, so it plays back the same
+    if(movieGetMode() == MOVIE_RECORDING)
+	movieReset();
+    else
+	panel->emusys->emuReset();
     // systemScreenMessage("Reset");
 }
 
@@ -97,8 +97,11 @@ void GameArea::LoadGame(const wxString &name)
 	if(!pfn.IsFileReadable()) {
 	    pfn.SetExt(wxT(".ups"));
 	    if(!pfn.IsFileReadable()) {
-		pfn.SetExt(wxT(".ppf"));
-		loadpatch = pfn.IsFileReadable();
+		pfn.SetExt(wxT(".bps"));
+		if(!pfn.IsFileReadable()) {
+		    pfn.SetExt(wxT(".ppf"));
+		    loadpatch = pfn.IsFileReadable();
+		}
 	    }
 	}
     }
@@ -1071,12 +1074,19 @@ public:
         //Set the start of the source pointer to the first pixel of the appropriate height
         src += width * band_lower;
 
-        //Run the interframe blending filter
-        iFilter->run(src,buffer);
-
 	    // naturally, any of these with accumulation buffers like those of
 	    // the IFB filters will screw up royally as well
-        mainFilter->run(buffer, dst);
+        //If only one of the filters is active it can write to dst directly,
+        //instead of going through buffer
+        if(!iFilter->exists())
+            mainFilter->run(src, dst);
+        else if(!mainFilter->exists())
+            iFilter->run(src, dst);
+        else {
+            //Run the interframe blending filter
+            iFilter->run(src,buffer);
+            mainFilter->run(buffer, dst);
+        }
 
         done->Post();
 	}
@@ -1,5 +1,6 @@
 #include <SDL.h>
 #include "wxvbam.h"
+#include "../common/Movie.h"
 #include "../common/SoundSDL.h"
 #include <wx/ffile.h>
 #include <wx/print.h>
@@ -80,27 +81,14 @@ void systemDrawScreen()
 }
 
 // record a game "movie"
-// actually just game save state combined with a keystroke log
-// doesn't work in GB "multiplayer" mode (only records default joypad)
-//
-//  <name>.vmv = keystroke log; all values little-endian ints:
-//     <version>.32 = 1
-//     for every joypad change (init to 0) and once at end of movie {
-//        <timestamp>.32 = frames since start of movie
-//        <joypad>.32 = default joypad reading at that time
-//     }
-//  <name>.vm0 = saved state
-
-wxFFile game_file;
-bool game_recording, game_playback;
-u32 game_frame;
-u32 game_joypad;
+// the inputs are recorded by the core (common/Movie.cpp) into <name>.vmv;
+// older movies with a <name>.vm0 saved state still play back
 
 void systemStartGameRecording(const wxString &fname)
 {
     GameArea *panel = wxGetApp().frame->GetPanel();
     if(!panel || panel->game_type() == IMAGE_UNKNOWN ||
-       !panel->emusys->emuWriteState) {
+       !panel->emusys->emuWriteMemState) {
 	wxLogError(_("No game in progress to record"));
 	return;
     }
@@ -108,21 +96,10 @@ void systemStartGameRecording(const wxString &fname)
     wxString fn = fname;
     if(fn.size() < 4 || !wxString(fn.substr(fn.size() - 4)).IsSameAs(wxT(".vmv"), false))
 	fn.append(wxT(".vmv"));
-    u32 version = 1;
-    if(!game_file.Open(fn.c_str(), wxT("wb")) ||
-       game_file.Write(&version, sizeof(version)) != sizeof(version)) {
-	wxLogError(_("Cannot open output file %s"), fname.c_str());
-	return;
-    }
-    fn[fn.size() - 1] = wxT('0');
-    if(!panel->emusys->emuWriteState(fn.mb_fn_str())) {
+    if(!movieStartRecording(panel->emusys, fn.mb_fn_str())) {
 	wxLogError(_("Error writing game recording"));
-	game_file.Close();
 	return;
     }
-    game_frame = 0;
-    game_joypad = 0;
-    game_recording = true;
     MainFrame *mf = wxGetApp().frame;
     mf->cmd_enable &= ~(CMDEN_NGREC|CMDEN_GPLAY|CMDEN_NGPLAY);
     mf->cmd_enable |= CMDEN_GREC;
@@ -131,30 +108,25 @@ void systemStartGameRecording(const wxString &fname)
 
 void systemStopGameRecording()
 {
-    if(!game_recording)
+    if(movieGetMode() != MOVIE_RECORDING)
 	return;
-    if(game_file.Write(&game_frame, sizeof(game_frame)) != sizeof(game_frame) ||
-       game_file.Write(&game_joypad, sizeof(game_joypad)) != sizeof(game_joypad) ||
-       !game_file.Close())
+    if(!movieStop())
 	wxLogError(_("Error writing game recording"));
-    game_recording = false;
     MainFrame *mf = wxGetApp().frame;
     mf->cmd_enable &= ~CMDEN_GREC;
     mf->cmd_enable |= CMDEN_NGREC|CMDEN_NGPLAY;
     mf->enable_menus();
 }
 
-u32 game_next_frame, game_next_joypad;
-
 void systemStartGamePlayback(const wxString &fname)
 {
     GameArea *panel = wxGetApp().frame->GetPanel();
     if(!panel || panel->game_type() == IMAGE_UNKNOWN ||
-       !panel->emusys->emuReadState) {
+       !panel->emusys->emuReadMemState) {
 	wxLogError(_("No game in progress to record"));
 	return;
     }
-    if(game_recording) {
+    if(movieGetMode() == MOVIE_RECORDING) {
 	wxLogError(_("Cannot play game recording while recording"));
 	return;
     }
@@ -162,31 +134,10 @@ void systemStartGamePlayback(const wxString &fname)
     wxString fn = fname;
     if(fn.size() < 4 || !wxString(fn.substr(fn.size() - 4)).IsSameAs(wxT(".vmv"), false))
 	fn.append(wxT(".vmv"));
-    u32 version;
-    if(!game_file.Open(fn.c_str(), wxT("rb")) ||
-       game_file.Read(&version, sizeof(version)) != sizeof(version) ||
-       wxUINT32_SWAP_ON_BE(version) != 1) {
+    if(!movieStartPlayback(panel->emusys, fn.mb_fn_str())) {
 	wxLogError(_("Cannot open recording file %s"), fname.c_str());
 	return;
     }
-    u32 gf, jp;
-    if(game_file.Read(&gf, sizeof(gf)) != sizeof(gf) ||
-       game_file.Read(&jp, sizeof(jp)) != sizeof(jp)) {
-	wxLogError(_("Error reading game recording"));
-	game_file.Close();
-	return;
-    }
-    game_next_frame = wxUINT32_SWAP_ON_BE(gf);
-    game_next_joypad = wxUINT32_SWAP_ON_BE(jp);
-    fn[fn.size() - 1] = wxT('0');
-    if(!panel->emusys->emuReadState(fn.mb_fn_str())) {
-	wxLogError(_("Error reading game recording"));
-	game_file.Close();
-	return;
-    }
-    game_frame = 0;
-    game_joypad = 0;
-    game_playback = true;
     MainFrame *mf = wxGetApp().frame;
     mf->cmd_enable &= ~(CMDEN_NGREC|CMDEN_GREC|CMDEN_NGPLAY);
     mf->cmd_enable |= CMDEN_GPLAY;
@@ -195,10 +146,9 @@ void systemStartGamePlayback(const wxString &fname)
 
 void systemStopGamePlayback()
 {
-    if(!game_playback)
+    if(movieGetMode() != MOVIE_PLAYING)
 	return;
-    game_file.Close();
-    game_playback = false;
+    movieStop();
     MainFrame *mf = wxGetApp().frame;
     mf->cmd_enable &= ~CMDEN_GPLAY;
     mf->cmd_enable |= CMDEN_NGREC|CMDEN_NGPLAY;
@@ -252,37 +202,6 @@ u32 systemReadJoypad(int joy)
 
     ret &= REALKEY_MASK;
 
-    if(game_recording) {
-	u32 rret = ret & ~(KEYM_SPEED|KEYM_CAPTURE);
-	if(rret != game_joypad) {
-	    game_joypad = rret;
-	    u32 gf = wxUINT32_SWAP_ON_BE(game_frame);
-	    u32 jp = wxUINT32_SWAP_ON_BE(game_joypad);
-	    if(game_file.Write(&gf, sizeof(gf)) != sizeof(gf) ||
-	       game_file.Write(&jp, sizeof(jp)) != sizeof(jp)) {
-		game_file.Close();
-		game_recording = false;
-		wxLogError(_("Error writing game recording"));
-	    }
-	}
-    } else if(game_playback) {
-	while(game_frame >= game_next_frame) {
-	    game_joypad = game_next_joypad;
-	    u32 gf, jp;
-	    if(game_file.Read(&gf, sizeof(gf)) != sizeof(gf) ||
-	       game_file.Read(&jp, sizeof(jp)) != sizeof(jp)) {
-		game_file.Close();
-		game_playback = false;
-		wxString msg(_("Playback ended"));
-		systemScreenMessage(msg);
-		break;
-	    }
-	    game_next_frame = wxUINT32_SWAP_ON_BE(gf);
-	    game_next_joypad = wxUINT32_SWAP_ON_BE(jp);
-	}
-	ret = game_joypad;
-    }
-
     return ret;
 }
 
@@ -356,8 +275,6 @@ void system10Frames(int rate)
 
 void systemFrame()
 {
-    if(game_recording || game_playback)
-	game_frame++;
 }
 
 // technically, num is ignored in favor of finding the first